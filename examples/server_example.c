@@ -1,23 +1,262 @@
 #include "https_server.h"
+#include "websocket.h"
+#include "proxy.h"
 #include "log.h"
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
 
-// 数据接收回调
+// [sse]开启时由load_server_options创建, /publish向它发布
+static st_sse_hub_t *sse_hub;
+
+// 一次/publish最多发布的事件数和每个事件的字节数, 防止一个请求长时间占住工作线程
+#define PUBLISH_MAX_COUNT 100
+#define PUBLISH_MAX_SIZE 4096
+
+// /static/下的文件只从这个目录发送, 启动时按[static] root解析为绝对路径, 为空表示不提供
+static char static_root[PATH_MAX];
+
+// 解析后的路径须在static_root之下, 挡住符号链接和..跳出目录
+static int open_static_file(const char *name) {
+    char path[PATH_MAX], resolved[PATH_MAX];
+    size_t root_length = strlen(static_root);
+    if (root_length == 0 || name[0] == '\0' ||
+        snprintf(path, sizeof(path), "%s/%s", static_root, name) >= (int)sizeof(path) || !realpath(path, resolved) ||
+        strncmp(resolved, static_root, root_length) != 0 || resolved[root_length] != '/') {
+        return -1;
+    }
+    return open(resolved, O_RDONLY | O_CLOEXEC);
+}
+
+// 取URL查询参数的值, 不做解码
+static bool query_param(const char *url, const char *name, char *value, size_t size) {
+    const char *p = strchr(url, '?');
+    size_t length = strlen(name);
+    while (p) {
+        p++;
+        if (strncmp(p, name, length) == 0 && p[length] == '=') {
+            p += length + 1;
+            size_t n = strcspn(p, "&");
+            snprintf(value, size, "%.*s", (int)n, p);
+            return true;
+        }
+        p = strchr(p, '&');
+    }
+    return false;
+}
+
+// 数据接收回调, 请求体可能分多次到达
 void on_data_received(void* client, const char *data, size_t length) {
     log_debug("data received: %.*s", (int)length, data);
-    
+}
+
+// 请求接收完毕回调
+void on_body_end(void* client) {
+    log_debug("%s %s", get_request_method(client), get_request_url(client));
+
     // 向客户端发送响应数据
     int status_code = 200;
     const char* status_message = "OK";
-    const char* body = "hello,client!";
-    bool result = send_response_to_client(client, status_code, status_message, body);
+    bool result;
+    if (strcmp(get_request_url(client), "/ws") == 0 && is_websocket_request(client)) {
+        // 升级为WebSocket, 之后的消息由on_ws_message处理
+        result = accept_websocket(client, NULL);
+    } else if (strncmp(get_request_url(client), "/cached", 7) == 0) {
+        // 开启[cache]后, 5秒内的请求直接由缓存响应
+        static int generated = 0;
+        char body[64];
+        snprintf(body, sizeof(body), "generated %d times\n", __atomic_add_fetch(&generated, 1, __ATOMIC_RELAXED));
+        add_response_header(client, "Cache-Control", "public, max-age=5");
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/cache-stats") == 0) {
+        st_cache_stats_t stats;
+        char body[256] = "cache disabled\n";
+        if (get_response_cache_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "hits:%llu misses:%llu inserts:%llu evictions:%llu expirations:%llu entries:%zu bytes:%zu\n",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.inserts,
+                (unsigned long long)stats.evictions, (unsigned long long)stats.expirations, stats.entries, stats.bytes);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strncmp(get_request_url(client), "/slow", 5) == 0) {
+        // 模拟耗时的处理器, 开启[coalesce]后并发的相同请求只执行一次, 开启[offload]后不阻塞事件循环
+        static int generated = 0;
+        char body[64];
+        usleep(200 * 1000);
+        snprintf(body, sizeof(body), "generated %d times\n", __atomic_add_fetch(&generated, 1, __ATOMIC_RELAXED));
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/coalesce-stats") == 0) {
+        st_flight_stats_t stats;
+        char body[256] = "coalesce disabled\n";
+        if (get_coalesce_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "leaders:%llu coalesced:%llu timeouts:%llu fallbacks:%llu\n",
+                (unsigned long long)stats.leaders, (unsigned long long)stats.coalesced,
+                (unsigned long long)stats.timeouts, (unsigned long long)stats.fallbacks);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/overload-stats") == 0) {
+        st_overload_stats_t stats;
+        char body[256] = "overload disabled\n";
+        if (get_overload_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "lag:%.1fms shed_rate:%.2f accept_paused:%d shed_requests:%llu shed_handshakes:%llu accept_pauses:%llu\n",
+                stats.lag * 1000, stats.shed_rate, stats.accept_paused, (unsigned long long)stats.shed_requests,
+                (unsigned long long)stats.shed_handshakes, (unsigned long long)stats.accept_pauses);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/offload-stats") == 0) {
+        st_offload_stats_t stats;
+        char body[256] = "offload disabled\n";
+        if (get_offload_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "threads:%d queued:%zu max_queued:%zu running:%zu submitted:%llu completed:%llu stolen:%llu orphaned:%llu wakeups:%llu wait_avg:%.2fms wait_max:%.2fms\n",
+                stats.threads, stats.queued, stats.max_queued, stats.running, (unsigned long long)stats.submitted,
+                (unsigned long long)stats.completed, (unsigned long long)stats.stolen, (unsigned long long)stats.orphaned,
+                (unsigned long long)stats.wakeups, stats.wait_avg * 1000, stats.wait_max * 1000);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/crypto-stats") == 0) {
+        st_async_crypto_stats_t stats;
+        char body[256] = "async crypto disabled\n";
+        if (get_async_crypto_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "threads:%d queued:%zu max_queued:%zu offloaded:%llu direct:%llu wait_avg:%.2fms compute_avg:%.2fms\n",
+                stats.threads, stats.queued, stats.max_queued, (unsigned long long)stats.offloaded,
+                (unsigned long long)stats.direct, stats.wait_avg * 1000, stats.compute_avg * 1000);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/trace") == 0) {
+        // 抽样追踪的请求, 保存为文件后用chrome://tracing或Perfetto打开
+        char *json = NULL;
+        size_t length = 0;
+        FILE *fp = open_memstream(&json, &length);
+        if (fp && dump_trace(client, fp)) {
+            fclose(fp);
+            result = send_response_body_to_client(client, status_code, status_message, "application/json", json, length);
+        } else {
+            if (fp) {
+                fclose(fp);
+            }
+            result = send_response_to_client(client, status_code, status_message, "trace disabled\n");
+        }
+        free(json);
+    } else if (strcmp(get_request_url(client), "/proxy-stats") == 0) {
+        st_proxy_stats_t stats;
+        char body[256];
+        proxy_stats(&stats);
+        snprintf(body, sizeof(body), "requests:%llu retries:%llu failures:%llu ejections:%llu connects:%llu reuses:%llu\n",
+            (unsigned long long)stats.requests, (unsigned long long)stats.retries,
+            (unsigned long long)stats.failures, (unsigned long long)stats.ejections,
+            (unsigned long long)stats.connects, (unsigned long long)stats.reuses);
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/pid") == 0) {
+        // 发送SIGUSR2升级后可以看到新进程接手
+        char body[32];
+        snprintf(body, sizeof(body), "%d\n", (int)getpid());
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strncmp(get_request_url(client), "/static/", 8) == 0) {
+        // [static] root目录下的文件, 明文监听上以sendfile发送. 不允许隐藏文件
+        const char *name = get_request_url(client) + 8;
+        int fd = -1;
+        struct stat st;
+        if (name[0] != '.' && !strstr(name, "/.")) {
+            fd = open_static_file(name);
+        }
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            result = send_file_to_client(client, status_code, status_message, "application/octet-stream", fd, 0, st.st_size);
+        } else {
+            if (fd >= 0) {
+                close(fd);
+            }
+            result = send_response_to_client(client, 404, "Not Found", "not found\n");
+        }
+    } else if (strncmp(get_request_url(client), "/events", 7) == 0) {
+        // 事件流, /events?topics=a,b 订阅多个主题
+        char topics[256] = "default";
+        query_param(get_request_url(client), "topics", topics, sizeof(topics));
+        result = accept_event_stream(client, topics);
+        if (!result) {
+            result = send_response_to_client(client, 404, "Not Found", "sse disabled\n");
+        }
+    } else if (strncmp(get_request_url(client), "/publish", 8) == 0) {
+        // /publish?topic=a&count=N&size=S 发布N个事件, 内容是序号和发布时的单调时钟(纳秒), 补齐到S字节; N和S有上限
+        char topic[128] = "default", value[32];
+        int count = query_param(get_request_url(client), "count", value, sizeof(value)) ? atoi(value) : 1;
+        size_t size = query_param(get_request_url(client), "size", value, sizeof(value)) ? strtoul(value, NULL, 10) : 0;
+        query_param(get_request_url(client), "topic", topic, sizeof(topic));
+        if (count > PUBLISH_MAX_COUNT) {
+            count = PUBLISH_MAX_COUNT;
+        }
+        if (size > PUBLISH_MAX_SIZE) {
+            size = PUBLISH_MAX_SIZE;
+        }
+        static long sequence = 0;
+        char data[PUBLISH_MAX_SIZE];
+        int published = 0;
+        for (int i = 0; i < count; i++) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            int length = snprintf(data, sizeof(data), "%ld %lld ", __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED),
+                                  (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+            while ((size_t)length < size) {
+                data[length++] = 'x';
+            }
+            published += sse_publish(sse_hub, topic, NULL, NULL, data, length);
+        }
+        char body[64];
+        snprintf(body, sizeof(body), "published %d\n", published);
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/sse-stats") == 0) {
+        st_sse_stats_t stats;
+        char body[256] = "sse disabled\n";
+        if (get_sse_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "subscribers:%zu published:%llu delivered:%llu writes:%llu dropped:%llu\n",
+                stats.subscribers, (unsigned long long)stats.published, (unsigned long long)stats.delivered,
+                (unsigned long long)stats.writes, (unsigned long long)stats.dropped);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/capture-stats") == 0) {
+        st_capture_stats_t stats;
+        char body[256] = "capture disabled\n";
+        if (get_capture_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "captured:%llu dropped:%llu bytes:%llu\n", (unsigned long long)stats.captured,
+                (unsigned long long)stats.dropped, (unsigned long long)stats.bytes);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/ocsp-stats") == 0) {
+        st_ocsp_stats_t stats;
+        char body[256] = "ocsp stapling disabled\n";
+        if (get_ocsp_stats(client, &stats)) {
+            snprintf(body, sizeof(body), "certificates:%d valid:%d stapled:%llu missing:%llu refreshes:%llu failures:%llu expires_in:%.0fs\n",
+                stats.certificates, stats.valid, (unsigned long long)stats.stapled, (unsigned long long)stats.missing,
+                (unsigned long long)stats.refreshes, (unsigned long long)stats.failures, stats.expires_in);
+        }
+        result = send_response_to_client(client, status_code, status_message, body);
+    } else if (strcmp(get_request_url(client), "/stream") == 0) {
+        // 流式响应, 以chunked编码逐块发送
+        result = start_response_to_client(client, status_code, status_message, "text/plain");
+        for (int i = 0; result && i < 3; i++) {
+            result = send_response_chunk(client, "hello,client!\n", 14);
+        }
+        result = result && finish_response_to_client(client);
+    } else {
+        const char* body = "hello,client!";
+        result = send_response_to_client(client, status_code, status_message, body);
+    }
     if (!result) {
         log_error("failed to send data to client");
     }
 }
 
+// WebSocket消息回调, 原样回显文本和二进制消息
+void on_ws_message(void* client, int opcode, const char *data, size_t length) {
+    if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) {
+        ws_send_message(client, opcode, data, length);
+    }
+}
+
 // 连接建立回调
 void on_connected(void* client) {
     log_debug("client connected");
@@ -48,20 +287,32 @@ int main() {
 
     set_log_level(log_level);
 
+    st_server_options_t options;
+    init_server_options(&options);
+    load_server_options(&options, &config);
+    sse_hub = options.sse;
+    const char *root = get_config_value(&config, "static", "root");
+    if (root && root[0] && !realpath(root, static_root)) {
+        log_warn("static root %s not found, /static/ disabled", root);
+        static_root[0] = '\0';
+    }
 
     event_callbacks callbacks = {
         .on_data_received = on_data_received,
         .on_connected = on_connected,
         .on_disconnected = on_disconnected,
-        .on_error = on_error  // 设置异常回调
+        .on_error = on_error,  // 设置异常回调
+        .on_body_end = on_body_end,
+        .on_ws_message = on_ws_message
     };
 
-    if (!start_https_server(cert_file, key_file, ssl_port, &callbacks)) {
+    bool started = start_https_server_with_options(cert_file, key_file, ssl_port, &options, &callbacks);
+    sse_hub = NULL;
+    free_server_options(&options);
+    free_config(&config);
+    if (!started) {
         log_error("failed to start https server");
-        free_config(&config);
         return 1;
     }
-
-    free_config(&config);
     return 0;
 }
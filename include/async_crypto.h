@@ -0,0 +1,44 @@
+#ifndef ASYNC_CRYPTO_H
+#define ASYNC_CRYPTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+// 异步私钥运算: TLS握手中的RSA/ECDSA签名(以及RSA密钥交换的解密)交给专用线程池, 不占用事件循环.
+// 服务器私钥换成本模块的RSA_METHOD/EC_KEY_METHOD, 握手以SSL_MODE_ASYNC在OpenSSL的ASYNC任务中运行:
+// 遇到私钥运算时提交给线程池并暂停任务, SSL_do_handshake返回SSL_ERROR_WANT_ASYNC;
+// 线程池算完后写该连接的eventfd(ASYNC_WAIT_CTX中的等待fd), 循环监听到后再次调用SSL_do_handshake,
+// 任务从暂停处继续. 不在ASYNC任务中调用时直接计算.
+//
+//   [async_crypto]
+//   enable=1
+//   threads=2
+
+#define ASYNC_CRYPTO_DEFAULT_THREADS 2
+
+typedef struct st_async_crypto st_async_crypto_t;
+
+typedef struct st_async_crypto_stats {
+    int threads;
+    size_t queued;                 // 等待线程池的私钥运算
+    size_t max_queued;
+    uint64_t offloaded;            // 在线程池中完成的私钥运算
+    uint64_t direct;               // 不在ASYNC任务中, 直接计算的
+    double wait_avg;               // 从提交到开始计算的平均等待(秒)
+    double compute_avg;            // 平均计算时间(秒)
+} st_async_crypto_stats_t;
+
+// 启动线程池, threads小于等于0时用默认值. OpenSSL不支持ASYNC时返回NULL
+st_async_crypto_t *async_crypto_new(int threads);
+
+// 执行完已提交的运算后停止线程池. 私钥还引用着方法, 须在attach过的SSL_CTX释放后调用
+void async_crypto_free(st_async_crypto_t *crypto);
+
+// 把ctx的私钥(RSA或EC)换成异步方法, 之后以SSL_MODE_ASYNC进行的握手才会交给线程池
+bool async_crypto_attach(st_async_crypto_t *crypto, SSL_CTX *ctx);
+
+void async_crypto_stats(st_async_crypto_t *crypto, st_async_crypto_stats_t *stats);
+
+#endif // ASYNC_CRYPTO_H
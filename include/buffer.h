@@ -0,0 +1,34 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+// 可增长的字节缓冲区, offset之前的数据已被消费
+typedef struct st_buffer {
+    char *data;
+    size_t size;
+    size_t offset;
+    size_t capacity;
+} st_buffer_t;
+
+int buffer_append(st_buffer_t *buffer, const void *data, size_t length);
+
+// 保证尾部至少有length字节可写, 返回写入位置; 写入后用buffer_commit提交
+char *buffer_reserve(st_buffer_t *buffer, size_t length);
+void buffer_consume(st_buffer_t *buffer, size_t length);
+void buffer_reset(st_buffer_t *buffer);
+void buffer_free(st_buffer_t *buffer);
+
+static inline size_t buffer_length(const st_buffer_t *buffer) {
+    return buffer->size - buffer->offset;
+}
+
+static inline void buffer_commit(st_buffer_t *buffer, size_t length) {
+    buffer->size += length;
+}
+
+static inline const char *buffer_data(const st_buffer_t *buffer) {
+    return buffer->data + buffer->offset;
+}
+
+#endif // BUFFER_H
@@ -0,0 +1,87 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "structs.h"
+
+// 请求流量抓取: 按请求抽样, 把解密后的请求(到达时间, 方法, URL, 头部, 请求体)写成紧凑的二进制文件,
+// 用于按生产环境的请求组合重放(test/replay.c). 请求头收完时序列化头部, 请求收完后整条记录追加到
+// 共享的内存缓冲区, 由后台线程写文件; 积压超过CAPTURE_MAX_PENDING时丢弃记录, 不阻塞工作线程.
+// HTTP/1.1和HTTP/2的请求都会抓取, HTTP/2的:authority记为host.
+//
+//   [capture]
+//   enable=1
+//   file=capture.bin
+//   sample_rate=1             抽样的请求比例
+//   max_body=4096             每个请求最多保存的请求体字节, 记录原始长度; 0表示不保存请求体
+//   redact=authorization,cookie,proxy-authorization   值替换为[redacted]的请求头, 逗号分隔
+//
+// 文件格式: 8字节魔数"XHCAP001", 8字节开始时间(Unix纳秒, 小端), 之后是记录, 每条记录以varint长度开头:
+//   varint 相对开始的微秒, 1字节flags, 方法, URL, varint 头部数, 每个头部的名称和值,
+//   varint 请求体原始长度, 保存的请求体. 字符串和请求体都是varint长度加内容
+
+#define CAPTURE_DEFAULT_SAMPLE_RATE 1.0
+#define CAPTURE_DEFAULT_MAX_BODY 4096
+#define CAPTURE_DEFAULT_REDACT "authorization,cookie,proxy-authorization"
+#define CAPTURE_MAX_PENDING (16 * 1024 * 1024)
+#define CAPTURE_REDACTED "[redacted]"
+
+#define CAPTURE_FLAG_HTTP2 1
+#define CAPTURE_FLAG_TRUNCATED 2       // 请求体超过max_body, 只保存了开头
+
+typedef struct st_capture st_capture_t;
+typedef struct st_capture_request st_capture_request_t;
+
+typedef struct st_capture_stats {
+    uint64_t captured;             // 写入缓冲区的请求
+    uint64_t dropped;              // 积压过多丢弃的请求
+    uint64_t bytes;                // 已写入文件的字节
+} st_capture_stats_t;
+
+// 打开文件并启动写线程, 失败返回NULL
+st_capture_t *capture_new(const char *path, double sample_rate, size_t max_body, const char *redact);
+
+// 写出剩余的记录后关闭文件, 所有工作线程退出后调用
+void capture_free(st_capture_t *capture);
+
+// 请求头收完时调用, 抽中时返回进行中的记录, 否则返回NULL
+st_capture_request_t *capture_begin(st_capture_t *capture, bool http2, const char *method, const st_request_t *request);
+
+void capture_body(st_capture_request_t *request, const char *data, size_t length);
+
+// 请求收完, 记录交给写线程并释放
+void capture_end(st_capture_t *capture, st_capture_request_t *request);
+
+// 请求没有收完连接就关闭了
+void capture_discard(st_capture_request_t *request);
+
+void capture_stats(st_capture_t *capture, st_capture_stats_t *stats);
+
+// ---- 读取 ----
+
+typedef struct st_capture_reader st_capture_reader_t;
+
+// 一条记录, 字符串以'\0'结尾, 在下一次capture_reader_next之前有效
+typedef struct st_capture_entry {
+    uint64_t offset_us;            // 相对抓取开始的时间
+    int flags;
+    const char *method;
+    const char *url;
+    int header_count;
+    const char *headers;           // 依次存放"name\0value\0"
+    const char *body;
+    size_t body_saved;
+    uint64_t body_length;          // 原始长度, 截断时大于body_saved
+} st_capture_entry_t;
+
+// start_ns可以为NULL
+st_capture_reader_t *capture_reader_open(const char *path, uint64_t *start_ns);
+
+// 返回1表示读到一条, 0表示结束, -1表示文件损坏
+int capture_reader_next(st_capture_reader_t *reader, st_capture_entry_t *entry);
+
+void capture_reader_close(st_capture_reader_t *reader);
+
+#endif // CAPTURE_H
@@ -0,0 +1,102 @@
+#ifndef CLIENT_CACHE_H
+#define CLIENT_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// client_loop的私有HTTP缓存, 只在循环线程中访问, 不加锁.
+// 键为路径和响应Vary列出的请求头的值, 同一路径的多个变体并存. 新鲜度按Cache-Control的max-age(减去Age),
+// 过期后有ETag/Last-Modified的条目用If-None-Match/If-Modified-Since重新验证, 304时沿用缓存的响应.
+// 内存中按字节数做LRU淘汰. 给了文件时每个条目同时追加到mmap的环形文件, 文件写满后覆盖最旧的记录;
+// 内存淘汰的条目还能从文件中找回, 重启后扫描文件重建索引. 文件按本机字节序存放, 同一时间只能被一个客户端打开.
+// 过期时间用墙上时钟, 重启后仍然有效.
+
+#define CLIENT_CACHE_DEFAULT_MAX_ENTRY (1024 * 1024)
+#define CLIENT_CACHE_DEFAULT_FILE_SIZE (256 * 1024 * 1024)
+
+typedef struct st_client_cache st_client_cache_t;
+
+// 缓存的响应, 数据依次为路径, Vary(依次存放小写的"name\0value\0"), 响应头("name\0value\0"), 响应体
+typedef struct st_client_cache_entry {
+    struct st_client_cache_entry *hash_next;
+    struct st_client_cache_entry *lru_prev;   // 靠近表头的更近被使用
+    struct st_client_cache_entry *lru_next;
+    uint64_t hash;                 // 路径的哈希
+    double expires;                // Unix时间(秒)
+    int refs;                      // 缓存持有一个, 等待重新验证的请求各持有一个
+    bool linked;                   // 还在缓存中
+    int status;
+    int header_count;
+    int64_t disk_offset;           // 文件中的记录, -1表示没有
+    size_t path_length;
+    size_t vary_length;
+    size_t headers_length;
+    size_t body_length;
+    char *data;
+} st_client_cache_entry_t;
+
+typedef struct st_client_cache_stats {
+    uint64_t hits;                 // 新鲜的条目直接返回
+    uint64_t revalidations;        // 发出条件请求
+    uint64_t not_modified;         // 收到304, 返回缓存的响应
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;            // 内存容量不足被淘汰
+    uint64_t disk_hits;            // 内存中没有, 从文件中找回
+    uint64_t disk_evictions;       // 文件写满被覆盖
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t disk_entries;
+    uint64_t disk_bytes;
+} st_client_cache_stats_t;
+
+// file为NULL时只在内存中缓存. 文件打不开时记录日志并只用内存
+st_client_cache_t *client_cache_new(size_t capacity, size_t max_entry, const char *file, size_t file_size);
+
+// 把文件写回磁盘后释放
+void client_cache_free(st_client_cache_t *cache);
+
+// head为序列化的请求头(请求行之后每行以\r\n结尾). 请求带有no-store/no-cache,
+// Range或条件请求头时由调用者自己处理, 返回false
+bool client_cache_usable(const char *head, size_t head_length);
+
+// 查找路径上与请求头匹配的变体, 包括已过期的. 返回的条目已加引用, 用完调用client_cache_release
+st_client_cache_entry_t *client_cache_lookup(st_client_cache_t *cache, const char *path, size_t path_length,
+                                             const char *head, size_t head_length);
+void client_cache_release(st_client_cache_t *cache, st_client_cache_entry_t *entry);
+
+bool client_cache_fresh(const st_client_cache_entry_t *entry);
+
+// 生成重新验证用的条件请求头, 每行以\r\n结尾. 没有验证器时返回0
+size_t client_cache_conditional(const st_client_cache_entry_t *entry, char *buffer, size_t size);
+
+// 保存200响应, 不可缓存(no-store, Vary: *, 太大, 既不新鲜也没有验证器)时返回false
+bool client_cache_store(st_client_cache_t *cache, const char *path, size_t path_length, const char *head, size_t head_length,
+                        int status, const char *headers, int header_count, size_t headers_length,
+                        const char *body, size_t body_length);
+
+// 收到304: 按304的Cache-Control(没有时用缓存的响应头)更新过期时间
+void client_cache_refresh(st_client_cache_t *cache, st_client_cache_entry_t *entry, const char *headers, int header_count);
+
+// 响应头的值, 没有时返回NULL. headers依次存放"name\0value\0"
+const char *client_cache_header(const char *headers, int header_count, const char *name);
+
+static inline const char *client_cache_headers(const st_client_cache_entry_t *entry) {
+    return entry->data + entry->path_length + entry->vary_length;
+}
+
+static inline const char *client_cache_body(const st_client_cache_entry_t *entry) {
+    return client_cache_headers(entry) + entry->headers_length;
+}
+
+// 任意线程调用
+void client_cache_stats(st_client_cache_t *cache, st_client_cache_stats_t *stats);
+
+// 不需要从服务器取响应体的请求比例, 包括304
+static inline double client_cache_hit_ratio(const st_client_cache_stats_t *stats) {
+    uint64_t lookups = stats->hits + stats->revalidations + stats->misses;
+    return lookups ? (double)(stats->hits + stats->not_modified) / lookups : 0;
+}
+
+#endif // CLIENT_CACHE_H
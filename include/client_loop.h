@@ -0,0 +1,178 @@
+#ifndef CLIENT_LOOP_H
+#define CLIENT_LOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "structs.h"
+#include "event_engine.h"
+#include "client_cache.h"
+
+// 可在任意线程提交请求的HTTP(S)客户端. 事件循环运行在自己的线程中, 维护到一台服务器的keep-alive连接池.
+// client_loop_submit把序列化好的请求放入有界无锁队列(MPSC), 一批请求只唤醒循环一次;
+// 队列满时立即返回false, 由调用者退避重试.
+// 完成通知有三种方式:
+//   - 只给回调: 在循环线程中调用, 回调内不能阻塞;
+//   - 给回调和完成队列: 响应投递到队列, 调用者在自己的线程用completion_queue_poll/wait执行回调;
+//   - client_loop_submit_future: 返回future, 任意线程用client_future_wait等待.
+//
+// 请求可以带截止时间, 到期时无论在排队还是已经发出都以CLIENT_ERROR_DEADLINE完成,
+// 已发出的关闭所在连接, 腾出连接数.
+// 对冲: 幂等请求发出hedge_delay秒后(或超过目标地址最近延迟的hedge_percentile分位数后)还没有响应,
+// 就在另一个连接上再发一次, 有多个地址时优先发往其他地址. 先到的响应胜出, 另一个被取消(关闭连接).
+// 对冲受预算限制: 每个请求积累hedge_budget%个令牌, 每次对冲消耗一个, 额外负载不超过约hedge_budget%.
+//
+// 大请求体和响应体可以流式传输, 不整个放在内存里: 请求体从fd或回调读取, 长度已知时用Content-Length,
+// 否则用chunked编码; 响应体写到fd或交给回调. 缓冲有界: 请求体每次从来源读取一段, socket写完再读下一段;
+// 响应体写不进fd时暂停读socket, 由TCP窗口让服务器放慢. 管道和套接字fd应设为非阻塞,
+// 回调在循环线程中调用, 阻塞会拖住同一客户端的其他请求. fd由调用者关闭.
+// 流式请求不对冲, 开始读取来源或写出响应体之后也不再换连接重试.
+//
+// cache_size大于0时GET请求先查私有缓存(见client_cache.h): 新鲜的响应不发请求直接完成,
+// 过期的带上If-None-Match/If-Modified-Since重新验证, 304时以缓存的200响应完成. 流式请求,
+// 带请求体的, 以及请求头中有no-cache/no-store, Range或条件请求头的不经过缓存.
+
+#define CLIENT_LOOP_DEFAULT_CONNECTIONS 8
+#define CLIENT_LOOP_DEFAULT_QUEUE_CAPACITY 4096
+#define CLIENT_LOOP_DEFAULT_CONNECT_TIMEOUT 3.0
+#define CLIENT_LOOP_DEFAULT_READ_TIMEOUT 30.0
+#define CLIENT_LOOP_DEFAULT_IDLE_TIMEOUT 60.0
+#define CLIENT_LOOP_DEFAULT_HEDGE_BUDGET 10.0
+
+typedef enum {
+    CLIENT_OK = 0,
+    CLIENT_ERROR_CONNECT,
+    CLIENT_ERROR_TLS,
+    CLIENT_ERROR_IO,
+    CLIENT_ERROR_TIMEOUT,
+    CLIENT_ERROR_PROTOCOL,
+    CLIENT_ERROR_CANCELLED,        // 客户端已停止
+    CLIENT_ERROR_DEADLINE,         // 超过请求的截止时间
+    CLIENT_ERROR_BODY              // 流式请求体/响应体的fd或回调出错
+} client_error_t;
+
+typedef enum {
+    CLIENT_BODY_BUFFER = 0,        // 请求体为body, 响应体收进st_client_response_t.body
+    CLIENT_BODY_FD,                // 请求体从body_fd读到EOF, 响应体写到response_fd
+    CLIENT_BODY_CALLBACK           // 请求体由body_read产生, 响应体交给response_write
+} client_body_mode_t;
+
+// 最多写size字节到buffer, 返回写入的字节数, 0表示结束, 小于0表示出错
+typedef ssize_t (*client_body_read_cb_t)(void *arg, char *buffer, size_t size);
+
+// 返回false时中止请求
+typedef bool (*client_body_write_cb_t)(void *arg, const char *data, size_t length);
+
+typedef struct st_client_loop st_client_loop_t;
+typedef struct st_completion_queue st_completion_queue_t;
+typedef struct st_client_future st_client_future_t;
+
+typedef struct st_client_request {
+    http_method method;
+    const char *path;
+    const char *headers;           // 附加的请求头, 每行以\r\n结尾, 可以为NULL
+    const char *body;
+    size_t body_length;
+    double deadline;               // 从提交起的截止时间(秒), 0表示不限
+    client_body_mode_t body_mode;
+    int body_fd;
+    client_body_read_cb_t body_read;
+    void *body_arg;
+    uint64_t body_size;            // 流式请求体的长度, 0表示未知: 普通文件取剩余大小, 否则用chunked编码
+    client_body_mode_t response_mode;
+    int response_fd;
+    client_body_write_cb_t response_write;
+    void *response_arg;
+} st_client_request_t;
+
+// 只在回调期间有效
+typedef struct st_client_response {
+    client_error_t error;
+    int status;
+    const char *headers;           // 依次存放"name\0value\0"
+    int header_count;
+    const char *body;              // 流式响应时为NULL
+    size_t body_length;            // 流式响应时为交给fd或回调的字节数
+} st_client_response_t;
+
+typedef void (*client_complete_cb_t)(const st_client_response_t *response, void *arg);
+
+typedef struct st_client_loop_options {
+    event_engine_t engine;
+    bool tls;
+    const char *unix_path;         // 连接该路径上的AF_UNIX套接字, host只用于Host请求头
+    const char *addresses;         // 逗号分隔的地址, 代替解析host, 用于同一服务的多个副本, 新连接轮流使用
+    bool verify;                   // 校验服务器证书, ca为NULL时用系统的CA
+    const char *ca;
+    int connections;               // 最多同时打开的连接数, 更多的请求排队
+    size_t queue_capacity;         // 提交队列的容量
+    double connect_timeout;
+    double read_timeout;
+    double idle_timeout;
+    double hedge_delay;            // 对冲前等待的秒数, 0表示不按固定延迟对冲
+    double hedge_percentile;       // 如95: 用地址的p95延迟作为对冲延迟, 样本不足时用hedge_delay; 0表示不用
+    double hedge_budget;           // 对冲请求最多占普通请求的百分比
+    size_t cache_size;             // 响应缓存占用内存的上限(字节), 0表示不缓存
+    size_t cache_max_entry;        // 单个响应的上限
+    const char *cache_file;        // 缓存同时写入这个文件, 重启后仍然可用, NULL表示只在内存中
+    size_t cache_file_size;        // 文件写满后覆盖最旧的记录
+} st_client_loop_options_t;
+
+typedef struct st_client_loop_stats {
+    uint64_t submitted;
+    uint64_t rejected;             // 队列满
+    uint64_t wakeups;              // 唤醒循环的次数, 与submitted之比就是平均批量
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t connects;
+    uint64_t hedged;               // 发出的对冲请求
+    uint64_t hedge_wins;           // 对冲请求先完成的次数
+    uint64_t hedge_denied;         // 预算不足没有对冲
+    uint64_t deadlines;            // 超过截止时间
+} st_client_loop_stats_t;
+
+void client_loop_init_options(st_client_loop_options_t *options);
+
+// 解析地址并创建客户端, 还没有启动线程
+st_client_loop_t *client_loop_new(const char *host, int port, const st_client_loop_options_t *options);
+
+// 启动事件循环线程
+bool client_loop_start(st_client_loop_t *client);
+
+// 停止循环线程, 未完成的请求以CLIENT_ERROR_CANCELLED完成, 然后释放
+void client_loop_free(st_client_loop_t *client);
+
+// 任意线程调用. 请求在调用时复制, 返回后调用者可以释放. 队列满或已停止时返回false
+bool client_loop_submit(st_client_loop_t *client, const st_client_request_t *request, client_complete_cb_t cb, void *arg, st_completion_queue_t *queue);
+
+// 返回的future必须用client_future_free释放, 队列满时返回NULL
+st_client_future_t *client_loop_submit_future(st_client_loop_t *client, const st_client_request_t *request);
+
+// 等待完成, timeout小于0时一直等待. 超时返回NULL, 结果在client_future_free之前有效
+const st_client_response_t *client_future_wait(st_client_future_t *future, double timeout);
+
+// 未完成时也可以释放, 结果到达后丢弃
+void client_future_free(st_client_future_t *future);
+
+void client_loop_stats(st_client_loop_t *client, st_client_loop_stats_t *stats);
+
+// 没有开启缓存时返回false, 命中率用client_cache_hit_ratio计算
+bool client_loop_cache_stats(st_client_loop_t *client, st_client_cache_stats_t *stats);
+
+const char *client_error_string(client_error_t error);
+
+// 完成队列属于调用者线程, 可以被多个客户端共用
+st_completion_queue_t *completion_queue_new(void);
+void completion_queue_free(st_completion_queue_t *queue);
+
+// 有完成时可读的eventfd, 用于接入调用者自己的事件循环
+int completion_queue_fd(st_completion_queue_t *queue);
+
+// 执行已到达的回调, 最多max个(小于等于0不限), 返回执行的个数
+int completion_queue_poll(st_completion_queue_t *queue, int max);
+
+// 没有完成时最多等待timeout秒(小于0时一直等待), 然后同completion_queue_poll
+int completion_queue_wait(st_completion_queue_t *queue, double timeout, int max);
+
+#endif // CLIENT_LOOP_H
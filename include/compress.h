@@ -0,0 +1,52 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+#include "buffer.h"
+
+// 单个编码方式缓存的压缩器上限, 每个压缩器约占300KB
+#define COMPRESS_POOL_MAX_FREE 16
+
+typedef enum {
+    CONTENT_ENCODING_IDENTITY,
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_DEFLATE,
+    CONTENT_ENCODING_COUNT
+} content_encoding_t;
+
+typedef struct st_compressor {
+    z_stream stream;
+    content_encoding_t encoding;
+    struct st_compressor *next;
+} st_compressor_t;
+
+// 每个事件循环一个, 复用z_stream以避免deflateInit/deflateEnd的大块内存分配
+typedef struct st_compress_pool {
+    st_compressor_t *free_list[CONTENT_ENCODING_COUNT];
+    int free_count[CONTENT_ENCODING_COUNT];
+    int level;
+    st_buffer_t scratch;       // 完整响应的压缩输出
+} st_compress_pool_t;
+
+// 压缩输出的接收者, 返回非0表示中止
+typedef int (*compress_sink_t)(void *ctx, const char *data, size_t length);
+
+st_compress_pool_t *create_compress_pool(int level);
+void destroy_compress_pool(st_compress_pool_t *pool);
+
+st_compressor_t *compressor_acquire(st_compress_pool_t *pool, content_encoding_t encoding);
+void compressor_release(st_compress_pool_t *pool, st_compressor_t *compressor);
+
+// 压缩一段数据, flush为Z_NO_FLUSH/Z_SYNC_FLUSH/Z_FINISH
+int compressor_write(st_compressor_t *compressor, const char *data, size_t length, int flush, compress_sink_t sink, void *ctx);
+
+// 根据Accept-Encoding选择编码, 优先gzip
+content_encoding_t negotiate_content_encoding(const char *accept_encoding);
+const char *content_encoding_name(content_encoding_t encoding);
+
+// types为逗号分隔的MIME类型列表, 以'/'结尾的项按前缀匹配
+bool compress_type_allowed(const char *types, const char *content_type);
+
+#endif // COMPRESS_H
@@ -1,11 +1,78 @@
 #ifndef __EPOLL_UTILS_H__
 #define __EPOLL_UTILS_H__
 
+#include <stdint.h>
 #include <sys/epoll.h>
 
+// 单次epoll_wait处理的默认事件数
+#define EPOLL_DEFAULT_MAX_EVENTS 1024
+
 int create_epoll_instance(void);
-void add_socket_to_epoll(int epoll_fd, int socket_fd, uint32_t events);
-void modify_socket_in_epoll(int epoll_fd, int socket_fd, uint32_t events);
-void remove_socket_from_epoll(int epoll_fd, int socket_fd);
+int add_socket_to_epoll(int epoll_fd, int socket_fd, uint32_t events, void *ptr);
+int modify_socket_in_epoll(int epoll_fd, int socket_fd, uint32_t events, void *ptr);
+int remove_socket_from_epoll(int epoll_fd, int socket_fd);
+
+typedef struct st_epoll_loop st_epoll_loop_t;
+typedef struct st_epoll_io st_epoll_io_t;
+typedef struct st_epoll_timer st_epoll_timer_t;
+typedef struct st_epoll_prepare st_epoll_prepare_t;
+
+typedef void (*epoll_io_cb_t)(st_epoll_loop_t *loop, st_epoll_io_t *w, uint32_t events);
+typedef void (*epoll_timer_cb_t)(st_epoll_loop_t *loop, st_epoll_timer_t *t);
+typedef void (*epoll_prepare_cb_t)(st_epoll_loop_t *loop, st_epoll_prepare_t *p);
+
+// fd观察者, epoll_event.data.ptr 指向它本身, 因此应放在连接结构体的首位
+struct st_epoll_io {
+    epoll_io_cb_t cb;
+    int fd;
+    uint32_t events;
+    int active;
+};
+
+// 定时器, 以最小堆组织
+struct st_epoll_timer {
+    epoll_timer_cb_t cb;
+    double at;
+    double repeat;
+    int heap_index;
+};
+
+// 每轮循环阻塞在epoll_wait之前调用, 用于收尾本轮产生的工作
+struct st_epoll_prepare {
+    epoll_prepare_cb_t cb;
+    st_epoll_prepare_t *next;
+    int active;
+};
+
+struct st_epoll_loop {
+    int epoll_fd;
+    int max_events;
+    struct epoll_event *events;
+    int event_index;
+    int event_count;
+    st_epoll_timer_t **timers;
+    int timer_count;
+    int timer_capacity;
+    st_epoll_prepare_t *prepares;
+    double now;
+    int stop;
+    void *data;
+};
+
+st_epoll_loop_t *epoll_loop_new(int max_events);
+void epoll_loop_destroy(st_epoll_loop_t *loop);
+int epoll_loop_run(st_epoll_loop_t *loop);
+void epoll_loop_break(st_epoll_loop_t *loop);
+double epoll_loop_now(st_epoll_loop_t *loop);
+
+int epoll_io_start(st_epoll_loop_t *loop, st_epoll_io_t *w, int fd, uint32_t events);
+void epoll_io_stop(st_epoll_loop_t *loop, st_epoll_io_t *w);
+
+void epoll_timer_init(st_epoll_timer_t *t, epoll_timer_cb_t cb);
+void epoll_timer_start(st_epoll_loop_t *loop, st_epoll_timer_t *t, double after, double repeat);
+void epoll_timer_stop(st_epoll_loop_t *loop, st_epoll_timer_t *t);
+
+void epoll_prepare_start(st_epoll_loop_t *loop, st_epoll_prepare_t *p, epoll_prepare_cb_t cb);
+void epoll_prepare_stop(st_epoll_loop_t *loop, st_epoll_prepare_t *p);
 
 #endif // __EPOLL_UTILS_H__
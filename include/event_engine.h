@@ -0,0 +1,119 @@
+#ifndef EVENT_ENGINE_H
+#define EVENT_ENGINE_H
+
+#include <ev.h>
+#include "epoll_utils.h"
+
+// 可选的事件引擎: libev 或原生边缘触发 epoll
+typedef enum {
+    EVENT_ENGINE_LIBEV,
+    EVENT_ENGINE_EPOLL
+} event_engine_t;
+
+#define EVENT_READ  EV_READ
+#define EVENT_WRITE EV_WRITE
+
+// 监听套接字在多个工作线程间共享 (epoll: EPOLLEXCLUSIVE, 水平触发)
+#define EVENT_IO_EXCLUSIVE 0x01
+
+typedef struct st_event_loop st_event_loop_t;
+typedef struct st_event_io st_event_io_t;
+typedef struct st_event_timer st_event_timer_t;
+typedef struct st_event_async st_event_async_t;
+typedef struct st_event_prepare st_event_prepare_t;
+
+typedef void (*event_io_cb_t)(st_event_loop_t *loop, st_event_io_t *w, int revents);
+typedef void (*event_timer_cb_t)(st_event_loop_t *loop, st_event_timer_t *t);
+typedef void (*event_async_cb_t)(st_event_loop_t *loop, st_event_async_t *a);
+typedef void (*event_prepare_cb_t)(st_event_loop_t *loop, st_event_prepare_t *p);
+
+struct st_event_loop {
+    event_engine_t engine;
+    struct ev_loop *ev;
+    st_epoll_loop_t *ep;
+    void *data;
+};
+
+// fd观察者. 后端观察者位于首位, 嵌入连接结构体首位时
+// epoll_event.data.ptr 即为连接指针
+struct st_event_io {
+    union {
+        st_epoll_io_t ep;
+        struct ev_io ev;
+    } w;
+    event_io_cb_t cb;
+    void *data;
+    int fd;
+    int events;
+    int flags;
+    int active;
+};
+
+struct st_event_timer {
+    union {
+        st_epoll_timer_t ep;
+        struct ev_timer ev;
+    } w;
+    event_timer_cb_t cb;
+    void *data;
+    double repeat;
+    int active;
+};
+
+// 跨线程唤醒: 任意线程调用event_async_send, 回调在循环所在线程执行,
+// 回调执行前的多次发送合并为一次
+struct st_event_async {
+    union {
+        st_epoll_io_t ep;      // eventfd
+        struct ev_async ev;
+    } w;
+    event_async_cb_t cb;
+    void *data;
+    st_event_loop_t *loop;
+    int fd;
+    int pending;
+    int active;
+};
+
+// 每轮循环阻塞等待之前调用, 此时本轮的IO和定时器回调都已执行完
+// (libev: ev_prepare; ev_check在poll之后, IO回调之前, 不适合收尾)
+struct st_event_prepare {
+    union {
+        st_epoll_prepare_t ep;
+        struct ev_prepare ev;
+    } w;
+    event_prepare_cb_t cb;
+    void *data;
+    int active;
+};
+
+const char *event_engine_name(event_engine_t engine);
+int event_engine_from_string(const char *name, event_engine_t *engine);
+
+st_event_loop_t *event_loop_new(event_engine_t engine, int max_events);
+void event_loop_destroy(st_event_loop_t *loop);
+int event_loop_run(st_event_loop_t *loop);
+// 只能在循环所在线程调用, 其他线程经event_async_send通知
+void event_loop_break(st_event_loop_t *loop);
+double event_loop_now(st_event_loop_t *loop);
+
+// epoll后端为边缘触发: 回调必须读/写到EAGAIN, 重新关注某事件后应主动尝试一次IO
+void event_io_init(st_event_io_t *w, event_io_cb_t cb, int fd, int events, int flags);
+int event_io_start(st_event_loop_t *loop, st_event_io_t *w);
+void event_io_set(st_event_loop_t *loop, st_event_io_t *w, int events);
+void event_io_stop(st_event_loop_t *loop, st_event_io_t *w);
+
+void event_timer_init(st_event_timer_t *t, event_timer_cb_t cb, double repeat);
+void event_timer_start(st_event_loop_t *loop, st_event_timer_t *t, double after);
+void event_timer_stop(st_event_loop_t *loop, st_event_timer_t *t);
+
+void event_async_init(st_event_async_t *a, event_async_cb_t cb);
+int event_async_start(st_event_loop_t *loop, st_event_async_t *a);
+void event_async_send(st_event_async_t *a);
+void event_async_stop(st_event_loop_t *loop, st_event_async_t *a);
+
+void event_prepare_init(st_event_prepare_t *p, event_prepare_cb_t cb);
+void event_prepare_start(st_event_loop_t *loop, st_event_prepare_t *p);
+void event_prepare_stop(st_event_loop_t *loop, st_event_prepare_t *p);
+
+#endif // EVENT_ENGINE_H
@@ -0,0 +1,47 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+// HPACK (RFC 7541) 头部压缩
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct st_hpack_entry {
+    char *name;                // name和value在同一块内存中
+    size_t name_length;
+    char *value;
+    size_t value_length;
+} st_hpack_entry_t;
+
+// 动态表, 环形数组, 最新的条目索引最小
+typedef struct st_hpack_table {
+    st_hpack_entry_t *entries;
+    size_t capacity;
+    size_t count;
+    size_t head;               // 最新条目的位置
+    size_t size;               // 按RFC计算的大小, 每个条目额外32字节
+    size_t max_size;           // 当前上限
+    size_t limit;              // 对端通过SETTINGS允许的上限
+    bool size_update_pending;  // 编码端需要在下一个头部块开头通告新的上限
+} st_hpack_table_t;
+
+// 解码出的头部, 数据只在回调期间有效
+typedef int (*hpack_header_cb_t)(void *ctx, const char *name, size_t name_length, const char *value, size_t value_length);
+
+void hpack_table_init(st_hpack_table_t *table, size_t max_size);
+void hpack_table_free(st_hpack_table_t *table);
+
+// 对端修改SETTINGS_HEADER_TABLE_SIZE, 用于编码端
+void hpack_table_set_limit(st_hpack_table_t *table, size_t limit);
+
+// 解码一个完整的头部块, 出错返回-1(COMPRESSION_ERROR)
+int hpack_decode(st_hpack_table_t *table, const uint8_t *data, size_t length, hpack_header_cb_t cb, void *ctx);
+
+// 编码一个头部, 名称会被转为小写; indexing为true时加入动态表
+int hpack_encode(st_hpack_table_t *table, st_buffer_t *out, const char *name, const char *value, size_t value_length, bool indexing);
+
+#endif // HPACK_H
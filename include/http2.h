@@ -0,0 +1,106 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "structs.h"
+#include "hpack.h"
+
+// HTTP/2 (RFC 7540) 服务端会话, 经ALPN协商"h2"后接管连接的读写.
+// 每个流有一个st_client句柄, 回调和响应接口与HTTP/1.1相同.
+
+#define H2_MAX_CONCURRENT_STREAMS 128
+#define H2_DEFAULT_WINDOW 65535
+#define H2_STREAM_WINDOW (256 * 1024)            // 每个流的接收窗口, 也是暂停读取时的缓存上限
+#define H2_CONNECTION_WINDOW (16 * 1024 * 1024)
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_DEFAULT_WEIGHT 16
+
+typedef struct st_h2_session st_h2_session_t;
+
+typedef struct st_h2_stream {
+    uint32_t id;
+    st_h2_session_t *session;
+    struct st_client *client;  // 交给处理器的句柄
+    // 优先级: 依赖的流和权重(1-256)
+    uint32_t dependency;
+    int weight;
+    int64_t deficit;           // 加权轮转的发送额度
+    int64_t send_window;
+    int64_t recv_window;
+    uint32_t recv_consumed;    // 已交给处理器但还未通告的字节数
+    st_buffer_t pending;       // 等待窗口的响应体
+    st_buffer_t in;            // 暂停读取时缓存的请求体
+    bool started;              // 已调用on_body_start
+    bool paused;
+    bool end_pending;          // pending发完后结束流
+    bool drain_wanted;         // pending清空后调用on_drain
+    bool remote_closed;        // 收到END_STREAM
+    bool local_closed;         // 已发送END_STREAM
+    bool body_ended;           // 已调用on_body_end
+    bool finished;             // 已关闭, 等待回收
+} st_h2_stream_t;
+
+struct st_h2_session {
+    struct st_client *conn;
+    st_buffer_t in;            // 不完整的帧
+    st_buffer_t out;           // 本轮生成的帧, 统一写入连接
+    st_buffer_t header_block;  // HEADERS+CONTINUATION拼接的头部块
+    st_buffer_t scratch;       // 编码响应头
+    uint32_t header_stream;    // 正在接收头部块的流, 0表示没有
+    uint8_t header_flags;
+    uint32_t header_dependency;   // HEADERS帧携带的优先级
+    int header_weight;
+    bool header_exclusive;
+    bool preface_received;
+    st_hpack_table_t decoder;
+    st_hpack_table_t encoder;
+    st_h2_stream_t **streams;
+    int stream_count;
+    int stream_capacity;
+    int active_count;          // 未关闭的流
+    int cursor;                // 轮转调度的起点
+    uint32_t last_stream_id;
+    int64_t send_window;
+    int64_t recv_window;
+    uint32_t recv_consumed;
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame_size;
+    bool goaway_received;
+    bool goaway_announced;     // 已发出流ID为最大值的GOAWAY, 对端不应再新建流
+    bool goaway_sent;          // 已发出最终的GOAWAY, 不再接受新流
+    bool writing;
+    bool garbage;              // 有待回收的流
+};
+
+// 握手完成后创建会话, 会立即发送服务端SETTINGS
+st_h2_session_t *h2_session_new(struct st_client *conn);
+void h2_session_free(st_h2_session_t *session);
+
+// 处理读到的数据, 出现连接错误时返回-1, 调用者应关闭连接
+int h2_session_feed(st_h2_session_t *session, const char *data, size_t length);
+
+// 连接的输出缓冲区写空, 继续发送等待中的DATA
+void h2_session_on_drain(st_h2_session_t *session);
+
+// 回收已关闭的流, 在io回调之外执行以免处理器持有悬空句柄
+void h2_session_collect(st_h2_session_t *session);
+
+// 流上的响应, content_length为负表示长度未知
+bool h2_send_headers(struct st_client *client, int status_code, const st_header_pair_t *headers, int header_count, long long content_length, bool end_stream);
+bool h2_send_data(struct st_client *client, const char *data, size_t length, bool end_stream);
+
+size_t h2_stream_backlog(struct st_client *client);
+void h2_stream_pause(struct st_client *client);
+void h2_stream_resume(struct st_client *client);
+
+// 响应未完成时放弃流, 发送RST_STREAM(INTERNAL_ERROR)
+void h2_stream_abort(struct st_client *client);
+
+// 优雅关闭分两步(RFC 9113 6.8): final为false时发送流ID为最大值的GOAWAY, 对端途中的请求照常处理;
+// 至少一个RTT之后final为true, 以实际的last_stream_id再发送一次, 之后的新流被拒绝.
+// 返回true表示最终的GOAWAY已发出且没有未关闭的流, 调用者可以关闭连接
+bool h2_session_shutdown(st_h2_session_t *session, bool final);
+
+#endif // HTTP2_H
@@ -2,16 +2,118 @@
 #define HTTPS_SERVER_H
 
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <openssl/ssl.h>
 #include "structs.h"
+#include "config.h"
+#include "response_cache.h"
+#include "single_flight.h"
+#include "overload.h"
+#include "offload.h"
+#include "async_crypto.h"
+#include "trace.h"
+#include "capture.h"
+#include "ocsp_stapling.h"
+#include "sse.h"
 
 
+// 初始化服务器默认选项
+void init_server_options(st_server_options_t *options);
+
+// 从配置文件的[server]段读取服务器选项
+void load_server_options(st_server_options_t *options, const st_config_file_t *config);
+
+// 释放load_server_options创建的代理和事件流, 须在服务器返回后调用; 服务器不接管选项中的任何对象
+void free_server_options(st_server_options_t *options);
+
 // 启动HTTPS服务器
 bool start_https_server(const char *cert_file, const char *key_file, int port, event_callbacks *callbacks);
 
+// 按指定选项启动HTTPS服务器
+bool start_https_server_with_options(const char *cert_file, const char *key_file, int port, const st_server_options_t *options, event_callbacks *callbacks);
+
 // 向客户端发送数据
 bool send_data_to_client(struct st_client *client, const char *data, size_t length);
 
+// 多段数据一起发送, 明文连接writev, TLS连接和HTTP/2流总长不超过一个记录时拼接后一次发送. 会修改iov
+bool send_vector_to_client(struct st_client *client, struct iovec *iov, int count);
+
 bool send_response_to_client(struct st_client *client, int status_code, const char *status_message, const char *body);
 
+// 发送完整响应, 正文可以包含二进制数据
+bool send_response_body_to_client(struct st_client *client, int status_code, const char *status_message, const char *content_type, const char *body, size_t body_length);
+
+// 以文件的[offset, offset+length)作为正文发送完整响应, fd的所有权交给服务器, 发完或出错时关闭.
+// 明文连接用sendfile直接从文件写入套接字, TLS连接分段读出后加密; 不做压缩和缓存.
+// 文件发完之前不解析同一连接上的下一个请求
+bool send_file_to_client(struct st_client *client, int status_code, const char *status_message, const char *content_type, int fd, off_t offset, size_t length);
+
+// 添加响应头, 须在发送响应之前调用, 最多MAX_EXTRA_RESPONSE_HEADERS个.
+// 开启[cache]时, 带Cache-Control: max-age/s-maxage的GET响应会被缓存
+bool add_response_header(struct st_client *client, const char *name, const char *value);
+
+// 响应缓存的命中/未命中/淘汰等统计, 未开启缓存时返回false
+bool get_response_cache_stats(struct st_client *client, st_cache_stats_t *stats);
+
+// 请求合并的统计(领头/合并/超时/回退), 未开启合并时返回false
+bool get_coalesce_stats(struct st_client *client, st_flight_stats_t *stats);
+// 过载保护的统计和当前线程的延迟, 未开启[overload]时返回false
+bool get_overload_stats(struct st_client *client, st_overload_stats_t *stats);
+// 处理器线程池的排队深度, 等待时间和窃取次数, 未开启[offload]时返回false
+bool get_offload_stats(struct st_client *client, st_offload_stats_t *stats);
+
+// 握手私钥运算线程池的排队和耗时, 未开启[async_crypto]时返回false
+bool get_async_crypto_stats(struct st_client *client, st_async_crypto_stats_t *stats);
+
+// 把追踪缓冲区中的记录导出为Chrome trace_event JSON, 未开启[trace]时返回false
+bool dump_trace(struct st_client *client, FILE *fp);
+// 过载时以503拒绝当前请求, 返回true表示已拒绝, 不应再调用处理器. 由HTTP/1.1和HTTP/2在on_body_start之前调用
+bool shed_request(struct st_client *client);
+
+// 流式响应: 先发送响应头(Transfer-Encoding: chunked), 再逐块发送, 最后结束响应
+bool start_response_to_client(struct st_client *client, int status_code, const char *status_message, const char *content_type);
+bool send_response_chunk(struct st_client *client, const char *data, size_t length);
+bool finish_response_to_client(struct st_client *client);
+
+// 以给定的响应头开始流式响应, 之后同样用send_response_chunk/finish_response_to_client.
+// content_length不小于0时正文原样发送, 否则HTTP/1.1使用chunked编码. 不做压缩
+bool start_response_with_headers(struct st_client *client, int status_code, const char *status_message, const st_header_pair_t *headers, int header_count, long long content_length);
+
+// 放弃已经开始的响应: HTTP/1.1关闭连接, HTTP/2重置流
+void abort_response_to_client(struct st_client *client);
+
+// 输出积压超过高水位时应停止写入, 等待on_drain回调
+bool client_output_full(struct st_client *client);
+
+// 暂停/恢复读取请求体, 用于上传的背压控制
+void pause_client_reading(struct st_client *client);
+void resume_client_reading(struct st_client *client);
+
+// 当前请求的信息, 在on_body_start之后有效
+const char *get_request_method(struct st_client *client);
+const char *get_request_url(struct st_client *client);
+const char *get_request_header(struct st_client *client, const char *name);
+// 按known_header_t(见known_headers.h)取请求头, 不需要比较名称
+const char *get_request_known_header(struct st_client *client, int id);
+
+// 是否为WebSocket升级请求(GET, Upgrade: websocket, 版本13)
+bool is_websocket_request(struct st_client *client);
+
+// 在on_body_start或on_body_end中接受升级, 之后的消息通过on_ws_message交付, 用websocket.h中的接口发送
+bool accept_websocket(struct st_client *client, const char *protocol);
+
+// 以text/event-stream开始响应并订阅topics(逗号分隔), 之后由sse_publish发布的事件推送给它.
+// 在on_body_start或on_body_end中调用, 未开启[sse]或在线程池中调用时返回false
+bool accept_event_stream(struct st_client *client, const char *topics);
+
+// 事件流的订阅者数和发布/投递/丢弃计数, 未开启[sse]时返回false
+bool get_sse_stats(struct st_client *client, st_sse_stats_t *stats);
+
+// 请求抓取的计数, 未开启[capture]时返回false
+bool get_capture_stats(struct st_client *client, st_capture_stats_t *stats);
+
+// OCSP装订的计数和响应的剩余有效期, 未开启[ocsp]时返回false
+bool get_ocsp_stats(struct st_client *client, st_ocsp_stats_t *stats);
+
 #endif // HTTPS_SERVER_H
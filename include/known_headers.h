@@ -0,0 +1,120 @@
+#ifndef KNOWN_HEADERS_H
+#define KNOWN_HEADERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// 常用请求头的编号. 查找表由tools/gen_known_headers.c在构建时生成,
+// 是小写名称上的最小完美哈希, 一次哈希加一次比较即可识别.
+
+#define KNOWN_HEADER_LIST(X) \
+    X(HOST, "host") \
+    X(CONTENT_LENGTH, "content-length") \
+    X(CONTENT_TYPE, "content-type") \
+    X(CONTENT_ENCODING, "content-encoding") \
+    X(TRANSFER_ENCODING, "transfer-encoding") \
+    X(CONNECTION, "connection") \
+    X(KEEP_ALIVE, "keep-alive") \
+    X(UPGRADE, "upgrade") \
+    X(TE, "te") \
+    X(EXPECT, "expect") \
+    X(ACCEPT, "accept") \
+    X(ACCEPT_ENCODING, "accept-encoding") \
+    X(ACCEPT_LANGUAGE, "accept-language") \
+    X(USER_AGENT, "user-agent") \
+    X(REFERER, "referer") \
+    X(ORIGIN, "origin") \
+    X(COOKIE, "cookie") \
+    X(AUTHORIZATION, "authorization") \
+    X(CACHE_CONTROL, "cache-control") \
+    X(PRAGMA, "pragma") \
+    X(IF_MATCH, "if-match") \
+    X(IF_NONE_MATCH, "if-none-match") \
+    X(IF_MODIFIED_SINCE, "if-modified-since") \
+    X(IF_UNMODIFIED_SINCE, "if-unmodified-since") \
+    X(IF_RANGE, "if-range") \
+    X(RANGE, "range") \
+    X(FORWARDED, "forwarded") \
+    X(X_FORWARDED_FOR, "x-forwarded-for") \
+    X(X_FORWARDED_PROTO, "x-forwarded-proto") \
+    X(X_REQUEST_ID, "x-request-id") \
+    X(VIA, "via") \
+    X(SEC_WEBSOCKET_KEY, "sec-websocket-key") \
+    X(SEC_WEBSOCKET_VERSION, "sec-websocket-version") \
+    X(SEC_WEBSOCKET_PROTOCOL, "sec-websocket-protocol") \
+    X(SEC_WEBSOCKET_EXTENSIONS, "sec-websocket-extensions")
+
+#define KNOWN_HEADER_ENUM(id, name) HEADER_##id,
+typedef enum {
+    KNOWN_HEADER_LIST(KNOWN_HEADER_ENUM)
+    KNOWN_HEADER_COUNT
+} known_header_t;
+#undef KNOWN_HEADER_ENUM
+
+#define HEADER_UNKNOWN (-1)
+
+// 已知名称的最大长度, 更长的名称直接判定为未知
+#define KNOWN_HEADER_MAX_LENGTH 32
+
+// 识别请求头名称(不区分大小写), 返回known_header_t或HEADER_UNKNOWN
+int known_header_lookup(const char *name, size_t length);
+
+// 编号对应的小写名称
+const char *known_header_name(int id);
+
+// 以下供生成器和查找共用
+
+#define KNOWN_HEADER_WORDS (KNOWN_HEADER_MAX_LENGTH / 8)
+
+// 8字节一组转小写(SWAR): 只有'A'-'Z'的字节或上0x20, 非ASCII字节不变
+static inline uint64_t known_header_fold_word(uint64_t w) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t x = w & (0x7f * ones);
+    uint64_t ge_a = x + (0x80 - 'A') * ones;      // 高位为1表示 >= 'A'
+    uint64_t gt_z = x + (0x80 - 'Z' - 1) * ones;  // 高位为1表示 > 'Z'
+    uint64_t upper = ge_a & ~gt_z & ~w & (0x80 * ones);
+    return w | (upper >> 2);
+}
+
+// 把名称读入清零补齐的words并转小写, 返回一级哈希. length不超过KNOWN_HEADER_MAX_LENGTH
+static inline uint64_t known_header_load(uint64_t *words, const char *name, size_t length) {
+    uint64_t h = length * 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t w;
+        memcpy(&w, name + i, 8);
+        words[i / 8] = known_header_fold_word(w);
+        h = (h ^ words[i / 8]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    if (i < length) {
+        // 剩余不足8字节: 能向前多读时取最后8字节再移位, 避免按变长memcpy
+        uint64_t w = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (length >= 8) {
+            memcpy(&w, name + length - 8, 8);
+            w >>= (8 - (length - i)) * 8;
+        } else {
+            for (size_t k = 0; k < length; k++) {
+                w |= (uint64_t)(uint8_t)name[k] << (k * 8);
+            }
+        }
+#else
+        memcpy(&w, name + i, length - i);
+#endif
+        words[i / 8] = known_header_fold_word(w);
+        h = (h ^ words[i / 8]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// 二级哈希: 由一级哈希和桶的种子得到槽位
+static inline uint32_t known_header_slot_hash(uint64_t h, uint32_t seed) {
+    h ^= (seed + 1) * 0xc4ceb9fe1a85ec53ULL;
+    h *= 0xff51afd7ed558ccdULL;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+#endif // KNOWN_HEADERS_H
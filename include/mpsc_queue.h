@@ -0,0 +1,34 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 有界无锁队列, 多个生产者线程并发入队, 单个消费者线程出队.
+// 每个槽位带序号(Vyukov), 生产者只在入队位置上竞争一次CAS, 满时立即失败由调用者决定重试或放弃.
+
+typedef struct st_mpsc_cell {
+    uint64_t sequence;
+    void *item;
+} st_mpsc_cell_t;
+
+typedef struct st_mpsc_queue {
+    st_mpsc_cell_t *cells;
+    size_t mask;
+    // 生产者和消费者的位置分在不同缓存行, 避免互相失效
+    uint64_t enqueue_pos __attribute__((aligned(64)));
+    uint64_t dequeue_pos __attribute__((aligned(64)));
+} st_mpsc_queue_t;
+
+// capacity向上取整为2的幂
+int mpsc_queue_init(st_mpsc_queue_t *queue, size_t capacity);
+void mpsc_queue_destroy(st_mpsc_queue_t *queue);
+
+// 任意线程调用, 队列满时返回false
+bool mpsc_queue_push(st_mpsc_queue_t *queue, void *item);
+
+// 只能由消费者线程调用, 队列空时返回NULL
+void *mpsc_queue_pop(st_mpsc_queue_t *queue);
+
+#endif // MPSC_QUEUE_H
@@ -0,0 +1,51 @@
+#ifndef OCSP_STAPLING_H
+#define OCSP_STAPLING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+// OCSP装订: 握手时把缓存的OCSP响应随证书发给请求了status_request的客户端, 客户端不用再单独查询吊销状态.
+// SSL_CTX中的每个证书一份缓存, 由后台线程在过期前更新: 从file重新读取DER响应, 没有file时向url
+// (为空时用证书AIA中的地址)发送OCSP请求. 握手中只复制缓存, 从不读文件或发请求;
+// 没有响应或已过nextUpdate时不装订, 握手照常进行. 更新失败时保留旧响应, 稍后重试.
+// 构造CertID需要颁发者证书, 取证书文件中的链, 没有时用issuer; 都没有时只能用file, 按序列号匹配且不验证签名.
+//
+//   [ocsp]
+//   enable=1
+//   file=ocsp.der
+//   url=
+//   issuer=
+//   refresh=3600
+//   timeout=5
+//
+// 本地测试可以用openssl生成响应文件:
+//   openssl ocsp -index index.txt -rsigner ca.pem -rkey ca.key -CA ca.pem -issuer ca.pem -cert cert.pem -respout ocsp.der
+
+#define OCSP_DEFAULT_REFRESH 3600      // 最长更新间隔(秒), 文件有变化时最迟这么久生效
+#define OCSP_DEFAULT_TIMEOUT 5         // 请求响应服务器的超时(秒)
+#define OCSP_RETRY_INTERVAL 60         // 更新失败后的重试间隔(秒)
+
+typedef struct st_ocsp_stapler st_ocsp_stapler_t;
+
+typedef struct st_ocsp_stats {
+    int certificates;
+    int valid;                     // 有未过期响应的证书
+    uint64_t stapled;              // 握手中附带了响应
+    uint64_t missing;              // 客户端请求了, 但没有响应或已过期
+    uint64_t refreshes;            // 成功更新
+    uint64_t failures;             // 读取, 请求或校验失败
+    double expires_in;             // 最早过期的响应还剩多少秒, 没有带nextUpdate的响应时为0
+} st_ocsp_stats_t;
+
+// 先同步加载一次再启动后台线程, 第一个握手就能装订. file和url都为空且证书没有AIA地址时返回NULL
+st_ocsp_stapler_t *ocsp_stapler_new(SSL_CTX *ctx, const char *file, const char *url, const char *issuer, double refresh,
+                                    double timeout);
+
+// 停止后台线程. 须在ctx释放后调用, 握手回调还引用着它
+void ocsp_stapler_free(st_ocsp_stapler_t *stapler);
+
+void ocsp_stapler_stats(st_ocsp_stapler_t *stapler, st_ocsp_stats_t *stats);
+
+#endif // OCSP_STAPLING_H
@@ -0,0 +1,110 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "structs.h"
+#include "event_engine.h"
+
+// 处理器线程池: 开启[offload]后, 普通请求的on_body_start/on_data_received/on_body_end
+// 不在事件循环中执行, 请求体在循环中收齐后整体交给线程池, 处理器可以阻塞(读盘, 查数据库).
+// 每个线程有自己的任务队列, 提交时轮流放入, 线程空闲时从其他线程的队列窃取.
+// 处理器在线程池中调用的响应接口只是记录下来, 处理器返回后经所属工作线程的邮箱和
+// event_async投递回去, 在循环中按顺序写出; 一次唤醒处理所有已到达的结果.
+// 处理器运行期间连接关闭时, 连接结构保留到处理器返回, on_disconnected也推迟到那时.
+// 限制: 处理器返回时响应必须已经结束(否则回复500或中止), 流式响应在返回后才开始发送;
+// client_output_full总是返回false; WebSocket升级请求仍在循环中处理.
+//
+//   [offload]
+//   enable=1
+//   threads=4
+//   max_body=1048576
+//   paths=/slow,/db           URL前缀, 不设置时所有请求都交给线程池, 其余的仍在循环中执行
+
+#define OFFLOAD_DEFAULT_THREADS 4
+#define OFFLOAD_DEFAULT_MAX_BODY (1024 * 1024)
+
+typedef struct st_offload st_offload_t;
+typedef struct st_offload_job st_offload_job_t;
+typedef struct st_offload_mailbox st_offload_mailbox_t;
+
+// 线程池中的任务, 嵌在调用者的结构中
+typedef struct st_offload_task {
+    struct st_offload_task *next;
+    void (*run)(struct st_offload_task *task);
+    double enqueued;               // 入队时的单调时钟, 用于统计等待时间
+} st_offload_task_t;
+
+// 在线程池中运行的一个请求
+struct st_offload_job {
+    st_offload_task_t task;
+    st_offload_t *offload;
+    struct st_client *client;
+    st_buffer_t body;              // 在循环中收齐的请求体
+    st_buffer_t ops;               // 处理器调用的响应接口, 返回后在循环中重放
+    response_state_t response_state;  // 按记录的操作推算的响应进度
+    int header_count;
+    bool running;                  // 已提交到线程池
+    bool too_large;                // 请求体超过max_body, 不执行处理器, 回复413
+    bool orphaned;                 // 处理器返回前连接已关闭, 由完成回调释放连接
+    bool disconnected;             // on_disconnected推迟到处理器返回后
+    st_offload_job_t *next;        // 邮箱链表
+};
+
+// 每个工作线程一个, 接收线程池返回的请求
+struct st_offload_mailbox {
+    st_event_async_t async;
+    pthread_mutex_t lock;
+    st_offload_job_t *head;
+    st_offload_job_t *tail;
+    struct st_server_worker *worker;
+    void (*delivered)(struct st_server_worker *worker);  // 处理完一批后调用
+};
+
+typedef struct st_offload_stats {
+    int threads;
+    size_t queued;                 // 当前排队的任务
+    size_t max_queued;             // 排队数的峰值
+    size_t running;                // 正在执行的处理器
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stolen;               // 从其他线程的队列窃取执行的任务
+    uint64_t orphaned;             // 处理器返回前连接已关闭
+    uint64_t wakeups;              // 唤醒工作线程的次数, 与completed之比就是平均批量
+    double wait_avg;               // 任务从提交到开始执行的平均等待(秒)
+    double wait_max;
+} st_offload_stats_t;
+
+// 启动线程池, threads小于等于0时用默认值, paths为空表示所有请求
+st_offload_t *offload_new(int threads, size_t max_body, const char *paths);
+
+// 执行完已提交的任务后停止线程池, 结果留在各邮箱中, 由offload_mailbox_destroy释放
+void offload_free(st_offload_t *offload);
+
+// 包装应用回调, 返回的回调在循环中收集请求并提交到线程池
+event_callbacks *offload_wrap_callbacks(st_offload_t *offload, event_callbacks *app);
+
+void offload_stats(st_offload_t *offload, st_offload_stats_t *stats);
+
+int offload_mailbox_init(st_offload_mailbox_t *mailbox, struct st_server_worker *worker, void (*delivered)(struct st_server_worker *worker));
+void offload_mailbox_destroy(st_offload_mailbox_t *mailbox);
+
+// 连接关闭时调用: 处理器仍在运行时标记连接, 返回true表示连接结构由完成回调释放
+bool offload_release(struct st_client *client);
+
+// 在线程池中执行该连接的处理器时返回对应的请求, 响应接口据此改为记录
+st_offload_job_t *offload_capture(struct st_client *client);
+
+// 记录处理器调用的响应接口, 参数和返回值与https_server.h中的对应接口相同
+bool offload_add_header(st_offload_job_t *job, const char *name, const char *value);
+bool offload_send_response(st_offload_job_t *job, int status_code, const char *status_message, const char *content_type, const char *body, size_t body_length);
+bool offload_start_response(st_offload_job_t *job, int status_code, const char *status_message, const char *content_type);
+bool offload_start_with_headers(st_offload_job_t *job, int status_code, const char *status_message, const st_header_pair_t *headers, int header_count, long long content_length);
+bool offload_send_chunk(st_offload_job_t *job, const char *data, size_t length);
+bool offload_finish_response(st_offload_job_t *job);
+void offload_abort_response(st_offload_job_t *job);
+bool offload_send_data(st_offload_job_t *job, const char *data, size_t length);
+
+#endif // OFFLOAD_H
@@ -0,0 +1,66 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+#include "event_engine.h"
+
+// 过载保护: 每个工作线程用周期定时器的漂移测量事件循环的延迟(lag).
+// 延迟超过target_lag时按比例拒绝新请求(预先生成的503+Retry-After)和
+// 不带会话恢复的完整TLS握手, 比例随延迟上升, 恢复后逐步下降;
+// 超过pause_lag时本线程停止accept, 交给其他线程或留在内核队列中.
+
+#define OVERLOAD_DEFAULT_INTERVAL 0.02      // 采样周期(秒)
+#define OVERLOAD_DEFAULT_TARGET_LAG 0.05
+#define OVERLOAD_DEFAULT_PAUSE_LAG 0.2
+#define OVERLOAD_DEFAULT_RETRY_AFTER 1      // Retry-After(秒)
+#define OVERLOAD_MAX_SHED_RATE 0.95         // 总留一部分请求, 延迟的测量才有意义
+#define OVERLOAD_MAX_RESPONSE 256
+#define OVERLOAD_BODY "server overloaded\n"
+
+typedef struct st_overload st_overload_t;
+
+// 停止/恢复accept的回调, paused为新状态
+typedef void (*overload_accept_cb_t)(st_overload_t *overload, bool paused);
+
+struct st_overload {
+    st_event_loop_t *loop;
+    st_event_timer_t timer;
+    double interval;
+    double target_lag;
+    double pause_lag;
+    double expected;               // 本次采样应当触发的单调时钟时间
+    double lag;                    // 平滑后的延迟(秒)
+    double shed_rate;              // 拒绝新请求和完整握手的比例
+    bool accept_paused;
+    uint32_t random;               // xorshift状态
+    overload_accept_cb_t on_accept;
+    void *data;
+    char response[OVERLOAD_MAX_RESPONSE];  // HTTP/1.1的503, 启动时生成
+    size_t response_length;
+    char retry_after[16];
+};
+
+typedef struct st_overload_stats {
+    uint64_t shed_requests;        // 以503拒绝的请求
+    uint64_t shed_handshakes;      // 拒绝的完整握手
+    uint64_t accept_pauses;        // 停止accept的次数
+    double lag;                    // 当前线程的平滑延迟
+    double shed_rate;
+    bool accept_paused;
+} st_overload_stats_t;
+
+int overload_init(st_overload_t *overload, st_event_loop_t *loop, double target_lag, double pause_lag, int retry_after, overload_accept_cb_t on_accept, void *data);
+void overload_destroy(st_overload_t *overload);
+
+// 是否接纳一个新请求, 拒绝时计入统计
+bool overload_admit_request(st_overload_t *overload);
+
+// 在ClientHello回调中使用: 尝试会话恢复的握手总是接纳, 完整握手按比例拒绝
+bool overload_admit_handshake(st_overload_t *overload, SSL *ssl);
+
+void overload_stats(const st_overload_t *overload, st_overload_stats_t *stats);
+
+#endif // OVERLOAD_H
@@ -0,0 +1,127 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include "structs.h"
+#include "config.h"
+#include "event_engine.h"
+
+// 反向代理: 按URL前缀把请求转发到配置的上游组. 上游连接(TLS或明文)按工作线程
+// 和上游主机池化, keep-alive复用. 请求体和响应体都按流转发, 一侧积压时暂停另一侧的读取.
+// 负载均衡为峰值EWMA或最少未完成请求, 连续失败的主机被暂时摘除.
+//
+// 配置:
+//   [proxy]
+//   route=/api/ backend          前缀和上游组, 可以有多行, 先匹配先用
+//   [upstream:backend]
+//   server=127.0.0.1:8080        可以有多行
+//   tls=0                        上游使用TLS
+//   verify=1                     校验上游证书, ca=指定CA文件
+//   balance=peak_ewma            或least_outstanding
+//   max_idle=32                  每个工作线程每台主机保留的空闲连接数
+//   connect_timeout=3  read_timeout=30  idle_timeout=60
+//   max_fails=3  fail_timeout=10  连续失败max_fails次后摘除fail_timeout秒
+
+#define PROXY_MAX_GROUPS 8
+#define PROXY_MAX_SERVERS 16
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_HOST_LENGTH 64
+#define PROXY_DEFAULT_MAX_IDLE 32
+#define PROXY_DEFAULT_CONNECT_TIMEOUT 3.0
+#define PROXY_DEFAULT_READ_TIMEOUT 30.0
+#define PROXY_DEFAULT_IDLE_TIMEOUT 60.0
+#define PROXY_DEFAULT_MAX_FAILS 3
+#define PROXY_DEFAULT_FAIL_TIMEOUT 10.0
+#define PROXY_EWMA_DECAY 10.0          // 峰值EWMA的时间常数(秒)
+#define PROXY_OUTPUT_HIGH_WATERMARK (256 * 1024)  // 上游输出积压超过时暂停读取请求体
+
+typedef enum {
+    BALANCE_PEAK_EWMA,
+    BALANCE_LEAST_OUTSTANDING
+} balance_t;
+
+typedef struct st_upstream_server {
+    char host[PROXY_MAX_HOST_LENGTH];
+    int port;
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+} st_upstream_server_t;
+
+typedef struct st_upstream_group {
+    char name[MAX_SECTION_NAME_LENGTH];
+    st_upstream_server_t servers[PROXY_MAX_SERVERS];
+    int server_count;
+    bool tls;
+    SSL_CTX *ssl_ctx;
+    balance_t balance;
+    int max_idle;
+    double connect_timeout;
+    double read_timeout;
+    double idle_timeout;
+    int max_fails;
+    double fail_timeout;
+} st_upstream_group_t;
+
+typedef struct st_proxy_route {
+    char prefix[MAX_VALUE_LENGTH];
+    size_t prefix_length;
+    int group;
+} st_proxy_route_t;
+
+typedef struct st_proxy {
+    st_upstream_group_t groups[PROXY_MAX_GROUPS];
+    int group_count;
+    st_proxy_route_t routes[PROXY_MAX_ROUTES];
+    int route_count;
+    event_callbacks *app;          // 应用的回调, 没有匹配路由的请求交给它
+    event_callbacks callbacks;     // 包装后的回调, 交给服务器
+} st_proxy_t;
+
+typedef struct st_upstream_conn st_upstream_conn_t;
+
+// 一台上游主机在一个工作线程中的状态. 均衡和摘除只看本线程的观测, 不需要加锁
+typedef struct st_upstream_peer {
+    const st_upstream_server_t *server;
+    const st_upstream_group_t *group;
+    st_upstream_conn_t *idle;      // 空闲连接, 后进先出
+    int idle_count;
+    int outstanding;               // 未完成的请求
+    double ewma;                   // 峰值EWMA首字节时间(秒)
+    double ewma_stamp;
+    int fails;                     // 连续失败次数
+    double ejected_until;
+} st_upstream_peer_t;
+
+// 每个工作线程一个
+typedef struct st_proxy_worker {
+    st_proxy_t *proxy;
+    st_event_loop_t *loop;
+    st_upstream_peer_t *peers[PROXY_MAX_GROUPS];
+    int cursors[PROXY_MAX_GROUPS];  // 代价相同时轮流选择的起点
+} st_proxy_worker_t;
+
+typedef struct st_proxy_stats {
+    uint64_t requests;
+    uint64_t retries;
+    uint64_t failures;             // 以502/504结束的请求
+    uint64_t ejections;
+    uint64_t connects;             // 新建的上游连接
+    uint64_t reuses;               // 复用的空闲连接
+} st_proxy_stats_t;
+
+// 从配置创建代理, [proxy]中没有路由时返回NULL
+st_proxy_t *proxy_load(const st_config_file_t *config);
+void proxy_free(st_proxy_t *proxy);
+
+// 包装应用回调: 匹配路由的请求由代理处理, 其余交给app
+event_callbacks *proxy_wrap_callbacks(st_proxy_t *proxy, event_callbacks *app);
+
+st_proxy_worker_t *proxy_worker_new(st_proxy_t *proxy, st_event_loop_t *loop);
+void proxy_worker_free(st_proxy_worker_t *worker);
+
+void proxy_stats(st_proxy_stats_t *stats);
+
+#endif // PROXY_H
@@ -0,0 +1,39 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "structs.h"
+
+// 请求头的存储, HTTP/1.1解析回调和HTTP/2头部解码共用
+
+void request_reset(st_request_t *request);
+
+// 释放头部存储, 之后仍可继续使用
+void request_free(st_request_t *request);
+
+// 下一个头部的位置, 超过MAX_REQUEST_HEADERS或内存不足时返回NULL
+st_http_header_t *request_next_header(st_request_t *request);
+
+// 追加当前字段的内容, 超过MAX_REQUEST_HEAD_SIZE时失败
+int request_append(st_request_t *request, const char *at, size_t length);
+
+// 结束当前字段, 返回字段起始位置
+int request_terminate(st_request_t *request, uint32_t *start, uint32_t *length);
+
+// 当前字段作为头部值结束, 识别已知头部并记录下标
+int request_commit_header(st_request_t *request);
+
+int request_set_url(st_request_t *request, const char *url, size_t length);
+int request_add_header(st_request_t *request, const char *name, size_t name_length, const char *value, size_t value_length);
+
+// 按名称查找请求头, 不区分大小写. 已知头部直接取下标, 其余逐个比较
+const char *request_find_header(const st_request_t *request, const char *name);
+
+// 按known_header_t取请求头, O(1)
+const char *request_get_header(const st_request_t *request, int id);
+
+// 方法名转换为llhttp_method_t, 未知方法返回-1
+int request_method_from_string(const char *method, size_t length);
+
+#endif // REQUEST_H
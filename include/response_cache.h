@@ -0,0 +1,85 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// 完整响应的缓存, 所有工作线程共享. 键为方法, URL和选定的请求头,
+// 值是序列化好的响应(含响应头), 命中时直接写给客户端.
+// 按键的哈希分成多个分片, 每个分片一把锁, 各自做LRU淘汰和容量统计.
+
+#define RESPONSE_CACHE_DEFAULT_SHARDS 16
+#define RESPONSE_CACHE_DEFAULT_CAPACITY (64 * 1024 * 1024)
+#define RESPONSE_CACHE_DEFAULT_MAX_ENTRY (1024 * 1024)
+
+typedef struct st_cache_entry {
+    struct st_cache_entry *hash_next;
+    struct st_cache_entry *lru_prev;   // 靠近表头的更近被使用
+    struct st_cache_entry *lru_next;
+    uint64_t hash;
+    double expires;                    // 单调时钟, 秒
+    int refs;                          // 缓存本身持有一个引用, 发送中的连接各持有一个
+    size_t key_length;
+    size_t length;                     // 响应长度
+    size_t connection_offset;          // "Connection: keep-alive\r\n"所在位置, 供关闭连接的客户端替换
+    char *data;                        // 响应, 之后紧跟键
+} st_cache_entry_t;
+
+typedef struct st_cache_shard {
+    pthread_mutex_t lock;
+    st_cache_entry_t **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    size_t bytes;
+    st_cache_entry_t *lru_head;
+    st_cache_entry_t *lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t expirations;
+} st_cache_shard_t;
+
+typedef struct st_response_cache {
+    st_cache_shard_t *shards;
+    int shard_count;
+    size_t shard_capacity;             // 每个分片的字节上限
+    size_t max_entry_size;
+} st_response_cache_t;
+
+typedef struct st_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;                // 容量不足被淘汰
+    uint64_t expirations;              // 过期被删除
+    size_t entries;
+    size_t bytes;
+} st_cache_stats_t;
+
+st_response_cache_t *response_cache_new(int shard_count, size_t capacity, size_t max_entry_size);
+void response_cache_free(st_response_cache_t *cache);
+
+// 查找未过期的响应, 命中时返回的条目已加引用, 用完后调用response_cache_release
+st_cache_entry_t *response_cache_lookup(st_response_cache_t *cache, const char *key, size_t key_length);
+void response_cache_release(st_cache_entry_t *entry);
+
+// 插入或替换响应, 响应头head中须有"Connection: keep-alive", ttl为秒
+bool response_cache_store(st_response_cache_t *cache, const char *key, size_t key_length,
+                          const char *head, size_t head_length, const char *body, size_t body_length, double ttl);
+
+void response_cache_stats(st_response_cache_t *cache, st_cache_stats_t *stats);
+
+// 从Cache-Control得到可共享缓存的秒数(优先s-maxage), 不能缓存时返回0
+double cache_control_ttl(const char *value);
+
+// Cache-Control中是否有指令name, 带不带参数都算
+bool cache_control_has(const char *value, const char *name);
+
+// 响应可在共享缓存中保存的秒数. 请求带Authorization(authorized)时, 只有响应
+// 明确允许(public, s-maxage或must-revalidate)才保存(RFC 9111 3.5)
+double cache_response_ttl(const char *cache_control, bool authorized);
+
+#endif // RESPONSE_CACHE_H
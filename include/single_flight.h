@@ -0,0 +1,107 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "event_engine.h"
+
+// 相同请求的合并(single-flight): 同一个键只有第一个请求执行处理器,
+// 并发到达的相同请求挂起等待, 领头请求的完整响应发给所有等待者.
+// 等待者可以属于其他工作线程, 结果经各线程的邮箱和event_async投递.
+
+#define FLIGHT_DEFAULT_SHARDS 16
+#define FLIGHT_DEFAULT_MAX_WAIT 5.0
+
+enum {
+    FLIGHT_LEADER,
+    FLIGHT_WAITER
+};
+
+// 共享的响应, 所有等待者引用同一份
+typedef struct st_flight_result {
+    int refs;
+    size_t length;
+    size_t connection_offset;  // "Connection: ..."行的位置, 等待者按自己的连接状态替换
+    size_t connection_length;  // 该行的长度(含\r\n)
+    char data[];
+} st_flight_result_t;
+
+typedef struct st_flight st_flight_t;
+typedef struct st_flight_shard st_flight_shard_t;
+typedef struct st_flight_mailbox st_flight_mailbox_t;
+
+typedef struct st_flight_waiter {
+    struct st_flight_waiter *next;
+    st_flight_t *flight;           // 仍在等待时非空, 受分片锁保护
+    st_flight_shard_t *shard;
+    st_flight_mailbox_t *mailbox;  // 等待者所在线程的邮箱
+    void *data;                    // 等待的连接, 连接关闭后置空
+    st_flight_result_t *result;    // 为空表示领头请求没有可共享的响应, 需要自己执行处理器
+    st_event_timer_t timer;        // 最长等待时间
+} st_flight_waiter_t;
+
+typedef void (*flight_deliver_cb_t)(st_flight_waiter_t *waiter);
+
+// 每个工作线程一个
+struct st_flight_mailbox {
+    pthread_mutex_t lock;
+    st_flight_waiter_t *head;
+    st_flight_waiter_t *tail;
+    st_event_async_t async;
+    flight_deliver_cb_t deliver;
+};
+
+struct st_flight {
+    st_flight_t *hash_next;
+    uint64_t hash;
+    size_t key_length;
+    st_flight_waiter_t *waiters;
+    char key[];
+};
+
+struct st_flight_shard {
+    pthread_mutex_t lock;
+    st_flight_t **buckets;
+    size_t bucket_count;
+    size_t flight_count;
+};
+
+typedef struct st_flight_stats {
+    uint64_t leaders;          // 执行了处理器的请求
+    uint64_t coalesced;        // 直接拿到领头请求响应的请求
+    uint64_t timeouts;         // 等待超时后自己执行处理器
+    uint64_t fallbacks;        // 领头请求失败后自己执行处理器
+} st_flight_stats_t;
+
+typedef struct st_flight_group {
+    st_flight_shard_t *shards;
+    int shard_count;
+    double max_wait;
+    st_flight_stats_t stats;   // 原子更新
+} st_flight_group_t;
+
+st_flight_group_t *flight_group_new(int shard_count, double max_wait);
+void flight_group_free(st_flight_group_t *group);
+
+// 加入键对应的请求组. 没有进行中的请求时成为领头(*flight), 否则登记为等待者(*waiter)
+int flight_join(st_flight_group_t *group, const char *key, size_t key_length, st_flight_mailbox_t *mailbox, void *data,
+                st_flight_t **flight, st_flight_waiter_t **waiter);
+
+// 领头请求的响应, head中的Connection行会被等待者替换. head为空表示没有可共享的响应
+void flight_complete(st_flight_group_t *group, st_flight_t *flight, const char *head, size_t head_length, const char *body, size_t body_length);
+
+// 等待者放弃等待(超时或连接关闭). 返回true表示已从请求组移除, 由调用者释放;
+// 返回false表示结果已投递到邮箱, 由邮箱回调处理
+bool flight_cancel(st_flight_group_t *group, st_flight_waiter_t *waiter, bool timed_out);
+
+void flight_waiter_free(st_flight_waiter_t *waiter);
+void flight_result_release(st_flight_result_t *result);
+
+int flight_mailbox_init(st_flight_mailbox_t *mailbox, st_event_loop_t *loop, flight_deliver_cb_t deliver);
+void flight_mailbox_destroy(st_flight_mailbox_t *mailbox, st_event_loop_t *loop);
+
+void flight_stats(st_flight_group_t *group, st_flight_stats_t *stats);
+
+#endif // SINGLE_FLIGHT_H
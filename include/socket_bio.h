@@ -0,0 +1,18 @@
+#ifndef SOCKET_BIO_H
+#define SOCKET_BIO_H
+
+#include <openssl/bio.h>
+#include "buffer.h"
+
+// 服务端连接的BIO: 读直接recv套接字; 写出的TLS记录只追加到连接的输出缓冲区,
+// 由连接在本轮事件循环结束时和其他数据一起写出, 一次循环中产生的多个记录只需一次系统调用.
+// 写不会阻塞也不会部分完成, SSL_write/SSL_do_handshake不再返回WANT_WRITE.
+// 类型带BIO_TYPE_DESCRIPTOR, SSL_get_fd仍然可用
+
+// 输出缓冲区由空变为非空时调用, 连接据此登记到本轮的待写出列表
+typedef void (*socket_bio_output_cb_t)(void *arg);
+
+// 失败返回NULL. out和arg的生命周期由调用者保证长于BIO
+BIO *socket_bio_new(int fd, st_buffer_t *out, socket_bio_output_cb_t on_output, void *arg);
+
+#endif // SOCKET_BIO_H
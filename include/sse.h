@@ -0,0 +1,61 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "structs.h"
+#include "event_engine.h"
+
+// 服务器推送事件(text/event-stream)的发布/订阅.
+// 每个工作线程维护自己连接的主题订阅表. 发布者可以在任意线程, 事件只格式化一次,
+// 成为只读的引用计数消息(已带好chunk帧), 投递到有订阅者的工作线程的邮箱, 由各线程并行分发.
+// 订阅者的队列只保存消息的引用, 不复制内容; 连接可写时一次取出积压的多条合并写出
+// (明文连接writev, TLS连接拼成一个记录), 输出积压到高水位后停止, 等on_drain再继续.
+// 队列超过max_queue条时丢弃最旧的. 没有事件时定期发送注释行作为心跳,
+// 订阅的HTTP/1.1连接不做空闲超时; HTTP/2连接的心跳间隔应小于idle_timeout.
+//
+//   [sse]
+//   enable=1
+//   max_queue=256             每个订阅者最多积压的消息
+//   heartbeat=15              心跳间隔(秒), 0表示不发送
+
+#define SSE_DEFAULT_MAX_QUEUE 256
+#define SSE_DEFAULT_HEARTBEAT 15.0
+
+typedef struct st_sse_hub st_sse_hub_t;
+typedef struct st_sse_worker st_sse_worker_t;
+typedef struct st_sse_subscriber st_sse_subscriber_t;
+
+typedef struct st_sse_stats {
+    size_t subscribers;
+    uint64_t published;            // 发布的事件
+    uint64_t delivered;            // 写给订阅者的事件
+    uint64_t writes;               // 写出的批次, delivered与之比就是平均合并的事件数
+    uint64_t dropped;              // 积压超过max_queue被丢弃的事件
+} st_sse_stats_t;
+
+// max_queue小于等于0时用默认值
+st_sse_hub_t *sse_hub_new(int max_queue, double heartbeat);
+
+// 所有工作线程退出后调用
+void sse_hub_free(st_sse_hub_t *hub);
+
+// 任意线程调用, 向主题发布一个事件. event和id可以为NULL, 不能含换行;
+// data中的每一行成为一个data:字段. 返回false表示参数无效或内存不足
+bool sse_publish(st_sse_hub_t *hub, const char *topic, const char *event, const char *id, const char *data, size_t length);
+
+void sse_stats(st_sse_hub_t *hub, st_sse_stats_t *stats);
+
+// 工作线程的订阅表和邮箱, 在循环所在线程创建和释放
+st_sse_worker_t *sse_worker_new(st_sse_hub_t *hub, st_event_loop_t *loop);
+void sse_worker_free(st_sse_worker_t *worker);
+
+// 响应头已发出的连接订阅topics(逗号分隔). 连接的回调换成本模块的包装, 取消订阅时恢复
+bool sse_subscribe(st_sse_worker_t *worker, struct st_client *client, const char *topics);
+
+// 结束本线程所有事件流, 用于排空
+void sse_worker_close_all(st_sse_worker_t *worker);
+
+#endif // SSE_H
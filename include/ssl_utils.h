@@ -1,11 +1,15 @@
 #ifndef SSL_UTILS_H
 #define SSL_UTILS_H
 
+#include <stdbool.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
 SSL_CTX* init_server_ssl(const char *cert_file, const char *key_file);
 SSL_CTX* init_client_ssl(void);
+
+// 通过ALPN选择应用层协议, http2为true时优先h2
+void set_server_alpn(SSL_CTX *ctx, bool http2);
 void cleanup_ssl(SSL_CTX *ctx);
 void handle_ssl_error(void);
 
@@ -5,6 +5,13 @@
 #include <ev.h>
 #include <llhttp.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "event_engine.h"
+#include "buffer.h"
+#include "compress.h"
+#include "known_headers.h"
 
 #define BUFFER_SIZE 4096
 #define INITIAL_BUFFER_SIZE 4096
@@ -13,6 +20,10 @@ typedef void (*data_callback_t)(void *client, const char *data, size_t length);
 typedef void (*connect_callback_t)(void *client);
 typedef void (*disconnect_callback_t)(void *client);
 typedef void (*error_callback_t)(void *client, const char *error_message);
+typedef void (*request_callback_t)(void *client);
+typedef void (*drain_callback_t)(void *client);
+typedef void (*ws_message_callback_t)(void *client, int opcode, const char *data, size_t length);
+typedef size_t (*coalesce_key_callback_t)(void *client, char *key, size_t size);
 
 // 客户端回调结构体
 typedef struct {
@@ -20,24 +31,256 @@ typedef struct {
     connect_callback_t on_connected;
     disconnect_callback_t on_disconnected;
     error_callback_t on_error;  // 新增的异常回调
+    request_callback_t on_body_start;   // 请求头解析完成, 请求体(可能为空)开始
+    request_callback_t on_body_end;     // 请求体接收完毕
+    drain_callback_t on_drain;          // 积压的输出已全部写出
+    ws_message_callback_t on_ws_message;  // 收到完整的WebSocket消息或控制帧
+    coalesce_key_callback_t coalesce_key; // 请求合并的键, 返回0表示不合并; 未设置时与缓存键相同. 带Authorization/Cookie的请求不合并
 } event_callbacks;
 
+#define MAX_REQUEST_HEADERS 64
+#define REQUEST_INITIAL_HEADERS 16
+#define MAX_REQUEST_HEAD_SIZE (64 * 1024)
 
-struct st_client {
-    struct ev_io io;
+// 请求头在head缓冲区中的位置
+typedef struct st_http_header {
+    uint32_t name;
+    uint32_t name_length;
+    uint32_t value;
+    uint32_t value_length;
+    int id;                    // known_header_t, 不是已知头部时为HEADER_UNKNOWN
+} st_http_header_t;
+
+// 当前请求, url和头部以'\0'结尾依次存放在head中
+typedef struct st_request {
+    st_buffer_t head;
+    uint32_t url;
+    uint32_t url_length;
+    uint32_t mark;
+    st_http_header_t *headers;  // 按需增长, 最多MAX_REQUEST_HEADERS个
+    int header_count;
+    int header_capacity;
+    uint8_t known[KNOWN_HEADER_COUNT];  // 已知头部第一次出现的下标+1, 0表示没有
+} st_request_t;
+
+// 响应头中的一个字段
+typedef struct st_header_pair {
+    const char *name;
+    const char *value;
+} st_header_pair_t;
+
+// 响应进度, 同一连接上的下一个请求要等当前响应结束后才解析
+typedef enum {
+    RESPONSE_STATE_NONE,
+    RESPONSE_STATE_STREAMING,
+    RESPONSE_STATE_DONE
+} response_state_t;
+
+
+// 监听套接字的类型. 明文监听用于同一主机上的内部转发, 与TLS共用解析, 处理器和响应路径
+typedef enum {
+    LISTENER_TLS,
+    LISTENER_TCP,              // 明文HTTP/1.1
+    LISTENER_UNIX,             // AF_UNIX流套接字上的明文HTTP/1.1
+    LISTENER_COUNT
+} listener_type_t;
+
+// 服务端连接状态
+typedef enum {
+    CLIENT_STATE_HANDSHAKE,
+    CLIENT_STATE_ACTIVE,
+    CLIENT_STATE_CLOSING
+} client_state_t;
+
+struct st_server_worker;
+struct st_h2_session;
+struct st_h2_stream;
+struct st_websocket;
+struct st_response_cache;
+struct st_flight;
+struct st_flight_waiter;
+struct st_flight_group;
+struct st_flight_mailbox;
+struct st_proxy;
+struct st_proxy_request;
+struct st_proxy_worker;
+struct st_overload;
+struct st_offload;
+struct st_offload_job;
+struct st_offload_mailbox;
+struct st_async_crypto;
+struct st_trace_record;
+struct st_tracer;
+struct st_capture;
+struct st_capture_request;
+struct st_file_output;
+struct st_sse_hub;
+struct st_sse_worker;
+struct st_sse_subscriber;
+
+typedef struct st_client {
+    st_event_io_t io;          // 必须位于首位, epoll_event.data.ptr 即连接指针
     int client_fd;
-    SSL *ssl;
-    llhttp_t parser;
-    llhttp_settings_t settings;
+    SSL *ssl;                  // 明文连接为NULL
+    llhttp_t parser;           // 所有连接共用同一张解析回调表
     event_callbacks *callbacks;
+    struct st_server_worker *worker;
+    st_event_timer_t timer;    // 握手/空闲超时
+    double last_activity;
+    st_buffer_t out;           // 尚未写出的数据
+    st_buffer_t in;            // 解析暂停时尚未解析的数据
+    client_state_t state;
+    st_request_t request;
+    response_state_t response_state;
+    bool keep_alive;
+    bool chunked;              // 当前响应使用chunked编码
+    bool read_paused;          // 处理器要求暂停读取
+    bool awaiting_response;    // 请求已收完, 等待响应结束
+    bool parsing;              // 正在llhttp_execute中
+    bool dispatching;          // 正在处理io事件
+    bool close_after_flush;
+    st_compressor_t *compressor;  // 当前流式响应的压缩器
+    struct st_h2_session *h2;     // 协商为HTTP/2的连接
+    struct st_h2_stream *h2_stream;  // HTTP/2流的句柄, 不对应套接字
+    struct st_websocket *ws;      // 已升级为WebSocket的连接
+    st_buffer_t extra_headers;    // 处理器添加的响应头, 依次存放"name\0value\0"
+    int extra_header_count;
+    st_buffer_t cache_key;        // 可缓存请求的键, 为空表示不缓存
+    bool cache_hit;               // 已从缓存响应, 不再调用处理器
+    struct st_flight *flight;     // 领头执行的合并请求, 响应后交给等待者
+    struct st_flight_waiter *flight_waiter;  // 挂起等待相同请求的响应, 不调用处理器
+    struct st_proxy_request *proxy;  // 正在转发到上游的请求
+    bool proxied;                 // 当前请求由代理处理, 不交给应用回调
+    bool shed;                    // 过载时已用503拒绝, 不调用处理器
+    struct st_offload_job *offload;  // 交给线程池的请求, 处理器运行期间连接关闭时由它释放连接
+    st_event_io_t async_io;       // 握手中的私钥运算完成通知
+    int async_fd;                 // 正在监听的通知fd, -1表示没有
+    struct st_trace_record *trace;  // 被抽中追踪的连接的当前记录
+    struct st_capture_request *capture;  // 被抽中抓取的当前请求, 请求收完后写出
+    struct st_file_output *file;  // 输出缓冲区之后还要发送的文件, 发完之前不解析下一个请求
+    struct st_sse_subscriber *sse;  // 订阅了事件流的连接, 回调已换成事件流的包装
+    size_t record_bytes;          // 动态记录大小: 本轮以小记录开始后已加密的字节
+    double record_last;           // 上次加密的时间, 空闲过久重新从小记录开始
+    struct st_client *prev;       // 工作线程的连接链表, 排空时遍历; HTTP/2流不在其中
+    struct st_client *next;
+    bool flush_queued;            // TLS输出缓冲区中有本轮产生的记录, 在循环结束时写出
+    struct st_client *flush_prev;
+    struct st_client *flush_next;
 }st_client_t;
 
 
+#define MAX_COMPRESS_TYPES_LENGTH 256
+#define MAX_CACHE_VARY_LENGTH 256
+#define MAX_OFFLOAD_PATHS_LENGTH 256
+#define MAX_TRACE_FILE_LENGTH 256
+#define MAX_CAPTURE_REDACT_LENGTH 256
+#define MAX_OCSP_URL_LENGTH 256
+#define MAX_EXTRA_RESPONSE_HEADERS 16
+#define MAX_UNIX_PATH_LENGTH 108
+
+// 服务器选项
+typedef struct st_server_options {
+    event_engine_t engine;     // 事件引擎
+    int workers;               // 工作线程数, 共享同一监听套接字
+    int max_events;            // epoll单次处理的事件数
+    int plain_port;            // 明文HTTP监听端口, 0表示不监听
+    char unix_path[MAX_UNIX_PATH_LENGTH];  // 明文HTTP的AF_UNIX监听路径, 为空时不监听
+    double idle_timeout;       // 握手/空闲超时(秒)
+    bool compress;             // 按Accept-Encoding压缩响应
+    int compress_level;
+    size_t compress_min_size;  // 小于该长度的完整响应不压缩
+    char compress_types[MAX_COMPRESS_TYPES_LENGTH];  // 可压缩的MIME类型
+    bool http2;                // 通过ALPN提供h2
+    size_t ws_max_message_size;  // WebSocket消息上限
+    bool cache;                // 缓存带Cache-Control: max-age的GET响应
+    int cache_shards;
+    size_t cache_capacity;     // 缓存总字节数上限
+    size_t cache_max_entry;    // 单个响应的上限
+    char cache_vary[MAX_CACHE_VARY_LENGTH];  // 参与缓存键的请求头, 逗号分隔
+    bool coalesce;             // 合并并发的相同GET请求, 只执行一次处理器
+    double coalesce_max_wait;  // 等待者的最长等待时间(秒), 超时后自己执行处理器
+    struct st_proxy *proxy;    // 反向代理的路由和上游组, 由load_server_options按[proxy]创建, 调用方用free_server_options释放
+    bool overload;             // 按事件循环延迟拒绝新请求和完整握手
+    double overload_target_lag;  // 开始拒绝的延迟(秒)
+    double overload_pause_lag;   // 停止accept的延迟(秒)
+    int overload_retry_after;    // 503响应的Retry-After(秒)
+    double drain_timeout;      // 升级或SIGTERM后等待进行中请求的最长时间(秒), 到期强制关闭
+    bool low_memory;           // 空闲连接释放SSL读写缓冲区和请求存储, 以少量分配换取内存
+    bool tcp_cork;             // 文件响应的头部和文件内容之间以MSG_MORE写出, 凑满报文段再发送
+    bool dynamic_records;      // TLS新连接和空闲后的连接先用小记录, 浏览器收到一个报文段就能解密
+    size_t small_record_size;  // 小记录的明文长度, 约一个TCP报文段
+    size_t record_boost_bytes; // 以小记录写出这么多字节后改用16KB记录
+    double record_idle_reset;  // 两次写之间空闲超过这么久(秒)重新从小记录开始
+    bool offload;              // 在线程池中执行处理器
+    int offload_threads;
+    char offload_paths[MAX_OFFLOAD_PATHS_LENGTH];  // 交给线程池的URL前缀, 逗号分隔, 为空时全部交给线程池
+    size_t offload_max_body;   // 交给线程池的请求体上限, 超过时回复413
+    bool async_crypto;         // 握手的私钥运算交给线程池
+    int async_crypto_threads;
+    bool trace;                // 抽样记录请求各阶段的时间
+    double trace_sample_rate;
+    size_t trace_capacity;
+    char trace_file[MAX_TRACE_FILE_LENGTH];      // 退出时导出Chrome trace JSON, 为空时不导出
+    bool capture;              // 抽样抓取解密后的请求写入文件, 用于重放
+    double capture_sample_rate;
+    size_t capture_max_body;
+    char capture_file[MAX_TRACE_FILE_LENGTH];
+    char capture_redact[MAX_CAPTURE_REDACT_LENGTH];  // 值不写入文件的请求头, 逗号分隔
+    bool ocsp;                 // 握手时装订后台更新的OCSP响应
+    char ocsp_file[MAX_TRACE_FILE_LENGTH];   // DER响应文件, 为空时向响应服务器请求
+    char ocsp_url[MAX_OCSP_URL_LENGTH];      // 响应服务器, 为空时用证书AIA中的地址
+    char ocsp_issuer[MAX_TRACE_FILE_LENGTH]; // 颁发者证书(PEM), 证书文件中没有链时需要
+    double ocsp_refresh;       // 最长更新间隔(秒)
+    double ocsp_timeout;       // 请求响应服务器的超时(秒)
+    struct st_sse_hub *sse;    // 事件流的发布/订阅, 由load_server_options按[sse]创建, 调用方用free_server_options释放
+} st_server_options_t;
+
 typedef struct st_server_params{
     SSL_CTX *ctx;
     event_callbacks *callbacks;
+    int listen_fds[LISTENER_COUNT];   // 按listener_type_t, -1表示不监听
+    st_server_options_t options;
+    struct st_response_cache *cache;  // 所有工作线程共享
+    struct st_flight_group *flights;  // 进行中的合并请求, 所有工作线程共享
+    struct st_offload *offload;       // 处理器线程池, 所有工作线程共享
+    struct st_async_crypto *crypto;   // 私钥运算线程池, 为NULL时在循环中计算
+    struct st_tracer *tracer;         // 请求追踪, 所有工作线程共享
+    struct st_capture *capture;       // 请求抓取, 所有工作线程共享
+    struct st_ocsp_stapler *ocsp;     // OCSP装订的响应缓存和更新线程
+    struct st_server_worker *workers;
+    int worker_count;
+    int upgrade_channel;              // 与新进程的交接套接字, -1表示没有进行中的升级
+    pid_t upgrade_pid;
+    st_event_io_t upgrade_io;         // 在0号工作线程中等待新进程就绪
 } st_server_params_t; 
 
+// 服务器工作线程, 每个线程一个事件循环
+typedef struct st_server_worker {
+    int id;
+    pthread_t thread;
+    st_server_params_t *params;
+    st_event_loop_t *loop;
+    st_event_io_t io_accept[LISTENER_COUNT];  // 下标即监听类型
+    st_compress_pool_t *compress_pool;
+    struct st_flight_mailbox *mailbox;  // 接收其他线程投递的合并请求结果
+    struct st_proxy_worker *proxy;      // 本线程的上游连接池
+    struct st_overload *overload;       // 本线程的延迟测量和准入控制
+    struct st_offload_mailbox *offload_mailbox;  // 接收线程池中返回的请求
+    int offload_pending;                // 已提交还没返回的请求, 排空时等它们返回后再退出
+    struct st_client *clients;          // 本线程的连接
+    int client_count;
+    st_event_async_t control;           // 信号处理和排空通知
+    int drain_requested;                // 其他线程要求排空, 原子访问
+    int stop_requested;                 // 其他线程要求立即退出循环, 原子访问
+    bool draining;                      // 已停止accept, 连接全部关闭后退出循环
+    double drain_started;
+    double drain_deadline;
+    st_event_timer_t drain_timer;       // 排空时定期关闭空闲连接
+    struct st_client *flushing;         // 本轮有TLS记录待写出的连接
+    st_event_prepare_t flush_prepare;   // 循环阻塞前把它们各用一次写出
+    struct st_sse_worker *sse;          // 本线程的事件流订阅表
+} st_server_worker_t;
+
 // typedef struct st_client {
 //     struct ev_io io;
 //     int client_fd;
@@ -2,6 +2,8 @@
 #define TCP_UTILS_H
 
 int create_server_socket(int port);
+// 在path上监听AF_UNIX流套接字, 先删除已存在的文件. 失败返回-1
+int create_unix_server_socket(const char *path);
 int create_client_socket(const char *hostname, int port);
 void set_non_blocking(int fd);
 
@@ -0,0 +1,111 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// 请求生命周期追踪: 按连接抽样, 被抽中的连接在每个阶段记录单调时钟,
+// 请求的最后一个字节写出后整条记录写入无锁环形缓冲区, 满了覆盖最旧的.
+// 可以随时导出为Chrome trace_event JSON(chrome://tracing或Perfetto打开), 每个连接一行.
+// 只追踪HTTP/1.1请求, HTTP/2连接只有accept和握手阶段.
+//
+//   [trace]
+//   enable=1
+//   sample_rate=0.01          抽样的连接比例
+//   capacity=65536            环形缓冲区的记录数, 取整到2的幂
+//   file=trace.json           服务器退出时导出, 不设置时不导出
+//
+// 同样的阶段还有USDT探针(provider为xhttp), 有<sys/sdt.h>时编译进去, 未挂载时只是一条nop:
+//   bpftrace -e 'usdt:./server_example:xhttp:headers_complete { @[tid] = nsecs; }'
+// 定义XHTTP_NO_USDT可以去掉探针.
+
+#if !defined(XHTTP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_USDT
+#define TRACE_PROBE(name, client, fd) DTRACE_PROBE2(xhttp, name, client, fd)
+#else
+#define TRACE_PROBE(name, client, fd) ((void)0)
+#endif
+
+// 触发探针, 连接被抽中时记录时间. client必须是struct st_client *
+#define TRACE_POINT(client, name, stage) do { \
+        TRACE_PROBE(name, (client), (client)->client_fd); \
+        if ((client)->trace) { \
+            trace_stamp((client)->trace, (stage)); \
+        } \
+    } while (0)
+
+#define TRACE_DEFAULT_SAMPLE_RATE 0.01
+#define TRACE_DEFAULT_CAPACITY 65536
+#define TRACE_URL_LENGTH 64
+
+typedef enum {
+    TRACE_ACCEPT,
+    TRACE_HANDSHAKE_START,
+    TRACE_HANDSHAKE_END,
+    TRACE_FIRST_BYTE,              // 请求的第一个字节(on_message_begin)
+    TRACE_HEADERS_COMPLETE,
+    TRACE_MESSAGE_COMPLETE,
+    TRACE_HANDLER_START,           // 调用应用的on_body_start
+    TRACE_HANDLER_END,             // 响应结束, 异步处理器也在这时
+    TRACE_LAST_BYTE,               // 响应的最后一个字节写入套接字
+    TRACE_STAGE_COUNT
+} trace_stage_t;
+
+typedef struct st_tracer st_tracer_t;
+
+// 一个被抽中的连接上当前请求的记录, 连接阶段只出现在连接的第一条记录中
+typedef struct st_trace_record {
+    uint64_t connection;           // 连接序号, 导出时作为tid
+    int worker;
+    uint64_t stamps[TRACE_STAGE_COUNT];  // 单调时钟(纳秒), 0表示没有到达
+    char method[8];
+    char url[TRACE_URL_LENGTH];
+    st_tracer_t *tracer;
+} st_trace_record_t;
+
+typedef struct st_trace_stats {
+    uint64_t sampled;              // 抽中的连接
+    uint64_t recorded;             // 写入缓冲区的记录
+    size_t capacity;
+} st_trace_stats_t;
+
+st_tracer_t *tracer_new(double sample_rate, size_t capacity);
+void tracer_free(st_tracer_t *tracer);
+
+// 新连接按抽样率决定是否追踪, 返回NULL表示不追踪
+st_trace_record_t *trace_begin(st_tracer_t *tracer, int worker);
+
+static inline uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void trace_stamp(st_trace_record_t *record, trace_stage_t stage) {
+    record->stamps[stage] = trace_now();
+}
+
+// 记录当前请求的方法和URL, 超长的截断
+void trace_set_request(st_trace_record_t *record, const char *method, const char *url);
+
+// 把已有的阶段写入缓冲区, 然后清空请求阶段, 准备记录下一个请求
+void trace_commit(st_trace_record_t *record);
+
+// 连接关闭: 提交未写入的阶段后释放
+void trace_end(st_trace_record_t *record);
+
+// 导出为Chrome trace_event JSON, 返回导出的记录数
+size_t trace_dump(st_tracer_t *tracer, FILE *fp);
+
+void trace_stats(st_tracer_t *tracer, st_trace_stats_t *stats);
+
+#endif // TRACE_H
@@ -0,0 +1,44 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// 不停机升级: 旧进程收到SIGUSR2后fork并exec可执行文件(已被替换时执行新文件),
+// 经socketpair以SCM_RIGHTS把监听套接字和TLS会话票据密钥交给新进程.
+// 新进程开始accept后回复就绪, 旧进程停止accept, 处理完进行中的请求后退出.
+// 票据密钥相同, 客户端可以在新进程上恢复会话, 不必重新完整握手.
+
+#define UPGRADE_ENV "XHTTP_UPGRADE_FD"
+#define UPGRADE_MAX_FDS 8
+#define UPGRADE_TICKET_KEYS_LENGTH 80   // 名称16字节, HMAC和AES密钥各32字节
+#define UPGRADE_READY_TIMEOUT 10        // 新进程接收交接数据的超时(秒)
+
+typedef struct st_handoff {
+    int fds[UPGRADE_MAX_FDS];           // 监听套接字, 取走后置为-1
+    int fd_count;
+    unsigned char ticket_keys[UPGRADE_TICKET_KEYS_LENGTH];
+    bool has_ticket_keys;
+} st_handoff_t;
+
+// 新进程: 环境变量UPGRADE_ENV指明交接套接字时接收旧进程的监听套接字和票据密钥,
+// 返回交接套接字, 之后用upgrade_ready通知旧进程. 不是升级启动时返回-1
+int upgrade_receive(st_handoff_t *handoff);
+
+// 取出本地端口为port的监听套接字, 没有时返回-1
+int upgrade_take_listener(st_handoff_t *handoff, int port);
+
+// 取出绑定在path上的AF_UNIX监听套接字, 没有时返回-1
+int upgrade_take_unix_listener(st_handoff_t *handoff, const char *path);
+
+// 关闭没有被取走的套接字
+void upgrade_release(st_handoff_t *handoff);
+
+// 新进程已开始accept
+void upgrade_ready(int channel);
+
+// 旧进程: 启动新进程并发送交接数据, 返回交接套接字, 新进程就绪时可读到一个字节,
+// 新进程失败时读到EOF. 失败返回-1
+int upgrade_spawn(const st_handoff_t *handoff, pid_t *pid);
+
+#endif // UPGRADE_H
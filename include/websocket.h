@@ -0,0 +1,63 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "structs.h"
+
+// WebSocket (RFC 6455) 服务端帧处理, 升级握手见https_server.h中的accept_websocket
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xa
+
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_INVALID_DATA 1007
+#define WS_CLOSE_TOO_BIG 1009
+
+#define WS_DEFAULT_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+typedef struct st_websocket {
+    st_buffer_t message;       // 分片消息拼接后的内容
+    int message_opcode;        // 正在接收的分片消息类型, 0表示没有
+    size_t max_message_size;
+    bool sending_fragments;    // 正在发送分片消息
+    bool close_sent;
+    bool close_received;
+} st_websocket_t;
+
+st_websocket_t *ws_create(size_t max_message_size);
+void ws_destroy(st_websocket_t *ws);
+
+// 计算Sec-WebSocket-Accept, out至少29字节
+void ws_accept_key(const char *key, char *out);
+
+// 在client->in上原地解析并去掩码, 完整消息通过on_ws_message交付.
+// 返回1表示关闭握手完成或出现协议错误, 输出写完后应关闭连接
+int ws_process(struct st_client *client);
+
+// 发送完整消息
+bool ws_send_message(struct st_client *client, int opcode, const char *data, size_t length);
+
+// 分片发送, 第一片使用opcode, 之后自动使用CONTINUATION, fin为true时结束消息
+bool ws_send_fragment(struct st_client *client, int opcode, const char *data, size_t length, bool fin);
+
+bool ws_send_ping(struct st_client *client, const char *data, size_t length);
+
+// 发起关闭握手, 收到对端的Close后关闭连接
+bool ws_close(struct st_client *client, uint16_t code, const char *reason);
+
+// 对payload按4字节掩码原地异或, 按CPU选择AVX2/SSE2/标量实现
+void ws_unmask(uint8_t *data, size_t length, const uint8_t key[4]);
+const char *ws_unmask_kernel(void);
+
+// 指定去掩码实现("scalar"/"sse2"/"avx2"), CPU不支持时返回false, 用于测试
+bool ws_set_unmask_kernel(const char *name);
+
+#endif // WEBSOCKET_H
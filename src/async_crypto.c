@@ -0,0 +1,392 @@
+#include "async_crypto.h"
+#include "log.h"
+#include <openssl/async.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// RSA 8192位
+#define ASYNC_CRYPTO_MAX_SIZE 1024
+
+enum {
+    CRYPTO_OP_RSA_PRIV_ENC,
+    CRYPTO_OP_RSA_PRIV_DEC,
+    CRYPTO_OP_ECDSA_SIGN
+};
+
+// 每个SSL一个, 作为ASYNC_WAIT_CTX的等待fd的custom_data, 在SSL释放时由cleanup回调释放.
+// 握手是顺序的, 同一时间最多一个私钥运算, 参数和结果都存放在这里, 连接中途关闭时线程池写的也是这里
+typedef struct st_crypto_channel {
+    struct st_crypto_channel *next;   // 线程池队列
+    st_async_crypto_t *crypto;
+    int fd;                        // eventfd, 运算完成时可读
+    int refs;                      // 等待fd和进行中的运算各持有一个, 原子访问
+    int done;                      // 原子访问
+    int op;
+    int padding;                   // RSA填充方式
+    int type;                      // ECDSA摘要类型
+    void *key;                     // RSA或EC_KEY, 运算期间持有引用
+    unsigned char input[ASYNC_CRYPTO_MAX_SIZE];
+    int input_length;
+    unsigned char output[ASYNC_CRYPTO_MAX_SIZE];
+    int output_length;
+    int result;
+    double enqueued;
+} st_crypto_channel_t;
+
+struct st_async_crypto {
+    RSA_METHOD *rsa_method;
+    EC_KEY_METHOD *ec_method;
+    int thread_count;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    st_crypto_channel_t *head;     // 受lock保护
+    st_crypto_channel_t *tail;
+    bool stopping;
+    // 统计, 原子访问
+    size_t queued;
+    size_t max_queued;
+    uint64_t offloaded;
+    uint64_t direct;
+    uint64_t wait_total_us;
+    uint64_t compute_total_us;
+};
+
+// 私钥ex_data中的st_async_crypto_t
+static int rsa_index = -1;
+static int ec_index = -1;
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+// ASYNC_WAIT_CTX中等待fd的键
+static const char channel_key = 0;
+
+static void init_indexes(void) {
+    rsa_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    ec_index = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void channel_release(st_crypto_channel_t *channel) {
+    if (__atomic_sub_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(channel->fd);
+        free(channel);
+    }
+}
+
+static void channel_cleanup(ASYNC_WAIT_CTX *ctx, const void *key, OSSL_ASYNC_FD fd, void *custom) {
+    channel_release((st_crypto_channel_t *)custom);
+}
+
+// ---- 线程池 ----
+
+static void compute(st_crypto_channel_t *channel) {
+    switch (channel->op) {
+        case CRYPTO_OP_RSA_PRIV_ENC:
+            channel->result = RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(channel->input_length, channel->input, channel->output,
+                                                                         (RSA *)channel->key, channel->padding);
+            RSA_free((RSA *)channel->key);
+            break;
+        case CRYPTO_OP_RSA_PRIV_DEC:
+            channel->result = RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL())(channel->input_length, channel->input, channel->output,
+                                                                         (RSA *)channel->key, channel->padding);
+            RSA_free((RSA *)channel->key);
+            break;
+        case CRYPTO_OP_ECDSA_SIGN: {
+            int (*sign)(int, const unsigned char *, int, unsigned char *, unsigned int *, const BIGNUM *, const BIGNUM *, EC_KEY *);
+            EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, NULL, NULL);
+            unsigned int length = 0;
+            channel->result = sign(channel->type, channel->input, channel->input_length, channel->output, &length, NULL, NULL, (EC_KEY *)channel->key);
+            channel->output_length = (int)length;
+            EC_KEY_free((EC_KEY *)channel->key);
+            break;
+        }
+    }
+    channel->key = NULL;
+}
+
+static void *run_crypto_thread(void *arg) {
+    st_async_crypto_t *crypto = (st_async_crypto_t *)arg;
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&crypto->lock);
+        while (!crypto->head && !crypto->stopping) {
+            pthread_cond_wait(&crypto->cond, &crypto->lock);
+        }
+        st_crypto_channel_t *channel = crypto->head;
+        if (!channel) {
+            pthread_mutex_unlock(&crypto->lock);
+            break;
+        }
+        crypto->head = channel->next;
+        if (!crypto->head) {
+            crypto->tail = NULL;
+        }
+        pthread_mutex_unlock(&crypto->lock);
+        __atomic_sub_fetch(&crypto->queued, 1, __ATOMIC_RELAXED);
+
+        double start = now_seconds();
+        compute(channel);
+        double end = now_seconds();
+        __atomic_add_fetch(&crypto->wait_total_us, (uint64_t)((start - channel->enqueued) * 1e6), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&crypto->compute_total_us, (uint64_t)((end - start) * 1e6), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&crypto->offloaded, 1, __ATOMIC_RELAXED);
+
+        // 先置完成再通知, 被其他事件提前恢复的任务也能看到结果
+        __atomic_store_n(&channel->done, 1, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        if (write(channel->fd, &one, sizeof(one)) < 0) {
+            log_error("async crypto notify failed");
+        }
+        channel_release(channel);
+    }
+    return NULL;
+}
+
+static void submit(st_async_crypto_t *crypto, st_crypto_channel_t *channel) {
+    channel->next = NULL;
+    channel->enqueued = now_seconds();
+    size_t queued = __atomic_add_fetch(&crypto->queued, 1, __ATOMIC_RELAXED);
+    size_t max = __atomic_load_n(&crypto->max_queued, __ATOMIC_RELAXED);
+    while (queued > max && !__atomic_compare_exchange_n(&crypto->max_queued, &max, queued, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    pthread_mutex_lock(&crypto->lock);
+    if (crypto->tail) {
+        crypto->tail->next = channel;
+    } else {
+        crypto->head = channel;
+    }
+    crypto->tail = channel;
+    pthread_cond_signal(&crypto->cond);
+    pthread_mutex_unlock(&crypto->lock);
+}
+
+// ---- 在ASYNC任务中执行 ----
+
+// 取当前任务所属SSL的通道, 第一次使用时创建并登记为等待fd
+static st_crypto_channel_t *current_channel(st_async_crypto_t *crypto) {
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    if (!job || !crypto || crypto->thread_count == 0) {
+        return NULL;
+    }
+    ASYNC_WAIT_CTX *wait_ctx = ASYNC_get_wait_ctx(job);
+    OSSL_ASYNC_FD fd;
+    void *custom = NULL;
+    if (ASYNC_WAIT_CTX_get_fd(wait_ctx, &channel_key, &fd, &custom) && custom) {
+        return (st_crypto_channel_t *)custom;
+    }
+    st_crypto_channel_t *channel = calloc(1, sizeof(st_crypto_channel_t));
+    if (!channel) {
+        return NULL;
+    }
+    channel->crypto = crypto;
+    channel->refs = 1;
+    channel->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->fd < 0 || !ASYNC_WAIT_CTX_set_wait_fd(wait_ctx, &channel_key, channel->fd, channel, channel_cleanup)) {
+        if (channel->fd >= 0) {
+            close(channel->fd);
+        }
+        free(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+// 提交后暂停任务直到线程池算完. 连接上的其他事件也会恢复任务, 这时继续暂停
+static int run_offloaded(st_crypto_channel_t *channel) {
+    __atomic_store_n(&channel->done, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&channel->refs, 1, __ATOMIC_RELAXED);
+    submit(channel->crypto, channel);
+    while (!__atomic_load_n(&channel->done, __ATOMIC_ACQUIRE)) {
+        if (!ASYNC_pause_job()) {
+            log_error("ASYNC_pause_job failed");
+            return -1;
+        }
+    }
+    return channel->result;
+}
+
+static int async_rsa_priv_enc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+    st_async_crypto_t *crypto = RSA_get_ex_data(rsa, rsa_index);
+    st_crypto_channel_t *channel = flen <= ASYNC_CRYPTO_MAX_SIZE ? current_channel(crypto) : NULL;
+    if (!channel) {
+        if (crypto) {
+            __atomic_add_fetch(&crypto->direct, 1, __ATOMIC_RELAXED);
+        }
+        return RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(flen, from, to, rsa, padding);
+    }
+    channel->op = CRYPTO_OP_RSA_PRIV_ENC;
+    channel->padding = padding;
+    channel->input_length = flen;
+    memcpy(channel->input, from, flen);
+    RSA_up_ref(rsa);
+    channel->key = rsa;
+    int result = run_offloaded(channel);
+    if (result > 0) {
+        memcpy(to, channel->output, result);
+    }
+    return result;
+}
+
+static int async_rsa_priv_dec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+    st_async_crypto_t *crypto = RSA_get_ex_data(rsa, rsa_index);
+    st_crypto_channel_t *channel = flen <= ASYNC_CRYPTO_MAX_SIZE ? current_channel(crypto) : NULL;
+    if (!channel) {
+        if (crypto) {
+            __atomic_add_fetch(&crypto->direct, 1, __ATOMIC_RELAXED);
+        }
+        return RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL())(flen, from, to, rsa, padding);
+    }
+    channel->op = CRYPTO_OP_RSA_PRIV_DEC;
+    channel->padding = padding;
+    channel->input_length = flen;
+    memcpy(channel->input, from, flen);
+    RSA_up_ref(rsa);
+    channel->key = rsa;
+    int result = run_offloaded(channel);
+    if (result > 0) {
+        memcpy(to, channel->output, result);
+    }
+    return result;
+}
+
+static int async_ecdsa_sign(int type, const unsigned char *dgst, int dlen, unsigned char *sig, unsigned int *siglen,
+                            const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey) {
+    st_async_crypto_t *crypto = EC_KEY_get_ex_data(eckey, ec_index);
+    st_crypto_channel_t *channel = !kinv && !r && dlen <= ASYNC_CRYPTO_MAX_SIZE ? current_channel(crypto) : NULL;
+    if (!channel) {
+        int (*sign)(int, const unsigned char *, int, unsigned char *, unsigned int *, const BIGNUM *, const BIGNUM *, EC_KEY *);
+        EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, NULL, NULL);
+        if (crypto) {
+            __atomic_add_fetch(&crypto->direct, 1, __ATOMIC_RELAXED);
+        }
+        return sign(type, dgst, dlen, sig, siglen, kinv, r, eckey);
+    }
+    channel->op = CRYPTO_OP_ECDSA_SIGN;
+    channel->type = type;
+    channel->input_length = dlen;
+    memcpy(channel->input, dgst, dlen);
+    EC_KEY_up_ref(eckey);
+    channel->key = eckey;
+    int result = run_offloaded(channel);
+    if (result == 1) {
+        memcpy(sig, channel->output, channel->output_length);
+        *siglen = channel->output_length;
+    } else {
+        *siglen = 0;
+    }
+    return result;
+}
+
+// ---- 接口 ----
+
+st_async_crypto_t *async_crypto_new(int threads) {
+    if (!ASYNC_is_capable()) {
+        log_error("OpenSSL ASYNC is not supported on this platform");
+        return NULL;
+    }
+    pthread_once(&index_once, init_indexes);
+    if (rsa_index < 0 || ec_index < 0) {
+        return NULL;
+    }
+    st_async_crypto_t *crypto = calloc(1, sizeof(st_async_crypto_t));
+    if (!crypto) {
+        return NULL;
+    }
+    if (threads <= 0) {
+        threads = ASYNC_CRYPTO_DEFAULT_THREADS;
+    }
+    // 在默认实现的基础上只替换私钥运算
+    crypto->rsa_method = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+    crypto->ec_method = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+    crypto->threads = calloc(threads, sizeof(pthread_t));
+    if (!crypto->rsa_method || !crypto->ec_method || !crypto->threads) {
+        RSA_meth_free(crypto->rsa_method);
+        EC_KEY_METHOD_free(crypto->ec_method);
+        free(crypto->threads);
+        free(crypto);
+        return NULL;
+    }
+    RSA_meth_set1_name(crypto->rsa_method, "xhttp async RSA");
+    RSA_meth_set_priv_enc(crypto->rsa_method, async_rsa_priv_enc);
+    RSA_meth_set_priv_dec(crypto->rsa_method, async_rsa_priv_dec);
+    int (*sign_setup)(EC_KEY *, BN_CTX *, BIGNUM **, BIGNUM **);
+    ECDSA_SIG *(*sign_sig)(const unsigned char *, int, const BIGNUM *, const BIGNUM *, EC_KEY *);
+    EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), NULL, &sign_setup, &sign_sig);
+    EC_KEY_METHOD_set_sign(crypto->ec_method, async_ecdsa_sign, sign_setup, sign_sig);
+
+    pthread_mutex_init(&crypto->lock, NULL);
+    pthread_cond_init(&crypto->cond, NULL);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&crypto->threads[i], NULL, run_crypto_thread, crypto) != 0) {
+            log_error("pthread_create");
+            async_crypto_free(crypto);
+            return NULL;
+        }
+        crypto->thread_count++;
+    }
+    return crypto;
+}
+
+void async_crypto_free(st_async_crypto_t *crypto) {
+    if (!crypto) {
+        return;
+    }
+    pthread_mutex_lock(&crypto->lock);
+    crypto->stopping = true;
+    pthread_cond_broadcast(&crypto->cond);
+    pthread_mutex_unlock(&crypto->lock);
+    for (int i = 0; i < crypto->thread_count; i++) {
+        pthread_join(crypto->threads[i], NULL);
+    }
+    pthread_cond_destroy(&crypto->cond);
+    pthread_mutex_destroy(&crypto->lock);
+    RSA_meth_free(crypto->rsa_method);
+    EC_KEY_METHOD_free(crypto->ec_method);
+    free(crypto->threads);
+    free(crypto);
+}
+
+bool async_crypto_attach(st_async_crypto_t *crypto, SSL_CTX *ctx) {
+    EVP_PKEY *pkey = SSL_CTX_get0_privatekey(ctx);
+    if (!pkey) {
+        return false;
+    }
+    switch (EVP_PKEY_base_id(pkey)) {
+        case EVP_PKEY_RSA: {
+            RSA *rsa = EVP_PKEY_get0_RSA(pkey);
+            return RSA_set_method(rsa, crypto->rsa_method) && RSA_set_ex_data(rsa, rsa_index, crypto);
+        }
+        case EVP_PKEY_EC: {
+            EC_KEY *eckey = EVP_PKEY_get0_EC_KEY(pkey);
+            return EC_KEY_set_method(eckey, crypto->ec_method) && EC_KEY_set_ex_data(eckey, ec_index, crypto);
+        }
+        default:
+            log_warn("async crypto supports only RSA and EC keys");
+            return false;
+    }
+}
+
+void async_crypto_stats(st_async_crypto_t *crypto, st_async_crypto_stats_t *stats) {
+    stats->threads = crypto->thread_count;
+    stats->queued = __atomic_load_n(&crypto->queued, __ATOMIC_RELAXED);
+    stats->max_queued = __atomic_load_n(&crypto->max_queued, __ATOMIC_RELAXED);
+    stats->offloaded = __atomic_load_n(&crypto->offloaded, __ATOMIC_RELAXED);
+    stats->direct = __atomic_load_n(&crypto->direct, __ATOMIC_RELAXED);
+    stats->wait_avg = stats->offloaded ? __atomic_load_n(&crypto->wait_total_us, __ATOMIC_RELAXED) / 1e6 / stats->offloaded : 0;
+    stats->compute_avg = stats->offloaded ? __atomic_load_n(&crypto->compute_total_us, __ATOMIC_RELAXED) / 1e6 / stats->offloaded : 0;
+}
@@ -0,0 +1,60 @@
+#include "buffer.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+char *buffer_reserve(st_buffer_t *buffer, size_t length) {
+    if (buffer->size + length > buffer->capacity) {
+        // 先把已消费的空间挪出来, 仍不够再扩容
+        if (buffer->offset > 0) {
+            memmove(buffer->data, buffer->data + buffer->offset, buffer->size - buffer->offset);
+            buffer->size -= buffer->offset;
+            buffer->offset = 0;
+        }
+        if (buffer->size + length > buffer->capacity) {
+            size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+            while (capacity < buffer->size + length) {
+                capacity *= 2;
+            }
+            char *data = realloc(buffer->data, capacity);
+            if (!data) {
+                log_error("malloc");
+                return NULL;
+            }
+            buffer->data = data;
+            buffer->capacity = capacity;
+        }
+    }
+    return buffer->data + buffer->size;
+}
+
+int buffer_append(st_buffer_t *buffer, const void *data, size_t length) {
+    char *space = buffer_reserve(buffer, length);
+    if (!space) {
+        return -1;
+    }
+    memcpy(space, data, length);
+    buffer->size += length;
+    return 0;
+}
+
+void buffer_consume(st_buffer_t *buffer, size_t length) {
+    buffer->offset += length;
+    if (buffer->offset >= buffer->size) {
+        buffer->offset = 0;
+        buffer->size = 0;
+    }
+}
+
+void buffer_reset(st_buffer_t *buffer) {
+    buffer->offset = 0;
+    buffer->size = 0;
+}
+
+void buffer_free(st_buffer_t *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->offset = 0;
+    buffer->capacity = 0;
+}
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include "buffer.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_MAGIC "XHCAP001"
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_FLUSH_SIZE (64 * 1024)  // 积压到这么多时唤醒写线程
+#define CAPTURE_FLUSH_INTERVAL 1        // 写线程至少每隔这么多秒写一次
+#define CAPTURE_MAX_REDACT 32
+#define CAPTURE_MAX_RECORD (64 * 1024 * 1024)
+
+struct st_capture_request {
+    uint64_t offset_us;
+    int flags;
+    st_buffer_t head;              // 方法, URL和头部
+    st_buffer_t body;              // 最多max_body字节
+    uint64_t body_length;
+    size_t max_body;
+};
+
+struct st_capture {
+    int fd;
+    double sample_rate;
+    size_t max_body;
+    char *redact_names;            // 下面的指针指向这里
+    const char *redact[CAPTURE_MAX_REDACT];
+    int redact_count;
+    uint64_t start;                // 单调时钟(纳秒)
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    st_buffer_t pending;           // 等待写出的记录
+    bool stopping;
+    pthread_t thread;
+    uint64_t captured;             // 原子访问, 下同
+    uint64_t dropped;
+    uint64_t bytes;
+};
+
+struct st_capture_reader {
+    FILE *fp;
+    st_buffer_t record;
+    st_buffer_t strings;           // 解码出的字符串, 以'\0'结尾
+};
+
+static __thread uint64_t random_state;
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, 每个线程一个状态
+static double next_random(void) {
+    if (random_state == 0) {
+        random_state = now_ns(CLOCK_MONOTONIC) ^ (uint64_t)(uintptr_t)&random_state;
+        random_state |= 1;
+    }
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return ((random_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int put_varint(st_buffer_t *buffer, uint64_t value) {
+    uint8_t bytes[10];
+    size_t n = 0;
+    do {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        bytes[n++] |= value ? 0x80 : 0;
+    } while (value);
+    return buffer_append(buffer, bytes, n);
+}
+
+static int put_string(st_buffer_t *buffer, const char *data, size_t length) {
+    if (put_varint(buffer, length) < 0) {
+        return -1;
+    }
+    // 空的缓冲区data为NULL
+    return length > 0 ? buffer_append(buffer, data, length) : 0;
+}
+
+static void put_u64(uint8_t *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)p[i] << (i * 8);
+    }
+    return value;
+}
+
+static bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// ---- 写线程 ----
+
+// 积压够多或者到了间隔时取走缓冲区, 在锁外写文件
+static void *run_writer(void *arg) {
+    st_capture_t *capture = (st_capture_t *)arg;
+    st_buffer_t writing = {0};
+    pthread_mutex_lock(&capture->lock);
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CAPTURE_FLUSH_INTERVAL;
+        while (!capture->stopping && buffer_length(&capture->pending) < CAPTURE_FLUSH_SIZE) {
+            if (pthread_cond_timedwait(&capture->cond, &capture->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        st_buffer_t swap = capture->pending;
+        capture->pending = writing;
+        writing = swap;
+        bool stopping = capture->stopping;
+        pthread_mutex_unlock(&capture->lock);
+
+        if (buffer_length(&writing) > 0) {
+            if (write_all(capture->fd, buffer_data(&writing), buffer_length(&writing))) {
+                __atomic_add_fetch(&capture->bytes, buffer_length(&writing), __ATOMIC_RELAXED);
+            } else {
+                log_error("capture write failed: %s", strerror(errno));
+            }
+            buffer_reset(&writing);
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        if (stopping && buffer_length(&capture->pending) == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&capture->lock);
+    buffer_free(&writing);
+    return NULL;
+}
+
+st_capture_t *capture_new(const char *path, double sample_rate, size_t max_body, const char *redact) {
+    st_capture_t *capture = calloc(1, sizeof(st_capture_t));
+    if (!capture) {
+        return NULL;
+    }
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture->fd < 0) {
+        log_error("open %s: %s", path, strerror(errno));
+        free(capture);
+        return NULL;
+    }
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 8);
+    put_u64(header + 8, now_ns(CLOCK_REALTIME));
+    capture->start = now_ns(CLOCK_MONOTONIC);
+    if (!write_all(capture->fd, (const char *)header, sizeof(header))) {
+        log_error("write %s: %s", path, strerror(errno));
+        close(capture->fd);
+        free(capture);
+        return NULL;
+    }
+    capture->bytes = sizeof(header);
+    capture->sample_rate = sample_rate;
+    capture->max_body = max_body;
+    capture->redact_names = strdup(redact ? redact : "");
+    char *save = NULL;
+    for (char *name = capture->redact_names ? strtok_r(capture->redact_names, ", ", &save) : NULL;
+         name && capture->redact_count < CAPTURE_MAX_REDACT; name = strtok_r(NULL, ", ", &save)) {
+        capture->redact[capture->redact_count++] = name;
+    }
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->cond, NULL);
+    if (pthread_create(&capture->thread, NULL, run_writer, capture) != 0) {
+        log_error("pthread_create");
+        pthread_mutex_destroy(&capture->lock);
+        pthread_cond_destroy(&capture->cond);
+        close(capture->fd);
+        free(capture->redact_names);
+        free(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+void capture_free(st_capture_t *capture) {
+    if (!capture) {
+        return;
+    }
+    pthread_mutex_lock(&capture->lock);
+    capture->stopping = true;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->thread, NULL);
+    close(capture->fd);
+    buffer_free(&capture->pending);
+    pthread_mutex_destroy(&capture->lock);
+    pthread_cond_destroy(&capture->cond);
+    free(capture->redact_names);
+    free(capture);
+}
+
+// ---- 工作线程 ----
+
+static bool is_redacted(const st_capture_t *capture, const char *name) {
+    for (int i = 0; i < capture->redact_count; i++) {
+        if (strcasecmp(capture->redact[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+st_capture_request_t *capture_begin(st_capture_t *capture, bool http2, const char *method, const st_request_t *request) {
+    if (!capture || capture->sample_rate <= 0 || (capture->sample_rate < 1 && next_random() >= capture->sample_rate)) {
+        return NULL;
+    }
+    st_capture_request_t *record = calloc(1, sizeof(st_capture_request_t));
+    if (!record) {
+        return NULL;
+    }
+    record->offset_us = (now_ns(CLOCK_MONOTONIC) - capture->start) / 1000;
+    record->flags = http2 ? CAPTURE_FLAG_HTTP2 : 0;
+    record->max_body = capture->max_body;
+    const char *head = request->head.data;
+    int ok = put_string(&record->head, method, strlen(method));
+    ok |= put_string(&record->head, head + request->url, request->url_length);
+    ok |= put_varint(&record->head, request->header_count);
+    for (int i = 0; i < request->header_count && ok == 0; i++) {
+        const st_http_header_t *header = &request->headers[i];
+        const char *name = head + header->name;
+        ok |= put_string(&record->head, name, header->name_length);
+        if (is_redacted(capture, name)) {
+            ok |= put_string(&record->head, CAPTURE_REDACTED, strlen(CAPTURE_REDACTED));
+        } else {
+            ok |= put_string(&record->head, head + header->value, header->value_length);
+        }
+    }
+    if (ok != 0) {
+        capture_discard(record);
+        return NULL;
+    }
+    return record;
+}
+
+void capture_body(st_capture_request_t *record, const char *data, size_t length) {
+    record->body_length += length;
+    size_t saved = buffer_length(&record->body);
+    size_t room = record->max_body > saved ? record->max_body - saved : 0;
+    if (length > room) {
+        record->flags |= CAPTURE_FLAG_TRUNCATED;
+        length = room;
+    }
+    if (length > 0 && buffer_append(&record->body, data, length) < 0) {
+        record->flags |= CAPTURE_FLAG_TRUNCATED;
+    }
+}
+
+void capture_end(st_capture_t *capture, st_capture_request_t *record) {
+    st_buffer_t content = {0};
+    uint8_t flags = (uint8_t)record->flags;
+    int ok = put_varint(&content, record->offset_us);
+    ok |= buffer_append(&content, &flags, 1);
+    ok |= buffer_append(&content, buffer_data(&record->head), buffer_length(&record->head));
+    ok |= put_varint(&content, record->body_length);
+    ok |= put_string(&content, buffer_data(&record->body), buffer_length(&record->body));
+    capture_discard(record);
+    if (ok != 0) {
+        buffer_free(&content);
+        __atomic_add_fetch(&capture->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    if (buffer_length(&capture->pending) + buffer_length(&content) > CAPTURE_MAX_PENDING ||
+        put_string(&capture->pending, buffer_data(&content), buffer_length(&content)) < 0) {
+        __atomic_add_fetch(&capture->dropped, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&capture->captured, 1, __ATOMIC_RELAXED);
+        if (buffer_length(&capture->pending) >= CAPTURE_FLUSH_SIZE) {
+            pthread_cond_signal(&capture->cond);
+        }
+    }
+    pthread_mutex_unlock(&capture->lock);
+    buffer_free(&content);
+}
+
+void capture_discard(st_capture_request_t *record) {
+    if (!record) {
+        return;
+    }
+    buffer_free(&record->head);
+    buffer_free(&record->body);
+    free(record);
+}
+
+void capture_stats(st_capture_t *capture, st_capture_stats_t *stats) {
+    stats->captured = __atomic_load_n(&capture->captured, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&capture->dropped, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&capture->bytes, __ATOMIC_RELAXED);
+}
+
+// ---- 读取 ----
+
+static int read_varint(FILE *fp, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(fp);
+        if (c == EOF) {
+            return shift == 0 ? 0 : -1;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 1;
+        }
+    }
+    return -1;
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t c = *(*p)++;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 解码一个字符串追加到strings, 返回在strings中的偏移, 失败返回-1
+static ssize_t get_string(st_capture_reader_t *reader, const uint8_t **p, const uint8_t *end) {
+    uint64_t length;
+    if (!get_varint(p, end, &length) || length > (uint64_t)(end - *p)) {
+        return -1;
+    }
+    ssize_t offset = buffer_length(&reader->strings);
+    if (buffer_append(&reader->strings, *p, length) < 0 || buffer_append(&reader->strings, "", 1) < 0) {
+        return -1;
+    }
+    *p += length;
+    return offset;
+}
+
+st_capture_reader_t *capture_reader_open(const char *path, uint64_t *start_ns) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 8) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    st_capture_reader_t *reader = calloc(1, sizeof(st_capture_reader_t));
+    if (!reader) {
+        fclose(fp);
+        return NULL;
+    }
+    reader->fp = fp;
+    if (start_ns) {
+        *start_ns = get_u64(header + 8);
+    }
+    return reader;
+}
+
+int capture_reader_next(st_capture_reader_t *reader, st_capture_entry_t *entry) {
+    uint64_t length;
+    int ret = read_varint(reader->fp, &length);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (length > CAPTURE_MAX_RECORD) {
+        return -1;
+    }
+    buffer_reset(&reader->record);
+    char *data = buffer_reserve(&reader->record, length);
+    if (!data || fread(data, 1, length, reader->fp) != length) {
+        return -1;
+    }
+    buffer_commit(&reader->record, length);
+
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + length;
+    uint64_t header_count;
+    buffer_reset(&reader->strings);
+    if (!get_varint(&p, end, &entry->offset_us) || p >= end) {
+        return -1;
+    }
+    entry->flags = *p++;
+    ssize_t method = get_string(reader, &p, end);
+    ssize_t url = get_string(reader, &p, end);
+    if (method < 0 || url < 0 || !get_varint(&p, end, &header_count) || header_count > MAX_REQUEST_HEADERS) {
+        return -1;
+    }
+    ssize_t headers = buffer_length(&reader->strings);
+    for (uint64_t i = 0; i < 2 * header_count; i++) {
+        if (get_string(reader, &p, end) < 0) {
+            return -1;
+        }
+    }
+    if (!get_varint(&p, end, &entry->body_length)) {
+        return -1;
+    }
+    ssize_t body = get_string(reader, &p, end);
+    if (body < 0) {
+        return -1;
+    }
+    const char *strings = buffer_data(&reader->strings);
+    entry->method = strings + method;
+    entry->url = strings + url;
+    entry->header_count = (int)header_count;
+    entry->headers = strings + headers;
+    entry->body = strings + body;
+    entry->body_saved = buffer_length(&reader->strings) - body - 1;
+    return 1;
+}
+
+void capture_reader_close(st_capture_reader_t *reader) {
+    if (!reader) {
+        return;
+    }
+    fclose(reader->fp);
+    buffer_free(&reader->record);
+    buffer_free(&reader->strings);
+    free(reader);
+}
@@ -0,0 +1,846 @@
+#define _GNU_SOURCE
+#include "client_cache.h"
+#include "buffer.h"
+#include "log.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_INITIAL_BUCKETS 64
+#define DISK_MAGIC "XHCCACHE"
+#define DISK_RECORD_MAGIC 0x52434858u  // "XHCR"
+#define DISK_DATA_START 4096
+
+// 文件头, 位于文件开始. 记录在[head, tail)中; wrapped时在[head, lap_end)和[DISK_DATA_START, tail)中
+typedef struct {
+    char magic[8];
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t lap_end;
+    uint64_t wrapped;
+} st_disk_header_t;
+
+// 记录头, 之后是和内存条目相同排列的数据, 整条记录8字节对齐. expires在304时原地更新, 不在校验和内
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t length;
+    uint64_t hash;
+    double expires;
+    uint32_t status;
+    uint32_t header_count;
+    uint32_t path_length;
+    uint32_t vary_length;
+    uint32_t headers_length;
+    uint32_t body_length;
+} st_disk_record_t;
+
+// 文件中的一条有效记录
+typedef struct st_disk_node {
+    struct st_disk_node *next;
+    uint64_t hash;
+    uint64_t offset;
+} st_disk_node_t;
+
+struct st_client_cache {
+    size_t capacity;
+    size_t max_entry;
+    st_client_cache_entry_t **buckets;
+    size_t bucket_count;
+    st_client_cache_entry_t *lru_head;
+    st_client_cache_entry_t *lru_tail;
+    int fd;                        // 没有文件时为-1
+    char *map;
+    st_disk_header_t *disk;
+    st_disk_node_t **disk_buckets;
+    size_t disk_bucket_count;
+    st_client_cache_stats_t counters;  // 循环线程写, 其他线程原子读
+};
+
+static void add(uint64_t *counter, int64_t delta) {
+    __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+}
+
+static double now_unix(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// FNV-1a
+static uint64_t hash_bytes(const char *data, size_t length) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (uint8_t)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// ---- 头部 ----
+
+// 在请求头中找name的值(去掉首尾空白), 跳过请求行. 没有时返回NULL
+static const char *request_header(const char *head, size_t head_length, const char *name, size_t *length) {
+    size_t name_length = strlen(name);
+    const char *end = head + head_length;
+    const char *line = memmem(head, head_length, "\r\n", 2);
+    while (line && (line += 2) < end) {
+        const char *eol = memmem(line, end - line, "\r\n", 2);
+        if (!eol || eol == line) {
+            break;
+        }
+        if ((size_t)(eol - line) > name_length && line[name_length] == ':' && strncasecmp(line, name, name_length) == 0) {
+            const char *value = line + name_length + 1;
+            while (value < eol && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char *value_end = eol;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            *length = value_end - value;
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+const char *client_cache_header(const char *headers, int header_count, const char *name) {
+    const char *p = headers;
+    for (int i = 0; i < header_count; i++) {
+        const char *value = p + strlen(p) + 1;
+        if (strcasecmp(p, name) == 0) {
+            return value;
+        }
+        p = value + strlen(value) + 1;
+    }
+    return NULL;
+}
+
+// 在逗号分隔的指令中找name, 返回是否存在, 有值时给出值
+static bool has_directive(const char *value, const char *name, long *number) {
+    size_t name_length = strlen(name);
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        size_t length = strcspn(value, ",=");
+        while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) {
+            length--;
+        }
+        bool match = length == name_length && strncasecmp(value, name, name_length) == 0;
+        value += strcspn(value, ",=");
+        if (*value == '=') {
+            value++;
+            while (*value == ' ' || *value == '"') {
+                value++;
+            }
+            if (match && number) {
+                *number = isdigit((unsigned char)*value) ? strtol(value, NULL, 10) : -1;
+            }
+            value += strcspn(value, ",");
+        } else if (match && number) {
+            *number = -1;
+        }
+        if (match) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 私有缓存的新鲜时间(秒): max-age减去Age, no-cache为0
+static double freshness(const char *headers, int header_count, const char *cache_control) {
+    long max_age = -1;
+    if (!cache_control || has_directive(cache_control, "no-cache", NULL) || !has_directive(cache_control, "max-age", &max_age) ||
+        max_age <= 0) {
+        return 0;
+    }
+    const char *age = client_cache_header(headers, header_count, "age");
+    double ttl = max_age - (age ? strtod(age, NULL) : 0);
+    return ttl > 0 ? ttl : 0;
+}
+
+static bool has_validator(const char *headers, int header_count) {
+    return client_cache_header(headers, header_count, "etag") || client_cache_header(headers, header_count, "last-modified");
+}
+
+bool client_cache_usable(const char *head, size_t head_length) {
+    size_t length;
+    const char *value = request_header(head, head_length, "cache-control", &length);
+    if (value) {
+        char directives[256];
+        snprintf(directives, sizeof(directives), "%.*s", (int)length, value);
+        if (has_directive(directives, "no-store", NULL) || has_directive(directives, "no-cache", NULL)) {
+            return false;
+        }
+    }
+    return !request_header(head, head_length, "range", &length) && !request_header(head, head_length, "if-none-match", &length) &&
+           !request_header(head, head_length, "if-modified-since", &length);
+}
+
+// 按响应的Vary取请求头的值, 生成"name\0value\0"序列. Vary: *时返回-1
+static int build_vary(st_buffer_t *vary, const char *list, const char *head, size_t head_length) {
+    while (list && *list) {
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+        size_t length = strcspn(list, ", \t");
+        if (length == 0) {
+            break;
+        }
+        if (length == 1 && *list == '*') {
+            return -1;
+        }
+        char name[128];
+        if (length >= sizeof(name)) {
+            return -1;
+        }
+        for (size_t i = 0; i < length; i++) {
+            name[i] = (char)tolower((unsigned char)list[i]);
+        }
+        name[length] = '\0';
+        size_t value_length = 0;
+        const char *value = request_header(head, head_length, name, &value_length);
+        if (buffer_append(vary, name, length + 1) < 0 || (value_length > 0 && buffer_append(vary, value, value_length) < 0) ||
+            buffer_append(vary, "", 1) < 0) {
+            return -1;
+        }
+        list += length;
+    }
+    return 0;
+}
+
+// 条目记下的每个请求头的值都与这次请求相同
+static bool vary_matches(const char *vary, size_t vary_length, const char *head, size_t head_length) {
+    const char *p = vary;
+    const char *end = vary + vary_length;
+    while (p < end) {
+        const char *value = p + strlen(p) + 1;
+        size_t length = 0;
+        const char *current = request_header(head, head_length, p, &length);
+        if (strlen(value) != length || (length > 0 && memcmp(value, current, length) != 0)) {
+            return false;
+        }
+        p = value + strlen(value) + 1;
+    }
+    return true;
+}
+
+// ---- 内存 ----
+
+static size_t entry_data_length(const st_client_cache_entry_t *entry) {
+    return entry->path_length + entry->vary_length + entry->headers_length + entry->body_length;
+}
+
+static size_t entry_cost(const st_client_cache_entry_t *entry) {
+    return sizeof(st_client_cache_entry_t) + entry_data_length(entry);
+}
+
+static const char *entry_vary(const st_client_cache_entry_t *entry) {
+    return entry->data + entry->path_length;
+}
+
+static bool entry_matches(const st_client_cache_entry_t *entry, uint64_t hash, const char *path, size_t path_length,
+                          const char *head, size_t head_length) {
+    return entry->hash == hash && entry->path_length == path_length && memcmp(entry->data, path, path_length) == 0 &&
+           vary_matches(entry_vary(entry), entry->vary_length, head, head_length);
+}
+
+static void lru_unlink(st_client_cache_t *cache, st_client_cache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(st_client_cache_t *cache, st_client_cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+static int grow_buckets(st_client_cache_t *cache) {
+    size_t count = cache->bucket_count ? cache->bucket_count * 2 : CACHE_INITIAL_BUCKETS;
+    st_client_cache_entry_t **buckets = calloc(count, sizeof(st_client_cache_entry_t *));
+    if (!buckets) {
+        return -1;
+    }
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        st_client_cache_entry_t *entry = cache->buckets[i];
+        while (entry) {
+            st_client_cache_entry_t *next = entry->hash_next;
+            st_client_cache_entry_t **slot = &buckets[entry->hash & (count - 1)];
+            entry->hash_next = *slot;
+            *slot = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+    return 0;
+}
+
+static void entry_unref(st_client_cache_entry_t *entry) {
+    if (--entry->refs == 0) {
+        free(entry);
+    }
+}
+
+// 从哈希表和LRU链表中移除, 释放缓存持有的引用
+static void remove_entry(st_client_cache_t *cache, st_client_cache_entry_t *entry) {
+    st_client_cache_entry_t **slot = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = entry->hash_next;
+    lru_unlink(cache, entry);
+    entry->linked = false;
+    add(&cache->counters.entries, -1);
+    add(&cache->counters.bytes, -(int64_t)entry_cost(entry));
+    entry_unref(entry);
+}
+
+static st_client_cache_entry_t *find_entry(st_client_cache_t *cache, uint64_t hash, const char *path, size_t path_length,
+                                           const char *head, size_t head_length) {
+    if (!cache->buckets) {
+        return NULL;
+    }
+    st_client_cache_entry_t *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+    while (entry && !entry_matches(entry, hash, path, path_length, head, head_length)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// 放进哈希表, 从最久未使用的一端淘汰到放得下
+static bool insert_entry(st_client_cache_t *cache, st_client_cache_entry_t *entry) {
+    size_t cost = entry_cost(entry);
+    if (cache->counters.entries >= cache->bucket_count && grow_buckets(cache) < 0) {
+        return false;
+    }
+    while (cache->counters.bytes + cost > cache->capacity && cache->lru_tail) {
+        remove_entry(cache, cache->lru_tail);
+        add(&cache->counters.evictions, 1);
+    }
+    st_client_cache_entry_t **slot = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    entry->hash_next = *slot;
+    *slot = entry;
+    lru_push_front(cache, entry);
+    entry->linked = true;
+    entry->refs = 1;
+    add(&cache->counters.entries, 1);
+    add(&cache->counters.bytes, cost);
+    return true;
+}
+
+// ---- 文件 ----
+
+static uint32_t checksum(const char *data, size_t length) {
+    uint64_t h = hash_bytes(data, length);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static st_disk_record_t *disk_record(st_client_cache_t *cache, uint64_t offset) {
+    return (st_disk_record_t *)(cache->map + offset);
+}
+
+static int grow_disk_buckets(st_client_cache_t *cache) {
+    size_t count = cache->disk_bucket_count ? cache->disk_bucket_count * 2 : CACHE_INITIAL_BUCKETS;
+    st_disk_node_t **buckets = calloc(count, sizeof(st_disk_node_t *));
+    if (!buckets) {
+        return -1;
+    }
+    for (size_t i = 0; i < cache->disk_bucket_count; i++) {
+        st_disk_node_t *node = cache->disk_buckets[i];
+        while (node) {
+            st_disk_node_t *next = node->next;
+            node->next = buckets[node->hash & (count - 1)];
+            buckets[node->hash & (count - 1)] = node;
+            node = next;
+        }
+    }
+    free(cache->disk_buckets);
+    cache->disk_buckets = buckets;
+    cache->disk_bucket_count = count;
+    return 0;
+}
+
+static bool disk_index(st_client_cache_t *cache, uint64_t hash, uint64_t offset) {
+    if (cache->counters.disk_entries >= cache->disk_bucket_count && grow_disk_buckets(cache) < 0) {
+        return false;
+    }
+    st_disk_node_t *node = malloc(sizeof(st_disk_node_t));
+    if (!node) {
+        return false;
+    }
+    node->hash = hash;
+    node->offset = offset;
+    node->next = cache->disk_buckets[hash & (cache->disk_bucket_count - 1)];
+    cache->disk_buckets[hash & (cache->disk_bucket_count - 1)] = node;
+    add(&cache->counters.disk_entries, 1);
+    return true;
+}
+
+static st_disk_node_t **disk_slot(st_client_cache_t *cache, uint64_t hash, uint64_t offset) {
+    if (!cache->disk_buckets) {
+        return NULL;
+    }
+    st_disk_node_t **slot = &cache->disk_buckets[hash & (cache->disk_bucket_count - 1)];
+    while (*slot && ((*slot)->hash != hash || (*slot)->offset != offset)) {
+        slot = &(*slot)->next;
+    }
+    return *slot ? slot : NULL;
+}
+
+static bool disk_unindex(st_client_cache_t *cache, uint64_t hash, uint64_t offset) {
+    st_disk_node_t **slot = disk_slot(cache, hash, offset);
+    if (!slot) {
+        return false;
+    }
+    st_disk_node_t *node = *slot;
+    *slot = node->next;
+    free(node);
+    add(&cache->counters.disk_entries, -1);
+    return true;
+}
+
+static void disk_update_bytes(st_client_cache_t *cache) {
+    st_disk_header_t *disk = cache->disk;
+    uint64_t used = disk->wrapped ? disk->lap_end - disk->head + disk->tail - DISK_DATA_START : disk->tail - disk->head;
+    __atomic_store_n(&cache->counters.disk_bytes, used, __ATOMIC_RELAXED);
+}
+
+// 腾出从tail开始的length字节: 写不下时回到开头, 覆盖最旧的记录
+static bool disk_make_room(st_client_cache_t *cache, uint64_t length) {
+    st_disk_header_t *disk = cache->disk;
+    if (length > disk->size - DISK_DATA_START) {
+        return false;
+    }
+    for (;;) {
+        if (!disk->wrapped) {
+            if (disk->tail + length <= disk->size) {
+                return true;
+            }
+            disk->lap_end = disk->tail;
+            disk->tail = DISK_DATA_START;
+            disk->wrapped = 1;
+            continue;
+        }
+        if (disk->head >= disk->lap_end) {
+            disk->head = DISK_DATA_START;
+            disk->wrapped = 0;
+            continue;
+        }
+        if (disk->tail + length <= disk->head) {
+            return true;
+        }
+        st_disk_record_t *record = disk_record(cache, disk->head);
+        if (record->magic != DISK_RECORD_MAGIC || record->length == 0) {
+            // 不应出现, 放弃这一圈剩下的记录
+            disk->head = disk->lap_end;
+            continue;
+        }
+        if (disk_unindex(cache, record->hash, disk->head)) {
+            add(&cache->counters.disk_evictions, 1);
+        }
+        disk->head += record->length;
+    }
+}
+
+static int64_t disk_append(st_client_cache_t *cache, const st_client_cache_entry_t *entry) {
+    size_t data_length = entry_data_length(entry);
+    uint64_t length = (sizeof(st_disk_record_t) + data_length + 7) & ~(uint64_t)7;
+    if (!disk_make_room(cache, length)) {
+        return -1;
+    }
+    uint64_t offset = cache->disk->tail;
+    st_disk_record_t *record = disk_record(cache, offset);
+    memcpy(record + 1, entry->data, data_length);
+    *record = (st_disk_record_t){
+        .magic = DISK_RECORD_MAGIC,
+        .checksum = checksum(entry->data, data_length),
+        .length = length,
+        .hash = entry->hash,
+        .expires = entry->expires,
+        .status = entry->status,
+        .header_count = entry->header_count,
+        .path_length = entry->path_length,
+        .vary_length = entry->vary_length,
+        .headers_length = entry->headers_length,
+        .body_length = entry->body_length,
+    };
+    cache->disk->tail += length;
+    disk_update_bytes(cache);
+    if (!disk_index(cache, entry->hash, offset)) {
+        return -1;
+    }
+    return offset;
+}
+
+// 文件中同一变体的旧记录
+static void disk_forget(st_client_cache_t *cache, uint64_t hash, const char *path, size_t path_length, const char *head,
+                        size_t head_length) {
+    if (!cache->disk_buckets) {
+        return;
+    }
+    st_disk_node_t *node = cache->disk_buckets[hash & (cache->disk_bucket_count - 1)];
+    while (node) {
+        st_disk_node_t *next = node->next;
+        st_disk_record_t *record = disk_record(cache, node->offset);
+        const char *data = (const char *)(record + 1);
+        if (node->hash == hash && record->path_length == path_length && memcmp(data, path, path_length) == 0 &&
+            vary_matches(data + path_length, record->vary_length, head, head_length)) {
+            disk_unindex(cache, hash, node->offset);
+        }
+        node = next;
+    }
+}
+
+static st_client_cache_entry_t *entry_from_record(const st_disk_record_t *record, uint64_t offset) {
+    size_t data_length = (size_t)record->path_length + record->vary_length + record->headers_length + record->body_length;
+    st_client_cache_entry_t *entry = malloc(sizeof(st_client_cache_entry_t) + data_length);
+    if (!entry) {
+        return NULL;
+    }
+    *entry = (st_client_cache_entry_t){
+        .hash = record->hash,
+        .expires = record->expires,
+        .status = record->status,
+        .header_count = record->header_count,
+        .disk_offset = offset,
+        .path_length = record->path_length,
+        .vary_length = record->vary_length,
+        .headers_length = record->headers_length,
+        .body_length = record->body_length,
+        .data = (char *)(entry + 1),
+    };
+    memcpy(entry->data, record + 1, data_length);
+    return entry;
+}
+
+// 内存中没有时从文件中找, 找到后放回内存
+static st_client_cache_entry_t *disk_lookup(st_client_cache_t *cache, uint64_t hash, const char *path, size_t path_length,
+                                            const char *head, size_t head_length) {
+    if (!cache->disk_buckets) {
+        return NULL;
+    }
+    for (st_disk_node_t *node = cache->disk_buckets[hash & (cache->disk_bucket_count - 1)]; node; node = node->next) {
+        st_disk_record_t *record = disk_record(cache, node->offset);
+        const char *data = (const char *)(record + 1);
+        if (node->hash != hash || record->path_length != path_length || memcmp(data, path, path_length) != 0 ||
+            !vary_matches(data + path_length, record->vary_length, head, head_length)) {
+            continue;
+        }
+        st_client_cache_entry_t *entry = entry_from_record(record, node->offset);
+        if (!entry || !insert_entry(cache, entry)) {
+            free(entry);
+            return NULL;
+        }
+        add(&cache->counters.disk_hits, 1);
+        return entry;
+    }
+    return NULL;
+}
+
+static bool record_valid(st_client_cache_t *cache, uint64_t offset, uint64_t end) {
+    st_disk_record_t *record = disk_record(cache, offset);
+    if (end - offset < sizeof(st_disk_record_t) || record->magic != DISK_RECORD_MAGIC || record->length > end - offset) {
+        return false;
+    }
+    uint64_t data_length = (uint64_t)record->path_length + record->vary_length + record->headers_length + record->body_length;
+    return sizeof(st_disk_record_t) + data_length <= record->length &&
+           record->checksum == checksum((const char *)(record + 1), data_length);
+}
+
+// 扫描[start, *end)重建索引, 遇到损坏的记录时把*end截到那里. 同一变体以后写入的为准
+static void disk_scan(st_client_cache_t *cache, uint64_t start, uint64_t *end) {
+    uint64_t offset = start;
+    while (offset < *end) {
+        if (!record_valid(cache, offset, *end)) {
+            log_info("client cache: truncated at %llu", (unsigned long long)offset);
+            *end = offset;
+            return;
+        }
+        st_disk_record_t *record = disk_record(cache, offset);
+        const char *data = (const char *)(record + 1);
+        // 旧记录的Vary值就是请求头的值, 用它当作请求头来匹配同一变体
+        st_buffer_t head = {0};
+        const char *p = data + record->path_length;
+        const char *vary_end = p + record->vary_length;
+        bool ok = buffer_append(&head, "\r\n", 2) == 0;
+        while (ok && p < vary_end) {
+            const char *value = p + strlen(p) + 1;
+            ok = buffer_append(&head, p, strlen(p)) == 0 && buffer_append(&head, ": ", 2) == 0 &&
+                 buffer_append(&head, value, strlen(value)) == 0 && buffer_append(&head, "\r\n", 2) == 0;
+            p = value + strlen(value) + 1;
+        }
+        if (ok) {
+            disk_forget(cache, record->hash, data, record->path_length, buffer_data(&head), buffer_length(&head));
+            disk_index(cache, record->hash, offset);
+        }
+        buffer_free(&head);
+        offset += record->length;
+    }
+}
+
+static bool disk_open(st_client_cache_t *cache, const char *path, size_t size) {
+    size = size < DISK_DATA_START * 2 ? DISK_DATA_START * 2 : size;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("client cache %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        log_error("client cache %s: used by another client", path);
+        close(fd);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size != size && ftruncate(fd, size) < 0)) {
+        log_error("client cache %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_error("client cache %s: mmap: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    cache->fd = fd;
+    cache->map = map;
+    cache->disk = (st_disk_header_t *)map;
+    st_disk_header_t *disk = cache->disk;
+    // 新文件或大小变了时重新开始
+    bool valid = memcmp(disk->magic, DISK_MAGIC, 8) == 0 && disk->size == size && disk->head >= DISK_DATA_START &&
+                 disk->tail >= DISK_DATA_START && disk->head <= size && disk->tail <= size &&
+                 (disk->wrapped ? disk->tail <= disk->head && disk->lap_end <= size && disk->head <= disk->lap_end
+                                : disk->head <= disk->tail);
+    if (!valid) {
+        memset(disk, 0, sizeof(*disk));
+        memcpy(disk->magic, DISK_MAGIC, 8);
+        disk->size = size;
+        disk->head = disk->tail = DISK_DATA_START;
+    } else if (disk->wrapped) {
+        disk_scan(cache, disk->head, &disk->lap_end);
+        disk_scan(cache, DISK_DATA_START, &disk->tail);
+    } else {
+        disk_scan(cache, disk->head, &disk->tail);
+    }
+    disk_update_bytes(cache);
+    log_info("client cache %s: %llu entries, %llu bytes", path, (unsigned long long)cache->counters.disk_entries,
+             (unsigned long long)cache->counters.disk_bytes);
+    return true;
+}
+
+static void disk_close(st_client_cache_t *cache) {
+    if (!cache->map) {
+        return;
+    }
+    msync(cache->map, cache->disk->size, MS_SYNC);
+    munmap(cache->map, cache->disk->size);
+    close(cache->fd);
+    for (size_t i = 0; i < cache->disk_bucket_count; i++) {
+        st_disk_node_t *node = cache->disk_buckets[i];
+        while (node) {
+            st_disk_node_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(cache->disk_buckets);
+}
+
+// ---- 对外接口 ----
+
+st_client_cache_t *client_cache_new(size_t capacity, size_t max_entry, const char *file, size_t file_size) {
+    st_client_cache_t *cache = calloc(1, sizeof(st_client_cache_t));
+    if (!cache) {
+        log_error("malloc");
+        return NULL;
+    }
+    cache->capacity = capacity;
+    cache->max_entry = max_entry > 0 ? max_entry : CLIENT_CACHE_DEFAULT_MAX_ENTRY;
+    cache->fd = -1;
+    if (file && *file && !disk_open(cache, file, file_size > 0 ? file_size : CLIENT_CACHE_DEFAULT_FILE_SIZE)) {
+        log_error("client cache: using memory only");
+    }
+    return cache;
+}
+
+void client_cache_free(st_client_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    while (cache->lru_head) {
+        remove_entry(cache, cache->lru_head);
+    }
+    free(cache->buckets);
+    disk_close(cache);
+    free(cache);
+}
+
+st_client_cache_entry_t *client_cache_lookup(st_client_cache_t *cache, const char *path, size_t path_length,
+                                             const char *head, size_t head_length) {
+    uint64_t hash = hash_bytes(path, path_length);
+    st_client_cache_entry_t *entry = find_entry(cache, hash, path, path_length, head, head_length);
+    if (entry) {
+        if (cache->lru_head != entry) {
+            lru_unlink(cache, entry);
+            lru_push_front(cache, entry);
+        }
+    } else if (cache->map) {
+        entry = disk_lookup(cache, hash, path, path_length, head, head_length);
+    }
+    if (!entry) {
+        add(&cache->counters.misses, 1);
+        return NULL;
+    }
+    if (client_cache_fresh(entry)) {
+        add(&cache->counters.hits, 1);
+    } else if (has_validator(client_cache_headers(entry), entry->header_count)) {
+        add(&cache->counters.revalidations, 1);
+    } else {
+        // 过期又不能验证, 不再保留
+        if (cache->map && entry->disk_offset >= 0) {
+            disk_unindex(cache, hash, entry->disk_offset);
+        }
+        remove_entry(cache, entry);
+        add(&cache->counters.misses, 1);
+        return NULL;
+    }
+    entry->refs++;
+    return entry;
+}
+
+void client_cache_release(st_client_cache_t *cache, st_client_cache_entry_t *entry) {
+    entry_unref(entry);
+}
+
+bool client_cache_fresh(const st_client_cache_entry_t *entry) {
+    return entry->expires > now_unix();
+}
+
+size_t client_cache_conditional(const st_client_cache_entry_t *entry, char *buffer, size_t size) {
+    const char *etag = client_cache_header(client_cache_headers(entry), entry->header_count, "etag");
+    const char *modified = client_cache_header(client_cache_headers(entry), entry->header_count, "last-modified");
+    int length = 0;
+    if (etag) {
+        length = snprintf(buffer, size, "If-None-Match: %s\r\n", etag);
+    } else if (modified) {
+        length = snprintf(buffer, size, "If-Modified-Since: %s\r\n", modified);
+    }
+    return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+bool client_cache_store(st_client_cache_t *cache, const char *path, size_t path_length, const char *head, size_t head_length,
+                        int status, const char *headers, int header_count, size_t headers_length,
+                        const char *body, size_t body_length) {
+    const char *cache_control = client_cache_header(headers, header_count, "cache-control");
+    if (status != 200 || (cache_control && has_directive(cache_control, "no-store", NULL))) {
+        return false;
+    }
+    double ttl = freshness(headers, header_count, cache_control);
+    if (ttl <= 0 && !has_validator(headers, header_count)) {
+        return false;
+    }
+    st_buffer_t vary = {0};
+    if (build_vary(&vary, client_cache_header(headers, header_count, "vary"), head, head_length) < 0) {
+        buffer_free(&vary);
+        return false;
+    }
+    size_t vary_length = buffer_length(&vary);
+    size_t data_length = path_length + vary_length + headers_length + body_length;
+    if (data_length > cache->max_entry || sizeof(st_client_cache_entry_t) + data_length > cache->capacity) {
+        buffer_free(&vary);
+        return false;
+    }
+    st_client_cache_entry_t *entry = malloc(sizeof(st_client_cache_entry_t) + data_length);
+    if (!entry) {
+        buffer_free(&vary);
+        return false;
+    }
+    *entry = (st_client_cache_entry_t){
+        .hash = hash_bytes(path, path_length),
+        .expires = now_unix() + ttl,
+        .status = status,
+        .header_count = header_count,
+        .disk_offset = -1,
+        .path_length = path_length,
+        .vary_length = vary_length,
+        .headers_length = headers_length,
+        .body_length = body_length,
+        .data = (char *)(entry + 1),
+    };
+    char *p = entry->data;
+    memcpy(p, path, path_length);
+    if (vary_length > 0) {
+        memcpy(p + path_length, buffer_data(&vary), vary_length);
+    }
+    memcpy(p + path_length + vary_length, headers, headers_length);
+    if (body_length > 0) {
+        memcpy(p + path_length + vary_length + headers_length, body, body_length);
+    }
+    buffer_free(&vary);
+
+    // 替换同一变体的旧条目
+    st_client_cache_entry_t *old = find_entry(cache, entry->hash, path, path_length, head, head_length);
+    if (old) {
+        remove_entry(cache, old);
+    }
+    if (!insert_entry(cache, entry)) {
+        free(entry);
+        return false;
+    }
+    if (cache->map) {
+        disk_forget(cache, entry->hash, path, path_length, head, head_length);
+        entry->disk_offset = disk_append(cache, entry);
+    }
+    add(&cache->counters.stores, 1);
+    return true;
+}
+
+void client_cache_refresh(st_client_cache_t *cache, st_client_cache_entry_t *entry, const char *headers, int header_count) {
+    const char *cache_control = client_cache_header(headers, header_count, "cache-control");
+    double ttl = cache_control ? freshness(headers, header_count, cache_control)
+                               : freshness(client_cache_headers(entry), entry->header_count,
+                                           client_cache_header(client_cache_headers(entry), entry->header_count, "cache-control"));
+    entry->expires = now_unix() + ttl;
+    if (cache->map && entry->disk_offset >= 0 && disk_slot(cache, entry->hash, entry->disk_offset)) {
+        disk_record(cache, entry->disk_offset)->expires = entry->expires;
+    }
+    add(&cache->counters.not_modified, 1);
+}
+
+void client_cache_stats(st_client_cache_t *cache, st_client_cache_stats_t *stats) {
+    const uint64_t *from = (const uint64_t *)&cache->counters;
+    uint64_t *to = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,1875 @@
+#define _GNU_SOURCE
+#include "client_loop.h"
+#include "mpsc_queue.h"
+#include "ssl_utils.h"
+#include "buffer.h"
+#include "log.h"
+#include <llhttp.h>
+#include <openssl/err.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#define CLIENT_READ_SIZE (16 * 1024)
+#define CLIENT_MAX_HEADERS 64
+#define CLIENT_MAX_BODY (64 * 1024 * 1024)
+#define CLIENT_MAX_HOST_LENGTH 256
+#define CLIENT_MAX_ATTEMPTS 2
+#define CLIENT_MAX_ADDRESSES 16
+#define CLIENT_LATENCY_BUCKETS 80      // 对数分桶, 每桶是上一桶的2^(1/4)倍
+#define CLIENT_LATENCY_BASE 0.0001     // 第一个桶的上界(秒)
+#define CLIENT_LATENCY_WINDOW 1024     // 样本达到后计数减半, 分位数跟随最近的延迟
+#define CLIENT_HEDGE_MIN_SAMPLES 64    // 样本少于此数时不用分位数
+#define CLIENT_HEDGE_MAX_TOKENS 10.0   // 对冲预算最多积累的令牌, 即允许的突发
+#define CLIENT_STREAM_CHUNK (64 * 1024)  // 流式请求体每次从来源读取的上限
+#define CLIENT_CHUNK_HEAD 8            // 定宽的chunk头"%06zx\r\n", 不用移动数据
+_Static_assert(CLIENT_STREAM_CHUNK <= 0xffffff, "chunk size must fit the fixed-width chunk head");
+#define CLIENT_MAX_CONDITIONAL 1024    // 重新验证时加上的请求头
+
+typedef enum {
+    CALL_CALLBACK,
+    CALL_QUEUE,
+    CALL_FUTURE
+} call_mode_t;
+
+// 一次提交的请求, 由提交线程分配和序列化, 完成后交给回调/完成队列/future
+typedef struct st_client_call {
+    st_client_loop_t *client;
+    call_mode_t mode;
+    client_complete_cb_t cb;
+    void *arg;
+    st_completion_queue_t *queue;
+    st_client_future_t *future;
+    struct st_client_call *next;   // 等待连接的队列或完成队列
+    struct st_client_call *prev;   // 等待连接的队列是双向的, 截止时可以摘除
+    bool pending;
+    struct st_client_conn *conn;   // 正在执行的连接
+    st_buffer_t request;           // 序列化的请求, 换连接重试时重发
+    bool idempotent;
+    int attempts;
+    double deadline;               // 单调时钟(秒), 0表示不限
+    double hedge_at;               // 到这个时间还没有完成就对冲, 0表示不对冲
+    double started;                // 本次尝试分配到连接的时间
+    st_event_timer_t timer;        // 截止时间和对冲
+    struct st_client_call *hedge;  // 原请求: 进行中的对冲副本
+    struct st_client_call *primary;  // 对冲副本: 所属的原请求, 副本不会交给调用者
+    bool attempt_failed;           // 原请求这次尝试已失败, 等待对冲副本的结果
+    client_error_t error;
+    int status;
+    st_buffer_t headers;           // 依次存放"name\0value\0"
+    int header_count;
+    st_buffer_t body;
+    client_body_mode_t body_mode;  // 流式请求体
+    int body_fd;
+    client_body_read_cb_t body_read;
+    void *body_arg;
+    bool chunked;
+    uint64_t body_left;            // 声明了长度时还没有读取的字节
+    bool body_started;             // 已从来源读取, 不能再重试
+    bool body_done;
+    st_buffer_t out;               // 从来源读出还没有写到socket的数据, 包括chunk编码
+    client_body_mode_t response_mode;  // 流式响应体
+    int response_fd;
+    client_body_write_cb_t response_write;
+    void *response_arg;
+    st_buffer_t spill;             // response_fd暂时写不进的数据, 非空时暂停读取
+    uint64_t streamed;             // 已交给fd或回调的响应体字节
+    bool cacheable;                // 经过响应缓存的GET请求
+    size_t path_length;            // 路径紧跟在请求行的"GET "之后
+    st_client_cache_entry_t *cached;  // 正在重新验证的缓存条目
+} st_client_call_t;
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_ACTIVE,
+    CONN_IDLE
+} conn_state_t;
+
+typedef struct st_client_conn {
+    st_event_io_t io;              // 位于首位
+    int fd;
+    SSL *ssl;
+    st_client_loop_t *client;
+    int address;                   // client->addresses中的下标
+    struct st_client_conn *next;   // 空闲栈
+    struct st_client_conn *prev_all;  // 所有连接, 停止时遍历
+    struct st_client_conn *next_all;
+    conn_state_t state;
+    st_event_timer_t timer;        // 连接/读取/空闲超时
+    st_event_io_t source_io;       // 等待请求体的fd可读
+    st_event_io_t sink_io;         // 等待响应体的fd可写
+    double last_activity;
+    llhttp_t parser;
+    st_client_call_t *call;
+    size_t sent;                   // 本次请求已写出的字节数
+    bool reused;
+    bool value_pending;
+    bool informational;
+    bool response_started;
+    bool message_done;
+    bool reusable;
+    bool dispatching;
+    bool failed;
+    bool timed_out;
+    bool body_error;               // 请求体来源或响应体去向出错
+} st_client_conn_t;
+
+// 一个服务器地址及其最近的响应延迟分布
+typedef struct st_client_address {
+    struct sockaddr_storage addr;
+    socklen_t length;
+    uint32_t latency[CLIENT_LATENCY_BUCKETS];
+    uint32_t samples;
+} st_client_address_t;
+
+struct st_client_loop {
+    char host[CLIENT_MAX_HOST_LENGTH];
+    char authority[CLIENT_MAX_HOST_LENGTH + 8];  // Host请求头
+    st_client_address_t addresses[CLIENT_MAX_ADDRESSES];
+    int address_count;
+    unsigned next_address;
+    st_client_loop_options_t options;
+    bool hedging;
+    double hedge_tokens;
+    SSL_CTX *ssl_ctx;
+    st_event_loop_t *loop;
+    pthread_t thread;
+    bool started;
+    st_mpsc_queue_t queue;
+    st_event_async_t async;
+    int wakeup;                    // 已发出唤醒还没有处理, 原子访问
+    int stopping;
+    st_client_call_t *pending_head;  // 循环线程中等待连接的请求
+    st_client_call_t *pending_tail;
+    st_client_conn_t *idle;
+    st_client_conn_t *conns;
+    int conn_count;
+    st_client_cache_t *cache;      // 只在循环线程中访问
+    st_client_loop_stats_t counters;
+};
+
+struct st_completion_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    st_client_call_t *head;
+    st_client_call_t *tail;
+    int fd;                        // eventfd, 队列非空时可读
+};
+
+struct st_client_future {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    st_client_call_t *call;
+    st_client_response_t response;
+    bool done;
+    bool abandoned;
+};
+
+static llhttp_settings_t response_settings;
+static pthread_once_t settings_once = PTHREAD_ONCE_INIT;
+
+static void conn_after(st_client_conn_t *conn);
+static void conn_flush(st_client_conn_t *conn);
+static void dispatch(st_client_loop_t *client);
+static void on_call_timer(st_event_loop_t *loop, st_event_timer_t *t);
+
+static void count(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+// 截止时间在提交线程计算, 不用循环的缓存时间
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ---- 延迟分布 ----
+
+static void latency_record(st_client_address_t *address, double seconds) {
+    int bucket = seconds <= CLIENT_LATENCY_BASE ? 0 : (int)ceil(log2(seconds / CLIENT_LATENCY_BASE) * 4);
+    if (bucket >= CLIENT_LATENCY_BUCKETS) {
+        bucket = CLIENT_LATENCY_BUCKETS - 1;
+    }
+    address->latency[bucket]++;
+    if (++address->samples >= CLIENT_LATENCY_WINDOW) {
+        address->samples = 0;
+        for (int i = 0; i < CLIENT_LATENCY_BUCKETS; i++) {
+            address->latency[i] /= 2;
+            address->samples += address->latency[i];
+        }
+    }
+}
+
+// 返回分位数所在桶的上界
+static double latency_percentile(const st_client_address_t *address, double percentile) {
+    uint64_t target = (uint64_t)ceil(address->samples * percentile / 100);
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < CLIENT_LATENCY_BUCKETS - 1; bucket++) {
+        seen += address->latency[bucket];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return CLIENT_LATENCY_BASE * exp2(bucket / 4.0);
+}
+
+// ---- 请求 ----
+
+static void call_free(st_client_call_t *call) {
+    buffer_free(&call->request);
+    buffer_free(&call->headers);
+    buffer_free(&call->body);
+    buffer_free(&call->out);
+    buffer_free(&call->spill);
+    free(call);
+}
+
+static void call_response(const st_client_call_t *call, st_client_response_t *response) {
+    response->error = call->error;
+    response->status = call->status;
+    response->headers = buffer_data(&call->headers);
+    response->header_count = call->header_count;
+    if (call->response_mode != CLIENT_BODY_BUFFER) {
+        response->body = NULL;
+        response->body_length = call->streamed;
+    } else {
+        response->body = buffer_data(&call->body);
+        response->body_length = buffer_length(&call->body);
+    }
+}
+
+static bool call_streaming(const st_client_call_t *call) {
+    return call->body_mode != CLIENT_BODY_BUFFER || call->response_mode != CLIENT_BODY_BUFFER;
+}
+
+static void queue_push(st_completion_queue_t *queue, st_client_call_t *call) {
+    pthread_mutex_lock(&queue->lock);
+    call->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = call;
+    } else {
+        queue->head = call;
+        uint64_t one = 1;
+        if (write(queue->fd, &one, sizeof(one)) < 0) {
+            log_error("eventfd write");
+        }
+    }
+    queue->tail = call;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void future_complete(st_client_future_t *future, st_client_call_t *call) {
+    pthread_mutex_lock(&future->lock);
+    if (future->abandoned) {
+        pthread_mutex_unlock(&future->lock);
+        pthread_mutex_destroy(&future->lock);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+        call_free(call);
+        return;
+    }
+    future->call = call;
+    call_response(call, &future->response);
+    future->done = true;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+}
+
+// 在循环线程中完成请求, 停止后在释放客户端的线程中完成队列里剩下的请求
+static void call_complete(st_client_loop_t *client, st_client_call_t *call, client_error_t error) {
+    call->error = error;
+    count(error == CLIENT_OK ? &client->counters.completed : &client->counters.failed);
+    if (call->mode == CALL_QUEUE) {
+        queue_push(call->queue, call);
+    } else if (call->mode == CALL_FUTURE) {
+        future_complete(call->future, call);
+    } else {
+        st_client_response_t response;
+        call_response(call, &response);
+        call->cb(&response, call->arg);
+        call_free(call);
+    }
+}
+
+static void pending_push(st_client_loop_t *client, st_client_call_t *call, bool front) {
+    call->next = NULL;
+    call->prev = NULL;
+    call->pending = true;
+    if (!client->pending_head) {
+        client->pending_head = client->pending_tail = call;
+    } else if (front) {
+        call->next = client->pending_head;
+        client->pending_head->prev = call;
+        client->pending_head = call;
+    } else {
+        call->prev = client->pending_tail;
+        client->pending_tail->next = call;
+        client->pending_tail = call;
+    }
+}
+
+static void pending_remove(st_client_loop_t *client, st_client_call_t *call) {
+    if (call->prev) {
+        call->prev->next = call->next;
+    } else {
+        client->pending_head = call->next;
+    }
+    if (call->next) {
+        call->next->prev = call->prev;
+    } else {
+        client->pending_tail = call->prev;
+    }
+    call->next = NULL;
+    call->prev = NULL;
+    call->pending = false;
+}
+
+static st_client_call_t *pending_pop(st_client_loop_t *client) {
+    st_client_call_t *call = client->pending_head;
+    if (call) {
+        pending_remove(client, call);
+    }
+    return call;
+}
+
+// ---- 连接 ----
+
+static void conn_close(st_client_conn_t *conn) {
+    st_client_loop_t *client = conn->client;
+    if (conn->state == CONN_IDLE) {
+        st_client_conn_t **slot = &client->idle;
+        while (*slot && *slot != conn) {
+            slot = &(*slot)->next;
+        }
+        if (*slot) {
+            *slot = conn->next;
+        }
+    }
+    if (conn->prev_all) {
+        conn->prev_all->next_all = conn->next_all;
+    } else {
+        client->conns = conn->next_all;
+    }
+    if (conn->next_all) {
+        conn->next_all->prev_all = conn->prev_all;
+    }
+    client->conn_count--;
+    event_io_stop(client->loop, &conn->io);
+    event_io_stop(client->loop, &conn->source_io);
+    event_io_stop(client->loop, &conn->sink_io);
+    event_timer_stop(client->loop, &conn->timer);
+    if (conn->ssl) {
+        SSL_free(conn->ssl);
+        ERR_clear_error();
+    }
+    close(conn->fd);
+    free(conn);
+}
+
+// 请求头和请求体都已写出
+static bool conn_request_sent(const st_client_conn_t *conn) {
+    const st_client_call_t *call = conn->call;
+    return conn->sent >= buffer_length(&call->request) &&
+           (call->body_mode == CLIENT_BODY_BUFFER || (call->body_done && buffer_length(&call->out) == 0));
+}
+
+static void conn_update_io(st_client_conn_t *conn) {
+    st_client_call_t *call = conn->call;
+    int events = EVENT_READ;
+    if (conn->state == CONN_CONNECTING) {
+        events = EVENT_WRITE;
+    } else if (conn->state == CONN_ACTIVE && call) {
+        // 响应体写不进去时不读, 等待请求体来源时不写
+        if (buffer_length(&call->spill) > 0) {
+            events = 0;
+        }
+        if (conn->sent < buffer_length(&call->request) || buffer_length(&call->out) > 0) {
+            events |= EVENT_WRITE;
+        }
+    }
+    event_io_set(conn->client->loop, &conn->io, events);
+}
+
+static void conn_fail(st_client_conn_t *conn, const char *reason) {
+    if (!conn->failed) {
+        log_debug("client %s: %s", conn->client->authority, reason);
+    }
+    conn->failed = true;
+}
+
+// 返回读到的字节数, 0表示对端关闭, -1表示出错, -2表示暂时没有数据
+static ssize_t conn_recv(st_client_conn_t *conn, char *buffer, size_t size) {
+    if (!conn->ssl) {
+        ssize_t n = recv(conn->fd, buffer, size, 0);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+        }
+        return n;
+    }
+    int n = SSL_read(conn->ssl, buffer, (int)size);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(conn->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        return -2;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && errno == 0)) {
+        return 0;
+    }
+    return -1;
+}
+
+static ssize_t conn_send(st_client_conn_t *conn, const char *data, size_t length) {
+    if (!conn->ssl) {
+        ssize_t n = send(conn->fd, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+        }
+        return n;
+    }
+    int n = SSL_write(conn->ssl, data, length > INT_MAX ? INT_MAX : (int)length);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(conn->ssl, n);
+    return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? -2 : -1;
+}
+
+static void on_source_io(st_event_loop_t *loop, st_event_io_t *w, int revents);
+
+// 从来源读一段请求体放进out, chunked时加上分块编码.
+// 返回1表示有进展(可能已结束), 0表示fd暂时不可读, 已开始等待, -1表示出错
+static int conn_pull_body(st_client_conn_t *conn) {
+    st_client_call_t *call = conn->call;
+    size_t size = CLIENT_STREAM_CHUNK;
+    if (!call->chunked && call->body_left < size) {
+        size = call->body_left;
+    }
+    if (size == 0) {
+        call->body_done = true;
+        return 1;
+    }
+    char *p = buffer_reserve(&call->out, CLIENT_CHUNK_HEAD + size + 2);
+    if (!p) {
+        return -1;
+    }
+    char *data = call->chunked ? p + CLIENT_CHUNK_HEAD : p;
+    ssize_t n;
+    if (call->body_mode == CLIENT_BODY_FD) {
+        n = read(call->body_fd, data, size);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            event_io_init(&conn->source_io, on_source_io, call->body_fd, EVENT_READ, 0);
+            conn->source_io.data = conn;
+            return event_io_start(conn->client->loop, &conn->source_io) < 0 ? -1 : 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            return 1;
+        }
+    } else {
+        n = call->body_read(call->body_arg, data, size);
+    }
+    call->body_started = true;
+    if (n < 0 || (size_t)n > size) {
+        return -1;
+    }
+    if (n == 0) {
+        // 声明了长度的来源提前结束
+        if (!call->chunked) {
+            return -1;
+        }
+        call->body_done = true;
+        return buffer_append(&call->out, "0\r\n\r\n", 5) < 0 ? -1 : 1;
+    }
+    if (call->chunked) {
+        // n不超过CLIENT_STREAM_CHUNK, 六位十六进制放得下; 缓冲区按size_t最大值留足
+        char head[sizeof(size_t) * 2 + 3];
+        snprintf(head, sizeof(head), "%06zx\r\n", (size_t)n);
+        memcpy(p, head, CLIENT_CHUNK_HEAD);
+        memcpy(data + n, "\r\n", 2);
+        buffer_commit(&call->out, CLIENT_CHUNK_HEAD + n + 2);
+    } else {
+        buffer_commit(&call->out, n);
+        call->body_left -= n;
+        call->body_done = call->body_left == 0;
+    }
+    return 1;
+}
+
+// 请求头写完后逐段发送流式请求体, socket写不进或来源暂时没有数据时返回
+static void conn_send_body(st_client_conn_t *conn) {
+    st_client_call_t *call = conn->call;
+    for (;;) {
+        if (buffer_length(&call->out) == 0) {
+            if (call->body_done) {
+                return;
+            }
+            int ret = conn_pull_body(conn);
+            if (ret < 0) {
+                conn->body_error = true;
+                conn_fail(conn, "request body source failed");
+            }
+            if (ret <= 0) {
+                return;
+            }
+            continue;
+        }
+        ssize_t n = conn_send(conn, buffer_data(&call->out), buffer_length(&call->out));
+        if (n == -2) {
+            return;
+        }
+        if (n < 0) {
+            conn_fail(conn, "write failed");
+            return;
+        }
+        buffer_consume(&call->out, n);
+        conn->last_activity = event_loop_now(conn->client->loop);
+    }
+}
+
+static void conn_flush(st_client_conn_t *conn) {
+    st_client_call_t *call = conn->call;
+    if (conn->state != CONN_ACTIVE || conn->failed || !call) {
+        return;
+    }
+    size_t length = buffer_length(&call->request);
+    while (conn->sent < length) {
+        ssize_t n = conn_send(conn, buffer_data(&call->request) + conn->sent, length - conn->sent);
+        if (n == -2) {
+            break;
+        }
+        if (n < 0) {
+            conn_fail(conn, "write failed");
+            return;
+        }
+        conn->sent += n;
+        conn->last_activity = event_loop_now(conn->client->loop);
+    }
+    if (conn->sent >= length && call->body_mode != CLIENT_BODY_BUFFER && !conn->source_io.active) {
+        conn_send_body(conn);
+    }
+    conn_update_io(conn);
+}
+
+static void conn_release(st_client_conn_t *conn);
+
+static void conn_activate(st_client_conn_t *conn) {
+    if (!conn->call) {
+        // 等待建立期间请求被取消了
+        conn_release(conn);
+        return;
+    }
+    conn->state = CONN_ACTIVE;
+    conn->last_activity = event_loop_now(conn->client->loop);
+    event_timer_start(conn->client->loop, &conn->timer, conn->client->options.read_timeout);
+    conn_flush(conn);
+}
+
+static void conn_handshake(st_client_conn_t *conn) {
+    int ret = SSL_do_handshake(conn->ssl);
+    if (ret == 1) {
+        conn_activate(conn);
+        return;
+    }
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ) {
+        event_io_set(conn->client->loop, &conn->io, EVENT_READ);
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+        event_io_set(conn->client->loop, &conn->io, EVENT_READ | EVENT_WRITE);
+    } else {
+        conn_fail(conn, "tls handshake failed");
+    }
+}
+
+static void conn_connected(st_client_conn_t *conn) {
+    st_client_loop_t *client = conn->client;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        conn_fail(conn, "connect failed");
+        return;
+    }
+    if (!client->ssl_ctx) {
+        conn_activate(conn);
+        return;
+    }
+    conn->ssl = SSL_new(client->ssl_ctx);
+    if (!conn->ssl) {
+        conn_fail(conn, "SSL_new failed");
+        return;
+    }
+    SSL_set_fd(conn->ssl, conn->fd);
+    SSL_set_connect_state(conn->ssl);
+    struct in6_addr ip;
+    if (inet_pton(AF_INET, client->host, &ip) != 1 && inet_pton(AF_INET6, client->host, &ip) != 1) {
+        SSL_set_tlsext_host_name(conn->ssl, client->host);
+    }
+    if (client->options.verify) {
+        SSL_set1_host(conn->ssl, client->host);
+    }
+    conn->state = CONN_HANDSHAKE;
+    conn_handshake(conn);
+}
+
+static void on_sink_io(st_event_loop_t *loop, st_event_io_t *w, int revents);
+
+// 响应体写不进fd: 暂停读取, fd可写时由on_sink_io写完再继续
+static void conn_wait_sink(st_client_conn_t *conn) {
+    event_io_init(&conn->sink_io, on_sink_io, conn->call->response_fd, EVENT_WRITE, 0);
+    conn->sink_io.data = conn;
+    if (event_io_start(conn->client->loop, &conn->sink_io) < 0) {
+        conn->body_error = true;
+        conn_fail(conn, "response body sink failed");
+        return;
+    }
+    conn_update_io(conn);
+}
+
+static void conn_read(st_client_conn_t *conn) {
+    char buffer[CLIENT_READ_SIZE];
+    while (!conn->failed && !conn->message_done && !(conn->call && buffer_length(&conn->call->spill) > 0)) {
+        ssize_t n = conn_recv(conn, buffer, sizeof(buffer));
+        if (n == -2) {
+            return;
+        }
+        if (n == 0 && conn->call) {
+            // 以关闭连接结束的响应体
+            llhttp_finish(&conn->parser);
+            if (conn->message_done) {
+                conn->reusable = false;
+                return;
+            }
+        }
+        if (n <= 0) {
+            conn_fail(conn, n == 0 ? "closed by server" : "read failed");
+            return;
+        }
+        if (!conn->call) {
+            conn_fail(conn, "unexpected data");
+            return;
+        }
+        conn->response_started = true;
+        conn->last_activity = event_loop_now(conn->client->loop);
+        llhttp_errno_t err = llhttp_execute(&conn->parser, buffer, n);
+        if (conn->message_done) {
+            // 响应之后还有数据, 连接状态不可信
+            conn->reusable = err == HPE_PAUSED && llhttp_get_error_pos(&conn->parser) == buffer + n;
+        } else if (err != HPE_OK) {
+            conn_fail(conn, llhttp_errno_name(err));
+            return;
+        }
+        if (buffer_length(&conn->call->spill) > 0) {
+            conn_wait_sink(conn);
+            return;
+        }
+    }
+}
+
+// 进入可能失败或完成响应的操作, 嵌套调用时由最外层统一处理
+static bool conn_enter(st_client_conn_t *conn) {
+    bool nested = conn->dispatching;
+    conn->dispatching = true;
+    return nested;
+}
+
+static void conn_leave(st_client_conn_t *conn, bool nested) {
+    if (!nested) {
+        conn->dispatching = false;
+        conn_after(conn);
+    }
+}
+
+static void on_conn_io(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    st_client_conn_t *conn = (st_client_conn_t *)w->data;
+    bool nested = conn_enter(conn);
+    if (conn->state == CONN_CONNECTING) {
+        conn_connected(conn);
+    } else if (conn->state == CONN_HANDSHAKE) {
+        conn_handshake(conn);
+    } else if (conn->state == CONN_IDLE) {
+        // 空闲时可读说明对端关闭了连接
+        conn_fail(conn, "idle connection closed");
+    } else {
+        if (revents & EVENT_WRITE) {
+            conn_flush(conn);
+        }
+        if (revents & EVENT_READ) {
+            conn_read(conn);
+        }
+    }
+    conn_leave(conn, nested);
+}
+
+static void on_source_io(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    st_client_conn_t *conn = (st_client_conn_t *)w->data;
+    event_io_stop(loop, w);
+    bool nested = conn_enter(conn);
+    conn_flush(conn);
+    conn_leave(conn, nested);
+}
+
+// 写完暂存的响应体后继续读取. TLS可能还有已解密的数据, 边缘触发时也可能错过了可读事件, 所以直接读一次
+static void on_sink_io(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    st_client_conn_t *conn = (st_client_conn_t *)w->data;
+    st_client_call_t *call = conn->call;
+    bool nested = conn_enter(conn);
+    while (buffer_length(&call->spill) > 0) {
+        ssize_t n = write(call->response_fd, buffer_data(&call->spill), buffer_length(&call->spill));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->body_error = true;
+                conn_fail(conn, "response body sink failed");
+            }
+            break;
+        }
+        buffer_consume(&call->spill, n);
+        conn->last_activity = event_loop_now(loop);
+    }
+    if (buffer_length(&call->spill) == 0 && !conn->failed) {
+        event_io_stop(loop, w);
+        conn_update_io(conn);
+        conn_read(conn);
+    }
+    conn_leave(conn, nested);
+}
+
+static void on_conn_timeout(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_client_conn_t *conn = (st_client_conn_t *)t->data;
+    if (conn->state == CONN_IDLE) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->state == CONN_ACTIVE) {
+        double remaining = conn->last_activity + conn->client->options.read_timeout - event_loop_now(loop);
+        if (remaining > 0) {
+            event_timer_start(loop, t, remaining);
+            return;
+        }
+    }
+    bool nested = conn_enter(conn);
+    conn->timed_out = true;
+    conn_fail(conn, "timed out");
+    conn_leave(conn, nested);
+}
+
+// 新连接轮流使用各个地址, avoid是对冲时原请求所在的地址
+static st_client_conn_t *conn_connect(st_client_loop_t *client, int avoid) {
+    int address = client->next_address++ % client->address_count;
+    if (address == avoid && client->address_count > 1) {
+        address = client->next_address++ % client->address_count;
+    }
+    const st_client_address_t *target = &client->addresses[address];
+    int fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("socket: %s", strerror(errno));
+        return NULL;
+    }
+    if (target->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (connect(fd, (const struct sockaddr *)&target->addr, target->length) < 0 && errno != EINPROGRESS) {
+        log_debug("connect %s: %s", client->authority, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    st_client_conn_t *conn = calloc(1, sizeof(st_client_conn_t));
+    if (!conn) {
+        log_error("malloc");
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->client = client;
+    conn->address = address;
+    conn->state = CONN_CONNECTING;
+    llhttp_init(&conn->parser, HTTP_RESPONSE, &response_settings);
+    conn->parser.data = conn;
+    event_io_init(&conn->io, on_conn_io, fd, EVENT_WRITE, 0);
+    conn->io.data = conn;
+    if (event_io_start(client->loop, &conn->io) < 0) {
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    event_timer_init(&conn->timer, on_conn_timeout, 0);
+    conn->timer.data = conn;
+    event_timer_start(client->loop, &conn->timer, client->options.connect_timeout);
+
+    conn->next_all = client->conns;
+    if (client->conns) {
+        client->conns->prev_all = conn;
+    }
+    client->conns = conn;
+    client->conn_count++;
+    count(&client->counters.connects);
+    return conn;
+}
+
+// ---- 截止时间和对冲 ----
+
+// 取消还在进行的尝试: 排队的移出队列, 已发出的关闭连接(HTTP/1.1不能中止单个请求);
+// 还在建立的连接保留下来, 建立后交给下一个请求
+static void attempt_cancel(st_client_loop_t *client, st_client_call_t *call) {
+    if (call->pending) {
+        pending_remove(client, call);
+    }
+    st_client_conn_t *conn = call->conn;
+    if (conn) {
+        conn->call = NULL;
+        call->conn = NULL;
+        if (conn->state == CONN_ACTIVE) {
+            conn_close(conn);
+        }
+    }
+}
+
+// ---- 响应缓存 ----
+
+static bool cache_fill(st_client_call_t *call, const st_client_cache_entry_t *entry) {
+    buffer_reset(&call->headers);
+    buffer_reset(&call->body);
+    if (buffer_append(&call->headers, client_cache_headers(entry), entry->headers_length) < 0 ||
+        (entry->body_length > 0 && buffer_append(&call->body, client_cache_body(entry), entry->body_length) < 0)) {
+        return false;
+    }
+    call->status = entry->status;
+    call->header_count = entry->header_count;
+    return true;
+}
+
+// 在请求头末尾加上条件请求头
+static bool add_conditional(st_client_call_t *call, const char *conditional, size_t length) {
+    st_buffer_t request = {0};
+    size_t head_length = buffer_length(&call->request) - 2;
+    if (buffer_append(&request, buffer_data(&call->request), head_length) < 0 || buffer_append(&request, conditional, length) < 0 ||
+        buffer_append(&request, "\r\n", 2) < 0) {
+        buffer_free(&request);
+        return false;
+    }
+    buffer_free(&call->request);
+    call->request = request;
+    return true;
+}
+
+// 新鲜的缓存直接完成请求, 返回true; 过期但有验证器时加上条件请求头, 留着条目等响应
+static bool cache_lookup(st_client_loop_t *client, st_client_call_t *call) {
+    const char *head = buffer_data(&call->request);
+    st_client_cache_entry_t *entry = client_cache_lookup(client->cache, head + 4, call->path_length, head,
+                                                         buffer_length(&call->request));
+    if (!entry) {
+        return false;
+    }
+    if (client_cache_fresh(entry)) {
+        bool filled = cache_fill(call, entry);
+        client_cache_release(client->cache, entry);
+        if (filled) {
+            call_complete(client, call, CLIENT_OK);
+        }
+        return filled;
+    }
+    char conditional[CLIENT_MAX_CONDITIONAL];
+    size_t length = client_cache_conditional(entry, conditional, sizeof(conditional));
+    if (length == 0 || !add_conditional(call, conditional, length)) {
+        client_cache_release(client->cache, entry);
+        return false;
+    }
+    call->cached = entry;
+    return false;
+}
+
+// 响应到达: 304换成缓存的响应并刷新过期时间, 200存入缓存
+static void cache_complete(st_client_loop_t *client, st_client_call_t *call, client_error_t error) {
+    st_client_cache_entry_t *entry = call->cached;
+    call->cached = NULL;
+    if (error == CLIENT_OK && entry && call->status == 304) {
+        client_cache_refresh(client->cache, entry, buffer_data(&call->headers), call->header_count);
+        cache_fill(call, entry);
+    } else if (error == CLIENT_OK && call->status == 200) {
+        const char *head = buffer_data(&call->request);
+        client_cache_store(client->cache, head + 4, call->path_length, head, buffer_length(&call->request), call->status,
+                           buffer_data(&call->headers), call->header_count, buffer_length(&call->headers),
+                           buffer_data(&call->body), buffer_length(&call->body));
+    }
+    if (entry) {
+        client_cache_release(client->cache, entry);
+    }
+}
+
+// 完成原请求, 先取消它自己和对冲副本还在进行的尝试
+static void call_finish(st_client_loop_t *client, st_client_call_t *call, client_error_t error) {
+    event_timer_stop(client->loop, &call->timer);
+    attempt_cancel(client, call);
+    if (call->hedge) {
+        attempt_cancel(client, call->hedge);
+        call_free(call->hedge);
+        call->hedge = NULL;
+    }
+    if (error != CLIENT_OK) {
+        buffer_reset(&call->headers);
+        buffer_reset(&call->body);
+        call->header_count = 0;
+        call->status = 0;
+    }
+    if (call->cacheable) {
+        cache_complete(client, call, error);
+    }
+    call_complete(client, call, error);
+}
+
+// 一次尝试结束. 先成功的一方胜出, 副本胜出时把响应交给原请求;
+// 一方失败时等另一方的结果, 都失败时以原请求的错误完成
+static void attempt_done(st_client_loop_t *client, st_client_call_t *call, client_error_t error) {
+    call->conn = NULL;
+    st_client_call_t *primary = call->primary;
+    if (!primary) {
+        if (error != CLIENT_OK && call->hedge) {
+            call->attempt_failed = true;
+            call->error = error;
+        } else {
+            call_finish(client, call, error);
+        }
+        return;
+    }
+    primary->hedge = NULL;
+    if (error == CLIENT_OK) {
+        st_buffer_t headers = primary->headers;
+        st_buffer_t body = primary->body;
+        primary->headers = call->headers;
+        primary->body = call->body;
+        call->headers = headers;
+        call->body = body;
+        primary->header_count = call->header_count;
+        primary->status = call->status;
+        count(&client->counters.hedge_wins);
+    }
+    call_free(call);
+    if (error == CLIENT_OK || primary->attempt_failed) {
+        call_finish(client, primary, error == CLIENT_OK ? CLIENT_OK : primary->error);
+    }
+}
+
+// 地址的延迟样本足够时用分位数, 否则用固定延迟
+static double hedge_delay(st_client_loop_t *client, int address) {
+    const st_client_address_t *target = &client->addresses[address];
+    if (client->options.hedge_percentile > 0 && target->samples >= CLIENT_HEDGE_MIN_SAMPLES) {
+        return latency_percentile(target, client->options.hedge_percentile);
+    }
+    return client->options.hedge_delay;
+}
+
+// 定时器设到截止时间和对冲时间中较早的一个
+static void call_arm_timer(st_client_loop_t *client, st_client_call_t *call) {
+    double at = call->deadline;
+    if (call->hedge_at > 0 && (at == 0 || call->hedge_at < at)) {
+        at = call->hedge_at;
+    }
+    if (at > 0) {
+        double after = at - monotonic_now();
+        event_timer_start(client->loop, &call->timer, after > 0 ? after : 0);
+    }
+}
+
+// 原请求还在连接上等响应时, 预算允许就复制一份排到队首
+static void hedge_start(st_client_loop_t *client, st_client_call_t *call) {
+    if (!call->conn || call->hedge) {
+        return;
+    }
+    if (client->hedge_tokens < 1) {
+        count(&client->counters.hedge_denied);
+        return;
+    }
+    st_client_call_t *hedge = calloc(1, sizeof(st_client_call_t));
+    if (!hedge || buffer_append(&hedge->request, buffer_data(&call->request), buffer_length(&call->request)) < 0) {
+        free(hedge);
+        return;
+    }
+    hedge->client = client;
+    hedge->mode = call->mode;
+    hedge->idempotent = true;
+    hedge->primary = call;
+    call->hedge = hedge;
+    client->hedge_tokens -= 1;
+    count(&client->counters.hedged);
+    pending_push(client, hedge, true);
+    dispatch(client);
+}
+
+static void on_call_timer(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_client_call_t *call = (st_client_call_t *)t->data;
+    st_client_loop_t *client = call->client;
+    double now = monotonic_now();
+    if (call->deadline > 0 && now >= call->deadline) {
+        count(&client->counters.deadlines);
+        call_finish(client, call, CLIENT_ERROR_DEADLINE);
+        dispatch(client);
+        return;
+    }
+    if (call->hedge_at > 0 && now >= call->hedge_at) {
+        call->hedge_at = 0;
+        hedge_start(client, call);
+    }
+    call_arm_timer(client, call);
+}
+
+// 循环收到请求: 积累对冲预算, 已经过期的直接完成, 缓存命中的直接完成, 有截止时间的启动定时器
+static bool call_start(st_client_loop_t *client, st_client_call_t *call) {
+    if (client->hedging) {
+        client->hedge_tokens = fmin(client->hedge_tokens + client->options.hedge_budget / 100, CLIENT_HEDGE_MAX_TOKENS);
+    }
+    if (call->deadline > 0 && monotonic_now() >= call->deadline) {
+        count(&client->counters.deadlines);
+        call_complete(client, call, CLIENT_ERROR_DEADLINE);
+        return false;
+    }
+    if (call->cacheable && cache_lookup(client, call)) {
+        return false;
+    }
+    if (call->deadline > 0) {
+        call_arm_timer(client, call);
+    }
+    return true;
+}
+
+// 复用的连接立即写出请求, 写失败在conn_leave中处理
+static void conn_assign(st_client_conn_t *conn, st_client_call_t *call) {
+    bool nested = conn_enter(conn);
+    st_client_loop_t *client = conn->client;
+    conn->call = call;
+    conn->sent = 0;
+    conn->response_started = false;
+    conn->message_done = false;
+    conn->reusable = false;
+    call->conn = conn;
+    call->started = monotonic_now();
+    call->attempts++;
+    // 原请求第一次发出时按目标地址的延迟决定对冲时间
+    if (client->hedging && !call->primary && call->attempts == 1 && call->idempotent && !call_streaming(call)) {
+        double delay = hedge_delay(client, conn->address);
+        if (delay > 0) {
+            call->hedge_at = call->started + delay;
+            call_arm_timer(client, call);
+        }
+    }
+    if (conn->state == CONN_IDLE) {
+        conn->reused = true;
+        conn_activate(conn);
+    }
+    conn_leave(conn, nested);
+}
+
+// 响应结束且可以复用时交给下一个请求或放回空闲栈
+static void conn_release(st_client_conn_t *conn) {
+    st_client_loop_t *client = conn->client;
+    conn->call = NULL;
+    conn->state = CONN_IDLE;
+    llhttp_init(&conn->parser, HTTP_RESPONSE, &response_settings);
+    conn->parser.data = conn;
+    st_client_call_t *call = pending_pop(client);
+    if (call) {
+        conn_assign(conn, call);
+        return;
+    }
+    conn->next = client->idle;
+    client->idle = conn;
+    conn_update_io(conn);
+    event_timer_start(client->loop, &conn->timer, client->options.idle_timeout);
+}
+
+static void conn_error(st_client_conn_t *conn) {
+    st_client_loop_t *client = conn->client;
+    st_client_call_t *call = conn->call;
+    conn_state_t state = conn->state;
+    bool timed_out = conn->timed_out;
+    bool response_started = conn->response_started;
+    // 复用的连接可能已被对端关闭, 还没有收到响应时换新连接重试
+    bool retry = call && conn->reused && !response_started && !call->body_started && call->attempts < CLIENT_MAX_ATTEMPTS &&
+                 (conn->sent == 0 || call->idempotent);
+    client_error_t error = timed_out ? CLIENT_ERROR_TIMEOUT :
+                           conn->body_error ? CLIENT_ERROR_BODY :
+                           state == CONN_CONNECTING ? CLIENT_ERROR_CONNECT :
+                           state == CONN_HANDSHAKE ? CLIENT_ERROR_TLS :
+                           response_started ? CLIENT_ERROR_PROTOCOL : CLIENT_ERROR_IO;
+    conn->call = NULL;
+    conn_close(conn);
+    if (call) {
+        call->conn = NULL;
+        if (retry) {
+            pending_push(client, call, true);
+        } else {
+            attempt_done(client, call, error);
+        }
+    }
+    dispatch(client);
+}
+
+// 先完成请求再放回连接, 以免连接被刚被取消的对冲副本占用
+static void response_complete(st_client_conn_t *conn) {
+    st_client_loop_t *client = conn->client;
+    st_client_call_t *call = conn->call;
+    call->status = conn->parser.status_code;
+    latency_record(&client->addresses[conn->address], monotonic_now() - call->started);
+    // 服务器没等请求体发完就响应时, 连接上还有半个请求
+    bool reusable = conn->reusable && llhttp_should_keep_alive(&conn->parser) && conn_request_sent(conn);
+    conn->call = NULL;
+    attempt_done(client, call, CLIENT_OK);
+    if (reusable) {
+        conn_release(conn);
+    } else {
+        conn_close(conn);
+    }
+    dispatch(client);
+}
+
+static void conn_after(st_client_conn_t *conn) {
+    if (conn->failed) {
+        conn_error(conn);
+    } else if (conn->message_done && buffer_length(&conn->call->spill) == 0) {
+        response_complete(conn);
+    }
+}
+
+// 取一个空闲连接. 对冲副本优先用其他地址的连接, 没有而且还能新建时返回NULL, 由调用者连到其他地址
+static st_client_conn_t *take_idle(st_client_loop_t *client, int avoid) {
+    st_client_conn_t **slot = &client->idle;
+    if (avoid >= 0 && client->address_count > 1) {
+        while (*slot && (*slot)->address == avoid) {
+            slot = &(*slot)->next;
+        }
+        if (!*slot) {
+            if (client->conn_count < client->options.connections) {
+                return NULL;
+            }
+            slot = &client->idle;
+        }
+    }
+    st_client_conn_t *conn = *slot;
+    if (conn) {
+        *slot = conn->next;
+        conn->next = NULL;
+    }
+    return conn;
+}
+
+// 等待的请求交给空闲连接, 连接数没有到上限时建立新连接
+static void dispatch(st_client_loop_t *client) {
+    while (client->pending_head) {
+        st_client_call_t *primary = client->pending_head->primary;
+        int avoid = primary && primary->conn ? primary->conn->address : -1;
+        st_client_conn_t *conn = take_idle(client, avoid);
+        if (!conn) {
+            if (client->conn_count >= client->options.connections) {
+                return;
+            }
+            conn = conn_connect(client, avoid);
+            if (!conn) {
+                attempt_done(client, pending_pop(client), CLIENT_ERROR_CONNECT);
+                continue;
+            }
+        }
+        conn_assign(conn, pending_pop(client));
+    }
+}
+
+// ---- 响应的解析回调 ----
+
+static int on_response_message_begin(llhttp_t *parser) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    st_client_call_t *call = conn->call;
+    buffer_reset(&call->headers);
+    buffer_reset(&call->body);
+    call->header_count = 0;
+    conn->value_pending = false;
+    return 0;
+}
+
+// 上一个头部的值为空时不会有值的回调, 在这里补上结尾
+static int end_header_value(st_client_conn_t *conn) {
+    if (!conn->value_pending) {
+        return 0;
+    }
+    conn->value_pending = false;
+    conn->call->header_count++;
+    return buffer_append(&conn->call->headers, "", 1);
+}
+
+static int on_response_header_field(llhttp_t *parser, const char *at, size_t length) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    if (end_header_value(conn) < 0 || buffer_length(&conn->call->headers) + length > MAX_REQUEST_HEAD_SIZE) {
+        return -1;
+    }
+    return buffer_append(&conn->call->headers, at, length);
+}
+
+static int on_response_header_field_complete(llhttp_t *parser) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    if (conn->call->header_count >= CLIENT_MAX_HEADERS) {
+        return -1;
+    }
+    conn->value_pending = true;
+    return buffer_append(&conn->call->headers, "", 1);
+}
+
+static int on_response_header_value(llhttp_t *parser, const char *at, size_t length) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    if (buffer_length(&conn->call->headers) + length > MAX_REQUEST_HEAD_SIZE) {
+        return -1;
+    }
+    return buffer_append(&conn->call->headers, at, length);
+}
+
+static int on_response_header_value_complete(llhttp_t *parser) {
+    return end_header_value((st_client_conn_t *)parser->data);
+}
+
+static int on_response_headers_complete(llhttp_t *parser) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    if (end_header_value(conn) < 0) {
+        return -1;
+    }
+    if (parser->status_code < 200) {
+        if (parser->status_code == 101) {
+            return -1;
+        }
+        // 1xx之后还有最终响应
+        conn->informational = true;
+    }
+    return 0;
+}
+
+// 流式响应体交给去向, fd写不进的部分放进spill, conn_read随后暂停读取
+static int deliver_body(st_client_conn_t *conn, const char *at, size_t length) {
+    st_client_call_t *call = conn->call;
+    call->streamed += length;
+    if (call->response_mode == CLIENT_BODY_CALLBACK) {
+        if (!call->response_write(call->response_arg, at, length)) {
+            conn->body_error = true;
+            return -1;
+        }
+        return 0;
+    }
+    while (length > 0 && buffer_length(&call->spill) == 0) {
+        ssize_t n = write(call->response_fd, at, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            conn->body_error = true;
+            return -1;
+        }
+        at += n;
+        length -= n;
+    }
+    return length > 0 ? buffer_append(&call->spill, at, length) : 0;
+}
+
+static int on_response_body(llhttp_t *parser, const char *at, size_t length) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    if (conn->call->response_mode != CLIENT_BODY_BUFFER) {
+        return deliver_body(conn, at, length);
+    }
+    if (buffer_length(&conn->call->body) + length > CLIENT_MAX_BODY) {
+        return -1;
+    }
+    return buffer_append(&conn->call->body, at, length);
+}
+
+static int on_response_message_complete(llhttp_t *parser) {
+    st_client_conn_t *conn = (st_client_conn_t *)parser->data;
+    if (conn->informational) {
+        conn->informational = false;
+        return 0;
+    }
+    conn->message_done = true;
+    conn->reusable = true;
+    return HPE_PAUSED;
+}
+
+static void init_response_settings(void) {
+    llhttp_settings_init(&response_settings);
+    response_settings.on_message_begin = on_response_message_begin;
+    response_settings.on_header_field = on_response_header_field;
+    response_settings.on_header_field_complete = on_response_header_field_complete;
+    response_settings.on_header_value = on_response_header_value;
+    response_settings.on_header_value_complete = on_response_header_value_complete;
+    response_settings.on_headers_complete = on_response_headers_complete;
+    response_settings.on_body = on_response_body;
+    response_settings.on_message_complete = on_response_message_complete;
+}
+
+// ---- 循环线程 ----
+
+// 停止时结束所有请求, 包括已经写出的
+static void cancel_all(st_client_loop_t *client) {
+    st_client_call_t *call;
+    while ((call = mpsc_queue_pop(&client->queue))) {
+        pending_push(client, call, false);
+    }
+    // 对冲副本随原请求一起结束
+    while (client->conns) {
+        st_client_conn_t *conn = client->conns;
+        call = conn->call;
+        conn->call = NULL;
+        conn_close(conn);
+        if (call) {
+            call->conn = NULL;
+            call_finish(client, call->primary ? call->primary : call, CLIENT_ERROR_CANCELLED);
+        }
+    }
+    while ((call = pending_pop(client))) {
+        call_finish(client, call->primary ? call->primary : call, CLIENT_ERROR_CANCELLED);
+    }
+}
+
+// 先清除唤醒标记再取队列, 之后入队的生产者会再次唤醒
+static void on_submit(st_event_loop_t *loop, st_event_async_t *a) {
+    st_client_loop_t *client = (st_client_loop_t *)a->data;
+    __atomic_store_n(&client->wakeup, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&client->stopping, __ATOMIC_ACQUIRE)) {
+        cancel_all(client);
+        event_loop_break(loop);
+        return;
+    }
+    st_client_call_t *call;
+    while ((call = mpsc_queue_pop(&client->queue))) {
+        if (call_start(client, call)) {
+            pending_push(client, call, false);
+        }
+    }
+    dispatch(client);
+}
+
+static void *run_client_loop(void *arg) {
+    st_client_loop_t *client = (st_client_loop_t *)arg;
+    // 信号由应用线程处理
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    event_loop_run(client->loop);
+    return NULL;
+}
+
+static void wake(st_client_loop_t *client) {
+    if (__atomic_exchange_n(&client->wakeup, 1, __ATOMIC_SEQ_CST) == 0) {
+        count(&client->counters.wakeups);
+        event_async_send(&client->async);
+    }
+}
+
+// ---- 对外接口 ----
+
+void client_loop_init_options(st_client_loop_options_t *options) {
+    memset(options, 0, sizeof(*options));
+    options->engine = EVENT_ENGINE_LIBEV;
+    options->tls = true;
+    options->verify = true;
+    options->connections = CLIENT_LOOP_DEFAULT_CONNECTIONS;
+    options->queue_capacity = CLIENT_LOOP_DEFAULT_QUEUE_CAPACITY;
+    options->connect_timeout = CLIENT_LOOP_DEFAULT_CONNECT_TIMEOUT;
+    options->read_timeout = CLIENT_LOOP_DEFAULT_READ_TIMEOUT;
+    options->idle_timeout = CLIENT_LOOP_DEFAULT_IDLE_TIMEOUT;
+    options->hedge_budget = CLIENT_LOOP_DEFAULT_HEDGE_BUDGET;
+    options->cache_max_entry = CLIENT_CACHE_DEFAULT_MAX_ENTRY;
+    options->cache_file_size = CLIENT_CACHE_DEFAULT_FILE_SIZE;
+}
+
+// 解析结果追加到地址表, 只取第一个
+static bool resolve(st_client_loop_t *client, const char *host, int port) {
+    char service[16];
+    struct addrinfo hints = {0}, *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (client->address_count >= CLIENT_MAX_ADDRESSES) {
+        log_error("too many addresses");
+        return false;
+    }
+    if (getaddrinfo(host, service, &hints, &result) != 0) {
+        log_error("resolve %s failed", host);
+        return false;
+    }
+    st_client_address_t *address = &client->addresses[client->address_count++];
+    memcpy(&address->addr, result->ai_addr, result->ai_addrlen);
+    address->length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static bool resolve_list(st_client_loop_t *client, const char *list, int port) {
+    char *copy = strdup(list);
+    if (!copy) {
+        return false;
+    }
+    bool ok = true;
+    char *save = NULL;
+    for (char *host = strtok_r(copy, ", ", &save); host && ok; host = strtok_r(NULL, ", ", &save)) {
+        ok = resolve(client, host, port);
+    }
+    free(copy);
+    return ok && client->address_count > 0;
+}
+
+static bool set_unix_address(st_client_loop_t *client, const char *path) {
+    st_client_address_t *address = &client->addresses[client->address_count++];
+    struct sockaddr_un *addr = (struct sockaddr_un *)&address->addr;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("unix socket path too long: %s", path);
+        return false;
+    }
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, strlen(path) + 1);
+    address->length = sizeof(struct sockaddr_un);
+    return true;
+}
+
+static SSL_CTX *create_ssl_ctx(const st_client_loop_options_t *options) {
+    SSL_CTX *ctx = init_client_ssl();
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (options->verify) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+        const char *ca = options->ca;
+        if (ca ? SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1 : SSL_CTX_set_default_verify_paths(ctx) != 1) {
+            log_error("failed to load CA");
+        }
+    }
+    return ctx;
+}
+
+st_client_loop_t *client_loop_new(const char *host, int port, const st_client_loop_options_t *options) {
+    pthread_once(&settings_once, init_response_settings);
+    if (strlen(host) >= CLIENT_MAX_HOST_LENGTH) {
+        return NULL;
+    }
+    st_client_loop_t *client = calloc(1, sizeof(st_client_loop_t));
+    if (!client) {
+        log_error("malloc");
+        return NULL;
+    }
+    client->options = *options;
+    if (client->options.connections <= 0) {
+        client->options.connections = CLIENT_LOOP_DEFAULT_CONNECTIONS;
+    }
+    if (client->options.queue_capacity == 0) {
+        client->options.queue_capacity = CLIENT_LOOP_DEFAULT_QUEUE_CAPACITY;
+    }
+    snprintf(client->host, sizeof(client->host), "%s", host);
+    bool default_port = port == (options->tls ? 443 : 80);
+    bool ipv6 = strchr(host, ':') != NULL;
+    if (default_port) {
+        snprintf(client->authority, sizeof(client->authority), ipv6 ? "[%s]" : "%s", host);
+    } else {
+        snprintf(client->authority, sizeof(client->authority), ipv6 ? "[%s]:%d" : "%s:%d", host, port);
+    }
+    bool resolved = options->unix_path ? set_unix_address(client, options->unix_path) :
+                    options->addresses ? resolve_list(client, options->addresses, port) : resolve(client, host, port);
+    if (!resolved) {
+        free(client);
+        return NULL;
+    }
+    client->hedging = (options->hedge_delay > 0 || options->hedge_percentile > 0) && options->hedge_budget > 0;
+    if (mpsc_queue_init(&client->queue, client->options.queue_capacity) < 0) {
+        free(client);
+        return NULL;
+    }
+    client->loop = event_loop_new(options->engine, 0);
+    if (!client->loop) {
+        mpsc_queue_destroy(&client->queue);
+        free(client);
+        return NULL;
+    }
+    event_async_init(&client->async, on_submit);
+    client->async.data = client;
+    if (event_async_start(client->loop, &client->async) < 0) {
+        event_loop_destroy(client->loop);
+        mpsc_queue_destroy(&client->queue);
+        free(client);
+        return NULL;
+    }
+    client->ssl_ctx = options->tls ? create_ssl_ctx(options) : NULL;
+    if (options->cache_size > 0 &&
+        !(client->cache = client_cache_new(options->cache_size, options->cache_max_entry, options->cache_file, options->cache_file_size))) {
+        log_error("client %s: response cache disabled", client->authority);
+    }
+    return client;
+}
+
+bool client_loop_start(st_client_loop_t *client) {
+    signal(SIGPIPE, SIG_IGN);
+    if (client->started) {
+        return true;
+    }
+    if (pthread_create(&client->thread, NULL, run_client_loop, client) != 0) {
+        log_error("pthread_create");
+        return false;
+    }
+    client->started = true;
+    return true;
+}
+
+void client_loop_free(st_client_loop_t *client) {
+    if (!client) {
+        return;
+    }
+    __atomic_store_n(&client->stopping, 1, __ATOMIC_RELEASE);
+    if (client->started) {
+        event_async_send(&client->async);
+        pthread_join(client->thread, NULL);
+    }
+    // 线程已退出或从未启动, 在这里结束剩下的请求
+    cancel_all(client);
+    event_async_stop(client->loop, &client->async);
+    event_loop_destroy(client->loop);
+    mpsc_queue_destroy(&client->queue);
+    if (client->ssl_ctx) {
+        cleanup_ssl(client->ssl_ctx);
+    }
+    client_cache_free(client->cache);
+    free(client);
+}
+
+// 流式请求体的长度: 调用者给出的, 或普通文件从当前位置到结尾的大小; 0表示未知
+static uint64_t stream_body_size(const st_client_request_t *request) {
+    struct stat st;
+    if (request->body_size > 0 || request->body_mode != CLIENT_BODY_FD || fstat(request->body_fd, &st) < 0 ||
+        !S_ISREG(st.st_mode)) {
+        return request->body_size;
+    }
+    off_t offset = lseek(request->body_fd, 0, SEEK_CUR);
+    return offset >= 0 && st.st_size > offset ? (uint64_t)(st.st_size - offset) : 0;
+}
+
+static bool valid_body_modes(const st_client_request_t *request) {
+    if ((request->body_mode == CLIENT_BODY_FD && request->body_fd < 0) ||
+        (request->body_mode == CLIENT_BODY_CALLBACK && !request->body_read)) {
+        return false;
+    }
+    return !(request->response_mode == CLIENT_BODY_FD && request->response_fd < 0) &&
+           !(request->response_mode == CLIENT_BODY_CALLBACK && !request->response_write);
+}
+
+static st_client_call_t *call_new(st_client_loop_t *client, const st_client_request_t *request) {
+    static const char *methods[] = {"GET", "POST", "PUT", "DELETE"};
+    if ((unsigned)request->method >= sizeof(methods) / sizeof(methods[0]) || !request->path || !valid_body_modes(request)) {
+        return NULL;
+    }
+    st_client_call_t *call = calloc(1, sizeof(st_client_call_t));
+    if (!call) {
+        return NULL;
+    }
+    bool streaming = request->body_mode != CLIENT_BODY_BUFFER;
+    size_t body_length = streaming ? 0 : request->body_length;
+    char length_header[64] = "";
+    if (streaming) {
+        call->body_left = stream_body_size(request);
+        call->chunked = call->body_left == 0;
+        if (call->chunked) {
+            snprintf(length_header, sizeof(length_header), "Transfer-Encoding: chunked\r\n");
+        } else {
+            snprintf(length_header, sizeof(length_header), "Content-Length: %llu\r\n", (unsigned long long)call->body_left);
+        }
+    } else if (body_length > 0 || request->method == HTTP_METHOD_POST || request->method == HTTP_METHOD_PUT) {
+        snprintf(length_header, sizeof(length_header), "Content-Length: %zu\r\n", body_length);
+    }
+    const char *headers = request->headers ? request->headers : "";
+    size_t head_length = strlen(methods[request->method]) + strlen(request->path) + strlen(client->authority) +
+                         strlen(headers) + strlen(length_header) + 32;
+    char *p = buffer_reserve(&call->request, head_length + body_length);
+    if (!p) {
+        free(call);
+        return NULL;
+    }
+    int length = snprintf(p, head_length, "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n", methods[request->method], request->path,
+                          client->authority, headers, length_header);
+    if (body_length > 0) {
+        memcpy(p + length, request->body, body_length);
+    }
+    buffer_commit(&call->request, length + body_length);
+    call->body_mode = request->body_mode;
+    call->body_fd = request->body_fd;
+    call->body_read = request->body_read;
+    call->body_arg = request->body_arg;
+    call->response_mode = request->response_mode;
+    call->response_fd = request->response_fd;
+    call->response_write = request->response_write;
+    call->response_arg = request->response_arg;
+    // 流式请求体读过就不能重发
+    call->idempotent = request->method != HTTP_METHOD_POST && !streaming;
+    call->path_length = strlen(request->path);
+    call->cacheable = client->cache && request->method == HTTP_METHOD_GET && !streaming && body_length == 0 &&
+                      request->response_mode == CLIENT_BODY_BUFFER &&
+                      client_cache_usable(buffer_data(&call->request), buffer_length(&call->request));
+    call->client = client;
+    if (request->deadline > 0) {
+        call->deadline = monotonic_now() + request->deadline;
+    }
+    event_timer_init(&call->timer, on_call_timer, 0);
+    call->timer.data = call;
+    return call;
+}
+
+static bool submit(st_client_loop_t *client, st_client_call_t *call) {
+    if (__atomic_load_n(&client->stopping, __ATOMIC_ACQUIRE) || !mpsc_queue_push(&client->queue, call)) {
+        count(&client->counters.rejected);
+        return false;
+    }
+    count(&client->counters.submitted);
+    wake(client);
+    return true;
+}
+
+bool client_loop_submit(st_client_loop_t *client, const st_client_request_t *request, client_complete_cb_t cb, void *arg, st_completion_queue_t *queue) {
+    if (!cb) {
+        return false;
+    }
+    st_client_call_t *call = call_new(client, request);
+    if (!call) {
+        return false;
+    }
+    call->mode = queue ? CALL_QUEUE : CALL_CALLBACK;
+    call->cb = cb;
+    call->arg = arg;
+    call->queue = queue;
+    if (!submit(client, call)) {
+        call_free(call);
+        return false;
+    }
+    return true;
+}
+
+st_client_future_t *client_loop_submit_future(st_client_loop_t *client, const st_client_request_t *request) {
+    st_client_future_t *future = calloc(1, sizeof(st_client_future_t));
+    st_client_call_t *call = future ? call_new(client, request) : NULL;
+    if (!call) {
+        free(future);
+        return NULL;
+    }
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    call->mode = CALL_FUTURE;
+    call->future = future;
+    if (!submit(client, call)) {
+        call_free(call);
+        pthread_mutex_destroy(&future->lock);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+        return NULL;
+    }
+    return future;
+}
+
+static void deadline_after(struct timespec *ts, double timeout) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    time_t seconds = (time_t)timeout;
+    ts->tv_sec += seconds;
+    ts->tv_nsec += (long)((timeout - seconds) * 1e9);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+const st_client_response_t *client_future_wait(st_client_future_t *future, double timeout) {
+    struct timespec deadline;
+    if (timeout >= 0) {
+        deadline_after(&deadline, timeout);
+    }
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) {
+        if (timeout < 0) {
+            pthread_cond_wait(&future->cond, &future->lock);
+        } else if (pthread_cond_timedwait(&future->cond, &future->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool done = future->done;
+    pthread_mutex_unlock(&future->lock);
+    return done ? &future->response : NULL;
+}
+
+void client_future_free(st_client_future_t *future) {
+    if (!future) {
+        return;
+    }
+    pthread_mutex_lock(&future->lock);
+    if (!future->done) {
+        // 结果到达时由循环线程释放
+        future->abandoned = true;
+        pthread_mutex_unlock(&future->lock);
+        return;
+    }
+    pthread_mutex_unlock(&future->lock);
+    call_free(future->call);
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->cond);
+    free(future);
+}
+
+bool client_loop_cache_stats(st_client_loop_t *client, st_client_cache_stats_t *stats) {
+    if (!client->cache) {
+        return false;
+    }
+    client_cache_stats(client->cache, stats);
+    return true;
+}
+
+void client_loop_stats(st_client_loop_t *client, st_client_loop_stats_t *stats) {
+    stats->submitted = __atomic_load_n(&client->counters.submitted, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&client->counters.rejected, __ATOMIC_RELAXED);
+    stats->wakeups = __atomic_load_n(&client->counters.wakeups, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&client->counters.completed, __ATOMIC_RELAXED);
+    stats->failed = __atomic_load_n(&client->counters.failed, __ATOMIC_RELAXED);
+    stats->connects = __atomic_load_n(&client->counters.connects, __ATOMIC_RELAXED);
+    stats->hedged = __atomic_load_n(&client->counters.hedged, __ATOMIC_RELAXED);
+    stats->hedge_wins = __atomic_load_n(&client->counters.hedge_wins, __ATOMIC_RELAXED);
+    stats->hedge_denied = __atomic_load_n(&client->counters.hedge_denied, __ATOMIC_RELAXED);
+    stats->deadlines = __atomic_load_n(&client->counters.deadlines, __ATOMIC_RELAXED);
+}
+
+const char *client_error_string(client_error_t error) {
+    switch (error) {
+        case CLIENT_OK:
+            return "ok";
+        case CLIENT_ERROR_CONNECT:
+            return "connect failed";
+        case CLIENT_ERROR_TLS:
+            return "tls handshake failed";
+        case CLIENT_ERROR_IO:
+            return "connection failed";
+        case CLIENT_ERROR_TIMEOUT:
+            return "timed out";
+        case CLIENT_ERROR_PROTOCOL:
+            return "invalid response";
+        case CLIENT_ERROR_CANCELLED:
+            return "cancelled";
+        case CLIENT_ERROR_DEADLINE:
+            return "deadline exceeded";
+        case CLIENT_ERROR_BODY:
+            return "body source or sink failed";
+    }
+    return "unknown error";
+}
+
+// ---- 完成队列 ----
+
+st_completion_queue_t *completion_queue_new(void) {
+    st_completion_queue_t *queue = calloc(1, sizeof(st_completion_queue_t));
+    if (!queue) {
+        return NULL;
+    }
+    queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->fd < 0) {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    return queue;
+}
+
+void completion_queue_free(st_completion_queue_t *queue) {
+    if (!queue) {
+        return;
+    }
+    st_client_call_t *call = queue->head;
+    while (call) {
+        st_client_call_t *next = call->next;
+        call_free(call);
+        call = next;
+    }
+    close(queue->fd);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
+
+int completion_queue_fd(st_completion_queue_t *queue) {
+    return queue->fd;
+}
+
+// 调用时持有锁, 取走最多max个完成; 取空时清除eventfd, 之后的入队会重新置位
+static st_client_call_t *queue_take(st_completion_queue_t *queue, int max) {
+    st_client_call_t *head = queue->head;
+    st_client_call_t *last = NULL;
+    int n = 0;
+    for (st_client_call_t *call = head; call && (max <= 0 || n < max); call = call->next) {
+        last = call;
+        n++;
+    }
+    if (!last) {
+        return NULL;
+    }
+    queue->head = last->next;
+    last->next = NULL;
+    if (!queue->head) {
+        queue->tail = NULL;
+        uint64_t value;
+        if (read(queue->fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            log_error("eventfd read");
+        }
+    }
+    return head;
+}
+
+static int run_completions(st_client_call_t *call) {
+    int n = 0;
+    while (call) {
+        st_client_call_t *next = call->next;
+        st_client_response_t response;
+        call_response(call, &response);
+        call->cb(&response, call->arg);
+        call_free(call);
+        call = next;
+        n++;
+    }
+    return n;
+}
+
+int completion_queue_poll(st_completion_queue_t *queue, int max) {
+    pthread_mutex_lock(&queue->lock);
+    st_client_call_t *calls = queue_take(queue, max);
+    pthread_mutex_unlock(&queue->lock);
+    return run_completions(calls);
+}
+
+int completion_queue_wait(st_completion_queue_t *queue, double timeout, int max) {
+    struct timespec deadline;
+    if (timeout >= 0) {
+        deadline_after(&deadline, timeout);
+    }
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->head) {
+        if (timeout < 0) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        } else if (pthread_cond_timedwait(&queue->cond, &queue->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    st_client_call_t *calls = queue_take(queue, max);
+    pthread_mutex_unlock(&queue->lock);
+    return run_completions(calls);
+}
@@ -0,0 +1,206 @@
+#include "compress.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define COMPRESS_CHUNK 16384
+
+static const char *encoding_names[] = {
+    "identity",
+    "gzip",
+    "deflate"
+};
+
+const char *content_encoding_name(content_encoding_t encoding) {
+    return encoding_names[encoding];
+}
+
+st_compress_pool_t *create_compress_pool(int level) {
+    st_compress_pool_t *pool = calloc(1, sizeof(st_compress_pool_t));
+    if (!pool) {
+        log_error("malloc");
+        return NULL;
+    }
+    pool->level = level;
+    return pool;
+}
+
+void destroy_compress_pool(st_compress_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    for (int i = 0; i < CONTENT_ENCODING_COUNT; i++) {
+        st_compressor_t *compressor = pool->free_list[i];
+        while (compressor) {
+            st_compressor_t *next = compressor->next;
+            deflateEnd(&compressor->stream);
+            free(compressor);
+            compressor = next;
+        }
+    }
+    buffer_free(&pool->scratch);
+    free(pool);
+}
+
+st_compressor_t *compressor_acquire(st_compress_pool_t *pool, content_encoding_t encoding) {
+    st_compressor_t *compressor = pool->free_list[encoding];
+    if (compressor) {
+        pool->free_list[encoding] = compressor->next;
+        pool->free_count[encoding]--;
+        compressor->next = NULL;
+        return compressor;
+    }
+
+    compressor = calloc(1, sizeof(st_compressor_t));
+    if (!compressor) {
+        log_error("malloc");
+        return NULL;
+    }
+    // gzip使用带gzip头的窗口位数, deflate为zlib格式
+    int window_bits = encoding == CONTENT_ENCODING_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&compressor->stream, pool->level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_error("deflateInit2 failed");
+        free(compressor);
+        return NULL;
+    }
+    compressor->encoding = encoding;
+    return compressor;
+}
+
+void compressor_release(st_compress_pool_t *pool, st_compressor_t *compressor) {
+    if (!compressor) {
+        return;
+    }
+    content_encoding_t encoding = compressor->encoding;
+    if (pool->free_count[encoding] >= COMPRESS_POOL_MAX_FREE || deflateReset(&compressor->stream) != Z_OK) {
+        deflateEnd(&compressor->stream);
+        free(compressor);
+        return;
+    }
+    compressor->next = pool->free_list[encoding];
+    pool->free_list[encoding] = compressor;
+    pool->free_count[encoding]++;
+}
+
+int compressor_write(st_compressor_t *compressor, const char *data, size_t length, int flush, compress_sink_t sink, void *ctx) {
+    unsigned char out[COMPRESS_CHUNK];
+    z_stream *stream = &compressor->stream;
+    stream->next_in = (unsigned char *)data;
+    stream->avail_in = (uInt)length;
+
+    for (;;) {
+        stream->next_out = out;
+        stream->avail_out = sizeof(out);
+        int ret = deflate(stream, flush);
+        if (ret == Z_STREAM_ERROR) {
+            log_error("deflate failed");
+            return -1;
+        }
+        size_t produced = sizeof(out) - stream->avail_out;
+        if (produced > 0 && sink(ctx, (const char *)out, produced) != 0) {
+            return -1;
+        }
+        // 输出区未被填满说明输入和待刷新的数据都已处理完
+        if (stream->avail_out != 0 || ret == Z_STREAM_END) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// 解析"gzip;q=0.5"这样的项, 返回q值
+static double parse_coding(const char *token, size_t length, char *name, size_t name_size) {
+    size_t i = 0;
+    while (i < length && isspace((unsigned char)token[i])) {
+        i++;
+    }
+    size_t n = 0;
+    while (i < length && token[i] != ';' && !isspace((unsigned char)token[i])) {
+        if (n + 1 < name_size) {
+            name[n++] = token[i];
+        }
+        i++;
+    }
+    name[n] = '\0';
+
+    const char *q = memchr(token + i, ';', length - i);
+    if (!q) {
+        return 1.0;
+    }
+    q++;
+    while (q < token + length && isspace((unsigned char)*q)) {
+        q++;
+    }
+    if (q + 1 < token + length && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+        return atof(q + 2);
+    }
+    return 1.0;
+}
+
+content_encoding_t negotiate_content_encoding(const char *accept_encoding) {
+    if (!accept_encoding) {
+        return CONTENT_ENCODING_IDENTITY;
+    }
+    // -1表示未出现, 此时才由"*"决定
+    double gzip = -1, deflate = -1, any = 0;
+    const char *p = accept_encoding;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        char name[32];
+        double q = parse_coding(p, length, name, sizeof(name));
+        if (strcasecmp(name, "gzip") == 0 || strcasecmp(name, "x-gzip") == 0) {
+            gzip = q;
+        } else if (strcasecmp(name, "deflate") == 0) {
+            deflate = q;
+        } else if (strcmp(name, "*") == 0) {
+            any = q;
+        }
+        p += length;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if (gzip > 0 && gzip >= deflate) {
+        return CONTENT_ENCODING_GZIP;
+    }
+    if (deflate > 0) {
+        return CONTENT_ENCODING_DEFLATE;
+    }
+    if (any > 0 && gzip < 0) {
+        return CONTENT_ENCODING_GZIP;
+    }
+    if (any > 0 && deflate < 0) {
+        return CONTENT_ENCODING_DEFLATE;
+    }
+    return CONTENT_ENCODING_IDENTITY;
+}
+
+bool compress_type_allowed(const char *types, const char *content_type) {
+    if (!types || !content_type) {
+        return false;
+    }
+    // 忽略"; charset=..."等参数
+    size_t type_length = strcspn(content_type, "; ");
+    const char *p = types;
+    while (*p) {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        size_t length = strcspn(p, ", ");
+        if (length == 0) {
+            break;
+        }
+        if (p[length - 1] == '/') {
+            if (type_length >= length && strncasecmp(content_type, p, length) == 0) {
+                return true;
+            }
+        } else if (type_length == length && strncasecmp(content_type, p, length) == 0) {
+            return true;
+        }
+        p += length;
+    }
+    return false;
+}
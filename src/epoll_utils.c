@@ -3,46 +3,301 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
 int create_epoll_instance(void) {
-    int epoll_fd = epoll_create1(0);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (epoll_fd == -1) {
-        log_error("epoll_create1");
-        exit(EXIT_FAILURE);
+        log_error("epoll_create1: %s", strerror(errno));
+        return -1;
     }
     return epoll_fd;
 }
 
-void add_socket_to_epoll(int epoll_fd, int socket_fd, uint32_t events) {
-    log_debug("%d, %d , %d", epoll_fd,socket_fd, events);
+int add_socket_to_epoll(int epoll_fd, int socket_fd, uint32_t events, void *ptr) {
+    log_debug("%d, %d , %u", epoll_fd, socket_fd, events);
     struct epoll_event ev;
     ev.events = events;
-    ev.data.fd = socket_fd;
+    ev.data.ptr = ptr;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev) == -1) {
-        log_error("epoll_ctl: add_socket");
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+        log_error("epoll_ctl: add_socket %d: %s", socket_fd, strerror(errno));
+        return -1;
     }
+    return 0;
 }
 
-void modify_socket_in_epoll(int epoll_fd, int socket_fd, uint32_t events) {
-    log_debug("%d, %d , %d", epoll_fd,socket_fd, events);
+int modify_socket_in_epoll(int epoll_fd, int socket_fd, uint32_t events, void *ptr) {
+    log_debug("%d, %d , %u", epoll_fd, socket_fd, events);
     struct epoll_event ev;
     ev.events = events;
-    ev.data.fd = socket_fd;
+    ev.data.ptr = ptr;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket_fd, &ev) == -1) {
-        log_error("epoll_ctl: modify_socket");
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+        log_error("epoll_ctl: modify_socket %d: %s", socket_fd, strerror(errno));
+        return -1;
     }
+    return 0;
 }
 
-void remove_socket_from_epoll(int epoll_fd, int socket_fd) {
-    log_debug("%d, %d ", epoll_fd,socket_fd);
+int remove_socket_from_epoll(int epoll_fd, int socket_fd) {
+    log_debug("%d, %d ", epoll_fd, socket_fd);
     if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL) == -1) {
-        log_error("epoll_ctl: remove_socket");
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+        log_error("epoll_ctl: remove_socket %d: %s", socket_fd, strerror(errno));
+        return -1;
     }
-    close(socket_fd);
+    return 0;
+}
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+st_epoll_loop_t *epoll_loop_new(int max_events) {
+    if (max_events <= 0) {
+        max_events = EPOLL_DEFAULT_MAX_EVENTS;
+    }
+    st_epoll_loop_t *loop = calloc(1, sizeof(st_epoll_loop_t));
+    if (!loop) {
+        log_error("malloc");
+        return NULL;
+    }
+    loop->events = calloc(max_events, sizeof(struct epoll_event));
+    if (!loop->events) {
+        log_error("malloc");
+        free(loop);
+        return NULL;
+    }
+    loop->epoll_fd = create_epoll_instance();
+    if (loop->epoll_fd < 0) {
+        free(loop->events);
+        free(loop);
+        return NULL;
+    }
+    loop->max_events = max_events;
+    loop->now = monotonic_now();
+    return loop;
+}
+
+void epoll_loop_destroy(st_epoll_loop_t *loop) {
+    if (!loop) {
+        return;
+    }
+    close(loop->epoll_fd);
+    free(loop->timers);
+    free(loop->events);
+    free(loop);
+}
+
+double epoll_loop_now(st_epoll_loop_t *loop) {
+    return loop->now;
+}
+
+void epoll_loop_break(st_epoll_loop_t *loop) {
+    loop->stop = 1;
+}
+
+int epoll_io_start(st_epoll_loop_t *loop, st_epoll_io_t *w, int fd, uint32_t events) {
+    w->fd = fd;
+    w->events = events;
+    if (add_socket_to_epoll(loop->epoll_fd, fd, events, w) < 0) {
+        return -1;
+    }
+    w->active = 1;
+    return 0;
+}
+
+void epoll_io_stop(st_epoll_loop_t *loop, st_epoll_io_t *w) {
+    if (!w->active) {
+        return;
+    }
+    w->active = 0;
+    remove_socket_from_epoll(loop->epoll_fd, w->fd);
+
+    // 本批次中尚未分发的事件可能仍指向该观察者
+    for (int i = loop->event_index + 1; i < loop->event_count; i++) {
+        if (loop->events[i].data.ptr == w) {
+            loop->events[i].data.ptr = NULL;
+        }
+    }
+}
+
+static void timer_heap_swap(st_epoll_loop_t *loop, int a, int b) {
+    st_epoll_timer_t *t = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = t;
+    loop->timers[a]->heap_index = a;
+    loop->timers[b]->heap_index = b;
+}
+
+static void timer_heap_up(st_epoll_loop_t *loop, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (loop->timers[parent]->at <= loop->timers[i]->at) {
+            break;
+        }
+        timer_heap_swap(loop, i, parent);
+        i = parent;
+    }
+}
+
+static void timer_heap_down(st_epoll_loop_t *loop, int i) {
+    for (;;) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+        if (left < loop->timer_count && loop->timers[left]->at < loop->timers[smallest]->at) {
+            smallest = left;
+        }
+        if (right < loop->timer_count && loop->timers[right]->at < loop->timers[smallest]->at) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        timer_heap_swap(loop, i, smallest);
+        i = smallest;
+    }
+}
+
+void epoll_timer_init(st_epoll_timer_t *t, epoll_timer_cb_t cb) {
+    t->cb = cb;
+    t->at = 0;
+    t->repeat = 0;
+    t->heap_index = -1;
+}
+
+void epoll_timer_start(st_epoll_loop_t *loop, st_epoll_timer_t *t, double after, double repeat) {
+    t->at = loop->now + after;
+    t->repeat = repeat;
+    if (t->heap_index >= 0) {
+        timer_heap_up(loop, t->heap_index);
+        timer_heap_down(loop, t->heap_index);
+        return;
+    }
+    if (loop->timer_count == loop->timer_capacity) {
+        int capacity = loop->timer_capacity ? loop->timer_capacity * 2 : 64;
+        st_epoll_timer_t **timers = realloc(loop->timers, capacity * sizeof(st_epoll_timer_t *));
+        if (!timers) {
+            log_error("malloc");
+            t->heap_index = -1;
+            return;
+        }
+        loop->timers = timers;
+        loop->timer_capacity = capacity;
+    }
+    t->heap_index = loop->timer_count;
+    loop->timers[loop->timer_count++] = t;
+    timer_heap_up(loop, t->heap_index);
+}
+
+void epoll_timer_stop(st_epoll_loop_t *loop, st_epoll_timer_t *t) {
+    int i = t->heap_index;
+    if (i < 0) {
+        return;
+    }
+    loop->timer_count--;
+    if (i != loop->timer_count) {
+        loop->timers[i] = loop->timers[loop->timer_count];
+        loop->timers[i]->heap_index = i;
+        timer_heap_up(loop, i);
+        timer_heap_down(loop, loop->timers[i]->heap_index);
+    }
+    t->heap_index = -1;
+}
+
+void epoll_prepare_start(st_epoll_loop_t *loop, st_epoll_prepare_t *p, epoll_prepare_cb_t cb) {
+    if (p->active) {
+        return;
+    }
+    p->cb = cb;
+    p->next = loop->prepares;
+    loop->prepares = p;
+    p->active = 1;
+}
+
+void epoll_prepare_stop(st_epoll_loop_t *loop, st_epoll_prepare_t *p) {
+    if (!p->active) {
+        return;
+    }
+    for (st_epoll_prepare_t **link = &loop->prepares; *link; link = &(*link)->next) {
+        if (*link == p) {
+            *link = p->next;
+            break;
+        }
+    }
+    p->active = 0;
+}
+
+static void run_prepares(st_epoll_loop_t *loop) {
+    st_epoll_prepare_t *p = loop->prepares;
+    while (p && !loop->stop) {
+        st_epoll_prepare_t *next = p->next;
+        p->cb(loop, p);
+        p = next;
+    }
+}
+
+static int next_timeout_ms(st_epoll_loop_t *loop) {
+    if (loop->timer_count == 0) {
+        return -1;
+    }
+    double delta = loop->timers[0]->at - loop->now;
+    if (delta <= 0) {
+        return 0;
+    }
+    // 向上取整, 避免定时器到期前反复空转
+    return (int)(delta * 1000 + 0.999);
+}
+
+static void run_timers(st_epoll_loop_t *loop) {
+    while (loop->timer_count > 0 && loop->timers[0]->at <= loop->now && !loop->stop) {
+        st_epoll_timer_t *t = loop->timers[0];
+        if (t->repeat > 0) {
+            t->at += t->repeat;
+            if (t->at < loop->now) {
+                t->at = loop->now + t->repeat;
+            }
+            timer_heap_down(loop, 0);
+        } else {
+            epoll_timer_stop(loop, t);
+        }
+        t->cb(loop, t);
+    }
+}
+
+int epoll_loop_run(st_epoll_loop_t *loop) {
+    loop->stop = 0;
+    while (!loop->stop) {
+        // 回调可能启动新的定时器, 先于计算超时执行
+        run_prepares(loop);
+        if (loop->stop) {
+            break;
+        }
+        loop->now = monotonic_now();
+        int n = epoll_wait(loop->epoll_fd, loop->events, loop->max_events, next_timeout_ms(loop));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("epoll_wait: %s", strerror(errno));
+            return -1;
+        }
+        loop->now = monotonic_now();
+
+        loop->event_count = n;
+        for (loop->event_index = 0; loop->event_index < n; loop->event_index++) {
+            st_epoll_io_t *w = loop->events[loop->event_index].data.ptr;
+            if (w && w->active) {
+                w->cb(loop, w, loop->events[loop->event_index].events);
+            }
+        }
+        loop->event_count = 0;
+        loop->event_index = 0;
+
+        run_timers(loop);
+    }
+    return 0;
 }
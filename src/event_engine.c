@@ -0,0 +1,335 @@
+#include "event_engine.h"
+#include "ev_utils.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static const char *engine_names[] = {
+    "libev",
+    "epoll"
+};
+
+const char *event_engine_name(event_engine_t engine) {
+    return engine_names[engine];
+}
+
+int event_engine_from_string(const char *name, event_engine_t *engine) {
+    for (size_t i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++) {
+        if (strcasecmp(name, engine_names[i]) == 0) {
+            *engine = (event_engine_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+st_event_loop_t *event_loop_new(event_engine_t engine, int max_events) {
+    st_event_loop_t *loop = calloc(1, sizeof(st_event_loop_t));
+    if (!loop) {
+        log_error("malloc");
+        return NULL;
+    }
+    loop->engine = engine;
+    if (engine == EVENT_ENGINE_EPOLL) {
+        loop->ep = epoll_loop_new(max_events);
+        if (!loop->ep) {
+            free(loop);
+            return NULL;
+        }
+        loop->ep->data = loop;
+    } else {
+        loop->ev = init_event_loop();
+        ev_set_userdata(loop->ev, loop);
+    }
+    return loop;
+}
+
+void event_loop_destroy(st_event_loop_t *loop) {
+    if (!loop) {
+        return;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_loop_destroy(loop->ep);
+    } else {
+        ev_loop_destroy(loop->ev);
+    }
+    free(loop);
+}
+
+int event_loop_run(st_event_loop_t *loop) {
+    log_debug("engine:%s", event_engine_name(loop->engine));
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        return epoll_loop_run(loop->ep);
+    }
+    ev_run(loop->ev, 0);
+    return 0;
+}
+
+void event_loop_break(st_event_loop_t *loop) {
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_loop_break(loop->ep);
+    } else {
+        stop_event_loop(loop->ev);
+    }
+}
+
+double event_loop_now(st_event_loop_t *loop) {
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        return epoll_loop_now(loop->ep);
+    }
+    return ev_now(loop->ev);
+}
+
+static void ev_io_trampoline(struct ev_loop *ev, struct ev_io *io, int revents) {
+    st_event_io_t *w = (st_event_io_t *)io;
+    w->cb((st_event_loop_t *)ev_userdata(ev), w, revents & (EVENT_READ | EVENT_WRITE));
+}
+
+static void epoll_io_trampoline(st_epoll_loop_t *ep, st_epoll_io_t *io, uint32_t events) {
+    st_event_io_t *w = (st_event_io_t *)io;
+    int revents = 0;
+    // 挂断和错误同时投递给读写两侧, 由回调在IO时发现
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        revents |= EVENT_READ;
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        revents |= EVENT_WRITE;
+    }
+    revents &= w->events;
+    if (revents) {
+        w->cb((st_event_loop_t *)ep->data, w, revents);
+    }
+}
+
+void event_io_init(st_event_io_t *w, event_io_cb_t cb, int fd, int events, int flags) {
+    memset(&w->w, 0, sizeof(w->w));
+    w->cb = cb;
+    w->fd = fd;
+    w->events = events;
+    w->flags = flags;
+    w->active = 0;
+}
+
+int event_io_start(st_event_loop_t *loop, st_event_io_t *w) {
+    if (w->active) {
+        return 0;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        uint32_t events;
+        if (w->flags & EVENT_IO_EXCLUSIVE) {
+            events = EPOLLIN | EPOLLEXCLUSIVE;
+        } else {
+            // 一次性注册全部事件, 之后关注掩码的变化不再需要epoll_ctl
+            events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        }
+        w->w.ep.cb = epoll_io_trampoline;
+        if (epoll_io_start(loop->ep, &w->w.ep, w->fd, events) < 0) {
+            return -1;
+        }
+    } else {
+        ev_io_init(&w->w.ev, ev_io_trampoline, w->fd, w->events);
+        if (w->events) {
+            ev_io_start(loop->ev, &w->w.ev);
+        }
+    }
+    w->active = 1;
+    return 0;
+}
+
+void event_io_set(st_event_loop_t *loop, st_event_io_t *w, int events) {
+    if (w->events == events) {
+        return;
+    }
+    w->events = events;
+    if (!w->active || loop->engine == EVENT_ENGINE_EPOLL) {
+        return;
+    }
+    ev_io_stop(loop->ev, &w->w.ev);
+    ev_io_set(&w->w.ev, w->fd, events);
+    if (events) {
+        ev_io_start(loop->ev, &w->w.ev);
+    }
+}
+
+void event_io_stop(st_event_loop_t *loop, st_event_io_t *w) {
+    if (!w->active) {
+        return;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_io_stop(loop->ep, &w->w.ep);
+    } else {
+        ev_io_stop(loop->ev, &w->w.ev);
+    }
+    w->active = 0;
+}
+
+static void ev_timer_trampoline(struct ev_loop *ev, struct ev_timer *timer, int revents) {
+    st_event_timer_t *t = (st_event_timer_t *)timer;
+    if (!t->repeat) {
+        t->active = 0;
+    }
+    t->cb((st_event_loop_t *)ev_userdata(ev), t);
+}
+
+static void epoll_timer_trampoline(st_epoll_loop_t *ep, st_epoll_timer_t *timer) {
+    st_event_timer_t *t = (st_event_timer_t *)timer;
+    if (!t->repeat) {
+        t->active = 0;
+    }
+    t->cb((st_event_loop_t *)ep->data, t);
+}
+
+void event_timer_init(st_event_timer_t *t, event_timer_cb_t cb, double repeat) {
+    memset(&t->w, 0, sizeof(t->w));
+    t->cb = cb;
+    t->repeat = repeat;
+    t->active = 0;
+}
+
+void event_timer_start(st_event_loop_t *loop, st_event_timer_t *t, double after) {
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        if (!t->active) {
+            epoll_timer_init(&t->w.ep, epoll_timer_trampoline);
+        }
+        epoll_timer_start(loop->ep, &t->w.ep, after, t->repeat);
+    } else {
+        if (t->active) {
+            ev_timer_stop(loop->ev, &t->w.ev);
+        }
+        ev_timer_init(&t->w.ev, ev_timer_trampoline, after, t->repeat);
+        ev_timer_start(loop->ev, &t->w.ev);
+    }
+    t->active = 1;
+}
+
+void event_timer_stop(st_event_loop_t *loop, st_event_timer_t *t) {
+    if (!t->active) {
+        return;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_timer_stop(loop->ep, &t->w.ep);
+    } else {
+        ev_timer_stop(loop->ev, &t->w.ev);
+    }
+    t->active = 0;
+}
+
+static void ev_async_trampoline(struct ev_loop *ev, struct ev_async *async, int revents) {
+    st_event_async_t *a = (st_event_async_t *)async;
+    a->cb((st_event_loop_t *)ev_userdata(ev), a);
+}
+
+static void epoll_async_trampoline(st_epoll_loop_t *ep, st_epoll_io_t *io, uint32_t events) {
+    st_event_async_t *a = (st_event_async_t *)io;
+    uint64_t count;
+    // 先清除标记再读, 回调期间的发送会再次写eventfd
+    __atomic_store_n(&a->pending, 0, __ATOMIC_SEQ_CST);
+    while (read(a->fd, &count, sizeof(count)) > 0) {
+    }
+    a->cb((st_event_loop_t *)ep->data, a);
+}
+
+void event_async_init(st_event_async_t *a, event_async_cb_t cb) {
+    memset(&a->w, 0, sizeof(a->w));
+    a->cb = cb;
+    a->loop = NULL;
+    a->fd = -1;
+    a->pending = 0;
+    a->active = 0;
+}
+
+int event_async_start(st_event_loop_t *loop, st_event_async_t *a) {
+    if (a->active) {
+        return 0;
+    }
+    a->loop = loop;
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        a->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (a->fd < 0) {
+            log_error("eventfd");
+            return -1;
+        }
+        a->w.ep.cb = epoll_async_trampoline;
+        if (epoll_io_start(loop->ep, &a->w.ep, a->fd, EPOLLIN | EPOLLET) < 0) {
+            close(a->fd);
+            a->fd = -1;
+            return -1;
+        }
+    } else {
+        ev_async_init(&a->w.ev, ev_async_trampoline);
+        ev_async_start(loop->ev, &a->w.ev);
+    }
+    a->active = 1;
+    return 0;
+}
+
+void event_async_send(st_event_async_t *a) {
+    if (a->loop->engine == EVENT_ENGINE_EPOLL) {
+        if (__atomic_exchange_n(&a->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            uint64_t one = 1;
+            if (write(a->fd, &one, sizeof(one)) < 0) {
+                log_error("eventfd write");
+            }
+        }
+    } else {
+        ev_async_send(a->loop->ev, &a->w.ev);
+    }
+}
+
+void event_async_stop(st_event_loop_t *loop, st_event_async_t *a) {
+    if (!a->active) {
+        return;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_io_stop(loop->ep, &a->w.ep);
+        close(a->fd);
+        a->fd = -1;
+    } else {
+        ev_async_stop(loop->ev, &a->w.ev);
+    }
+    a->active = 0;
+}
+
+static void ev_prepare_trampoline(struct ev_loop *ev, struct ev_prepare *prepare, int revents) {
+    st_event_prepare_t *p = (st_event_prepare_t *)prepare;
+    p->cb((st_event_loop_t *)ev_userdata(ev), p);
+}
+
+static void epoll_prepare_trampoline(st_epoll_loop_t *ep, st_epoll_prepare_t *prepare) {
+    st_event_prepare_t *p = (st_event_prepare_t *)prepare;
+    p->cb((st_event_loop_t *)ep->data, p);
+}
+
+void event_prepare_init(st_event_prepare_t *p, event_prepare_cb_t cb) {
+    memset(&p->w, 0, sizeof(p->w));
+    p->cb = cb;
+    p->active = 0;
+}
+
+void event_prepare_start(st_event_loop_t *loop, st_event_prepare_t *p) {
+    if (p->active) {
+        return;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_prepare_start(loop->ep, &p->w.ep, epoll_prepare_trampoline);
+    } else {
+        ev_prepare_init(&p->w.ev, ev_prepare_trampoline);
+        ev_prepare_start(loop->ev, &p->w.ev);
+    }
+    p->active = 1;
+}
+
+void event_prepare_stop(st_event_loop_t *loop, st_event_prepare_t *p) {
+    if (!p->active) {
+        return;
+    }
+    if (loop->engine == EVENT_ENGINE_EPOLL) {
+        epoll_prepare_stop(loop->ep, &p->w.ep);
+    } else {
+        ev_prepare_stop(loop->ev, &p->w.ev);
+    }
+    p->active = 0;
+}
@@ -0,0 +1,554 @@
+#include "hpack.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_COUNT 61
+#define HPACK_MAX_NAME_LENGTH 256
+
+typedef struct {
+    const char *name;
+    const char *value;
+} st_hpack_static_t;
+
+static const st_hpack_static_t static_table[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+};
+
+typedef struct {
+    uint32_t code;
+    uint8_t length;
+} st_huffman_code_t;
+
+// RFC 7541 附录B, 最后一项为EOS
+static const st_huffman_code_t huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30}
+};
+
+// 规范Huffman码: 同一码长的符号按顺序连续编码, 解码时只需每个码长的首码和符号表
+static uint32_t huffman_first_code[31];
+static uint16_t huffman_first_index[31];
+static uint16_t huffman_count[31];
+static uint16_t huffman_symbols[257];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void) {
+    int k = 0;
+    for (int length = 1; length <= 30; length++) {
+        huffman_first_index[length] = k;
+        for (int sym = 0; sym < 257; sym++) {
+            if (huffman_codes[sym].length != length) {
+                continue;
+            }
+            if (huffman_count[length] == 0) {
+                huffman_first_code[length] = huffman_codes[sym].code;
+            }
+            huffman_count[length]++;
+            huffman_symbols[k++] = sym;
+        }
+    }
+}
+
+static int huffman_decode(const uint8_t *data, size_t length, st_buffer_t *out) {
+    char buf[256];
+    size_t n = 0;
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((data[i] >> b) & 1);
+            bits++;
+            if (huffman_count[bits] && code >= huffman_first_code[bits] &&
+                code - huffman_first_code[bits] < huffman_count[bits]) {
+                int sym = huffman_symbols[huffman_first_index[bits] + code - huffman_first_code[bits]];
+                if (sym == 256) {
+                    return -1;
+                }
+                buf[n++] = (char)sym;
+                if (n == sizeof(buf)) {
+                    if (buffer_append(out, buf, n) < 0) {
+                        return -1;
+                    }
+                    n = 0;
+                }
+                code = 0;
+                bits = 0;
+            } else if (bits >= 30) {
+                return -1;
+            }
+        }
+    }
+    // 填充位必须是EOS的前缀(全1)且不超过7位
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+    return n > 0 ? buffer_append(out, buf, n) : 0;
+}
+
+static size_t huffman_length(const char *data, size_t length) {
+    size_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits += huffman_codes[(uint8_t)data[i]].length;
+    }
+    return (bits + 7) / 8;
+}
+
+static int huffman_encode(const char *data, size_t length, st_buffer_t *out) {
+    uint8_t buf[256];
+    size_t n = 0;
+    uint64_t bits = 0;
+    int pending = 0;
+    for (size_t i = 0; i < length; i++) {
+        const st_huffman_code_t *code = &huffman_codes[(uint8_t)data[i]];
+        bits = (bits << code->length) | code->code;
+        pending += code->length;
+        while (pending >= 8) {
+            pending -= 8;
+            buf[n++] = (uint8_t)(bits >> pending);
+            if (n == sizeof(buf)) {
+                if (buffer_append(out, buf, n) < 0) {
+                    return -1;
+                }
+                n = 0;
+            }
+        }
+    }
+    if (pending > 0) {
+        buf[n++] = (uint8_t)((bits << (8 - pending)) | (0xff >> pending));
+    }
+    return n > 0 ? buffer_append(out, buf, n) : 0;
+}
+
+static int decode_integer(const uint8_t **p, const uint8_t *end, int prefix, uint32_t *value) {
+    if (*p >= end) {
+        return -1;
+    }
+    uint32_t mask = (1u << prefix) - 1;
+    uint32_t v = *(*p)++ & mask;
+    if (v < mask) {
+        *value = v;
+        return 0;
+    }
+    for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+        uint8_t b = *(*p)++;
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int encode_integer(st_buffer_t *out, uint8_t first, int prefix, size_t value) {
+    uint8_t buf[16];
+    size_t n = 0;
+    size_t mask = (1u << prefix) - 1;
+    if (value < mask) {
+        buf[n++] = first | (uint8_t)value;
+    } else {
+        buf[n++] = first | (uint8_t)mask;
+        value -= mask;
+        while (value >= 128) {
+            buf[n++] = (uint8_t)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        buf[n++] = (uint8_t)value;
+    }
+    return buffer_append(out, buf, n);
+}
+
+void hpack_table_init(st_hpack_table_t *table, size_t max_size) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = max_size;
+    table->limit = max_size;
+    pthread_once(&huffman_once, huffman_init);
+}
+
+static st_hpack_entry_t *table_get(st_hpack_table_t *table, size_t index) {
+    return &table->entries[(table->head + index) % table->capacity];
+}
+
+static void table_evict(st_hpack_table_t *table, size_t max_size) {
+    while (table->count > 0 && table->size > max_size) {
+        st_hpack_entry_t *entry = table_get(table, table->count - 1);
+        table->size -= entry->name_length + entry->value_length + HPACK_ENTRY_OVERHEAD;
+        free(entry->name);
+        entry->name = NULL;
+        table->count--;
+    }
+}
+
+void hpack_table_free(st_hpack_table_t *table) {
+    table_evict(table, 0);
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+}
+
+void hpack_table_set_limit(st_hpack_table_t *table, size_t limit) {
+    size_t max_size = limit < HPACK_DEFAULT_TABLE_SIZE ? limit : HPACK_DEFAULT_TABLE_SIZE;
+    table->limit = limit;
+    if (max_size != table->max_size) {
+        table->max_size = max_size;
+        table_evict(table, max_size);
+        table->size_update_pending = true;
+    }
+}
+
+static int table_add(st_hpack_table_t *table, const char *name, size_t name_length, const char *value, size_t value_length) {
+    size_t size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+    if (size > table->max_size) {
+        // 放不下的条目使表被清空, 这不是错误
+        table_evict(table, 0);
+        return 0;
+    }
+    table_evict(table, table->max_size - size);
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        st_hpack_entry_t *entries = malloc(capacity * sizeof(st_hpack_entry_t));
+        if (!entries) {
+            log_error("malloc");
+            return -1;
+        }
+        for (size_t i = 0; i < table->count; i++) {
+            entries[i] = *table_get(table, i);
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        table->head = 0;
+    }
+
+    char *data = malloc(name_length + value_length + 2);
+    if (!data) {
+        log_error("malloc");
+        return -1;
+    }
+    memcpy(data, name, name_length);
+    data[name_length] = '\0';
+    memcpy(data + name_length + 1, value, value_length);
+    data[name_length + 1 + value_length] = '\0';
+
+    table->head = (table->head + table->capacity - 1) % table->capacity;
+    st_hpack_entry_t *entry = &table->entries[table->head];
+    entry->name = data;
+    entry->name_length = name_length;
+    entry->value = data + name_length + 1;
+    entry->value_length = value_length;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+// 索引从1开始, 先静态表后动态表
+static int table_lookup(st_hpack_table_t *table, uint32_t index, const char **name, size_t *name_length, const char **value, size_t *value_length) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        const st_hpack_static_t *entry = &static_table[index - 1];
+        *name = entry->name;
+        *name_length = strlen(entry->name);
+        *value = entry->value;
+        *value_length = strlen(entry->value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= table->count) {
+        return -1;
+    }
+    st_hpack_entry_t *entry = table_get(table, index);
+    *name = entry->name;
+    *name_length = entry->name_length;
+    *value = entry->value;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+// 字符串统一解码到scratch, 返回其偏移
+static int decode_string(const uint8_t **p, const uint8_t *end, st_buffer_t *scratch, size_t *offset, size_t *length) {
+    if (*p >= end) {
+        return -1;
+    }
+    bool huffman = **p & 0x80;
+    uint32_t n;
+    if (decode_integer(p, end, 7, &n) < 0 || n > (size_t)(end - *p)) {
+        return -1;
+    }
+    *offset = buffer_length(scratch);
+    int ret = huffman ? huffman_decode(*p, n, scratch) : buffer_append(scratch, *p, n);
+    if (ret < 0) {
+        return -1;
+    }
+    *p += n;
+    *length = buffer_length(scratch) - *offset;
+    return 0;
+}
+
+int hpack_decode(st_hpack_table_t *table, const uint8_t *data, size_t length, hpack_header_cb_t cb, void *ctx) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + length;
+    st_buffer_t scratch = {0};
+    int ret = -1;
+
+    while (p < end) {
+        uint8_t first = *p;
+        const char *name, *value;
+        size_t name_length, value_length;
+        uint32_t index;
+
+        if (first & 0x80) {
+            // 索引头部
+            if (decode_integer(&p, end, 7, &index) < 0 ||
+                table_lookup(table, index, &name, &name_length, &value, &value_length) < 0) {
+                goto done;
+            }
+            if (cb(ctx, name, name_length, value, value_length) < 0) {
+                goto done;
+            }
+            continue;
+        }
+        if ((first & 0xe0) == 0x20) {
+            // 动态表大小更新
+            if (decode_integer(&p, end, 5, &index) < 0 || index > table->limit) {
+                goto done;
+            }
+            table->max_size = index;
+            table_evict(table, index);
+            continue;
+        }
+
+        // 字面值: 01为加入动态表, 0000为不加入, 0001为永不加入
+        bool indexing = (first & 0xc0) == 0x40;
+        if (decode_integer(&p, end, indexing ? 6 : 4, &index) < 0) {
+            goto done;
+        }
+        buffer_reset(&scratch);
+        size_t name_offset = 0, value_offset;
+        if (index == 0) {
+            if (decode_string(&p, end, &scratch, &name_offset, &name_length) < 0) {
+                goto done;
+            }
+        } else if (table_lookup(table, index, &name, &name_length, &value, &value_length) < 0 ||
+                   buffer_append(&scratch, name, name_length) < 0) {
+            goto done;
+        }
+        if (decode_string(&p, end, &scratch, &value_offset, &value_length) < 0) {
+            goto done;
+        }
+        name = buffer_data(&scratch) + name_offset;
+        value = buffer_data(&scratch) + value_offset;
+        if (indexing && table_add(table, name, name_length, value, value_length) < 0) {
+            goto done;
+        }
+        if (cb(ctx, name, name_length, value, value_length) < 0) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    buffer_free(&scratch);
+    return ret;
+}
+
+static int encode_string(st_buffer_t *out, const char *data, size_t length) {
+    size_t encoded = huffman_length(data, length);
+    if (encoded < length) {
+        if (encode_integer(out, 0x80, 7, encoded) < 0) {
+            return -1;
+        }
+        return huffman_encode(data, length, out);
+    }
+    if (encode_integer(out, 0, 7, length) < 0) {
+        return -1;
+    }
+    return buffer_append(out, data, length);
+}
+
+int hpack_encode(st_hpack_table_t *table, st_buffer_t *out, const char *name, const char *value, size_t value_length, bool indexing) {
+    char lower[HPACK_MAX_NAME_LENGTH];
+    size_t name_length = strlen(name);
+    if (name_length > sizeof(lower)) {
+        log_error("header name too long");
+        return -1;
+    }
+    for (size_t i = 0; i < name_length; i++) {
+        lower[i] = tolower((unsigned char)name[i]);
+    }
+
+    // 头部块的开头通告动态表大小的变化
+    if (table->size_update_pending) {
+        if (encode_integer(out, 0x20, 5, table->max_size) < 0) {
+            return -1;
+        }
+        table->size_update_pending = false;
+    }
+
+    uint32_t name_index = 0;
+    for (int i = 0; i < HPACK_STATIC_COUNT; i++) {
+        const st_hpack_static_t *entry = &static_table[i];
+        if (strlen(entry->name) != name_length || memcmp(entry->name, lower, name_length) != 0) {
+            continue;
+        }
+        if (strlen(entry->value) == value_length && memcmp(entry->value, value, value_length) == 0) {
+            return encode_integer(out, 0x80, 7, i + 1);
+        }
+        if (!name_index) {
+            name_index = i + 1;
+        }
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        st_hpack_entry_t *entry = table_get(table, i);
+        if (entry->name_length != name_length || memcmp(entry->name, lower, name_length) != 0) {
+            continue;
+        }
+        if (entry->value_length == value_length && memcmp(entry->value, value, value_length) == 0) {
+            return encode_integer(out, 0x80, 7, HPACK_STATIC_COUNT + 1 + i);
+        }
+        if (!name_index) {
+            name_index = HPACK_STATIC_COUNT + 1 + i;
+        }
+    }
+
+    if (encode_integer(out, indexing ? 0x40 : 0x00, indexing ? 6 : 4, name_index) < 0) {
+        return -1;
+    }
+    if (!name_index && encode_string(out, lower, name_length) < 0) {
+        return -1;
+    }
+    if (encode_string(out, value, value_length) < 0) {
+        return -1;
+    }
+    return indexing ? table_add(table, lower, name_length, value, value_length) : 0;
+}
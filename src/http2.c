@@ -0,0 +1,1047 @@
+#include "http2.h"
+#include "https_server.h"
+#include "request.h"
+#include "capture.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_STREAM_ID 0x7fffffff
+#define H2_MAX_FRAME_SIZE 16777215
+#define H2_OUTPUT_HIGH_WATERMARK (64 * 1024)
+#define H2_WEIGHT_QUANTUM 1024     // 权重为16时每轮约一个DATA帧
+
+enum {
+    H2_FRAME_DATA = 0,
+    H2_FRAME_HEADERS = 1,
+    H2_FRAME_PRIORITY = 2,
+    H2_FRAME_RST_STREAM = 3,
+    H2_FRAME_SETTINGS = 4,
+    H2_FRAME_PUSH_PROMISE = 5,
+    H2_FRAME_PING = 6,
+    H2_FRAME_GOAWAY = 7,
+    H2_FRAME_WINDOW_UPDATE = 8,
+    H2_FRAME_CONTINUATION = 9
+};
+
+enum {
+    H2_FLAG_END_STREAM = 0x01,
+    H2_FLAG_ACK = 0x01,
+    H2_FLAG_END_HEADERS = 0x04,
+    H2_FLAG_PADDED = 0x08,
+    H2_FLAG_PRIORITY = 0x20
+};
+
+enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH = 2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 6
+};
+
+static void session_write(st_h2_session_t *session);
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int append_frame(st_h2_session_t *session, uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t length) {
+    uint8_t header[H2_FRAME_HEADER_SIZE];
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, stream_id & 0x7fffffff);
+    if (buffer_append(&session->out, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    return length > 0 ? buffer_append(&session->out, payload, length) : 0;
+}
+
+static int send_rst_stream(st_h2_session_t *session, uint32_t stream_id, uint32_t code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    return append_frame(session, H2_FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static int send_window_update(st_h2_session_t *session, uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    return append_frame(session, H2_FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void append_goaway(st_h2_session_t *session, uint32_t last_stream_id, uint32_t code) {
+    uint8_t payload[8];
+    put32(payload, last_stream_id);
+    put32(payload + 4, code);
+    append_frame(session, H2_FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+// 连接错误: 发送GOAWAY, 由调用者关闭连接
+static int connection_error(st_h2_session_t *session, uint32_t code, const char *reason) {
+    log_error("http2 connection error %u: %s", code, reason);
+    append_goaway(session, session->last_stream_id, code);
+    return -1;
+}
+
+static st_h2_stream_t *find_stream(st_h2_session_t *session, uint32_t id) {
+    for (int i = 0; i < session->stream_count; i++) {
+        st_h2_stream_t *stream = session->streams[i];
+        if (stream->id == id && !stream->finished) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static st_h2_stream_t *create_stream(st_h2_session_t *session, uint32_t id) {
+    if (session->stream_count == session->stream_capacity) {
+        int capacity = session->stream_capacity ? session->stream_capacity * 2 : 16;
+        st_h2_stream_t **streams = realloc(session->streams, capacity * sizeof(st_h2_stream_t *));
+        if (!streams) {
+            log_error("malloc");
+            return NULL;
+        }
+        session->streams = streams;
+        session->stream_capacity = capacity;
+    }
+
+    st_h2_stream_t *stream = calloc(1, sizeof(st_h2_stream_t));
+    struct st_client *client = calloc(1, sizeof(struct st_client));
+    if (!stream || !client) {
+        log_error("malloc");
+        free(stream);
+        free(client);
+        return NULL;
+    }
+    struct st_client *conn = session->conn;
+    client->client_fd = conn->client_fd;
+    client->worker = conn->worker;
+    client->callbacks = conn->callbacks;
+    client->state = CLIENT_STATE_ACTIVE;
+    client->keep_alive = true;
+    client->h2_stream = stream;
+
+    stream->id = id;
+    stream->session = session;
+    stream->client = client;
+    stream->weight = H2_DEFAULT_WEIGHT;
+    stream->send_window = session->peer_initial_window;
+    stream->recv_window = H2_STREAM_WINDOW;
+
+    session->streams[session->stream_count++] = stream;
+    session->active_count++;
+    return stream;
+}
+
+static void free_stream(st_h2_stream_t *stream) {
+    struct st_client *client = stream->client;
+    compressor_release(client->worker->compress_pool, client->compressor);
+    buffer_free(&client->extra_headers);
+    capture_discard(client->capture);
+    client->capture = NULL;
+    // 处理器还在线程池中运行时, 流的连接结构由它返回后释放
+    if (!offload_release(client)) {
+        request_free(&client->request);
+        free(client);
+    }
+    buffer_free(&stream->pending);
+    buffer_free(&stream->in);
+    free(stream);
+}
+
+// 关闭流, 实际释放推迟到h2_session_collect
+static void finish_stream(st_h2_stream_t *stream, bool reset) {
+    st_h2_session_t *session = stream->session;
+    if (stream->finished) {
+        return;
+    }
+    stream->finished = true;
+    session->active_count--;
+    buffer_free(&stream->pending);
+    buffer_free(&stream->in);
+
+    // 子节点改为依赖本流的父节点
+    for (int i = 0; i < session->stream_count; i++) {
+        if (session->streams[i]->dependency == stream->id) {
+            session->streams[i]->dependency = stream->dependency;
+        }
+    }
+
+    struct st_client *client = stream->client;
+    if (reset && stream->started && client->response_state != RESPONSE_STATE_DONE &&
+        client->callbacks && client->callbacks->on_disconnected) {
+        client->callbacks->on_disconnected(client);
+    }
+
+    session->garbage = true;
+    if (!session->conn->dispatching) {
+        event_timer_start(session->conn->worker->loop, &session->conn->timer, 0);
+    }
+}
+
+// 本端发送END_STREAM后请求体还没收完, 用RST_STREAM(NO_ERROR)让对端停止发送
+static void stream_local_closed(st_h2_stream_t *stream) {
+    stream->local_closed = true;
+    if (!stream->remote_closed) {
+        send_rst_stream(stream->session, stream->id, H2_NO_ERROR);
+        stream->remote_closed = true;
+    }
+    finish_stream(stream, false);
+}
+
+static void stream_reset(st_h2_stream_t *stream, uint32_t code) {
+    send_rst_stream(stream->session, stream->id, code);
+    finish_stream(stream, true);
+}
+
+// 通告处理器已消费的接收窗口
+static void stream_ack(st_h2_stream_t *stream) {
+    if (stream->finished || stream->remote_closed || stream->recv_consumed < H2_STREAM_WINDOW / 2) {
+        return;
+    }
+    send_window_update(stream->session, stream->id, stream->recv_consumed);
+    stream->recv_window += stream->recv_consumed;
+    stream->recv_consumed = 0;
+}
+
+// 交付缓存的请求体, 收完后调用on_body_end
+static void stream_deliver(st_h2_stream_t *stream) {
+    struct st_client *client = stream->client;
+    while (!stream->paused && !stream->finished && buffer_length(&stream->in) > 0) {
+        size_t length = buffer_length(&stream->in);
+        if (client->capture) {
+            capture_body(client->capture, buffer_data(&stream->in), length);
+        }
+        if (!client->shed && client->callbacks && client->callbacks->on_data_received) {
+            client->callbacks->on_data_received(client, buffer_data(&stream->in), length);
+        }
+        buffer_consume(&stream->in, length);
+        stream->recv_consumed += length;
+    }
+    if (stream->paused || stream->finished || buffer_length(&stream->in) > 0) {
+        return;
+    }
+    if (stream->remote_closed && !stream->body_ended) {
+        stream->body_ended = true;
+        if (client->capture) {
+            capture_end(client->worker->params->capture, client->capture);
+            client->capture = NULL;
+        }
+        if (!client->shed && client->callbacks && client->callbacks->on_body_end) {
+            client->callbacks->on_body_end(client);
+        }
+    }
+}
+
+typedef struct {
+    st_h2_stream_t *stream;
+    bool malformed;
+    bool regular_seen;
+    bool has_method;
+    bool has_path;
+} st_header_context_t;
+
+// 头部块必须完整解码以保持HPACK状态, 所以出错时只做标记
+static int on_request_header(void *ctx, const char *name, size_t name_length, const char *value, size_t value_length) {
+    st_header_context_t *hc = (st_header_context_t *)ctx;
+    struct st_client *client = hc->stream->client;
+    st_request_t *request = &client->request;
+    if (hc->malformed) {
+        return 0;
+    }
+    if (name_length > 0 && name[0] == ':') {
+        if (hc->regular_seen) {
+            hc->malformed = true;
+        } else if (name_length == 7 && memcmp(name, ":method", 7) == 0) {
+            int method = request_method_from_string(value, value_length);
+            hc->malformed = method < 0;
+            client->parser.method = method;
+            hc->has_method = true;
+        } else if (name_length == 5 && memcmp(name, ":path", 5) == 0) {
+            hc->malformed = value_length == 0 || request_set_url(request, value, value_length) < 0;
+            hc->has_path = true;
+        } else if (name_length == 10 && memcmp(name, ":authority", 10) == 0) {
+            hc->malformed = request_add_header(request, "host", 4, value, value_length) < 0;
+        } else if (name_length != 7 || memcmp(name, ":scheme", 7) != 0) {
+            hc->malformed = true;
+        }
+        return 0;
+    }
+    hc->regular_seen = true;
+    for (size_t i = 0; i < name_length; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            hc->malformed = true;
+            return 0;
+        }
+    }
+    hc->malformed = request_add_header(request, name, name_length, value, value_length) < 0;
+    return 0;
+}
+
+static int on_ignored_header(void *ctx, const char *name, size_t name_length, const char *value, size_t value_length) {
+    return 0;
+}
+
+static bool is_descendant(st_h2_session_t *session, uint32_t id, uint32_t ancestor) {
+    for (int depth = 0; id && depth <= session->stream_count; depth++) {
+        st_h2_stream_t *stream = find_stream(session, id);
+        if (!stream) {
+            return false;
+        }
+        if (stream->dependency == ancestor) {
+            return true;
+        }
+        id = stream->dependency;
+    }
+    return false;
+}
+
+static void set_priority(st_h2_session_t *session, st_h2_stream_t *stream, uint32_t dependency, int weight, bool exclusive) {
+    if (dependency && !find_stream(session, dependency)) {
+        // 依赖不在树中时使用默认优先级
+        dependency = 0;
+        weight = H2_DEFAULT_WEIGHT;
+        exclusive = false;
+    }
+    if (dependency && is_descendant(session, dependency, stream->id)) {
+        find_stream(session, dependency)->dependency = stream->dependency;
+    }
+    if (exclusive) {
+        for (int i = 0; i < session->stream_count; i++) {
+            st_h2_stream_t *other = session->streams[i];
+            if (other != stream && other->dependency == dependency) {
+                other->dependency = stream->id;
+            }
+        }
+    }
+    stream->dependency = dependency;
+    stream->weight = weight;
+}
+
+static int parse_priority(const uint8_t *p, uint32_t *dependency, int *weight, bool *exclusive) {
+    uint32_t value = get32(p);
+    *exclusive = value >> 31;
+    *dependency = value & 0x7fffffff;
+    *weight = p[4] + 1;
+    return 0;
+}
+
+static int process_header_block(st_h2_session_t *session, uint32_t id, uint8_t flags, const uint8_t *block, size_t length) {
+    st_h2_stream_t *stream = find_stream(session, id);
+    if (stream || id <= session->last_stream_id || session->goaway_received || session->goaway_sent ||
+        session->active_count >= H2_MAX_CONCURRENT_STREAMS) {
+        if (hpack_decode(&session->decoder, block, length, on_ignored_header, NULL) < 0) {
+            return connection_error(session, H2_COMPRESSION_ERROR, "hpack decode failed");
+        }
+        if (stream) {
+            // 尾部头部, 必须结束流
+            if (!(flags & H2_FLAG_END_STREAM)) {
+                stream_reset(stream, H2_PROTOCOL_ERROR);
+                return 0;
+            }
+            stream->remote_closed = true;
+            stream_deliver(stream);
+        } else if (id <= session->last_stream_id) {
+            send_rst_stream(session, id, H2_STREAM_CLOSED);
+        } else if (!session->goaway_received) {
+            session->last_stream_id = id;
+            send_rst_stream(session, id, H2_REFUSED_STREAM);
+        }
+        return 0;
+    }
+
+    session->last_stream_id = id;
+    stream = create_stream(session, id);
+    if (!stream) {
+        if (hpack_decode(&session->decoder, block, length, on_ignored_header, NULL) < 0) {
+            return connection_error(session, H2_COMPRESSION_ERROR, "hpack decode failed");
+        }
+        send_rst_stream(session, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    if (session->header_flags & H2_FLAG_PRIORITY) {
+        set_priority(session, stream, session->header_dependency, session->header_weight, session->header_exclusive);
+    }
+
+    st_header_context_t hc = {stream, false, false, false, false};
+    if (hpack_decode(&session->decoder, block, length, on_request_header, &hc) < 0) {
+        return connection_error(session, H2_COMPRESSION_ERROR, "hpack decode failed");
+    }
+    if (hc.malformed || !hc.has_method || !hc.has_path) {
+        stream_reset(stream, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    log_debug("stream:%u,method:%s,url:%s", id, get_request_method(stream->client), get_request_url(stream->client));
+    struct st_client *client = stream->client;
+    stream->started = true;
+    stream->remote_closed = flags & H2_FLAG_END_STREAM;
+    if (client->worker->params->capture) {
+        client->capture = capture_begin(client->worker->params->capture, true, get_request_method(client), &client->request);
+    }
+    if (!shed_request(client) && client->callbacks && client->callbacks->on_body_start) {
+        client->callbacks->on_body_start(client);
+    }
+    stream_deliver(stream);
+    return 0;
+}
+
+static int on_headers_frame(st_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (id == 0 || !(id & 1)) {
+        return connection_error(session, H2_PROTOCOL_ERROR, "invalid stream id");
+    }
+    if (flags & H2_FLAG_PADDED) {
+        if (length < 1 || p[0] >= length) {
+            return connection_error(session, H2_PROTOCOL_ERROR, "invalid padding");
+        }
+        length -= 1 + p[0];
+        p++;
+    }
+    session->header_flags = flags;
+    if (flags & H2_FLAG_PRIORITY) {
+        if (length < 5) {
+            return connection_error(session, H2_PROTOCOL_ERROR, "invalid priority");
+        }
+        parse_priority(p, &session->header_dependency, &session->header_weight, &session->header_exclusive);
+        if (session->header_dependency == id) {
+            session->header_flags &= ~H2_FLAG_PRIORITY;
+        }
+        p += 5;
+        length -= 5;
+    }
+    if (flags & H2_FLAG_END_HEADERS) {
+        return process_header_block(session, id, flags, p, length);
+    }
+    session->header_stream = id;
+    buffer_reset(&session->header_block);
+    return buffer_append(&session->header_block, p, length) < 0 ? connection_error(session, H2_INTERNAL_ERROR, "malloc") : 0;
+}
+
+static int on_continuation_frame(st_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (id != session->header_stream) {
+        return connection_error(session, H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+    }
+    if (buffer_length(&session->header_block) + length > MAX_REQUEST_HEAD_SIZE) {
+        return connection_error(session, H2_ENHANCE_YOUR_CALM, "header block too large");
+    }
+    if (buffer_append(&session->header_block, p, length) < 0) {
+        return connection_error(session, H2_INTERNAL_ERROR, "malloc");
+    }
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        return 0;
+    }
+    session->header_stream = 0;
+    return process_header_block(session, id, session->header_flags, (const uint8_t *)buffer_data(&session->header_block), buffer_length(&session->header_block));
+}
+
+static int on_data_frame(st_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (id == 0) {
+        return connection_error(session, H2_PROTOCOL_ERROR, "DATA on stream 0");
+    }
+    size_t frame_length = length;
+    if (flags & H2_FLAG_PADDED) {
+        if (length < 1 || p[0] >= length) {
+            return connection_error(session, H2_PROTOCOL_ERROR, "invalid padding");
+        }
+        length -= 1 + p[0];
+        p++;
+    }
+
+    // 连接级窗口按整个帧计算, 收到即通告
+    session->recv_window -= frame_length;
+    if (session->recv_window < 0) {
+        return connection_error(session, H2_FLOW_CONTROL_ERROR, "connection window exceeded");
+    }
+    session->recv_consumed += frame_length;
+    if (session->recv_consumed >= H2_CONNECTION_WINDOW / 2) {
+        send_window_update(session, 0, session->recv_consumed);
+        session->recv_window += session->recv_consumed;
+        session->recv_consumed = 0;
+    }
+
+    st_h2_stream_t *stream = find_stream(session, id);
+    if (!stream || stream->remote_closed) {
+        if (id > session->last_stream_id) {
+            return connection_error(session, H2_PROTOCOL_ERROR, "DATA on idle stream");
+        }
+        send_rst_stream(session, id, H2_STREAM_CLOSED);
+        return 0;
+    }
+    stream->recv_window -= frame_length;
+    if (stream->recv_window < 0) {
+        stream_reset(stream, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    stream->recv_consumed += frame_length - length;
+
+    if (length > 0) {
+        if (stream->paused || buffer_length(&stream->in) > 0) {
+            if (buffer_append(&stream->in, p, length) < 0) {
+                stream_reset(stream, H2_INTERNAL_ERROR);
+                return 0;
+            }
+        } else {
+            struct st_client *client = stream->client;
+            if (client->capture) {
+                capture_body(client->capture, (const char *)p, length);
+            }
+            if (!client->shed && client->callbacks && client->callbacks->on_data_received) {
+                client->callbacks->on_data_received(client, (const char *)p, length);
+            }
+            stream->recv_consumed += length;
+        }
+    }
+    if (flags & H2_FLAG_END_STREAM) {
+        stream->remote_closed = true;
+    }
+    stream_deliver(stream);
+    stream_ack(stream);
+    return 0;
+}
+
+static int on_settings_frame(st_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (id != 0) {
+        return connection_error(session, H2_PROTOCOL_ERROR, "SETTINGS on stream");
+    }
+    if (flags & H2_FLAG_ACK) {
+        return length == 0 ? 0 : connection_error(session, H2_FRAME_SIZE_ERROR, "SETTINGS ack with payload");
+    }
+    if (length % 6 != 0) {
+        return connection_error(session, H2_FRAME_SIZE_ERROR, "invalid SETTINGS length");
+    }
+    for (size_t i = 0; i < length; i += 6) {
+        uint16_t key = (p[i] << 8) | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        switch (key) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_table_set_limit(&session->encoder, value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return connection_error(session, H2_PROTOCOL_ERROR, "invalid ENABLE_PUSH");
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) {
+                    return connection_error(session, H2_FLOW_CONTROL_ERROR, "invalid INITIAL_WINDOW_SIZE");
+                }
+                // 已打开的流按差值调整发送窗口, 可能变为负数
+                int64_t delta = (int64_t)value - session->peer_initial_window;
+                for (int s = 0; s < session->stream_count; s++) {
+                    session->streams[s]->send_window += delta;
+                }
+                session->peer_initial_window = value;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE) {
+                    return connection_error(session, H2_PROTOCOL_ERROR, "invalid MAX_FRAME_SIZE");
+                }
+                session->peer_max_frame_size = value;
+                break;
+            default:
+                break;
+        }
+    }
+    return append_frame(session, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_window_update_frame(st_h2_session_t *session, uint32_t id, const uint8_t *p, size_t length) {
+    if (length != 4) {
+        return connection_error(session, H2_FRAME_SIZE_ERROR, "invalid WINDOW_UPDATE length");
+    }
+    uint32_t increment = get32(p) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0) {
+            return connection_error(session, H2_PROTOCOL_ERROR, "zero WINDOW_UPDATE");
+        }
+        session->send_window += increment;
+        if (session->send_window > H2_MAX_WINDOW) {
+            return connection_error(session, H2_FLOW_CONTROL_ERROR, "connection window overflow");
+        }
+        return 0;
+    }
+    st_h2_stream_t *stream = find_stream(session, id);
+    if (!stream) {
+        return 0;
+    }
+    if (increment == 0) {
+        stream_reset(stream, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    stream->send_window += increment;
+    if (stream->send_window > H2_MAX_WINDOW) {
+        stream_reset(stream, H2_FLOW_CONTROL_ERROR);
+    }
+    return 0;
+}
+
+static int process_frame(st_h2_session_t *session, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (session->header_stream && type != H2_FRAME_CONTINUATION) {
+        return connection_error(session, H2_PROTOCOL_ERROR, "expected CONTINUATION");
+    }
+    switch (type) {
+        case H2_FRAME_DATA:
+            return on_data_frame(session, flags, id, p, length);
+        case H2_FRAME_HEADERS:
+            return on_headers_frame(session, flags, id, p, length);
+        case H2_FRAME_CONTINUATION:
+            return on_continuation_frame(session, flags, id, p, length);
+        case H2_FRAME_PRIORITY: {
+            if (id == 0) {
+                return connection_error(session, H2_PROTOCOL_ERROR, "PRIORITY on stream 0");
+            }
+            if (length != 5) {
+                return connection_error(session, H2_FRAME_SIZE_ERROR, "invalid PRIORITY length");
+            }
+            uint32_t dependency;
+            int weight;
+            bool exclusive;
+            parse_priority(p, &dependency, &weight, &exclusive);
+            st_h2_stream_t *stream = find_stream(session, id);
+            if (stream && dependency == id) {
+                stream_reset(stream, H2_PROTOCOL_ERROR);
+            } else if (stream) {
+                set_priority(session, stream, dependency, weight, exclusive);
+            }
+            return 0;
+        }
+        case H2_FRAME_RST_STREAM: {
+            if (id == 0) {
+                return connection_error(session, H2_PROTOCOL_ERROR, "RST_STREAM on stream 0");
+            }
+            if (length != 4) {
+                return connection_error(session, H2_FRAME_SIZE_ERROR, "invalid RST_STREAM length");
+            }
+            if (id > session->last_stream_id) {
+                return connection_error(session, H2_PROTOCOL_ERROR, "RST_STREAM on idle stream");
+            }
+            st_h2_stream_t *stream = find_stream(session, id);
+            if (stream) {
+                log_debug("stream:%u reset by peer, code:%u", id, get32(p));
+                finish_stream(stream, true);
+            }
+            return 0;
+        }
+        case H2_FRAME_SETTINGS:
+            return on_settings_frame(session, flags, id, p, length);
+        case H2_FRAME_PUSH_PROMISE:
+            return connection_error(session, H2_PROTOCOL_ERROR, "PUSH_PROMISE from client");
+        case H2_FRAME_PING:
+            if (id != 0) {
+                return connection_error(session, H2_PROTOCOL_ERROR, "PING on stream");
+            }
+            if (length != 8) {
+                return connection_error(session, H2_FRAME_SIZE_ERROR, "invalid PING length");
+            }
+            return (flags & H2_FLAG_ACK) ? 0 : append_frame(session, H2_FRAME_PING, H2_FLAG_ACK, 0, p, length);
+        case H2_FRAME_GOAWAY:
+            if (id != 0) {
+                return connection_error(session, H2_PROTOCOL_ERROR, "GOAWAY on stream");
+            }
+            session->goaway_received = true;
+            return 0;
+        case H2_FRAME_WINDOW_UPDATE:
+            return on_window_update_frame(session, id, p, length);
+        default:
+            // 未知类型的帧必须忽略
+            return 0;
+    }
+}
+
+int h2_session_feed(st_h2_session_t *session, const char *data, size_t length) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t available = length;
+    bool buffered = buffer_length(&session->in) > 0;
+    if (buffered) {
+        if (buffer_append(&session->in, data, length) < 0) {
+            return -1;
+        }
+        p = (const uint8_t *)buffer_data(&session->in);
+        available = buffer_length(&session->in);
+    }
+
+    size_t used = 0;
+    int ret = 0;
+    if (!session->preface_received) {
+        size_t n = available < H2_PREFACE_LENGTH ? available : H2_PREFACE_LENGTH;
+        if (memcmp(p, H2_PREFACE, n) != 0) {
+            log_error("invalid http2 preface");
+            return -1;
+        }
+        if (n == H2_PREFACE_LENGTH) {
+            session->preface_received = true;
+            used = n;
+        }
+    }
+
+    // 本轮生成的帧在最后一起写出
+    session->writing = true;
+    while (session->preface_received && ret == 0 && available - used >= H2_FRAME_HEADER_SIZE) {
+        const uint8_t *frame = p + used;
+        size_t frame_length = ((size_t)frame[0] << 16) | (frame[1] << 8) | frame[2];
+        if (frame_length > H2_DEFAULT_FRAME_SIZE) {
+            ret = connection_error(session, H2_FRAME_SIZE_ERROR, "frame too large");
+            break;
+        }
+        if (available - used < H2_FRAME_HEADER_SIZE + frame_length) {
+            break;
+        }
+        ret = process_frame(session, frame[3], frame[4], get32(frame + 5) & 0x7fffffff, frame + H2_FRAME_HEADER_SIZE, frame_length);
+        used += H2_FRAME_HEADER_SIZE + frame_length;
+    }
+    session->writing = false;
+
+    if (ret == 0) {
+        if (buffered) {
+            buffer_consume(&session->in, used);
+        } else if (used < available && buffer_append(&session->in, data + used, available - used) < 0) {
+            ret = -1;
+        }
+    }
+    session_write(session);
+    if (ret == 0 && session->goaway_received && session->active_count == 0) {
+        return -1;
+    }
+    return ret;
+}
+
+static bool output_full(st_h2_session_t *session) {
+    return buffer_length(&session->conn->out) + buffer_length(&session->out) >= H2_OUTPUT_HIGH_WATERMARK;
+}
+
+static bool stream_sendable(st_h2_stream_t *stream) {
+    if (stream->finished) {
+        return false;
+    }
+    if (buffer_length(&stream->pending) > 0) {
+        return stream->send_window > 0 && stream->session->send_window > 0;
+    }
+    return stream->end_pending;
+}
+
+// 依赖链上有可以发送的祖先时先让祖先发送
+static bool ancestor_sendable(st_h2_session_t *session, st_h2_stream_t *stream) {
+    uint32_t id = stream->dependency;
+    for (int depth = 0; id && depth <= session->stream_count; depth++) {
+        st_h2_stream_t *parent = find_stream(session, id);
+        if (!parent) {
+            return false;
+        }
+        if (stream_sendable(parent)) {
+            return true;
+        }
+        id = parent->dependency;
+    }
+    return false;
+}
+
+static void write_data_frame(st_h2_session_t *session, st_h2_stream_t *stream) {
+    size_t length = buffer_length(&stream->pending);
+    size_t limit = session->peer_max_frame_size;
+    if (length > limit) {
+        length = limit;
+    }
+    if (length > 0) {
+        int64_t window = stream->send_window < session->send_window ? stream->send_window : session->send_window;
+        if ((int64_t)length > window) {
+            length = window;
+        }
+        if ((int64_t)length > stream->deficit) {
+            length = stream->deficit;
+        }
+    }
+    bool end = stream->end_pending && length == buffer_length(&stream->pending);
+    append_frame(session, H2_FRAME_DATA, end ? H2_FLAG_END_STREAM : 0, stream->id, buffer_data(&stream->pending), length);
+    buffer_consume(&stream->pending, length);
+    stream->send_window -= length;
+    session->send_window -= length;
+    stream->deficit -= length;
+    if (end) {
+        stream->end_pending = false;
+        stream->local_closed = true;
+    }
+}
+
+// 按权重加权轮转发送DATA, 返回是否有数据写出
+static bool schedule_data(st_h2_session_t *session) {
+    bool progress = false;
+    int count = session->stream_count;
+    for (int n = 0; n < count && !output_full(session); n++) {
+        int index = (session->cursor + n) % count;
+        st_h2_stream_t *stream = session->streams[index];
+        if (!stream_sendable(stream) || ancestor_sendable(session, stream)) {
+            continue;
+        }
+        int64_t quantum = (int64_t)stream->weight * H2_WEIGHT_QUANTUM;
+        stream->deficit += quantum;
+        if (stream->deficit > quantum) {
+            stream->deficit = quantum;
+        }
+        while (stream->deficit > 0 && stream_sendable(stream) && !output_full(session)) {
+            write_data_frame(session, stream);
+            progress = true;
+        }
+        session->cursor = (index + 1) % count;
+
+        if (buffer_length(&stream->pending) == 0) {
+            stream->deficit = 0;
+            if (stream->drain_wanted && !stream->local_closed) {
+                stream->drain_wanted = false;
+                progress = true;
+                struct st_client *client = stream->client;
+                if (client->callbacks && client->callbacks->on_drain) {
+                    client->callbacks->on_drain(client);
+                }
+            }
+        }
+        if (stream->local_closed && !stream->finished) {
+            stream_local_closed(stream);
+        }
+    }
+    return progress;
+}
+
+static void session_write(st_h2_session_t *session) {
+    if (session->writing) {
+        return;
+    }
+    session->writing = true;
+    for (;;) {
+        bool progress = schedule_data(session);
+        if (buffer_length(&session->out) > 0) {
+            bool sent = send_data_to_client(session->conn, buffer_data(&session->out), buffer_length(&session->out));
+            buffer_reset(&session->out);
+            if (!sent) {
+                break;
+            }
+        }
+        // 连接的输出缓冲区中是本轮待写出的记录, 积压到高水位才停止
+        if (!progress || output_full(session)) {
+            break;
+        }
+    }
+    session->writing = false;
+}
+
+void h2_session_on_drain(st_h2_session_t *session) {
+    session_write(session);
+}
+
+void h2_session_collect(st_h2_session_t *session) {
+    if (!session->garbage) {
+        return;
+    }
+    session->garbage = false;
+    int count = 0;
+    for (int i = 0; i < session->stream_count; i++) {
+        st_h2_stream_t *stream = session->streams[i];
+        if (stream->finished) {
+            free_stream(stream);
+        } else {
+            session->streams[count++] = stream;
+        }
+    }
+    session->stream_count = count;
+    session->cursor = 0;
+    if (session->goaway_received && session->active_count == 0) {
+        session->conn->state = CLIENT_STATE_CLOSING;
+    }
+}
+
+st_h2_session_t *h2_session_new(struct st_client *conn) {
+    st_h2_session_t *session = calloc(1, sizeof(st_h2_session_t));
+    if (!session) {
+        log_error("malloc");
+        return NULL;
+    }
+    session->conn = conn;
+    session->send_window = H2_DEFAULT_WINDOW;
+    session->recv_window = H2_CONNECTION_WINDOW;
+    session->peer_initial_window = H2_DEFAULT_WINDOW;
+    session->peer_max_frame_size = H2_DEFAULT_FRAME_SIZE;
+    hpack_table_init(&session->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_DEFAULT_TABLE_SIZE);
+
+    uint8_t settings[18];
+    const struct {
+        uint16_t key;
+        uint32_t value;
+    } values[] = {
+        {H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_CONCURRENT_STREAMS},
+        {H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW},
+        {H2_SETTINGS_MAX_HEADER_LIST_SIZE, MAX_REQUEST_HEAD_SIZE}
+    };
+    for (int i = 0; i < 3; i++) {
+        settings[i * 6] = values[i].key >> 8;
+        settings[i * 6 + 1] = values[i].key;
+        put32(settings + i * 6 + 2, values[i].value);
+    }
+    append_frame(session, H2_FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    send_window_update(session, 0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+    session_write(session);
+    return session;
+}
+
+void h2_session_free(st_h2_session_t *session) {
+    if (!session) {
+        return;
+    }
+    for (int i = 0; i < session->stream_count; i++) {
+        st_h2_stream_t *stream = session->streams[i];
+        struct st_client *client = stream->client;
+        if (!stream->finished && stream->started && client->response_state != RESPONSE_STATE_DONE &&
+            client->callbacks && client->callbacks->on_disconnected) {
+            client->callbacks->on_disconnected(client);
+        }
+        free_stream(stream);
+    }
+    free(session->streams);
+    hpack_table_free(&session->decoder);
+    hpack_table_free(&session->encoder);
+    buffer_free(&session->in);
+    buffer_free(&session->out);
+    buffer_free(&session->header_block);
+    buffer_free(&session->scratch);
+    free(session);
+}
+
+bool h2_send_headers(struct st_client *client, int status_code, const st_header_pair_t *headers, int header_count, long long content_length, bool end_stream) {
+    st_h2_stream_t *stream = client->h2_stream;
+    st_h2_session_t *session = stream->session;
+    if (stream->finished || stream->local_closed) {
+        return false;
+    }
+
+    st_buffer_t *block = &session->scratch;
+    char status[16];
+    char length[32];
+    buffer_reset(block);
+    snprintf(status, sizeof(status), "%03d", status_code);
+    if (hpack_encode(&session->encoder, block, ":status", status, strlen(status), false) < 0) {
+        return false;
+    }
+    for (int i = 0; i < header_count; i++) {
+        if (hpack_encode(&session->encoder, block, headers[i].name, headers[i].value, strlen(headers[i].value), true) < 0) {
+            return false;
+        }
+    }
+    if (content_length >= 0) {
+        snprintf(length, sizeof(length), "%lld", content_length);
+        if (hpack_encode(&session->encoder, block, "content-length", length, strlen(length), false) < 0) {
+            return false;
+        }
+    }
+
+    // 超过对端帧大小的头部块拆成HEADERS+CONTINUATION
+    const char *p = buffer_data(block);
+    size_t remaining = buffer_length(block);
+    uint8_t type = H2_FRAME_HEADERS;
+    uint8_t flags = end_stream ? H2_FLAG_END_STREAM : 0;
+    do {
+        size_t n = remaining < session->peer_max_frame_size ? remaining : session->peer_max_frame_size;
+        if (n == remaining) {
+            flags |= H2_FLAG_END_HEADERS;
+        }
+        if (append_frame(session, type, flags, stream->id, p, n) < 0) {
+            return false;
+        }
+        p += n;
+        remaining -= n;
+        type = H2_FRAME_CONTINUATION;
+        flags = 0;
+    } while (remaining > 0);
+
+    if (end_stream) {
+        stream_local_closed(stream);
+    }
+    session_write(session);
+    return true;
+}
+
+bool h2_send_data(struct st_client *client, const char *data, size_t length, bool end_stream) {
+    st_h2_stream_t *stream = client->h2_stream;
+    st_h2_session_t *session = stream->session;
+    if (stream->finished || stream->local_closed || stream->end_pending) {
+        return false;
+    }
+    if (length > 0 && buffer_append(&stream->pending, data, length) < 0) {
+        return false;
+    }
+    stream->end_pending = end_stream;
+    session_write(session);
+    if (buffer_length(&stream->pending) >= H2_OUTPUT_HIGH_WATERMARK) {
+        stream->drain_wanted = true;
+    }
+    return session->conn->state == CLIENT_STATE_ACTIVE;
+}
+
+size_t h2_stream_backlog(struct st_client *client) {
+    return buffer_length(&client->h2_stream->pending);
+}
+
+void h2_stream_pause(struct st_client *client) {
+    client->h2_stream->paused = true;
+}
+
+void h2_stream_resume(struct st_client *client) {
+    st_h2_stream_t *stream = client->h2_stream;
+    if (!stream->paused) {
+        return;
+    }
+    stream->paused = false;
+    stream_deliver(stream);
+    stream_ack(stream);
+    session_write(stream->session);
+}
+
+void h2_stream_abort(struct st_client *client) {
+    st_h2_stream_t *stream = client->h2_stream;
+    if (stream->finished) {
+        return;
+    }
+    stream_reset(stream, H2_INTERNAL_ERROR);
+    session_write(stream->session);
+}
+
+bool h2_session_shutdown(st_h2_session_t *session, bool final) {
+    if (!session->goaway_announced) {
+        session->goaway_announced = true;
+        append_goaway(session, H2_MAX_STREAM_ID, H2_NO_ERROR);
+    }
+    if (final && !session->goaway_sent) {
+        session->goaway_sent = true;
+        append_goaway(session, session->last_stream_id, H2_NO_ERROR);
+    }
+    session_write(session);
+    return session->goaway_sent && session->active_count == 0;
+}
@@ -6,6 +6,7 @@
 #include <llhttp.h>
 #include <openssl/ssl.h>
 #include <ev.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,17 +17,20 @@
 
 #define MAX_LEN 4096
 
-static size_t build_http_request(char *buffer, size_t buffer_size, http_method method, const char *path, const char *body, size_t body_length) {
-    static const char* method_array[] = {"GET", "POST", "DELETE", "PUT"};
+static llhttp_settings_t response_settings;
+static pthread_once_t response_settings_once = PTHREAD_ONCE_INIT;
+
+// 只生成请求头, 请求体单独发送, 可以是任意长度的二进制数据
+static int build_http_request(char *buffer, size_t buffer_size, http_method method, const char *path, size_t body_length) {
+    static const char* method_array[] = {"GET", "POST", "PUT", "DELETE"};
     const char* method_str = method_array[method];
-    size_t length = snprintf(buffer, buffer_size,
+    int length = snprintf(buffer, buffer_size,
              "%s %s HTTP/1.1\r\n"
              "Host: localhost\r\n"
              "Connection: keep-alive\r\n"
              "Content-Length: %zu\r\n"
-             "\r\n"
-             "%s",
-             method_str, path, body_length, body);
+             "\r\n",
+             method_str, path, body_length);
     return length;
 }
 
@@ -135,7 +139,7 @@ static void on_read(struct ev_loop *loop, struct ev_io *w, int revents) {
 
 // Send data to server
 bool send_data_to_server(struct st_client *client, const char *data, size_t length) {
-    log_debug("data:%s, length:%ld, client:%p", data, length, client);
+    log_debug("length:%zu, client:%p", length, client);
 
     int result = SSL_write(client->ssl, data, length);
     if (result <= 0) {
@@ -159,9 +163,28 @@ bool send_data_to_server(struct st_client *client, const char *data, size_t leng
 
 // Send HTTP request
 bool send_http_request(struct st_client* client, http_method method, const char *path, const char *body, size_t body_length) {
-    char request_buffer[4096];
-    int request_length = build_http_request(request_buffer, sizeof(request_buffer), method, path, body, body_length);
-    return send_data_to_server(client, request_buffer, request_length);
+    char request_buffer[MAX_LEN];
+    int request_length = build_http_request(request_buffer, sizeof(request_buffer), method, path, body_length);
+    if (request_length < 0 || (size_t)request_length >= sizeof(request_buffer)) {
+        log_error("request head too long");
+        return false;
+    }
+    if (!send_data_to_server(client, request_buffer, request_length)) {
+        return false;
+    }
+    return body_length == 0 || send_data_to_server(client, body, body_length);
+}
+
+static void init_response_settings(void) {
+    llhttp_settings_init(&response_settings);
+    response_settings.on_message_begin = on_message_begin;
+    response_settings.on_url = on_url;
+    response_settings.on_status = on_status;
+    response_settings.on_header_field = on_header_field;
+    response_settings.on_header_value = on_header_value;
+    response_settings.on_headers_complete = on_headers_complete;
+    response_settings.on_body = on_body;
+    response_settings.on_message_complete = on_message_complete;
 }
 
 // Start HTTPS client
@@ -199,16 +222,8 @@ bool start_https_client(const char *host, int port, event_callbacks *callbacks)
     client->callbacks = callbacks;
 
     // Initialize llhttp parser
-    llhttp_settings_init(&client->settings);
-    client->settings.on_message_begin = on_message_begin;
-    client->settings.on_url = on_url;
-    client->settings.on_status = on_status;
-    client->settings.on_header_field = on_header_field;
-    client->settings.on_header_value = on_header_value;
-    client->settings.on_headers_complete = on_headers_complete;
-    client->settings.on_body = on_body;
-    client->settings.on_message_complete = on_message_complete;
-    llhttp_init(&client->parser, HTTP_RESPONSE, &client->settings);
+    pthread_once(&response_settings_once, init_response_settings);
+    llhttp_init(&client->parser, HTTP_RESPONSE, &response_settings);
     client->parser.data = client;
 
     SSL_set_fd(ssl, client_fd);
@@ -1,24 +1,89 @@
+#define _GNU_SOURCE
 #include "https_server.h"
+#include "request.h"
+#include "http2.h"
+#include "websocket.h"
+#include "response_cache.h"
+#include "proxy.h"
+#include "overload.h"
+#include "offload.h"
+#include "async_crypto.h"
+#include "ocsp_stapling.h"
+#include "trace.h"
+#include "capture.h"
+#include "sse.h"
+#include "upgrade.h"
 #include "ssl_utils.h"
+#include "socket_bio.h"
 #include "tcp_utils.h"
-#include "ev_utils.h"
+#include "event_engine.h"
 #include "log.h"
 #include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <ev.h>
+#include <errno.h>
 #include <error.h>
 #include <unistd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #define MAX_LEN 4096
+#define WS_READ_SIZE (16 * 1024)
+#define MAX_ACCEPTS_PER_EVENT 64
+#define OUTPUT_HIGH_WATERMARK (64 * 1024)
+#define COMPRESS_SCRATCH_MAX (1024 * 1024)
+#define MAX_RESPONSE_HEADERS (3 + MAX_EXTRA_RESPONSE_HEADERS)
+#define DRAIN_SWEEP_INTERVAL 0.1
+#define DEFAULT_DRAIN_TIMEOUT 30.0
+#define DRAIN_GOAWAY_GRACE 1.0
+#define FILE_READ_SIZE (64 * 1024)
+#define SENDFILE_CHUNK (1024 * 1024)
+#define TLS_RECORD_SIZE (16 * 1024)
+#define DEFAULT_SMALL_RECORD_SIZE 1400
+#define DEFAULT_RECORD_BOOST_BYTES (128 * 1024)
+#define DEFAULT_RECORD_IDLE_RESET 1.0
+#define IO_AGAIN -2
+#define DEFAULT_COMPRESS_TYPES "text/,application/json,application/javascript,application/xml,image/svg+xml"
 
-// 处理SSL错误
-static void handle_error(struct st_client *client, const char *context) {
-    int err = SSL_get_error(client->ssl, -1);
+// 所有连接共用的请求解析回调
+static llhttp_settings_t request_settings;
+static pthread_once_t request_settings_once = PTHREAD_ONCE_INIT;
+
+// 文件响应中还没有发送的部分
+typedef struct st_file_output {
+    int fd;
+    off_t offset;
+    size_t remaining;
+} st_file_output_t;
+
+// 套接字和文件的错误按errno报告
+static void handle_io_error(struct st_client *client, const char *context) {
+    const char *error_message = errno ? strerror(errno) : context;
+    log_error("%s: %s", context, error_message);
+    if (client->callbacks && client->callbacks->on_error) {
+        client->callbacks->on_error(client, error_message);
+    }
+}
+
+// 处理SSL错误, 明文连接按errno
+static void handle_error(struct st_client *client, int ret, const char *context) {
+    if (!client->ssl) {
+        handle_io_error(client, context);
+        return;
+    }
+    int err = SSL_get_error(client->ssl, ret);
     const char *error_message = "unknown ssl error";
     switch (err) {
         case SSL_ERROR_SSL:
@@ -40,227 +105,2739 @@ static void handle_error(struct st_client *client, const char *context) {
     }
 }
 
-static size_t build_http_response(char *buffer, size_t buffer_size, int status_code, const char *status_message, const char *body) {
-    const char *headers = "Content-Type: text/plain\r\nConnection: keep-alive\r\n";
-    size_t body_length = strlen(body);
-    size_t total_length = snprintf(buffer, buffer_size,
-        "HTTP/1.1 %d %s\r\n"
-        "%s"
-        "Content-Length: %zu\r\n"
-        "\r\n"
-        "%s",
-        status_code, status_message, headers, body_length, body);
+// 返回读到的字节数, 0表示对端关闭, -1表示出错(已报告), IO_AGAIN表示暂时没有数据
+static ssize_t client_recv(struct st_client *client, char *buffer, size_t size) {
+    if (!client->ssl) {
+        ssize_t n = recv(client->client_fd, buffer, size, 0);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return IO_AGAIN;
+        }
+        if (errno == ECONNRESET) {
+            return 0;
+        }
+        handle_error(client, -1, "read failed");
+        return -1;
+    }
+    int n = SSL_read(client->ssl, buffer, size > INT_MAX ? INT_MAX : (int)size);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(client->ssl, n);
+    if (err == SSL_ERROR_WANT_READ) {
+        return IO_AGAIN;
+    }
+    if (err == SSL_ERROR_WANT_WRITE) {
+        event_io_set(client->worker->loop, &client->io, EVENT_READ | EVENT_WRITE);
+        return IO_AGAIN;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && (errno == 0 || errno == ECONNRESET))) {
+        return 0;
+    }
+    handle_error(client, n, "ssl read failed");
+    return -1;
+}
+
+// 直接写套接字: 明文连接的数据, 或TLS连接已经加密的记录.
+// 返回写出的字节数, -1表示出错(已报告), IO_AGAIN表示套接字写满
+static ssize_t client_send(struct st_client *client, const char *data, size_t length, int flags) {
+    ssize_t n = send(client->client_fd, data, length, MSG_NOSIGNAL | flags);
+    if (n >= 0) {
+        return n;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return IO_AGAIN;
+    }
+    handle_io_error(client, "write failed");
+    return -1;
+}
+
+// 动态记录大小: 下一次SSL_write最多交给它多少明文. 开始阶段每次一个小记录,
+// 写够record_boost_bytes后不再切分, 由OpenSSL按16KB分记录
+static size_t record_payload(struct st_client *client, size_t length) {
+    const st_server_options_t *options = &client->worker->params->options;
+    if (!options->dynamic_records) {
+        return length;
+    }
+    double now = event_loop_now(client->worker->loop);
+    if (now - client->record_last >= options->record_idle_reset) {
+        // 拥塞窗口可能已经回落
+        client->record_bytes = 0;
+    }
+    client->record_last = now;
+    if (client->record_bytes >= options->record_boost_bytes) {
+        return length;
+    }
+    return length < options->small_record_size ? length : options->small_record_size;
+}
+
+// TLS连接加密后的记录由BIO追加到输出缓冲区, 不会写满. 返回false表示出错(已报告)
+static bool encrypt_to_output(struct st_client *client, const char *data, size_t length) {
+    while (length > 0) {
+        size_t payload = record_payload(client, length);
+        int n = SSL_write(client->ssl, data, payload > INT_MAX ? INT_MAX : (int)payload);
+        if (n <= 0) {
+            handle_error(client, n, "SSL write failed");
+            return false;
+        }
+        data += n;
+        length -= n;
+        client->record_bytes += n;
+    }
+    return true;
+}
+
+// BIO回调: 输出缓冲区中有了新的记录, 登记到本轮循环结束时统一写出
+static void queue_flush(void *arg) {
+    struct st_client *client = (struct st_client *)arg;
+    st_server_worker_t *worker = client->worker;
+    if (client->flush_queued) {
+        return;
+    }
+    client->flush_queued = true;
+    client->flush_prev = NULL;
+    client->flush_next = worker->flushing;
+    if (worker->flushing) {
+        worker->flushing->flush_prev = client;
+    }
+    worker->flushing = client;
+}
+
+static void unqueue_flush(struct st_client *client) {
+    if (!client->flush_queued) {
+        return;
+    }
+    if (client->flush_prev) {
+        client->flush_prev->flush_next = client->flush_next;
+    } else {
+        client->worker->flushing = client->flush_next;
+    }
+    if (client->flush_next) {
+        client->flush_next->flush_prev = client->flush_prev;
+    }
+    client->flush_queued = false;
+}
+
+// 输出缓冲区和待发送文件的总长度
+static size_t pending_output(struct st_client *client) {
+    return buffer_length(&client->out) + (client->file ? client->file->remaining : 0);
+}
+
+static void free_file_output(struct st_client *client) {
+    if (client->file) {
+        close(client->file->fd);
+        free(client->file);
+        client->file = NULL;
+    }
+}
+
+static const char *connection_header(struct st_client *client) {
+    return client->keep_alive ? "keep-alive" : "close";
+}
+
+// 构造HTTP/1.1响应头, content_length为负时使用chunked编码
+static size_t build_http_response_head(struct st_client *client, char *buffer, size_t buffer_size, int status_code, const char *status_message, const st_header_pair_t *headers, int header_count, long long content_length) {
+    size_t length = snprintf(buffer, buffer_size, "HTTP/1.1 %d %s\r\n", status_code, status_message);
+    for (int i = 0; i < header_count && length < buffer_size; i++) {
+        length += snprintf(buffer + length, buffer_size - length, "%s: %s\r\n", headers[i].name, headers[i].value);
+    }
+    if (length >= buffer_size) {
+        return length;
+    }
+    if (content_length >= 0) {
+        length += snprintf(buffer + length, buffer_size - length,
+            "Connection: %s\r\n"
+            "Content-Length: %lld\r\n"
+            "\r\n",
+            connection_header(client), content_length);
+    } else if (!client->chunked) {
+        // HTTP/1.0没有chunked编码, 以关闭连接结束响应体
+        length += snprintf(buffer + length, buffer_size - length, "Connection: close\r\n\r\n");
+    } else {
+        length += snprintf(buffer + length, buffer_size - length,
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n",
+            connection_header(client));
+    }
+    return length;
+}
+
+// 响应是否可能被压缩, 可能时需要带上Vary头
+static bool response_compressible(struct st_client *client, int status_code, const char *content_type) {
+    const st_server_options_t *options = &client->worker->params->options;
+    if (!options->compress || !client->worker->compress_pool) {
+        return false;
+    }
+    if (status_code < 200 || status_code == 204 || status_code == 304) {
+        return false;
+    }
+    return compress_type_allowed(options->compress_types, content_type);
+}
+
+static content_encoding_t response_encoding(struct st_client *client) {
+    return negotiate_content_encoding(get_request_known_header(client, HEADER_ACCEPT_ENCODING));
+}
 
-    if (total_length >= buffer_size) {
-        return total_length;
+// 逗号分隔的头部值中是否包含token, 不区分大小写
+static bool header_has_token(const char *value, const char *token) {
+    size_t token_length = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        size_t length = strcspn(value, ",");
+        while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) {
+            length--;
+        }
+        if (length == token_length && strncasecmp(value, token, length) == 0) {
+            return true;
+        }
+        value += strcspn(value, ",");
     }
-    return total_length;
+    return false;
+}
+
+static int append_to_buffer(void *ctx, const char *data, size_t length) {
+    return buffer_append((st_buffer_t *)ctx, data, length);
 }
 
+static void resume_parsing(struct st_client *client);
+static bool serve_from_cache(struct st_client *client);
+static bool join_flight(struct st_client *client);
+
 int on_message_begin(llhttp_t *parser) {
     log_debug("parse start");
+    struct st_client *client = (struct st_client *)parser->data;
+    if (client->trace && client->trace->stamps[TRACE_FIRST_BYTE]) {
+        // 流水线上的上一个响应还没写完
+        trace_commit(client->trace);
+    }
+    TRACE_POINT(client, first_byte, TRACE_FIRST_BYTE);
+    request_reset(&client->request);
+    client->response_state = RESPONSE_STATE_NONE;
+    buffer_reset(&client->extra_headers);
+    client->extra_header_count = 0;
+    buffer_reset(&client->cache_key);
+    client->cache_hit = false;
+    client->proxied = false;
+    client->shed = false;
     return 0;
 }
+
 int on_url(llhttp_t *parser, const char* at, size_t length) {
-    char url[MAX_LEN];
-    strncpy(url, at, length);
-    url[length] = '\0';
-    log_debug("url: %s", url);
+    struct st_client *client = (struct st_client *)parser->data;
+    return request_append(&client->request, at, length);
+}
+
+int on_url_complete(llhttp_t *parser) {
+    struct st_client *client = (struct st_client *)parser->data;
+    st_request_t *request = &client->request;
+    if (request_terminate(request, &request->url, &request->url_length) < 0) {
+        return -1;
+    }
+    log_debug("url: %s", request->head.data + request->url);
     return 0;
 }
+
 int on_header_field(llhttp_t *parser, const char* at, size_t length) {
-    char header_field[MAX_LEN];
-    strncpy(header_field, at, length);
-    header_field[length] = '\0';
-    log_debug("head field: %s", header_field);
-    return 0;
+    struct st_client *client = (struct st_client *)parser->data;
+    return request_append(&client->request, at, length);
+}
+
+int on_header_field_complete(llhttp_t *parser) {
+    struct st_client *client = (struct st_client *)parser->data;
+    st_request_t *request = &client->request;
+    st_http_header_t *header = request_next_header(request);
+    if (!header) {
+        return -1;
+    }
+    return request_terminate(request, &header->name, &header->name_length);
 }
 
 // HTTP message parsing callbacks
 int on_header_value(llhttp_t *parser, const char* at, size_t length) {
- char header_value[MAX_LEN];
-    strncpy(header_value, at, length);
-    header_value[length] = '\0';
-    log_debug("head value: %s", header_value);
+    struct st_client *client = (struct st_client *)parser->data;
+    return request_append(&client->request, at, length);
+}
+
+int on_header_value_complete(llhttp_t *parser) {
+    struct st_client *client = (struct st_client *)parser->data;
+    st_request_t *request = &client->request;
+    st_http_header_t *header = &request->headers[request->header_count];
+    if (request_commit_header(request) < 0) {
+        return -1;
+    }
+    log_debug("head field: %s, value: %s", request->head.data + header->name, request->head.data + header->value);
     return 0;
 }
 
 int on_headers_complete(llhttp_t *parser) {
     log_debug("on_headers_complete, major: %d, major: %d, keep-alive: %d, upgrade: %d", parser->http_major, parser->http_minor, llhttp_should_keep_alive(parser), parser->upgrade);
-    return 0;
+    struct st_client *client = (struct st_client *)parser->data;
+    // 排空时不再保持连接, 响应之后关闭
+    client->keep_alive = llhttp_should_keep_alive(parser) && !client->worker->draining;
+    client->chunked = parser->http_major > 1 || (parser->http_major == 1 && parser->http_minor >= 1);
+    TRACE_POINT(client, headers_complete, TRACE_HEADERS_COMPLETE);
+    if (client->trace) {
+        trace_set_request(client->trace, llhttp_method_name((llhttp_method_t)parser->method), get_request_url(client));
+    }
+    if (client->worker->params->capture) {
+        client->capture = capture_begin(client->worker->params->capture, false, get_request_method(client), &client->request);
+    }
+    if (serve_from_cache(client) || shed_request(client) || join_flight(client)) {
+        return 0;
+    }
+    TRACE_POINT(client, handler_start, TRACE_HANDLER_START);
+    if (client->callbacks && client->callbacks->on_body_start) {
+        client->callbacks->on_body_start(client);
+    }
+    return client->read_paused ? HPE_PAUSED : 0;
 }
 
 int on_body(llhttp_t *parser, const char *at, size_t length) {
-    log_debug("%s, %ld",at,length);
+    log_debug("client:%p,body length:%ld", parser->data, length);
     struct st_client *client = (struct st_client *)parser->data;
-    if (client->callbacks && client->callbacks->on_data_received) {
+    if (client->capture) {
+        capture_body(client->capture, at, length);
+    }
+    if (!client->cache_hit && !client->flight_waiter && !client->shed && client->callbacks && client->callbacks->on_data_received) {
         client->callbacks->on_data_received(client, at, length);
     }
-    return 0;
+    return client->read_paused ? HPE_PAUSED : 0;
 }
 
 int on_message_complete(llhttp_t *parser) {
     log_debug("message complete");
-    return 0;
+    struct st_client *client = (struct st_client *)parser->data;
+    TRACE_POINT(client, message_complete, TRACE_MESSAGE_COMPLETE);
+    if (client->capture) {
+        capture_end(client->worker->params->capture, client->capture);
+        client->capture = NULL;
+    }
+    if (!client->cache_hit && !client->flight_waiter && !client->shed && client->callbacks && client->callbacks->on_body_end) {
+        client->callbacks->on_body_end(client);
+    }
+    // 流水线上的下一个请求等本次响应结束后再解析
+    if (client->response_state != RESPONSE_STATE_DONE && client->state == CLIENT_STATE_ACTIVE) {
+        client->awaiting_response = true;
+    }
+    return (client->read_paused || client->awaiting_response || client->close_after_flush || client->file) ? HPE_PAUSED : 0;
 }
 
-static void on_read(struct ev_loop *loop, struct ev_io *w, int revents) {
-    struct st_client *client = (struct st_client *)w->data;
-    char buffer[4096];
+static void leave_flight(struct st_client *client);
+
+static void unlink_client(struct st_client *client) {
+    st_server_worker_t *worker = client->worker;
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        worker->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    worker->client_count--;
+}
 
-    log_debug("loop:%p,io:%p,client:%p,parser:%p",loop,w,client,&client->parser);
-    int read = SSL_read(client->ssl, buffer, sizeof(buffer));
-    if (read <= 0) {
+// 排空中最后一个连接关闭, 且交给线程池的请求都已返回, 工作线程退出
+static void check_drained(st_server_worker_t *worker) {
+    if (worker->draining && worker->client_count == 0 && worker->offload_pending == 0) {
+        event_loop_break(worker->loop);
+    }
+}
+
+static void close_client(struct st_client *client) {
+    st_server_worker_t *worker = client->worker;
+    st_event_loop_t *loop = worker->loop;
+    if (client->async_fd >= 0 && SSL_waiting_for_async(client->ssl)) {
+        // 握手任务暂停在线程池中的私钥运算上, 等它返回并结束任务后再关闭, 否则任务的栈无法回收.
+        // 先关闭套接字的读写, 恢复后的握手必然失败, 不会变成已连接
+        client->state = CLIENT_STATE_CLOSING;
+        shutdown(client->client_fd, SHUT_RDWR);
+        event_io_stop(loop, &client->io);
+        event_timer_stop(loop, &client->timer);
+        return;
+    }
+    log_debug("client:%p,client_fd:%d", client, client->client_fd);
+    unlink_client(client);
+
+    event_io_stop(loop, &client->io);
+    event_io_stop(loop, &client->async_io);
+    event_timer_stop(loop, &client->timer);
+    leave_flight(client);
+
+    // 明文连接建立时就已通知on_connected
+    if (!client->ssl || SSL_is_init_finished(client->ssl)) {
+        // 先通知未完成的HTTP/2流, 再通知连接
+        h2_session_free(client->h2);
         if (client->callbacks && client->callbacks->on_disconnected) {
             client->callbacks->on_disconnected(client);
         }
-        handle_error(client, "ssl read failed");
-        ev_io_stop(loop, w);
-        log_debug("errno:%d, err:%s", errno,strerror(errno));
-        if (SSL_shutdown(client->ssl) < 0) {
-            handle_error(client, "ssl read failed");
+        // 非阻塞地尽力发送close_notify
+        if (client->ssl) {
+            SSL_shutdown(client->ssl);
         }
-        SSL_free(client->ssl);
-        close(w->fd);
+    }
+    // 输出缓冲区中的记录(含close_notify和握手失败的告警)也只尽力写一次
+    if (client->ssl && buffer_length(&client->out) > 0) {
+        send(client->client_fd, buffer_data(&client->out), buffer_length(&client->out), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    // SSL_shutdown写出的记录也会登记
+    unqueue_flush(client);
+    ERR_clear_error();
+    SSL_free(client->ssl);
+    close(client->client_fd);
+    free_file_output(client);
+    buffer_free(&client->out);
+    buffer_free(&client->in);
+    buffer_free(&client->extra_headers);
+    buffer_free(&client->cache_key);
+    compressor_release(client->worker->compress_pool, client->compressor);
+    ws_destroy(client->ws);
+    trace_end(client->trace);
+    client->trace = NULL;
+    capture_discard(client->capture);
+    client->capture = NULL;
+    // 处理器还在线程池中运行时, 连接结构和请求由它返回后释放
+    if (!offload_release(client)) {
+        request_free(&client->request);
         free(client);
-    } else {
-        buffer[read] = '\0';
-        log_debug("buffer:%s,length:%d",buffer,read);
-        llhttp_errno_t err = llhttp_execute(&client->parser, buffer, read);
-        if (err != HPE_OK) {
-            log_error("llhttp error: %s", llhttp_errno_name(err));
-        }
-        log_debug("llhttp_execute %d",err);
     }
+    check_drained(worker);
 }
 
-static void on_client_accept(struct ev_loop *loop, struct ev_io *w, int revents) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int client_fd = accept(w->fd, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd < 0) {
-        log_error("accept");
-        return;
+// 在io回调之外需要关闭连接时, 推迟到下一次定时器回调, 避免调用者持有悬空指针
+static void schedule_close(struct st_client *client) {
+    client->state = CLIENT_STATE_CLOSING;
+    if (!client->dispatching) {
+        event_timer_start(client->worker->loop, &client->timer, 0);
     }
+}
 
-    struct st_client *client = malloc(sizeof(struct st_client));
-    if (!client) {
-        log_error("malloc");
-        close(client_fd);
-        return;
+static void update_client_io(struct st_client *client) {
+    int events = 0;
+    if (!client->read_paused && !client->awaiting_response && !client->close_after_flush && !client->file) {
+        events |= EVENT_READ;
     }
-    client->client_fd = client_fd;
+    if (pending_output(client) > 0) {
+        events |= EVENT_WRITE;
+    }
+    event_io_set(client->worker->loop, &client->io, events);
+}
+
+// 响应的最后一个字节已交给套接字, 被追踪的连接提交这个请求的记录
+static void trace_last_byte(struct st_client *client) {
+    TRACE_POINT(client, last_byte, TRACE_LAST_BYTE);
+    if (client->trace) {
+        trace_commit(client->trace);
+    }
+}
 
-    struct st_server_params *server_data = (struct st_server_params*)w->data;
-    client->ssl = SSL_new(server_data->ctx);
+// 文件响应的下一段: 明文连接以sendfile直接写入套接字, 直到写完或写满;
+// TLS连接按记录大小读出加密, 在输出缓冲区中攒够一段由调用者写出. 返回false表示出错
+static bool continue_file(struct st_client *client) {
+    st_file_output_t *file = client->file;
     if (!client->ssl) {
-        log_error("SSL_new");
-        close(client_fd);
-        free(client);
-        return;
+        while (file->remaining > 0) {
+            errno = 0;
+            ssize_t n = sendfile(client->client_fd, file->fd, &file->offset, file->remaining < SENDFILE_CHUNK ? file->remaining : SENDFILE_CHUNK);
+            if (n > 0) {
+                file->remaining -= n;
+                client->last_activity = event_loop_now(client->worker->loop);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            // n为0时文件在发送途中被截断, 已经发出的Content-Length无法兑现
+            handle_error(client, -1, "sendfile failed");
+            return false;
+        }
+        return true;
+    }
+    char data[TLS_RECORD_SIZE];
+    while (file->remaining > 0 && buffer_length(&client->out) < FILE_READ_SIZE) {
+        size_t size = file->remaining < sizeof(data) ? file->remaining : sizeof(data);
+        errno = 0;
+        ssize_t n = pread(file->fd, data, size, file->offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            handle_io_error(client, "read file failed");
+            return false;
+        }
+        if (!encrypt_to_output(client, data, n)) {
+            return false;
+        }
+        file->offset += n;
+        file->remaining -= n;
     }
+    return true;
+}
 
-    llhttp_settings_init(&client->settings);
-    client->settings.on_message_begin = on_message_begin;
-    client->settings.on_url = on_url;
-    client->settings.on_header_field = on_header_field;
-    client->settings.on_header_value = on_header_value;
-    client->settings.on_headers_complete = on_headers_complete;
-    client->settings.on_body = on_body;
-    client->settings.on_message_complete = on_message_complete;
-    llhttp_init(&client->parser, HTTP_REQUEST, &client->settings);
-    client->parser.data = client;
+// 写出缓冲区中积压的数据和待发送的文件, 直到写空或者套接字写满. 返回false表示出错.
+// 之后文件还有内容时, tcp_cork以MSG_MORE写出, 内核凑满报文段再发送
+static bool write_pending(struct st_client *client) {
+    bool cork = client->worker->params->options.tcp_cork;
+    bool ok = true;
+    for (;;) {
+        if (buffer_length(&client->out) == 0) {
+            if (!client->file || client->file->remaining == 0) {
+                break;
+            }
+            if (!continue_file(client)) {
+                ok = false;
+                break;
+            }
+            if (buffer_length(&client->out) == 0) {
+                // sendfile写完或写满
+                break;
+            }
+        }
+        int flags = cork && client->file && client->file->remaining > 0 ? MSG_MORE : 0;
+        ssize_t written = client_send(client, buffer_data(&client->out), buffer_length(&client->out), flags);
+        if (written > 0) {
+            buffer_consume(&client->out, written);
+            client->last_activity = event_loop_now(client->worker->loop);
+            continue;
+        }
+        ok = written == IO_AGAIN;
+        break;
+    }
+    // 本轮登记的记录已经写出或等待写事件, 循环结束时不必再写
+    unqueue_flush(client);
+    return ok;
+}
 
-    SSL_set_fd(client->ssl, client_fd);
-    if (SSL_accept(client->ssl) <= 0) {
-        handle_error(client, "SSL accept failed");
-        SSL_free(client->ssl);
-        close(client_fd);
-        free(client);
+static void flush_client(struct st_client *client) {
+    bool backlogged = pending_output(client) > 0;
+    if (!write_pending(client)) {
+        client->state = CLIENT_STATE_CLOSING;
+        return;
+    }
+    // 文件已全部读出, 后面的响应排在输出缓冲区中已有数据之后, 可以继续解析
+    bool file_done = client->file && client->file->remaining == 0;
+    if (file_done) {
+        free_file_output(client);
+    }
+    update_client_io(client);
+    if (client->state != CLIENT_STATE_ACTIVE) {
+        // 握手报文, 还没有响应
         return;
     }
 
-    client->callbacks = server_data->callbacks;
-    log_debug("new client,client_fd:%d,client:%p,ssl:%p,event_callbacks:%p,parser:%p",client_fd,client,client->ssl,client->callbacks,&client->parser);
+    if (buffer_length(&client->out) == 0) {
+        if (backlogged && client->response_state == RESPONSE_STATE_DONE) {
+            trace_last_byte(client);
+        }
+        if (client->close_after_flush) {
+            client->state = CLIENT_STATE_CLOSING;
+            return;
+        }
+        if (client->h2) {
+            h2_session_on_drain(client->h2);
+        } else if (backlogged && client->callbacks && client->callbacks->on_drain) {
+            client->callbacks->on_drain(client);
+        }
+    }
+    if (file_done) {
+        resume_parsing(client);
+    }
+}
 
-    if (client->callbacks && client->callbacks->on_connected) {
-        client->callbacks->on_connected(client);
+// 向解析器投递数据, 解析暂停时返回已消费的字节数
+static size_t execute_parser(struct st_client *client, const char *data, size_t length) {
+    client->parsing = true;
+    llhttp_errno_t err = llhttp_execute(&client->parser, data, length);
+    client->parsing = false;
+    if (err == HPE_OK) {
+        return length;
+    }
+    if (err == HPE_PAUSED) {
+        return llhttp_get_error_pos(&client->parser) - data;
+    }
+    if (err == HPE_PAUSED_UPGRADE) {
+        size_t consumed = llhttp_get_error_pos(&client->parser) - data;
+        if (client->ws) {
+            // 之后的数据属于WebSocket
+            return consumed;
+        }
+        // 处理器没有接受升级, 继续按HTTP/1.1解析
+        llhttp_resume_after_upgrade(&client->parser);
+        return consumed + execute_parser(client, data + consumed, length - consumed);
     }
+    log_error("llhttp error: %s", llhttp_errno_name(err));
+    client->state = CLIENT_STATE_CLOSING;
+    return length;
+}
 
-    client->io.data = client;
+// 响应写完就关闭的连接不再解析后续请求
+static bool parsing_blocked(struct st_client *client) {
+    return client->state != CLIENT_STATE_ACTIVE || client->read_paused || client->awaiting_response || client->close_after_flush || client->file;
+}
+
+// 读取没有得到数据时判断是否需要关闭连接
+static void handle_read_result(struct st_client *client, ssize_t read) {
+    if (read == IO_AGAIN) {
+        return;
+    }
+    if (read == 0) {
+        log_debug("client:%p closed by peer", client);
+    }
+    client->state = CLIENT_STATE_CLOSING;
+}
 
-    ev_io_init(&client->io, on_read, client_fd, EV_READ);
-    ev_io_start(loop, &client->io);
+// WebSocket直接读入输入缓冲区, 帧在原地解析, 未分片的消息不再拷贝
+static void read_websocket(struct st_client *client) {
+    for (;;) {
+        if (ws_process(client) != 0) {
+            // 关闭握手完成或协议错误, 写完Close帧后关闭
+            client->read_paused = true;
+            client->close_after_flush = true;
+            if (buffer_length(&client->out) == 0) {
+                client->state = CLIENT_STATE_CLOSING;
+            }
+            update_client_io(client);
+            return;
+        }
+        if (parsing_blocked(client)) {
+            return;
+        }
+        char *space = buffer_reserve(&client->in, WS_READ_SIZE);
+        if (!space) {
+            client->state = CLIENT_STATE_CLOSING;
+            return;
+        }
+        ssize_t read = client_recv(client, space, WS_READ_SIZE);
+        if (read <= 0) {
+            handle_read_result(client, read);
+            return;
+        }
+        buffer_commit(&client->in, read);
+        client->last_activity = event_loop_now(client->worker->loop);
+    }
 }
 
-// 数据发送接口
-bool send_data_to_client(struct st_client *client, const char *data, size_t length) {
-    log_debug("client:%p,data:%s,data length:%ld", client, data, length);
-    int result = SSL_write(client->ssl, data, length);
-    if (result <= 0) {
-        int err = SSL_get_error(client->ssl, result);
-        const char *error_message = "Unknown SSL write error";
-        switch (err) {
-            case SSL_ERROR_WANT_WRITE:
-            case SSL_ERROR_WANT_READ:
-                // The operation did not complete; try again later.
-                return false;
-            default:
-                error_message = "SSL write failed";
-                break;
+// 边缘触发下必须一直读到WANT_READ, 暂停时则保留未解析的数据
+static void read_from_client(struct st_client *client) {
+    char buffer[MAX_LEN];
+
+    while (!parsing_blocked(client)) {
+        if (client->ws) {
+            read_websocket(client);
+            return;
+        }
+        ssize_t read = client_recv(client, buffer, sizeof(buffer));
+        if (read <= 0) {
+            handle_read_result(client, read);
+            return;
+        }
+
+        client->last_activity = event_loop_now(client->worker->loop);
+        log_debug("client:%p,length:%zd", client, read);
+        if (client->h2) {
+            if (h2_session_feed(client->h2, buffer, read) < 0) {
+                client->state = CLIENT_STATE_CLOSING;
+            }
+            continue;
         }
-        if (client->callbacks && client->callbacks->on_error) {
-            client->callbacks->on_error(client, error_message);
+        size_t consumed = execute_parser(client, buffer, read);
+        if (consumed < (size_t)read && client->state == CLIENT_STATE_ACTIVE) {
+            if (buffer_append(&client->in, buffer + consumed, read - consumed) < 0) {
+                client->state = CLIENT_STATE_CLOSING;
+                return;
+            }
+            update_client_io(client);
         }
+    }
+}
+
+// 解除暂停: 先解析暂存的数据, 再继续从套接字读取
+static void resume_parsing(struct st_client *client) {
+    if (client->parsing || parsing_blocked(client)) {
+        return;
+    }
+    if (!client->ws && llhttp_get_errno(&client->parser) == HPE_PAUSED) {
+        llhttp_resume(&client->parser);
+    }
+    while (!client->ws && buffer_length(&client->in) > 0 && !parsing_blocked(client)) {
+        size_t consumed = execute_parser(client, buffer_data(&client->in), buffer_length(&client->in));
+        buffer_consume(&client->in, consumed);
+        if (!parsing_blocked(client) && llhttp_get_errno(&client->parser) == HPE_PAUSED) {
+            llhttp_resume(&client->parser);
+        }
+    }
+    update_client_io(client);
+    if (client->dispatching) {
+        return;
+    }
+    // 边缘触发不会为已经就绪的数据再次通知
+    client->dispatching = true;
+    read_from_client(client);
+    client->dispatching = false;
+    if (client->state == CLIENT_STATE_CLOSING) {
+        schedule_close(client);
+    }
+}
+
+static void on_client_async(st_event_loop_t *loop, st_event_io_t *w, int revents);
+
+// 监听握手任务的通知fd. 同一SSL的fd在各次暂停间不变, 只在第一次时开始监听
+static bool watch_async_fd(struct st_client *client) {
+    OSSL_ASYNC_FD fd;
+    size_t count = 0;
+    if (!SSL_get_all_async_fds(client->ssl, NULL, &count) || count != 1 || !SSL_get_all_async_fds(client->ssl, &fd, &count)) {
+        log_error("unexpected async fds:%zu", count);
+        return false;
+    }
+    if (client->async_fd == fd) {
+        event_io_start(client->worker->loop, &client->async_io);
+        return true;
+    }
+    event_io_stop(client->worker->loop, &client->async_io);
+    event_io_init(&client->async_io, on_client_async, fd, EVENT_READ, 0);
+    client->async_io.data = client;
+    if (event_io_start(client->worker->loop, &client->async_io) < 0) {
         return false;
     }
+    client->async_fd = fd;
     return true;
 }
 
-bool send_response_to_client(struct st_client *client, int status_code, const char *status_message, const char *body){
-    char response_buffer[4096];
-    size_t response_length = build_http_response(response_buffer, sizeof(response_buffer), status_code, status_message, body);
-    return send_data_to_client(client, response_buffer, response_length);
+// 连接可以收发HTTP了: TLS握手完成, 或者明文连接刚被接受. 明文连接只有HTTP/1.1
+static void start_client(struct st_client *client) {
+    client->state = CLIENT_STATE_ACTIVE;
+    client->last_activity = event_loop_now(client->worker->loop);
+
+    const unsigned char *alpn = NULL;
+    unsigned int alpn_length = 0;
+    if (client->ssl) {
+        SSL_get0_alpn_selected(client->ssl, &alpn, &alpn_length);
+    }
+    if (alpn_length == 2 && memcmp(alpn, "h2", 2) == 0) {
+        client->h2 = h2_session_new(client);
+        if (!client->h2) {
+            client->state = CLIENT_STATE_CLOSING;
+            return;
+        }
+        if (client->worker->draining) {
+            h2_session_shutdown(client->h2, false);
+        }
+    }
+    log_debug("new client,client_fd:%d,client:%p,ssl:%p,event_callbacks:%p,parser:%p",client->client_fd,client,client->ssl,client->callbacks,&client->parser);
+
+    if (client->callbacks && client->callbacks->on_connected) {
+        client->callbacks->on_connected(client);
+    }
+    update_client_io(client);
+    // 请求可能与握手的最后一个报文一起到达
+    read_from_client(client);
 }
 
-bool start_https_server(const char *cert_file, const char *key_file, int port, event_callbacks *callbacks) {
-    signal(SIGPIPE, SIG_IGN);
-    SSL_CTX *ctx = init_server_ssl(cert_file, key_file);
-    if (!ctx) {
-        return false;
+static void do_handshake(struct st_client *client) {
+    st_event_loop_t *loop = client->worker->loop;
+    if (SSL_in_before(client->ssl)) {
+        TRACE_POINT(client, handshake_start, TRACE_HANDSHAKE_START);
+    }
+    int ret = SSL_do_handshake(client->ssl);
+    if (ret != 1) {
+        int err = SSL_get_error(client->ssl, ret);
+        if (err == SSL_ERROR_WANT_READ) {
+            event_io_set(loop, &client->io, EVENT_READ);
+        } else if (err == SSL_ERROR_WANT_WRITE) {
+            event_io_set(loop, &client->io, EVENT_READ | EVENT_WRITE);
+        } else if (err == SSL_ERROR_WANT_ASYNC) {
+            // 私钥运算在线程池中, 套接字事件暂停到通知fd可读
+            event_io_set(loop, &client->io, 0);
+            if (!watch_async_fd(client)) {
+                client->state = CLIENT_STATE_CLOSING;
+            }
+        } else {
+            handle_error(client, ret, "SSL accept failed");
+            client->state = CLIENT_STATE_CLOSING;
+        }
+        return;
     }
 
-    int server_fd = create_server_socket(port);
-    if (server_fd < 0) {
-        cleanup_ssl(ctx);
-        return false;
+    if (client->async_fd >= 0) {
+        event_io_stop(loop, &client->async_io);
     }
+    // 之后的读写不再经过ASYNC任务
+    SSL_clear_mode(client->ssl, SSL_MODE_ASYNC);
+    TRACE_POINT(client, handshake_end, TRACE_HANDSHAKE_END);
+    start_client(client);
+}
 
-    struct ev_loop *loop = init_event_loop();
-    struct ev_io io_accept;
+// 低内存模式: 连接空闲时释放输入输出缓冲区, 两个请求之间再释放请求存储和响应头缓冲区.
+// 读取本来就经过循环栈上的缓冲区, 只有未解析完的数据才留在连接上
+static void release_idle_memory(struct st_client *client) {
+    if (!client->worker->params->options.low_memory || client->state != CLIENT_STATE_ACTIVE) {
+        return;
+    }
+    if (buffer_length(&client->in) == 0) {
+        buffer_free(&client->in);
+    }
+    if (buffer_length(&client->out) == 0) {
+        buffer_free(&client->out);
+    }
+    if (client->h2 || client->ws || client->file || client->response_state != RESPONSE_STATE_DONE || client->awaiting_response ||
+        client->offload || client->proxy || client->flight || client->flight_waiter || client->parsing) {
+        return;
+    }
+    request_free(&client->request);
+    buffer_free(&client->extra_headers);
+    buffer_free(&client->cache_key);
+}
 
-    // Create a struct to hold both the SSL context and the callbacks
-    struct st_server_params *server_data = malloc(sizeof(st_server_params_t));
+static void on_client_io(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    struct st_client *client = (struct st_client *)w->data;
 
-    if (!server_data) {
-        log_error("malloc");
-        close(server_fd);
-        cleanup_ssl(ctx);
-        return false;
+    client->dispatching = true;
+    if (client->state == CLIENT_STATE_HANDSHAKE) {
+        do_handshake(client);
+    } else {
+        if (revents & EVENT_WRITE) {
+            flush_client(client);
+        }
+        read_from_client(client);
     }
+    client->dispatching = false;
 
-    server_data->ctx = ctx;
-    server_data->callbacks = callbacks;
-    log_debug("loop:%p,server_fd:%d,ctx:%p",loop,server_fd,ctx);
+    if (client->h2) {
+        h2_session_collect(client->h2);
+    }
+    if (client->state == CLIENT_STATE_CLOSING) {
+        close_client(client);
+        return;
+    }
+    release_idle_memory(client);
+}
 
-    ev_io_init(&io_accept, on_client_accept, server_fd, EV_READ);
-    io_accept.data = server_data;
+// 循环阻塞之前: 本轮各个回调产生的TLS记录, 每个连接一次写出
+static void on_flush_prepare(st_event_loop_t *loop, st_event_prepare_t *p) {
+    st_server_worker_t *worker = (st_server_worker_t *)p->data;
+    struct st_client *client;
+    while ((client = worker->flushing)) {
+        unqueue_flush(client);
+        if (client->state != CLIENT_STATE_CLOSING) {
+            client->dispatching = true;
+            flush_client(client);
+            client->dispatching = false;
+            if (client->h2) {
+                h2_session_collect(client->h2);
+            }
+        }
+        if (client->state == CLIENT_STATE_CLOSING) {
+            close_client(client);
+            continue;
+        }
+        release_idle_memory(client);
+    }
+}
 
-    ev_io_start(loop, &io_accept);
-    ev_run(loop, 0);
+// 线程池中的私钥运算完成, 恢复暂停的握手任务
+static void on_client_async(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    struct st_client *client = (struct st_client *)w->data;
+    uint64_t count;
+    while (read(client->async_fd, &count, sizeof(count)) > 0) {
+    }
 
-    close(server_fd);
+    client->dispatching = true;
+    if (client->state == CLIENT_STATE_HANDSHAKE) {
+        event_io_set(loop, &client->io, EVENT_READ);
+        do_handshake(client);
+    } else if (client->state == CLIENT_STATE_CLOSING && SSL_waiting_for_async(client->ssl)) {
+        // 连接已在等待中关闭, 只让任务运行到结束
+        SSL_do_handshake(client->ssl);
+        ERR_clear_error();
+    }
+    client->dispatching = false;
+
+    if (client->state == CLIENT_STATE_CLOSING) {
+        close_client(client);
+    }
+}
+
+// 空闲超时: 只在到期时检查最后活动时间, 避免每次读写都重置定时器
+static void on_client_timeout(st_event_loop_t *loop, st_event_timer_t *t) {
+    struct st_client *client = (struct st_client *)t->data;
+    if (client->h2) {
+        h2_session_collect(client->h2);
+    }
+    if (client->state == CLIENT_STATE_CLOSING) {
+        close_client(client);
+        return;
+    }
+    if (client->worker->params->options.idle_timeout <= 0) {
+        return;
+    }
+    if (client->sse) {
+        // 事件流本来就可能长时间没有输入输出, 断开的对端由心跳发现
+        event_timer_start(loop, t, client->worker->params->options.idle_timeout);
+        return;
+    }
+    double remaining = client->last_activity + client->worker->params->options.idle_timeout - event_loop_now(loop);
+    if (remaining > 0) {
+        event_timer_start(loop, t, remaining);
+        return;
+    }
+    log_debug("client:%p idle timeout", client);
+    close_client(client);
+}
+
+static void create_client(st_server_worker_t *worker, int client_fd, listener_type_t type) {
+    st_server_params_t *server_data = worker->params;
+    st_event_loop_t *loop = worker->loop;
+
+    struct st_client *client = calloc(1, sizeof(struct st_client));
+    if (!client) {
+        log_error("malloc");
+        close(client_fd);
+        return;
+    }
+    client->client_fd = client_fd;
+    client->worker = worker;
+    client->callbacks = server_data->callbacks;
+    client->state = CLIENT_STATE_HANDSHAKE;
+    // 还没有请求, 与上一个响应已结束的keep-alive连接一样视为空闲
+    client->response_state = RESPONSE_STATE_DONE;
+    client->last_activity = event_loop_now(loop);
+    client->async_fd = -1;
+
+    if (type == LISTENER_TLS) {
+        client->ssl = SSL_new(server_data->ctx);
+        if (!client->ssl) {
+            log_error("SSL_new");
+            close(client_fd);
+            free(client);
+            return;
+        }
+        // 写出的记录留在输出缓冲区, 本轮循环结束时一次写出
+        BIO *bio = socket_bio_new(client_fd, &client->out, queue_flush, client);
+        if (!bio) {
+            SSL_free(client->ssl);
+            close(client_fd);
+            free(client);
+            return;
+        }
+        SSL_set_bio(client->ssl, bio, bio);
+        // 一次recv读入记录头和记录体, 以及已经到达的后续记录
+        SSL_set_read_ahead(client->ssl, 1);
+        SSL_set_accept_state(client->ssl);
+        SSL_set_app_data(client->ssl, client);
+        if (server_data->crypto) {
+            SSL_set_mode(client->ssl, SSL_MODE_ASYNC);
+        }
+    }
+
+    llhttp_init(&client->parser, HTTP_REQUEST, &request_settings);
+    client->parser.data = client;
+
+    event_io_init(&client->io, on_client_io, client_fd, EVENT_READ, 0);
+    client->io.data = client;
+    if (event_io_start(loop, &client->io) < 0) {
+        SSL_free(client->ssl);
+        close(client_fd);
+        free(client);
+        return;
+    }
+
+    event_timer_init(&client->timer, on_client_timeout, 0);
+    client->timer.data = client;
+    if (server_data->options.idle_timeout > 0) {
+        event_timer_start(loop, &client->timer, server_data->options.idle_timeout);
+    }
+
+    client->next = worker->clients;
+    if (worker->clients) {
+        worker->clients->prev = client;
+    }
+    worker->clients = client;
+    worker->client_count++;
+
+    client->trace = trace_begin(server_data->tracer, worker->id);
+    TRACE_POINT(client, accept, TRACE_ACCEPT);
+
+    if (!client->ssl) {
+        // 明文连接没有握手, 请求可能已经随连接到达
+        client->dispatching = true;
+        start_client(client);
+        client->dispatching = false;
+        if (client->state == CLIENT_STATE_CLOSING) {
+            close_client(client);
+        }
+    }
+}
+
+static void init_request_settings(void) {
+    llhttp_settings_init(&request_settings);
+    request_settings.on_message_begin = on_message_begin;
+    request_settings.on_url = on_url;
+    request_settings.on_url_complete = on_url_complete;
+    request_settings.on_header_field = on_header_field;
+    request_settings.on_header_field_complete = on_header_field_complete;
+    request_settings.on_header_value = on_header_value;
+    request_settings.on_header_value_complete = on_header_value_complete;
+    request_settings.on_headers_complete = on_headers_complete;
+    request_settings.on_body = on_body;
+    request_settings.on_message_complete = on_message_complete;
+}
+
+static void on_client_accept(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    st_server_worker_t *worker = (st_server_worker_t *)w->data;
+    listener_type_t type = (listener_type_t)(w - worker->io_accept);
+
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(w->fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            // 监听套接字被多个线程共享, 其他线程可能已经取走了连接
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if (type != LISTENER_UNIX) {
+            int nodelay = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        log_debug("worker:%d,client_fd:%d,listener:%d", worker->id, client_fd, type);
+        create_client(worker, client_fd, type);
+    }
+}
+
+// 数据发送接口, 套接字写满时剩余数据进入连接的输出缓冲区.
+// TLS连接只加密到输出缓冲区, 本轮循环结束时写出; 积压到高水位时先写一次
+bool send_data_to_client(struct st_client *client, const char *data, size_t length) {
+    log_debug("client:%p,data length:%ld", client, length);
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_send_data(job, data, length);
+    }
+    if (client->h2_stream) {
+        return h2_send_data(client, data, length, false);
+    }
+    if (client->state != CLIENT_STATE_ACTIVE) {
+        return false;
+    }
+    if (client->ssl) {
+        if (!encrypt_to_output(client, data, length)) {
+            schedule_close(client);
+            return false;
+        }
+        if (buffer_length(&client->out) >= OUTPUT_HIGH_WATERMARK) {
+            if (!write_pending(client)) {
+                schedule_close(client);
+                return false;
+            }
+            update_client_io(client);
+        }
+        return true;
+    }
+
+    while (length > 0 && pending_output(client) == 0) {
+        ssize_t result = client_send(client, data, length, 0);
+        if (result > 0) {
+            data += result;
+            length -= result;
+            continue;
+        }
+        if (result != IO_AGAIN) {
+            schedule_close(client);
+            return false;
+        }
+        // 套接字写满, 剩余的数据在下面排队
+        break;
+    }
+
+    if (length > 0) {
+        if (buffer_append(&client->out, data, length) < 0) {
+            schedule_close(client);
+            return false;
+        }
+        update_client_io(client);
+    }
+    return true;
+}
+
+// 多段数据一起发送: 明文连接直接writev, 不拼接也不逐段写; TLS连接等逐段交给send_data_to_client,
+// 总长不超过一个记录时先拼接, 只加密成一个记录(HTTP/2流则是一个DATA帧)
+bool send_vector_to_client(struct st_client *client, struct iovec *iov, int count) {
+    if ((client->ssl || client->h2_stream) && !offload_capture(client)) {
+        size_t total = 0;
+        for (int i = 0; i < count; i++) {
+            total += iov[i].iov_len;
+        }
+        if (total <= TLS_RECORD_SIZE) {
+            char record[TLS_RECORD_SIZE];
+            size_t length = 0;
+            for (int i = 0; i < count; i++) {
+                memcpy(record + length, iov[i].iov_base, iov[i].iov_len);
+                length += iov[i].iov_len;
+            }
+            return send_data_to_client(client, record, length);
+        }
+    }
+    if (client->ssl || client->h2_stream || offload_capture(client) || client->state != CLIENT_STATE_ACTIVE || pending_output(client) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (!send_data_to_client(client, iov[i].iov_base, iov[i].iov_len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    int first = 0;
+    while (first < count) {
+        ssize_t n = writev(client->client_fd, iov + first, count - first);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            handle_error(client, -1, "write failed");
+            schedule_close(client);
+            return false;
+        }
+        while (first < count && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    if (first == count) {
+        return true;
+    }
+    for (; first < count; first++) {
+        if (buffer_append(&client->out, iov[first].iov_base, iov[first].iov_len) < 0) {
+            schedule_close(client);
+            return false;
+        }
+    }
+    update_client_io(client);
+    return true;
+}
+
+// 响应结束: 非keep-alive连接在写完后关闭, 否则继续解析流水线上的请求
+static bool complete_response(struct st_client *client) {
+    client->response_state = RESPONSE_STATE_DONE;
+    TRACE_POINT(client, handler_end, TRACE_HANDLER_END);
+    if (client->h2_stream) {
+        return true;
+    }
+    if (pending_output(client) == 0) {
+        trace_last_byte(client);
+    }
+    if (!client->keep_alive) {
+        client->close_after_flush = true;
+        if (pending_output(client) == 0) {
+            schedule_close(client);
+        }
+        return true;
+    }
+    if (client->awaiting_response) {
+        client->awaiting_response = false;
+        resume_parsing(client);
+    }
+    return true;
+}
+
+// 响应头: Content-Type/Content-Encoding/Vary, 以及处理器添加的头部
+static int response_headers(struct st_client *client, st_header_pair_t *headers, const char *content_type, bool compressible, content_encoding_t encoding) {
+    int count = 0;
+    headers[count++] = (st_header_pair_t){"Content-Type", content_type};
+    if (encoding != CONTENT_ENCODING_IDENTITY) {
+        headers[count++] = (st_header_pair_t){"Content-Encoding", content_encoding_name(encoding)};
+    }
+    if (compressible) {
+        headers[count++] = (st_header_pair_t){"Vary", "Accept-Encoding"};
+    }
+    const char *p = buffer_data(&client->extra_headers);
+    for (int i = 0; i < client->extra_header_count; i++) {
+        const char *name = p;
+        const char *value = name + strlen(name) + 1;
+        headers[count++] = (st_header_pair_t){name, value};
+        p = value + strlen(value) + 1;
+    }
+    return count;
+}
+
+bool add_response_header(struct st_client *client, const char *name, const char *value) {
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_add_header(job, name, value);
+    }
+    if (client->response_state != RESPONSE_STATE_NONE || client->extra_header_count >= MAX_EXTRA_RESPONSE_HEADERS) {
+        return false;
+    }
+    if (buffer_append(&client->extra_headers, name, strlen(name) + 1) < 0 ||
+        buffer_append(&client->extra_headers, value, strlen(value) + 1) < 0) {
+        return false;
+    }
+    client->extra_header_count++;
+    return true;
+}
+
+// 处理器添加的响应头, 不区分大小写
+static const char *find_extra_header(struct st_client *client, const char *name) {
+    const char *p = buffer_data(&client->extra_headers);
+    for (int i = 0; i < client->extra_header_count; i++) {
+        const char *value = p + strlen(p) + 1;
+        if (strcasecmp(p, name) == 0) {
+            return value;
+        }
+        p = value + strlen(value) + 1;
+    }
+    return NULL;
+}
+
+// 为GET请求生成缓存键: 方法, URL, 协商出的压缩方式和配置的Vary请求头
+static bool build_cache_key(struct st_client *client) {
+    const st_server_options_t *options = &client->worker->params->options;
+    st_buffer_t *key = &client->cache_key;
+    buffer_reset(key);
+    const char *url = get_request_url(client);
+    if (buffer_append(key, "GET ", 4) < 0 || buffer_append(key, url, strlen(url) + 1) < 0) {
+        return false;
+    }
+    if (options->compress) {
+        char encoding = '0' + (char)response_encoding(client);
+        if (buffer_append(key, &encoding, 1) < 0) {
+            return false;
+        }
+    }
+    const char *vary = options->cache_vary;
+    while (*vary) {
+        while (*vary == ' ' || *vary == ',') {
+            vary++;
+        }
+        size_t length = strcspn(vary, ", ");
+        if (length == 0) {
+            break;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s", (int)length, vary);
+        const char *value = get_request_header(client, name);
+        // 头部缺失与值为空要区分开
+        if (buffer_append(key, value ? "+" : "-", 1) < 0 ||
+            (value && buffer_append(key, value, strlen(value) + 1) < 0)) {
+            return false;
+        }
+        vary += length;
+    }
+    return true;
+}
+
+// 发送序列化好的响应, 其中的Connection行换成本连接的
+static bool send_serialized_response(struct st_client *client, const char *data, size_t length, size_t connection_offset, size_t connection_length) {
+    const char *line = client->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    size_t line_length = strlen(line);
+    if (line_length == connection_length && memcmp(data + connection_offset, line, line_length) == 0) {
+        return send_data_to_client(client, data, length);
+    }
+    size_t skip = connection_offset + connection_length;
+    size_t rest = length - skip;
+    char buffer[MAX_LEN];
+    if (connection_offset + line_length + rest <= sizeof(buffer)) {
+        memcpy(buffer, data, connection_offset);
+        memcpy(buffer + connection_offset, line, line_length);
+        memcpy(buffer + connection_offset + line_length, data + skip, rest);
+        return send_data_to_client(client, buffer, connection_offset + line_length + rest);
+    }
+    struct iovec iov[] = {
+        {(void *)data, connection_offset},
+        {(void *)line, line_length},
+        {(void *)(data + skip), rest},
+    };
+    return send_vector_to_client(client, iov, 3);
+}
+
+// 在调用处理器之前查找缓存, 命中时直接写出序列化好的响应
+static bool serve_from_cache(struct st_client *client) {
+    st_response_cache_t *cache = client->worker->params->cache;
+    if (!cache || client->h2_stream || client->parser.method != HTTP_GET || client->parser.upgrade) {
+        return false;
+    }
+    const char *cache_control = get_request_known_header(client, HEADER_CACHE_CONTROL);
+    if (cache_control && header_has_token(cache_control, "no-store")) {
+        return false;
+    }
+    if (!build_cache_key(client)) {
+        buffer_reset(&client->cache_key);
+        return false;
+    }
+    // 客户端要求重新验证时跳过查找, 但仍用新响应更新缓存
+    if (cache_control && header_has_token(cache_control, "no-cache")) {
+        return false;
+    }
+    st_cache_entry_t *entry = response_cache_lookup(cache, buffer_data(&client->cache_key), buffer_length(&client->cache_key));
+    if (!entry) {
+        return false;
+    }
+    bool result = send_serialized_response(client, entry->data, entry->length, entry->connection_offset, strlen("Connection: keep-alive\r\n"));
+    response_cache_release(entry);
+    buffer_reset(&client->cache_key);
+    client->cache_hit = true;
+    if (result) {
+        complete_response(client);
+    }
+    return true;
+}
+
+// 按处理器给出的Cache-Control保存完整响应
+static void store_in_cache(struct st_client *client, int status_code, const char *head, size_t head_length, const char *body, size_t body_length) {
+    st_response_cache_t *cache = client->worker->params->cache;
+    if (!cache || buffer_length(&client->cache_key) == 0 || status_code != 200 || !client->keep_alive ||
+        find_extra_header(client, "Set-Cookie")) {
+        return;
+    }
+    double ttl = cache_response_ttl(find_extra_header(client, "Cache-Control"),
+                                    get_request_known_header(client, HEADER_AUTHORIZATION) != NULL);
+    if (ttl > 0) {
+        response_cache_store(cache, buffer_data(&client->cache_key), buffer_length(&client->cache_key), head, head_length, body, body_length, ttl);
+    }
+}
+
+// 等待者自己执行处理器: 超时, 或领头请求没有可共享的响应
+static void run_waiting_handler(struct st_client *client) {
+    if (client->callbacks && client->callbacks->on_body_start) {
+        client->callbacks->on_body_start(client);
+    }
+    if (client->state == CLIENT_STATE_ACTIVE && client->callbacks && client->callbacks->on_body_end) {
+        client->callbacks->on_body_end(client);
+    }
+}
+
+static void on_flight_timeout(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_flight_waiter_t *waiter = (st_flight_waiter_t *)t->data;
+    struct st_client *client = (struct st_client *)waiter->data;
+    // 结果已经在投递途中时等邮箱回调处理
+    if (!flight_cancel(client->worker->params->flights, waiter, true)) {
+        return;
+    }
+    log_debug("client:%p coalesced request timed out", client);
+    client->flight_waiter = NULL;
+    flight_waiter_free(waiter);
+    run_waiting_handler(client);
+}
+
+// 邮箱回调, 在等待者所在的线程执行
+static void on_flight_delivered(st_flight_waiter_t *waiter) {
+    struct st_client *client = (struct st_client *)waiter->data;
+    if (!client) {
+        // 连接已关闭
+        flight_waiter_free(waiter);
+        return;
+    }
+    event_timer_stop(client->worker->loop, &waiter->timer);
+    client->flight_waiter = NULL;
+    st_flight_result_t *result = waiter->result;
+    if (result) {
+        if (send_serialized_response(client, result->data, result->length, result->connection_offset, result->connection_length)) {
+            complete_response(client);
+        }
+    } else {
+        run_waiting_handler(client);
+    }
+    flight_waiter_free(waiter);
+}
+
+// 缓存未命中后, 相同的GET请求只让第一个执行处理器, 其余的挂起. 返回true表示已挂起
+static bool join_flight(struct st_client *client) {
+    st_flight_group_t *group = client->worker->params->flights;
+    if (!group || client->h2_stream || client->parser.method != HTTP_GET || client->parser.upgrade ||
+        client->parser.content_length > 0 || (client->parser.flags & F_CHUNKED)) {
+        return false;
+    }
+    // 带身份的请求的响应可能因人而异, 不与别人合并
+    if (get_request_known_header(client, HEADER_AUTHORIZATION) || get_request_known_header(client, HEADER_COOKIE)) {
+        return false;
+    }
+    char buffer[MAX_LEN];
+    const char *key = buffer;
+    size_t key_length;
+    if (client->callbacks && client->callbacks->coalesce_key) {
+        key_length = client->callbacks->coalesce_key(client, buffer, sizeof(buffer));
+        if (key_length > sizeof(buffer)) {
+            return false;
+        }
+    } else {
+        if (buffer_length(&client->cache_key) == 0 && !build_cache_key(client)) {
+            buffer_reset(&client->cache_key);
+            return false;
+        }
+        key = buffer_data(&client->cache_key);
+        key_length = buffer_length(&client->cache_key);
+    }
+    if (key_length == 0) {
+        return false;
+    }
+    st_flight_t *flight;
+    st_flight_waiter_t *waiter;
+    int role = flight_join(group, key, key_length, client->worker->mailbox, client, &flight, &waiter);
+    if (role == FLIGHT_LEADER) {
+        client->flight = flight;
+        return false;
+    }
+    if (role != FLIGHT_WAITER) {
+        return false;
+    }
+    client->flight_waiter = waiter;
+    event_timer_init(&waiter->timer, on_flight_timeout, 0);
+    waiter->timer.data = waiter;
+    event_timer_start(client->worker->loop, &waiter->timer, group->max_wait);
+    return true;
+}
+
+// 领头请求的响应交给等待者, head为空表示不能共享(流式响应, 设置了Cookie, private或no-store, 连接关闭等)
+static void finish_flight(struct st_client *client, const char *head, size_t head_length, const char *body, size_t body_length) {
+    if (!client->flight) {
+        return;
+    }
+    const char *cache_control = find_extra_header(client, "Cache-Control");
+    if (head && (find_extra_header(client, "Set-Cookie") || cache_control_has(cache_control, "private") ||
+                 cache_control_has(cache_control, "no-store"))) {
+        head = NULL;
+    }
+    flight_complete(client->worker->params->flights, client->flight, head, head_length, body, body_length);
+    client->flight = NULL;
+}
+
+static void leave_flight(struct st_client *client) {
+    finish_flight(client, NULL, 0, NULL, 0);
+    st_flight_waiter_t *waiter = client->flight_waiter;
+    if (!waiter) {
+        return;
+    }
+    client->flight_waiter = NULL;
+    event_timer_stop(client->worker->loop, &waiter->timer);
+    if (flight_cancel(client->worker->params->flights, waiter, false)) {
+        flight_waiter_free(waiter);
+    } else {
+        // 结果已在邮箱中, 由邮箱回调释放
+        waiter->data = NULL;
+    }
+}
+
+// 过载时在调用处理器之前拒绝新请求. HTTP/1.1直接写出预先生成的503并在写完后关闭连接
+bool shed_request(struct st_client *client) {
+    st_overload_t *overload = client->worker->overload;
+    if (!overload || overload_admit_request(overload)) {
+        return false;
+    }
+    client->shed = true;
+    if (client->h2_stream) {
+        add_response_header(client, "Retry-After", overload->retry_after);
+        send_response_to_client(client, 503, "Service Unavailable", OVERLOAD_BODY);
+        return true;
+    }
+    client->keep_alive = false;
+    if (send_data_to_client(client, overload->response, overload->response_length)) {
+        complete_response(client);
+    }
+    return true;
+}
+
+bool get_overload_stats(struct st_client *client, st_overload_stats_t *stats) {
+    if (!client->worker->overload) {
+        return false;
+    }
+    overload_stats(client->worker->overload, stats);
+    return true;
+}
+
+bool get_coalesce_stats(struct st_client *client, st_flight_stats_t *stats) {
+    st_flight_group_t *group = client->worker->params->flights;
+    if (!group) {
+        return false;
+    }
+    flight_stats(group, stats);
+    return true;
+}
+
+bool get_offload_stats(struct st_client *client, st_offload_stats_t *stats) {
+    st_offload_t *offload = client->worker->params->offload;
+    if (!offload) {
+        return false;
+    }
+    offload_stats(offload, stats);
+    return true;
+}
+
+bool get_async_crypto_stats(struct st_client *client, st_async_crypto_stats_t *stats) {
+    st_async_crypto_t *crypto = client->worker->params->crypto;
+    if (!crypto) {
+        return false;
+    }
+    async_crypto_stats(crypto, stats);
+    return true;
+}
+
+bool dump_trace(struct st_client *client, FILE *fp) {
+    st_tracer_t *tracer = client->worker->params->tracer;
+    if (!tracer) {
+        return false;
+    }
+    trace_dump(tracer, fp);
+    return true;
+}
+
+bool get_response_cache_stats(struct st_client *client, st_cache_stats_t *stats) {
+    st_response_cache_t *cache = client->worker->params->cache;
+    if (!cache) {
+        return false;
+    }
+    response_cache_stats(cache, stats);
+    return true;
+}
+
+bool send_response_body_to_client(struct st_client *client, int status_code, const char *status_message, const char *content_type, const char *body, size_t body_length) {
+    // 在线程池中执行的处理器只记录响应, 返回后在所属线程中写出
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_send_response(job, status_code, status_message, content_type, body, body_length);
+    }
+    char response_buffer[MAX_LEN];
+    st_header_pair_t headers[MAX_RESPONSE_HEADERS];
+    st_compress_pool_t *pool = client->worker->compress_pool;
+    content_encoding_t used = CONTENT_ENCODING_IDENTITY;
+
+    bool compressible = response_compressible(client, status_code, content_type);
+    if (compressible) {
+        content_encoding_t encoding = response_encoding(client);
+        if (encoding != CONTENT_ENCODING_IDENTITY && body_length >= client->worker->params->options.compress_min_size) {
+            st_compressor_t *compressor = compressor_acquire(pool, encoding);
+            if (compressor) {
+                buffer_reset(&pool->scratch);
+                // 压缩后没有变小就发送原文
+                if (compressor_write(compressor, body, body_length, Z_FINISH, append_to_buffer, &pool->scratch) == 0 &&
+                    buffer_length(&pool->scratch) < body_length) {
+                    body = buffer_data(&pool->scratch);
+                    body_length = buffer_length(&pool->scratch);
+                    used = encoding;
+                }
+                compressor_release(pool, compressor);
+            }
+        }
+    }
+    int header_count = response_headers(client, headers, content_type, compressible, used);
+
+    bool result;
+    if (client->h2_stream) {
+        result = h2_send_headers(client, status_code, headers, header_count, (long long)body_length, body_length == 0) &&
+                 (body_length == 0 || h2_send_data(client, body, body_length, true));
+    } else {
+        size_t head_length = build_http_response_head(client, response_buffer, sizeof(response_buffer), status_code, status_message, headers, header_count, (long long)body_length);
+        if (head_length >= sizeof(response_buffer)) {
+            log_error("response head too large");
+            finish_flight(client, NULL, 0, NULL, 0);
+            return false;
+        }
+        store_in_cache(client, status_code, response_buffer, head_length, body, body_length);
+        finish_flight(client, response_buffer, head_length, body, body_length);
+        // 小响应合并成一次写入, 即一个TLS记录
+        if (head_length + body_length <= sizeof(response_buffer)) {
+            memcpy(response_buffer + head_length, body, body_length);
+            result = send_data_to_client(client, response_buffer, head_length + body_length);
+        } else {
+            struct iovec iov[] = {{response_buffer, head_length}, {(void *)body, body_length}};
+            result = send_vector_to_client(client, iov, 2);
+        }
+    }
+    // 偶发的大响应不必一直占着压缩缓冲区
+    if (used != CONTENT_ENCODING_IDENTITY && pool->scratch.capacity > COMPRESS_SCRATCH_MAX) {
+        buffer_free(&pool->scratch);
+    }
+    return result && complete_response(client);
+}
+
+// 读出文件的一段, 文件比预期短时失败
+static bool read_file_range(int fd, char *data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, data, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool send_file_to_client(struct st_client *client, int status_code, const char *status_message, const char *content_type, int fd, off_t offset, size_t length) {
+    if (offload_capture(client) || client->h2_stream) {
+        // 线程池中的处理器和HTTP/2流不直接写套接字, 读入内存按普通响应发送
+        char *body = malloc(length > 0 ? length : 1);
+        bool result = body && read_file_range(fd, body, length, offset) &&
+                      send_response_body_to_client(client, status_code, status_message, content_type, body, length);
+        free(body);
+        close(fd);
+        return result;
+    }
+    if (client->response_state != RESPONSE_STATE_NONE || client->state != CLIENT_STATE_ACTIVE) {
+        log_error("client:%p cannot send file", client);
+        close(fd);
+        return false;
+    }
+    char head[MAX_LEN];
+    st_header_pair_t headers[MAX_RESPONSE_HEADERS];
+    int header_count = response_headers(client, headers, content_type, false, CONTENT_ENCODING_IDENTITY);
+    size_t head_length = build_http_response_head(client, head, sizeof(head), status_code, status_message, headers, header_count, (long long)length);
+    // 文件响应不缓存也不共享, 等待者自己执行处理器
+    finish_flight(client, NULL, 0, NULL, 0);
+    if (head_length >= sizeof(head)) {
+        log_error("response head too large");
+        close(fd);
+        return false;
+    }
+    if (length == 0) {
+        close(fd);
+        return send_data_to_client(client, head, head_length) && complete_response(client);
+    }
+    client->file = malloc(sizeof(st_file_output_t));
+    if (!client->file) {
+        close(fd);
+        return false;
+    }
+    *client->file = (st_file_output_t){fd, offset, length};
+    // 明文连接的头部排在输出缓冲区中, 与文件的第一段连续写出
+    if (!send_data_to_client(client, head, head_length)) {
+        free_file_output(client);
+        return false;
+    }
+    // 边缘触发下套接字写满之后才会再有写事件, 先写到写满为止
+    if (!write_pending(client)) {
+        schedule_close(client);
+        return false;
+    }
+    if (client->file->remaining == 0) {
+        free_file_output(client);
+    }
+    update_client_io(client);
+    return complete_response(client);
+}
+
+bool send_response_to_client(struct st_client *client, int status_code, const char *status_message, const char *body){
+    return send_response_body_to_client(client, status_code, status_message, "text/plain", body, strlen(body));
+}
+
+bool start_response_to_client(struct st_client *client, int status_code, const char *status_message, const char *content_type) {
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_start_response(job, status_code, status_message, content_type);
+    }
+    if (client->response_state != RESPONSE_STATE_NONE) {
+        log_error("client:%p response already started", client);
+        return false;
+    }
+    char head[MAX_LEN];
+    st_header_pair_t headers[MAX_RESPONSE_HEADERS];
+    content_encoding_t used = CONTENT_ENCODING_IDENTITY;
+    bool compressible = response_compressible(client, status_code, content_type);
+    if (compressible) {
+        content_encoding_t encoding = response_encoding(client);
+        if (encoding != CONTENT_ENCODING_IDENTITY) {
+            client->compressor = compressor_acquire(client->worker->compress_pool, encoding);
+            if (client->compressor) {
+                used = encoding;
+            }
+        }
+    }
+    int header_count = response_headers(client, headers, content_type, compressible, used);
+    client->response_state = RESPONSE_STATE_STREAMING;
+    finish_flight(client, NULL, 0, NULL, 0);
+    if (client->h2_stream) {
+        return h2_send_headers(client, status_code, headers, header_count, -1, false);
+    }
+
+    size_t head_length = build_http_response_head(client, head, sizeof(head), status_code, status_message, headers, header_count, -1);
+    if (head_length >= sizeof(head)) {
+        log_error("response head too large");
+        return false;
+    }
+    if (!client->chunked) {
+        client->keep_alive = false;
+    }
+    return send_data_to_client(client, head, head_length);
+}
+
+bool start_response_with_headers(struct st_client *client, int status_code, const char *status_message, const st_header_pair_t *headers, int header_count, long long content_length) {
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_start_with_headers(job, status_code, status_message, headers, header_count, content_length);
+    }
+    if (client->response_state != RESPONSE_STATE_NONE) {
+        log_error("client:%p response already started", client);
+        return false;
+    }
+    client->response_state = RESPONSE_STATE_STREAMING;
+    finish_flight(client, NULL, 0, NULL, 0);
+    if (client->h2_stream) {
+        return h2_send_headers(client, status_code, headers, header_count, content_length, false);
+    }
+    char head[4 * MAX_LEN];
+    if (content_length >= 0) {
+        // 长度已知, 正文原样发送
+        client->chunked = false;
+    } else if (!client->chunked) {
+        client->keep_alive = false;
+    }
+    size_t head_length = build_http_response_head(client, head, sizeof(head), status_code, status_message, headers, header_count, content_length);
+    if (head_length >= sizeof(head)) {
+        log_error("response head too large");
+        return false;
+    }
+    return send_data_to_client(client, head, head_length);
+}
+
+void abort_response_to_client(struct st_client *client) {
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        offload_abort_response(job);
+        return;
+    }
+    if (client->response_state == RESPONSE_STATE_DONE) {
+        return;
+    }
+    client->response_state = RESPONSE_STATE_DONE;
+    if (client->h2_stream) {
+        h2_stream_abort(client);
+        return;
+    }
+    // 响应已经开始, 只能在写完已有数据后关闭连接, 对端据此发现响应不完整
+    client->keep_alive = false;
+    client->close_after_flush = true;
+    if (pending_output(client) == 0) {
+        schedule_close(client);
+    }
+}
+
+// 发送一个chunk, HTTP/1.0下直接发送原始数据
+static bool send_chunk_frame(struct st_client *client, const char *data, size_t length) {
+    if (!client->chunked || client->h2_stream) {
+        return send_data_to_client(client, data, length);
+    }
+
+    char chunk[MAX_LEN];
+    int prefix = snprintf(chunk, sizeof(chunk), "%zx\r\n", length);
+    if (prefix + length + 2 <= sizeof(chunk)) {
+        memcpy(chunk + prefix, data, length);
+        memcpy(chunk + prefix + length, "\r\n", 2);
+        return send_data_to_client(client, chunk, prefix + length + 2);
+    }
+    struct iovec iov[] = {{chunk, prefix}, {(void *)data, length}, {"\r\n", 2}};
+    return send_vector_to_client(client, iov, 3);
+}
+
+static int chunk_sink(void *ctx, const char *data, size_t length) {
+    return send_chunk_frame((struct st_client *)ctx, data, length) ? 0 : -1;
+}
+
+bool send_response_chunk(struct st_client *client, const char *data, size_t length) {
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_send_chunk(job, data, length);
+    }
+    if (client->response_state != RESPONSE_STATE_STREAMING) {
+        return false;
+    }
+    // 空块会被当作响应结束
+    if (length == 0) {
+        return true;
+    }
+    if (client->compressor) {
+        // 每块都同步刷新, 保证已写入的数据能立刻被对端解压
+        return compressor_write(client->compressor, data, length, Z_SYNC_FLUSH, chunk_sink, client) == 0;
+    }
+    return send_chunk_frame(client, data, length);
+}
+
+bool finish_response_to_client(struct st_client *client) {
+    st_offload_job_t *job = offload_capture(client);
+    if (job) {
+        return offload_finish_response(job);
+    }
+    if (client->response_state != RESPONSE_STATE_STREAMING) {
+        return false;
+    }
+    if (client->compressor) {
+        int ret = compressor_write(client->compressor, NULL, 0, Z_FINISH, chunk_sink, client);
+        compressor_release(client->worker->compress_pool, client->compressor);
+        client->compressor = NULL;
+        if (ret != 0) {
+            return false;
+        }
+    }
+    if (client->h2_stream) {
+        if (!h2_send_data(client, NULL, 0, true)) {
+            return false;
+        }
+    } else if (client->chunked && !send_data_to_client(client, "0\r\n\r\n", 5)) {
+        return false;
+    }
+    return complete_response(client);
+}
+
+bool client_output_full(struct st_client *client) {
+    if (offload_capture(client)) {
+        return false;
+    }
+    if (client->h2_stream) {
+        return h2_stream_backlog(client) >= OUTPUT_HIGH_WATERMARK;
+    }
+    return pending_output(client) >= OUTPUT_HIGH_WATERMARK;
+}
+
+// 交给线程池时请求体已经收齐, 暂停和恢复没有意义
+void pause_client_reading(struct st_client *client) {
+    if (offload_capture(client)) {
+        return;
+    }
+    if (client->h2_stream) {
+        h2_stream_pause(client);
+        return;
+    }
+    client->read_paused = true;
+    update_client_io(client);
+}
+
+void resume_client_reading(struct st_client *client) {
+    if (offload_capture(client)) {
+        return;
+    }
+    if (client->h2_stream) {
+        h2_stream_resume(client);
+        return;
+    }
+    if (!client->read_paused) {
+        return;
+    }
+    client->read_paused = false;
+    resume_parsing(client);
+}
+
+const char *get_request_method(struct st_client *client) {
+    return llhttp_method_name((llhttp_method_t)client->parser.method);
+}
+
+const char *get_request_url(struct st_client *client) {
+    return client->request.head.data ? client->request.head.data + client->request.url : "";
+}
+
+const char *get_request_header(struct st_client *client, const char *name) {
+    return request_find_header(&client->request, name);
+}
+
+const char *get_request_known_header(struct st_client *client, int id) {
+    return request_get_header(&client->request, id);
+}
+
+bool is_websocket_request(struct st_client *client) {
+    if (client->h2_stream || client->ws || client->parser.method != HTTP_GET || !client->parser.upgrade) {
+        return false;
+    }
+    const char *upgrade = get_request_known_header(client, HEADER_UPGRADE);
+    const char *connection = get_request_known_header(client, HEADER_CONNECTION);
+    const char *version = get_request_known_header(client, HEADER_SEC_WEBSOCKET_VERSION);
+    return upgrade && header_has_token(upgrade, "websocket") &&
+           connection && header_has_token(connection, "upgrade") &&
+           get_request_known_header(client, HEADER_SEC_WEBSOCKET_KEY) &&
+           version && strcmp(version, "13") == 0;
+}
+
+bool accept_websocket(struct st_client *client, const char *protocol) {
+    if (!is_websocket_request(client) || client->response_state != RESPONSE_STATE_NONE) {
+        return false;
+    }
+    char accept[32];
+    char head[MAX_LEN];
+    ws_accept_key(get_request_known_header(client, HEADER_SEC_WEBSOCKET_KEY), accept);
+    size_t length = snprintf(head, sizeof(head),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "%s%s%s"
+        "\r\n",
+        accept, protocol ? "Sec-WebSocket-Protocol: " : "", protocol ? protocol : "", protocol ? "\r\n" : "");
+    if (length >= sizeof(head)) {
+        return false;
+    }
+
+    client->ws = ws_create(client->worker->params->options.ws_max_message_size);
+    if (!client->ws) {
+        return false;
+    }
+    client->response_state = RESPONSE_STATE_DONE;
+    client->keep_alive = true;
+    if (!send_data_to_client(client, head, length)) {
+        return false;
+    }
+    // 在on_body_end之后才接受时, 解析器停在请求末尾, 暂存的数据属于WebSocket
+    if (client->awaiting_response) {
+        client->awaiting_response = false;
+        resume_parsing(client);
+    }
+    return true;
+}
+
+bool accept_event_stream(struct st_client *client, const char *topics) {
+    if (!client->worker->sse || offload_capture(client) || client->response_state != RESPONSE_STATE_NONE) {
+        return false;
+    }
+    static const st_header_pair_t headers[] = {
+        {"Content-Type", "text/event-stream"},
+        {"Cache-Control", "no-cache"}
+    };
+    if (!start_response_with_headers(client, 200, "OK", headers, 2, -1)) {
+        return false;
+    }
+    if (!sse_subscribe(client->worker->sse, client, topics)) {
+        abort_response_to_client(client);
+        return false;
+    }
+    return true;
+}
+
+bool get_sse_stats(struct st_client *client, st_sse_stats_t *stats) {
+    if (!client->worker->params->options.sse) {
+        return false;
+    }
+    sse_stats(client->worker->params->options.sse, stats);
+    return true;
+}
+
+bool get_ocsp_stats(struct st_client *client, st_ocsp_stats_t *stats) {
+    if (!client->worker->params->ocsp) {
+        return false;
+    }
+    ocsp_stapler_stats(client->worker->params->ocsp, stats);
+    return true;
+}
+
+bool get_capture_stats(struct st_client *client, st_capture_stats_t *stats) {
+    if (!client->worker->params->capture) {
+        return false;
+    }
+    capture_stats(client->worker->params->capture, stats);
+    return true;
+}
+
+void init_server_options(st_server_options_t *options) {
+    options->engine = EVENT_ENGINE_LIBEV;
+    options->workers = 1;
+    options->max_events = EPOLL_DEFAULT_MAX_EVENTS;
+    options->plain_port = 0;
+    options->unix_path[0] = '\0';
+    options->idle_timeout = 60;
+    options->compress = false;
+    options->compress_level = Z_DEFAULT_COMPRESSION;
+    options->compress_min_size = 256;
+    snprintf(options->compress_types, sizeof(options->compress_types), "%s", DEFAULT_COMPRESS_TYPES);
+    options->http2 = false;
+    options->ws_max_message_size = WS_DEFAULT_MAX_MESSAGE_SIZE;
+    options->cache = false;
+    options->cache_shards = RESPONSE_CACHE_DEFAULT_SHARDS;
+    options->cache_capacity = RESPONSE_CACHE_DEFAULT_CAPACITY;
+    options->cache_max_entry = RESPONSE_CACHE_DEFAULT_MAX_ENTRY;
+    options->cache_vary[0] = '\0';
+    options->coalesce = false;
+    options->coalesce_max_wait = FLIGHT_DEFAULT_MAX_WAIT;
+    options->proxy = NULL;
+    options->overload = false;
+    options->overload_target_lag = OVERLOAD_DEFAULT_TARGET_LAG;
+    options->overload_pause_lag = OVERLOAD_DEFAULT_PAUSE_LAG;
+    options->overload_retry_after = OVERLOAD_DEFAULT_RETRY_AFTER;
+    options->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    options->low_memory = false;
+    options->tcp_cork = false;
+    options->dynamic_records = true;
+    options->small_record_size = DEFAULT_SMALL_RECORD_SIZE;
+    options->record_boost_bytes = DEFAULT_RECORD_BOOST_BYTES;
+    options->record_idle_reset = DEFAULT_RECORD_IDLE_RESET;
+    options->offload = false;
+    options->offload_threads = OFFLOAD_DEFAULT_THREADS;
+    options->offload_max_body = OFFLOAD_DEFAULT_MAX_BODY;
+    options->offload_paths[0] = '\0';
+    options->async_crypto = false;
+    options->async_crypto_threads = ASYNC_CRYPTO_DEFAULT_THREADS;
+    options->trace = false;
+    options->trace_sample_rate = TRACE_DEFAULT_SAMPLE_RATE;
+    options->trace_capacity = TRACE_DEFAULT_CAPACITY;
+    options->trace_file[0] = '\0';
+    options->capture = false;
+    options->capture_sample_rate = CAPTURE_DEFAULT_SAMPLE_RATE;
+    options->capture_max_body = CAPTURE_DEFAULT_MAX_BODY;
+    snprintf(options->capture_file, sizeof(options->capture_file), "capture.bin");
+    snprintf(options->capture_redact, sizeof(options->capture_redact), "%s", CAPTURE_DEFAULT_REDACT);
+    options->ocsp = false;
+    options->ocsp_file[0] = '\0';
+    options->ocsp_url[0] = '\0';
+    options->ocsp_issuer[0] = '\0';
+    options->ocsp_refresh = OCSP_DEFAULT_REFRESH;
+    options->ocsp_timeout = OCSP_DEFAULT_TIMEOUT;
+    options->sse = NULL;
+}
+
+void load_server_options(st_server_options_t *options, const st_config_file_t *config) {
+    const char *value = get_config_value(config, "server", "engine");
+    if (value && event_engine_from_string(value, &options->engine) < 0) {
+        log_warn("unknown engine %s, using %s", value, event_engine_name(options->engine));
+    }
+    if ((value = get_config_value(config, "server", "workers"))) {
+        options->workers = atoi(value);
+    }
+    if ((value = get_config_value(config, "server", "max_events"))) {
+        options->max_events = atoi(value);
+    }
+    if ((value = get_config_value(config, "server", "plain_port"))) {
+        options->plain_port = atoi(value);
+    }
+    if ((value = get_config_value(config, "server", "unix_path"))) {
+        snprintf(options->unix_path, sizeof(options->unix_path), "%s", value);
+    }
+    if ((value = get_config_value(config, "server", "idle_timeout"))) {
+        options->idle_timeout = atof(value);
+    }
+    if ((value = get_config_value(config, "server", "http2"))) {
+        options->http2 = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "websocket", "max_message_size"))) {
+        options->ws_max_message_size = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "cache", "enable"))) {
+        options->cache = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "cache", "shards"))) {
+        options->cache_shards = atoi(value);
+    }
+    if ((value = get_config_value(config, "cache", "capacity"))) {
+        options->cache_capacity = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "cache", "max_entry_size"))) {
+        options->cache_max_entry = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "cache", "vary"))) {
+        snprintf(options->cache_vary, sizeof(options->cache_vary), "%s", value);
+    }
+    if ((value = get_config_value(config, "server", "drain_timeout"))) {
+        options->drain_timeout = atof(value);
+    }
+    if ((value = get_config_value(config, "server", "low_memory"))) {
+        options->low_memory = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "server", "tcp_cork"))) {
+        options->tcp_cork = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "server", "dynamic_records"))) {
+        options->dynamic_records = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "server", "small_record_size"))) {
+        size_t size = strtoul(value, NULL, 10);
+        // 不超过OpenSSL的最大明文分片
+        options->small_record_size = size > 0 && size <= TLS_RECORD_SIZE ? size : DEFAULT_SMALL_RECORD_SIZE;
+    }
+    if ((value = get_config_value(config, "server", "record_boost_bytes"))) {
+        options->record_boost_bytes = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "server", "record_idle_reset"))) {
+        options->record_idle_reset = atof(value);
+    }
+    if ((value = get_config_value(config, "overload", "enable"))) {
+        options->overload = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "overload", "target_lag"))) {
+        options->overload_target_lag = atof(value);
+    }
+    if ((value = get_config_value(config, "overload", "pause_lag"))) {
+        options->overload_pause_lag = atof(value);
+    }
+    if ((value = get_config_value(config, "overload", "retry_after"))) {
+        options->overload_retry_after = atoi(value);
+    }
+    if ((value = get_config_value(config, "offload", "enable"))) {
+        options->offload = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "offload", "threads"))) {
+        options->offload_threads = atoi(value);
+    }
+    if ((value = get_config_value(config, "offload", "max_body"))) {
+        options->offload_max_body = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "offload", "paths"))) {
+        snprintf(options->offload_paths, sizeof(options->offload_paths), "%s", value);
+    }
+    if ((value = get_config_value(config, "async_crypto", "enable"))) {
+        options->async_crypto = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "async_crypto", "threads"))) {
+        options->async_crypto_threads = atoi(value);
+    }
+    if ((value = get_config_value(config, "trace", "enable"))) {
+        options->trace = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "trace", "sample_rate"))) {
+        options->trace_sample_rate = atof(value);
+    }
+    if ((value = get_config_value(config, "trace", "capacity"))) {
+        options->trace_capacity = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "trace", "file"))) {
+        snprintf(options->trace_file, sizeof(options->trace_file), "%s", value);
+    }
+    if ((value = get_config_value(config, "capture", "enable"))) {
+        options->capture = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "capture", "file"))) {
+        snprintf(options->capture_file, sizeof(options->capture_file), "%s", value);
+    }
+    if ((value = get_config_value(config, "capture", "sample_rate"))) {
+        options->capture_sample_rate = atof(value);
+    }
+    if ((value = get_config_value(config, "capture", "max_body"))) {
+        options->capture_max_body = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "capture", "redact"))) {
+        snprintf(options->capture_redact, sizeof(options->capture_redact), "%s", value);
+    }
+    if ((value = get_config_value(config, "ocsp", "enable"))) {
+        options->ocsp = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "ocsp", "file"))) {
+        snprintf(options->ocsp_file, sizeof(options->ocsp_file), "%s", value);
+    }
+    if ((value = get_config_value(config, "ocsp", "url"))) {
+        snprintf(options->ocsp_url, sizeof(options->ocsp_url), "%s", value);
+    }
+    if ((value = get_config_value(config, "ocsp", "issuer"))) {
+        snprintf(options->ocsp_issuer, sizeof(options->ocsp_issuer), "%s", value);
+    }
+    if ((value = get_config_value(config, "ocsp", "refresh"))) {
+        options->ocsp_refresh = atof(value);
+    }
+    if ((value = get_config_value(config, "ocsp", "timeout"))) {
+        options->ocsp_timeout = atof(value);
+    }
+    if ((value = get_config_value(config, "coalesce", "enable"))) {
+        options->coalesce = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "coalesce", "max_wait"))) {
+        options->coalesce_max_wait = atof(value);
+    }
+    if (!options->proxy) {
+        options->proxy = proxy_load(config);
+    }
+    if (!options->sse && (value = get_config_value(config, "sse", "enable")) && atoi(value) != 0) {
+        const char *max_queue = get_config_value(config, "sse", "max_queue");
+        const char *heartbeat = get_config_value(config, "sse", "heartbeat");
+        options->sse = sse_hub_new(max_queue ? atoi(max_queue) : SSE_DEFAULT_MAX_QUEUE, heartbeat ? atof(heartbeat) : SSE_DEFAULT_HEARTBEAT);
+    }
+    if ((value = get_config_value(config, "compress", "enable"))) {
+        options->compress = atoi(value) != 0;
+    }
+    if ((value = get_config_value(config, "compress", "level"))) {
+        options->compress_level = atoi(value);
+    }
+    if ((value = get_config_value(config, "compress", "min_size"))) {
+        options->compress_min_size = strtoul(value, NULL, 10);
+    }
+    if ((value = get_config_value(config, "compress", "types"))) {
+        snprintf(options->compress_types, sizeof(options->compress_types), "%s", value);
+    }
+}
+
+void free_server_options(st_server_options_t *options) {
+    proxy_free(options->proxy);
+    options->proxy = NULL;
+    sse_hub_free(options->sse);
+    options->sse = NULL;
+}
+
+// 合并请求的结果经邮箱投递到等待者所在的线程
+static bool create_worker_mailbox(st_server_worker_t *worker) {
+    if (!worker->params->flights) {
+        return true;
+    }
+    worker->mailbox = malloc(sizeof(st_flight_mailbox_t));
+    if (!worker->mailbox || flight_mailbox_init(worker->mailbox, worker->loop, on_flight_delivered) < 0) {
+        log_error("create mailbox failed");
+        free(worker->mailbox);
+        worker->mailbox = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void destroy_worker_mailbox(st_server_worker_t *worker) {
+    if (worker->mailbox) {
+        flight_mailbox_destroy(worker->mailbox, worker->loop);
+        free(worker->mailbox);
+        worker->mailbox = NULL;
+    }
+}
+
+// 线程池中的处理器返回后, 连接可能已经全部关闭
+static void on_offload_delivered(st_server_worker_t *worker) {
+    check_drained(worker);
+}
+
+static bool create_worker_offload(st_server_worker_t *worker) {
+    if (!worker->params->offload) {
+        return true;
+    }
+    worker->offload_mailbox = malloc(sizeof(st_offload_mailbox_t));
+    if (!worker->offload_mailbox || offload_mailbox_init(worker->offload_mailbox, worker, on_offload_delivered) < 0) {
+        log_error("create offload mailbox failed");
+        free(worker->offload_mailbox);
+        worker->offload_mailbox = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void destroy_worker_offload(st_server_worker_t *worker) {
+    if (worker->offload_mailbox) {
+        offload_mailbox_destroy(worker->offload_mailbox);
+        free(worker->offload_mailbox);
+        worker->offload_mailbox = NULL;
+    }
+}
+
+// 过载时在ClientHello阶段拒绝不尝试会话恢复的握手, 省下密钥交换和签名
+static int on_client_hello(SSL *ssl, int *alert, void *arg) {
+    struct st_client *client = (struct st_client *)SSL_get_app_data(ssl);
+    if (client && client->worker->overload && !overload_admit_handshake(client->worker->overload, ssl)) {
+        *alert = SSL_AD_HANDSHAKE_FAILURE;
+        return SSL_CLIENT_HELLO_ERROR;
+    }
+    return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+// 所有工作线程共享监听套接字, epoll下以EPOLLEXCLUSIVE避免惊群
+static int start_accepting(st_server_worker_t *worker) {
+    for (int type = 0; type < LISTENER_COUNT; type++) {
+        if (worker->params->listen_fds[type] >= 0 && event_io_start(worker->loop, &worker->io_accept[type]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void stop_accepting(st_server_worker_t *worker) {
+    for (int type = 0; type < LISTENER_COUNT; type++) {
+        if (worker->params->listen_fds[type] >= 0) {
+            event_io_stop(worker->loop, &worker->io_accept[type]);
+        }
+    }
+}
+
+// 监听套接字是EPOLLEXCLUSIVE注册的, 只能整体移除和重新加入
+static void on_overload_accept(st_overload_t *overload, bool paused) {
+    st_server_worker_t *worker = (st_server_worker_t *)overload->data;
+    if (paused) {
+        stop_accepting(worker);
+    } else if (!worker->draining && start_accepting(worker) < 0) {
+        log_error("worker:%d resume accept failed", worker->id);
+    }
+}
+
+static bool create_worker_overload(st_server_worker_t *worker) {
+    const st_server_options_t *options = &worker->params->options;
+    if (!options->overload) {
+        return true;
+    }
+    worker->overload = malloc(sizeof(st_overload_t));
+    if (!worker->overload || overload_init(worker->overload, worker->loop, options->overload_target_lag, options->overload_pause_lag,
+                                           options->overload_retry_after, on_overload_accept, worker) < 0) {
+        log_error("create overload controller failed");
+        free(worker->overload);
+        worker->overload = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void destroy_worker_overload(st_server_worker_t *worker) {
+    if (worker->overload) {
+        overload_destroy(worker->overload);
+        free(worker->overload);
+        worker->overload = NULL;
+    }
+}
+
+// 排空: 空闲的连接立即关闭, 其余的在当前请求结束后关闭, 到期时强制关闭.
+// 返回true表示连接已关闭
+static bool drain_client(struct st_client *client, bool force) {
+    if (force || client->state == CLIENT_STATE_CLOSING) {
+        close_client(client);
+        return true;
+    }
+    if (client->state == CLIENT_STATE_HANDSHAKE) {
+        // 握手完成后的第一个请求会带Connection: close
+        return false;
+    }
+    if (client->h2) {
+        // 第一次GOAWAY之后连接安静一段时间, 对端途中的请求已到达并正常处理, 再发送最终的GOAWAY
+        double now = event_loop_now(client->worker->loop);
+        bool final = now >= client->worker->drain_started + DRAIN_GOAWAY_GRACE && now >= client->last_activity + DRAIN_GOAWAY_GRACE;
+        if (h2_session_shutdown(client->h2, final) && buffer_length(&client->out) == 0) {
+            close_client(client);
+            return true;
+        }
+        return false;
+    }
+    if (client->ws) {
+        ws_close(client, 1001, "going away");
+        return false;
+    }
+    if (client->response_state == RESPONSE_STATE_DONE && !client->awaiting_response && pending_output(client) == 0) {
+        close_client(client);
+        return true;
+    }
+    client->keep_alive = false;
+    return false;
+}
+
+static void on_drain_timer(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_server_worker_t *worker = (st_server_worker_t *)t->data;
+    bool force = event_loop_now(loop) >= worker->drain_deadline;
+    if (force) {
+        log_warn("worker:%d drain timeout, closing %d connections", worker->id, worker->client_count);
+    }
+    for (struct st_client *client = worker->clients, *next; client; client = next) {
+        next = client->next;
+        drain_client(client, force);
+    }
+    if (worker->client_count > 0) {
+        event_timer_start(loop, t, DRAIN_SWEEP_INTERVAL);
+    }
+}
+
+static void start_drain(st_server_worker_t *worker) {
+    if (worker->draining) {
+        return;
+    }
+    st_event_loop_t *loop = worker->loop;
+    worker->draining = true;
+    worker->drain_started = event_loop_now(loop);
+    worker->drain_deadline = worker->drain_started + worker->params->options.drain_timeout;
+    stop_accepting(worker);
+    log_info("worker:%d draining %d connections", worker->id, worker->client_count);
+    // 事件流没有尽头, 先结束它们, 之后与普通响应一样写完后关闭
+    sse_worker_close_all(worker->sse);
+    for (struct st_client *client = worker->clients, *next; client; client = next) {
+        next = client->next;
+        drain_client(client, false);
+    }
+    if (worker->client_count == 0) {
+        check_drained(worker);
+        return;
+    }
+    event_timer_start(loop, &worker->drain_timer, DRAIN_SWEEP_INTERVAL);
+}
+
+static void drain_all_workers(st_server_params_t *params) {
+    for (int i = 0; i < params->worker_count; i++) {
+        __atomic_store_n(&params->workers[i].drain_requested, 1, __ATOMIC_RELEASE);
+        event_async_send(&params->workers[i].control);
+    }
+}
+
+// 新进程就绪时读到一个字节, 启动失败时读到EOF
+static void on_upgrade_channel(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    st_server_params_t *params = (st_server_params_t *)w->data;
+    char ready;
+    ssize_t n = read(w->fd, &ready, 1);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    event_io_stop(loop, w);
+    close(w->fd);
+    params->upgrade_channel = -1;
+    if (n == 1) {
+        log_info("upgrade: pid %d is ready, draining", (int)params->upgrade_pid);
+        drain_all_workers(params);
+        return;
+    }
+    log_error("upgrade: pid %d failed to start, still serving", (int)params->upgrade_pid);
+    waitpid(params->upgrade_pid, NULL, WNOHANG);
+}
+
+static void start_upgrade(st_server_params_t *params) {
+    if (params->upgrade_channel >= 0 || params->workers[0].draining) {
+        log_warn("upgrade already in progress");
+        return;
+    }
+    st_handoff_t handoff = {0};
+    for (int type = 0; type < LISTENER_COUNT; type++) {
+        if (params->listen_fds[type] >= 0) {
+            handoff.fds[handoff.fd_count++] = params->listen_fds[type];
+        }
+    }
+    handoff.has_ticket_keys = SSL_CTX_get_tlsext_ticket_keys(params->ctx, handoff.ticket_keys, sizeof(handoff.ticket_keys)) == 1;
+    int channel = upgrade_spawn(&handoff, &params->upgrade_pid);
+    if (channel < 0) {
+        return;
+    }
+    set_non_blocking(channel);
+    params->upgrade_channel = channel;
+    event_io_init(&params->upgrade_io, on_upgrade_channel, channel, EVENT_READ, 0);
+    params->upgrade_io.data = params;
+    if (event_io_start(params->workers[0].loop, &params->upgrade_io) < 0) {
+        close(channel);
+        params->upgrade_channel = -1;
+    }
+}
+
+// 信号经0号工作线程的control转到事件循环中处理
+enum {
+    SIGNAL_UPGRADE = 1,
+    SIGNAL_TERMINATE = 2
+};
+static st_server_worker_t *signal_worker;
+static int pending_signals;
+
+static void on_signal(int signo) {
+    __atomic_or_fetch(&pending_signals, signo == SIGUSR2 ? SIGNAL_UPGRADE : SIGNAL_TERMINATE, __ATOMIC_SEQ_CST);
+    if (signal_worker) {
+        event_async_send(&signal_worker->control);
+    }
+}
+
+static void on_worker_control(st_event_loop_t *loop, st_event_async_t *a) {
+    st_server_worker_t *worker = (st_server_worker_t *)a->data;
+    if (worker == signal_worker) {
+        int signals = __atomic_exchange_n(&pending_signals, 0, __ATOMIC_SEQ_CST);
+        if (signals & SIGNAL_UPGRADE) {
+            start_upgrade(worker->params);
+        }
+        if (signals & SIGNAL_TERMINATE) {
+            log_info("SIGTERM, draining");
+            drain_all_workers(worker->params);
+        }
+    }
+    if (__atomic_exchange_n(&worker->drain_requested, 0, __ATOMIC_ACQUIRE)) {
+        start_drain(worker);
+    }
+    if (__atomic_load_n(&worker->stop_requested, __ATOMIC_ACQUIRE)) {
+        event_loop_break(loop);
+    }
+}
+
+static void set_signal_handlers(st_server_worker_t *worker) {
+    struct sigaction action = {0};
+    signal_worker = worker;
+    action.sa_handler = worker ? on_signal : SIG_DFL;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+static void *run_worker(void *arg) {
+    st_server_worker_t *worker = (st_server_worker_t *)arg;
+    log_debug("worker:%d,engine:%s", worker->id, event_engine_name(worker->loop->engine));
+    event_loop_run(worker->loop);
+    return NULL;
+}
+
+static void dump_trace_file(st_tracer_t *tracer, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_error("open %s: %s", path, strerror(errno));
+        return;
+    }
+    size_t count = trace_dump(tracer, fp);
+    fclose(fp);
+    log_info("%zu trace records written to %s", count, path);
+}
+
+static void close_listeners(int *fds) {
+    for (int type = 0; type < LISTENER_COUNT; type++) {
+        if (fds[type] >= 0) {
+            close(fds[type]);
+            fds[type] = -1;
+        }
+    }
+}
+
+// 打开配置的监听套接字, 升级启动时优先沿用旧进程交来的. 任何一个失败都返回false
+static bool open_listeners(st_handoff_t *handoff, int port, const st_server_options_t *options, int *fds) {
+    for (int type = 0; type < LISTENER_COUNT; type++) {
+        fds[type] = -1;
+    }
+    fds[LISTENER_TLS] = upgrade_take_listener(handoff, port);
+    if (fds[LISTENER_TLS] < 0) {
+        fds[LISTENER_TLS] = create_server_socket(port);
+    }
+    if (options->plain_port > 0) {
+        fds[LISTENER_TCP] = upgrade_take_listener(handoff, options->plain_port);
+        if (fds[LISTENER_TCP] < 0) {
+            fds[LISTENER_TCP] = create_server_socket(options->plain_port);
+        }
+    }
+    if (options->unix_path[0]) {
+        fds[LISTENER_UNIX] = upgrade_take_unix_listener(handoff, options->unix_path);
+        if (fds[LISTENER_UNIX] < 0) {
+            fds[LISTENER_UNIX] = create_unix_server_socket(options->unix_path);
+        }
+    }
+    for (int type = 0; type < LISTENER_COUNT; type++) {
+        if (type == LISTENER_TLS || (type == LISTENER_TCP && options->plain_port > 0) || (type == LISTENER_UNIX && options->unix_path[0])) {
+            if (fds[type] < 0) {
+                return false;
+            }
+            set_non_blocking(fds[type]);
+        }
+    }
+    return true;
+}
+
+bool start_https_server(const char *cert_file, const char *key_file, int port, event_callbacks *callbacks) {
+    st_server_options_t options;
+    init_server_options(&options);
+    return start_https_server_with_options(cert_file, key_file, port, &options, callbacks);
+}
+
+bool start_https_server_with_options(const char *cert_file, const char *key_file, int port, const st_server_options_t *options, event_callbacks *callbacks) {
+    signal(SIGPIPE, SIG_IGN);
+    pthread_once(&request_settings_once, init_request_settings);
+    SSL_CTX *ctx = init_server_ssl(cert_file, key_file);
+    if (!ctx) {
+        return false;
+    }
+    if (options->low_memory) {
+        // 没有待处理的数据时释放每个连接约34KB的读写缓冲区
+        SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+    }
+    set_server_alpn(ctx, options->http2);
+    if (options->overload) {
+        SSL_CTX_set_client_hello_cb(ctx, on_client_hello, NULL);
+    }
+
+    // 升级启动时沿用旧进程的监听套接字和票据密钥, 会话在新旧进程间可以恢复
+    st_handoff_t handoff;
+    int upgrade_channel = upgrade_receive(&handoff);
+    if (handoff.has_ticket_keys) {
+        SSL_CTX_set_tlsext_ticket_keys(ctx, handoff.ticket_keys, sizeof(handoff.ticket_keys));
+    }
+    int listen_fds[LISTENER_COUNT];
+    bool listening = open_listeners(&handoff, port, options, listen_fds);
+    upgrade_release(&handoff);
+    if (!listening) {
+        close_listeners(listen_fds);
+        if (upgrade_channel >= 0) {
+            close(upgrade_channel);
+        }
+        cleanup_ssl(ctx);
+        return false;
+    }
+
+    // Create a struct to hold both the SSL context and the callbacks
+    struct st_server_params *server_data = malloc(sizeof(st_server_params_t));
+    int worker_count = options->workers > 0 ? options->workers : 1;
+    st_server_worker_t *workers = calloc(worker_count, sizeof(st_server_worker_t));
+
+    if (!server_data || !workers) {
+        log_error("malloc");
+        free(server_data);
+        free(workers);
+        close_listeners(listen_fds);
+        if (upgrade_channel >= 0) {
+            close(upgrade_channel);
+        }
+        cleanup_ssl(ctx);
+        return false;
+    }
+
+    server_data->ctx = ctx;
+    server_data->crypto = NULL;
+    if (options->async_crypto) {
+        server_data->crypto = async_crypto_new(options->async_crypto_threads);
+        if (server_data->crypto && !async_crypto_attach(server_data->crypto, ctx)) {
+            async_crypto_free(server_data->crypto);
+            server_data->crypto = NULL;
+        }
+        if (!server_data->crypto) {
+            log_warn("async crypto unavailable, private key operations run on the event loop");
+        }
+    }
+    server_data->ocsp = NULL;
+    if (options->ocsp && !(server_data->ocsp = ocsp_stapler_new(ctx, options->ocsp_file, options->ocsp_url, options->ocsp_issuer,
+                                                                options->ocsp_refresh, options->ocsp_timeout))) {
+        log_error("ocsp stapling disabled");
+    }
+    server_data->tracer = NULL;
+    if (options->trace && !(server_data->tracer = tracer_new(options->trace_sample_rate, options->trace_capacity))) {
+        log_error("create tracer failed, tracing disabled");
+    }
+    server_data->capture = NULL;
+    if (options->capture && !(server_data->capture = capture_new(options->capture_file, options->capture_sample_rate,
+                                                                 options->capture_max_body, options->capture_redact))) {
+        log_error("create capture file failed, capture disabled");
+    }
+    server_data->offload = NULL;
+    if (options->offload && !(server_data->offload = offload_new(options->offload_threads, options->offload_max_body, options->offload_paths))) {
+        log_error("create offload pool failed, handlers run on the event loop");
+    }
+    // 代理先处理匹配路由的请求, 其余的再交给线程池
+    event_callbacks *app = server_data->offload ? offload_wrap_callbacks(server_data->offload, callbacks) : callbacks;
+    server_data->callbacks = options->proxy ? proxy_wrap_callbacks(options->proxy, app) : app;
+    memcpy(server_data->listen_fds, listen_fds, sizeof(listen_fds));
+    server_data->options = *options;
+    server_data->cache = options->cache ? response_cache_new(options->cache_shards, options->cache_capacity, options->cache_max_entry) : NULL;
+    server_data->flights = options->coalesce ? flight_group_new(FLIGHT_DEFAULT_SHARDS, options->coalesce_max_wait) : NULL;
+    server_data->workers = workers;
+    server_data->worker_count = worker_count;
+    server_data->upgrade_channel = -1;
+    log_debug("listen_fds:%d,%d,%d,ctx:%p,engine:%s,workers:%d",listen_fds[LISTENER_TLS],listen_fds[LISTENER_TCP],listen_fds[LISTENER_UNIX],ctx,event_engine_name(options->engine),worker_count);
+
+    bool result = true;
+    int started = 0;
+    for (; started < worker_count; started++) {
+        st_server_worker_t *worker = &workers[started];
+        worker->id = started;
+        worker->params = server_data;
+        worker->loop = event_loop_new(options->engine, options->max_events);
+        if (!worker->loop) {
+            result = false;
+            break;
+        }
+        worker->loop->data = worker;
+        if (options->compress) {
+            worker->compress_pool = create_compress_pool(options->compress_level);
+        }
+
+        if (options->proxy) {
+            worker->proxy = proxy_worker_new(options->proxy, worker->loop);
+        }
+        if (options->sse && !(worker->sse = sse_worker_new(options->sse, worker->loop))) {
+            log_error("create sse worker failed");
+            proxy_worker_free(worker->proxy);
+            event_loop_destroy(worker->loop);
+            destroy_compress_pool(worker->compress_pool);
+            result = false;
+            break;
+        }
+        event_async_init(&worker->control, on_worker_control);
+        worker->control.data = worker;
+        event_timer_init(&worker->drain_timer, on_drain_timer, 0);
+        worker->drain_timer.data = worker;
+        event_prepare_init(&worker->flush_prepare, on_flush_prepare);
+        worker->flush_prepare.data = worker;
+        event_prepare_start(worker->loop, &worker->flush_prepare);
+        if (event_async_start(worker->loop, &worker->control) < 0 || !create_worker_mailbox(worker) || !create_worker_offload(worker)) {
+            event_async_stop(worker->loop, &worker->control);
+            destroy_worker_mailbox(worker);
+            sse_worker_free(worker->sse);
+            proxy_worker_free(worker->proxy);
+            event_loop_destroy(worker->loop);
+            destroy_compress_pool(worker->compress_pool);
+            result = false;
+            break;
+        }
+        for (int type = 0; type < LISTENER_COUNT; type++) {
+            event_io_init(&worker->io_accept[type], on_client_accept, listen_fds[type], EVENT_READ, EVENT_IO_EXCLUSIVE);
+            worker->io_accept[type].data = worker;
+        }
+        if (start_accepting(worker) < 0 || !create_worker_overload(worker)) {
+            stop_accepting(worker);
+            event_async_stop(worker->loop, &worker->control);
+            destroy_worker_offload(worker);
+            destroy_worker_mailbox(worker);
+            sse_worker_free(worker->sse);
+            proxy_worker_free(worker->proxy);
+            event_loop_destroy(worker->loop);
+            destroy_compress_pool(worker->compress_pool);
+            result = false;
+            break;
+        }
+
+        if (started > 0 && pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            log_error("pthread_create");
+            stop_accepting(worker);
+            event_async_stop(worker->loop, &worker->control);
+            destroy_worker_overload(worker);
+            destroy_worker_offload(worker);
+            destroy_worker_mailbox(worker);
+            sse_worker_free(worker->sse);
+            proxy_worker_free(worker->proxy);
+            event_loop_destroy(worker->loop);
+            destroy_compress_pool(worker->compress_pool);
+            result = false;
+            break;
+        }
+    }
+
+    if (result) {
+        set_signal_handlers(&workers[0]);
+        if (upgrade_channel >= 0) {
+            // 所有工作线程都已在accept, 旧进程可以开始排空
+            upgrade_ready(upgrade_channel);
+            upgrade_channel = -1;
+        }
+        run_worker(&workers[0]);
+        set_signal_handlers(NULL);
+    }
+    if (upgrade_channel >= 0) {
+        close(upgrade_channel);
+    }
+    if (server_data->upgrade_channel >= 0) {
+        event_io_stop(workers[0].loop, &server_data->upgrade_io);
+        close(server_data->upgrade_channel);
+    }
+    for (int i = 1; i < started; i++) {
+        // 排空中的工作线程在连接全部关闭后自行退出; 否则(只启动了部分线程)经control通知它在自己的线程中退出
+        if (!workers[0].draining) {
+            __atomic_store_n(&workers[i].stop_requested, 1, __ATOMIC_RELEASE);
+            event_async_send(&workers[i].control);
+        }
+        pthread_join(workers[i].thread, NULL);
+    }
+    // 还在运行的处理器返回后结果留在邮箱中, 随邮箱释放
+    offload_free(server_data->offload);
+    for (int i = 0; i < started; i++) {
+        event_timer_stop(workers[i].loop, &workers[i].drain_timer);
+        event_async_stop(workers[i].loop, &workers[i].control);
+        destroy_worker_overload(&workers[i]);
+        destroy_worker_offload(&workers[i]);
+        destroy_worker_mailbox(&workers[i]);
+        sse_worker_free(workers[i].sse);
+        proxy_worker_free(workers[i].proxy);
+        event_loop_destroy(workers[i].loop);
+        destroy_compress_pool(workers[i].compress_pool);
+    }
+
+    close_listeners(listen_fds);
     cleanup_ssl(ctx);
+    // 私钥随SSL_CTX释放后才能释放它引用的方法
+    async_crypto_free(server_data->crypto);
+    ocsp_stapler_free(server_data->ocsp);
+    if (server_data->tracer && server_data->options.trace_file[0]) {
+        dump_trace_file(server_data->tracer, server_data->options.trace_file);
+    }
+    tracer_free(server_data->tracer);
+    capture_free(server_data->capture);
+    response_cache_free(server_data->cache);
+    flight_group_free(server_data->flights);
+    free(workers);
     free(server_data); // Don't forget to free the allocated memory
-    return true;
+    return result;
 }
@@ -0,0 +1,41 @@
+#include "known_headers.h"
+#include "known_headers_table.h"
+
+// 按8字节对齐并补零, 可以按字比较
+#define KNOWN_HEADER_KEY(id, name) name,
+static const char known_header_keys[KNOWN_HEADER_COUNT][KNOWN_HEADER_MAX_LENGTH] __attribute__((aligned(8))) = {
+    KNOWN_HEADER_LIST(KNOWN_HEADER_KEY)
+};
+#undef KNOWN_HEADER_KEY
+
+#define KNOWN_HEADER_LENGTH(id, name) sizeof(name) - 1,
+static const uint8_t known_header_lengths[KNOWN_HEADER_COUNT] = {KNOWN_HEADER_LIST(KNOWN_HEADER_LENGTH)};
+#undef KNOWN_HEADER_LENGTH
+
+int known_header_lookup(const char *name, size_t length) {
+    if (length == 0 || length > KNOWN_HEADER_MAX_LENGTH) {
+        return HEADER_UNKNOWN;
+    }
+    uint64_t words[KNOWN_HEADER_WORDS] = {0};
+    uint64_t h = known_header_load(words, name, length);
+    uint32_t seed = known_header_seeds[h % KNOWN_HEADER_BUCKETS];
+    int id = known_header_slots[known_header_slot_hash(h, seed) % KNOWN_HEADER_COUNT];
+    if (known_header_lengths[id] != length) {
+        return HEADER_UNKNOWN;
+    }
+    for (size_t i = 0; i < (length + 7) / 8; i++) {
+        uint64_t key;
+        memcpy(&key, known_header_keys[id] + i * 8, 8);
+        if (key != words[i]) {
+            return HEADER_UNKNOWN;
+        }
+    }
+    return id;
+}
+
+const char *known_header_name(int id) {
+    if (id < 0 || id >= KNOWN_HEADER_COUNT) {
+        return NULL;
+    }
+    return known_header_keys[id];
+}
@@ -0,0 +1,62 @@
+#include "mpsc_queue.h"
+#include <stdlib.h>
+
+int mpsc_queue_init(st_mpsc_queue_t *queue, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    queue->cells = malloc(size * sizeof(st_mpsc_cell_t));
+    if (!queue->cells) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        queue->cells[i].sequence = i;
+        queue->cells[i].item = NULL;
+    }
+    queue->mask = size - 1;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    return 0;
+}
+
+void mpsc_queue_destroy(st_mpsc_queue_t *queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+// 槽位序号等于入队位置时可写, 等于位置+1时可读, 消费者读完后把序号推进一整圈
+bool mpsc_queue_push(st_mpsc_queue_t *queue, void *item) {
+    uint64_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    st_mpsc_cell_t *cell;
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 消费者还没有读走上一圈的数据
+            return false;
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *mpsc_queue_pop(st_mpsc_queue_t *queue) {
+    uint64_t pos = queue->dequeue_pos;
+    st_mpsc_cell_t *cell = &queue->cells[pos & queue->mask];
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+        return NULL;
+    }
+    void *item = cell->item;
+    __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    queue->dequeue_pos = pos + 1;
+    return item;
+}
@@ -0,0 +1,466 @@
+#include "ocsp_stapling.h"
+#include "log.h"
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OCSP_MAX_RESPONSE (64 * 1024)
+#define OCSP_CLOCK_SKEW 300            // 检查thisUpdate/nextUpdate时允许的时钟偏差(秒)
+
+typedef struct {
+    X509 *cert;
+    X509 *issuer;                  // NULL表示不知道颁发者
+    OCSP_CERTID *id;               // 有颁发者时才有
+    char *url;
+    unsigned char *response;       // DER, 受lock保护
+    int response_length;
+    double next_update;            // Unix时间, 0表示响应没有给出
+    double refresh_at;             // 只在后台线程中访问
+} st_ocsp_entry_t;
+
+struct st_ocsp_stapler {
+    char *file;
+    double refresh;
+    double timeout;
+    st_ocsp_entry_t *entries;
+    int entry_count;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+    // 统计, 原子访问
+    uint64_t stapled;
+    uint64_t missing;
+    uint64_t refreshes;
+    uint64_t failures;
+};
+
+static double now_unix(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double asn1_to_unix(const ASN1_GENERALIZEDTIME *time) {
+    int days, seconds;
+    if (!time || !ASN1_TIME_diff(&days, &seconds, NULL, time)) {
+        return 0;
+    }
+    return now_unix() + days * 86400.0 + seconds;
+}
+
+// ---- 读取和请求响应 ----
+
+static bool read_response(const char *file, unsigned char **der, int *length) {
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        log_error("ocsp: cannot open %s", file);
+        return false;
+    }
+    unsigned char *data = OPENSSL_malloc(OCSP_MAX_RESPONSE);
+    size_t n = data ? fread(data, 1, OCSP_MAX_RESPONSE, fp) : 0;
+    bool too_large = n == OCSP_MAX_RESPONSE && fgetc(fp) != EOF;
+    fclose(fp);
+    if (n == 0 || too_large) {
+        log_error("ocsp: %s is empty or larger than %d bytes", file, OCSP_MAX_RESPONSE);
+        OPENSSL_free(data);
+        return false;
+    }
+    *der = data;
+    *length = (int)n;
+    return true;
+}
+
+// 非阻塞BIO等待可读或可写, 到deadline时返回false
+static bool wait_bio(BIO *bio, double deadline) {
+    int fd;
+    double left = deadline - now_unix();
+    if (BIO_get_fd(bio, &fd) < 0 || left <= 0) {
+        return false;
+    }
+    struct pollfd pfd = {.fd = fd, .events = BIO_should_read(bio) ? POLLIN : POLLOUT};
+    return poll(&pfd, 1, (int)(left * 1000) + 1) > 0;
+}
+
+static bool fetch_response(st_ocsp_stapler_t *stapler, st_ocsp_entry_t *entry, unsigned char **der, int *length) {
+    char *host = NULL, *port = NULL, *path = NULL;
+    int use_ssl = 0;
+    OCSP_REQUEST *request = NULL;
+    OCSP_CERTID *id = NULL;
+    BIO *bio = NULL;
+    OCSP_REQ_CTX *context = NULL;
+    OCSP_RESPONSE *response = NULL;
+    bool result = false;
+    if (!OCSP_parse_url(entry->url, &host, &port, &path, &use_ssl) || use_ssl) {
+        log_error("ocsp: unsupported responder url %s", entry->url);
+        goto done;
+    }
+    if (!(request = OCSP_REQUEST_new()) || !(id = OCSP_CERTID_dup(entry->id)) || !OCSP_request_add0_id(request, id)) {
+        OCSP_CERTID_free(id);
+        goto done;
+    }
+    if (!(bio = BIO_new_connect(host))) {
+        goto done;
+    }
+    BIO_set_conn_port(bio, port);
+    BIO_set_nbio(bio, 1);
+    double deadline = now_unix() + stapler->timeout;
+    while (BIO_do_connect(bio) <= 0) {
+        if (!BIO_should_retry(bio) || !wait_bio(bio, deadline)) {
+            log_error("ocsp: cannot connect to %s", entry->url);
+            goto done;
+        }
+    }
+    if (!(context = OCSP_sendreq_new(bio, path, NULL, -1)) || !OCSP_REQ_CTX_add1_header(context, "Host", host) ||
+        !OCSP_REQ_CTX_set1_req(context, request)) {
+        goto done;
+    }
+    int rc;
+    while ((rc = OCSP_sendreq_nbio(&response, context)) == -1) {
+        if (!wait_bio(bio, deadline)) {
+            break;
+        }
+    }
+    if (rc != 1 || !response) {
+        log_error("ocsp: request to %s failed", entry->url);
+        goto done;
+    }
+    *der = NULL;
+    result = (*length = i2d_OCSP_RESPONSE(response, der)) > 0;
+done:
+    OCSP_RESPONSE_free(response);
+    OCSP_REQ_CTX_free(context);
+    BIO_free_all(bio);
+    OCSP_REQUEST_free(request);
+    OPENSSL_free(host);
+    OPENSSL_free(port);
+    OPENSSL_free(path);
+    return result;
+}
+
+// ---- 校验 ----
+
+// 没有颁发者时按序列号找证书的状态
+static bool find_status(const st_ocsp_entry_t *entry, OCSP_BASICRESP *basic, int *status, ASN1_GENERALIZEDTIME **this_update,
+                        ASN1_GENERALIZEDTIME **next_update) {
+    int reason;
+    if (entry->id) {
+        return OCSP_resp_find_status(basic, entry->id, status, &reason, NULL, this_update, next_update) == 1;
+    }
+    for (int i = 0; i < OCSP_resp_count(basic); i++) {
+        OCSP_SINGLERESP *single = OCSP_resp_get0(basic, i);
+        ASN1_INTEGER *serial = NULL;
+        if (OCSP_id_get0_info(NULL, NULL, NULL, &serial, (OCSP_CERTID *)OCSP_SINGLERESP_get0_id(single)) &&
+            ASN1_INTEGER_cmp(serial, X509_get_serialNumber(entry->cert)) == 0) {
+            *status = OCSP_single_get0_status(single, &reason, NULL, this_update, next_update);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 签名者须是颁发者本身, 或颁发者签发的带OCSP签名用途的证书
+static bool verify_response(const st_ocsp_entry_t *entry, OCSP_BASICRESP *basic) {
+    STACK_OF(X509) *certs = sk_X509_new_null();
+    X509_STORE *store = X509_STORE_new();
+    bool result = false;
+    if (certs && store && sk_X509_push(certs, entry->issuer) && X509_STORE_add_cert(store, entry->issuer)) {
+        X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+        result = OCSP_basic_verify(basic, certs, store, 0) == 1;
+    }
+    X509_STORE_free(store);
+    sk_X509_free(certs);
+    return result;
+}
+
+static bool check_response(const st_ocsp_entry_t *entry, const unsigned char *der, int length, double *next_update) {
+    OCSP_RESPONSE *response = d2i_OCSP_RESPONSE(NULL, &der, length);
+    OCSP_BASICRESP *basic = NULL;
+    int status;
+    ASN1_GENERALIZEDTIME *this_time = NULL, *next_time = NULL;
+    bool result = false;
+    if (!response || OCSP_response_status(response) != OCSP_RESPONSE_STATUS_SUCCESSFUL ||
+        !(basic = OCSP_response_get1_basic(response))) {
+        log_error("ocsp: malformed or unsuccessful response");
+    } else if (!find_status(entry, basic, &status, &this_time, &next_time)) {
+        log_error("ocsp: response has no status for the certificate");
+    } else if (entry->issuer && !verify_response(entry, basic)) {
+        log_error("ocsp: response signature does not verify");
+    } else if (!OCSP_check_validity(this_time, next_time, OCSP_CLOCK_SKEW, -1)) {
+        log_error("ocsp: response is not yet valid or has expired");
+    } else {
+        if (status != V_OCSP_CERTSTATUS_GOOD) {
+            log_warn("ocsp: certificate status is %s", OCSP_cert_status_str(status));
+        }
+        *next_update = asn1_to_unix(next_time);
+        result = true;
+    }
+    OCSP_BASICRESP_free(basic);
+    OCSP_RESPONSE_free(response);
+    return result;
+}
+
+// ---- 更新 ----
+
+static double retry_interval(const st_ocsp_stapler_t *stapler) {
+    return stapler->refresh < OCSP_RETRY_INTERVAL ? stapler->refresh : OCSP_RETRY_INTERVAL;
+}
+
+// 成功后在剩余有效期过半时再更新, 但不超过refresh; 失败时保留旧响应并稍后重试
+static void refresh_entry(st_ocsp_stapler_t *stapler, st_ocsp_entry_t *entry) {
+    unsigned char *der = NULL;
+    int length = 0;
+    double next_update = 0;
+    double now = now_unix();
+    bool loaded = stapler->file ? read_response(stapler->file, &der, &length) : fetch_response(stapler, entry, &der, &length);
+    if (!loaded || !check_response(entry, der, length, &next_update)) {
+        OPENSSL_free(der);
+        __atomic_add_fetch(&stapler->failures, 1, __ATOMIC_RELAXED);
+        entry->refresh_at = now + retry_interval(stapler);
+        return;
+    }
+    pthread_mutex_lock(&stapler->lock);
+    unsigned char *old = entry->response;
+    entry->response = der;
+    entry->response_length = length;
+    entry->next_update = next_update;
+    pthread_mutex_unlock(&stapler->lock);
+    OPENSSL_free(old);
+    __atomic_add_fetch(&stapler->refreshes, 1, __ATOMIC_RELAXED);
+    double interval = stapler->refresh;
+    if (next_update > 0 && (next_update - now) / 2 < interval) {
+        double retry = retry_interval(stapler);
+        interval = (next_update - now) / 2 > retry ? (next_update - now) / 2 : retry;
+    }
+    entry->refresh_at = now + interval;
+}
+
+static void *refresh_thread(void *arg) {
+    st_ocsp_stapler_t *stapler = (st_ocsp_stapler_t *)arg;
+    pthread_mutex_lock(&stapler->lock);
+    while (!stapler->stopping) {
+        double due = stapler->entries[0].refresh_at;
+        for (int i = 1; i < stapler->entry_count; i++) {
+            if (stapler->entries[i].refresh_at < due) {
+                due = stapler->entries[i].refresh_at;
+            }
+        }
+        if (due > now_unix()) {
+            struct timespec deadline = {(time_t)due, (long)((due - (time_t)due) * 1e9)};
+            pthread_cond_timedwait(&stapler->cond, &stapler->lock, &deadline);
+            continue;
+        }
+        pthread_mutex_unlock(&stapler->lock);
+        double now = now_unix();
+        for (int i = 0; i < stapler->entry_count; i++) {
+            if (stapler->entries[i].refresh_at <= now) {
+                refresh_entry(stapler, &stapler->entries[i]);
+            }
+        }
+        pthread_mutex_lock(&stapler->lock);
+    }
+    pthread_mutex_unlock(&stapler->lock);
+    return NULL;
+}
+
+// ---- 握手 ----
+
+// 只复制缓存的响应, 没有或已过期时不装订
+static int on_status_request(SSL *ssl, void *arg) {
+    st_ocsp_stapler_t *stapler = (st_ocsp_stapler_t *)arg;
+    X509 *cert = SSL_get_certificate(ssl);
+    unsigned char *copy = NULL;
+    int length = 0;
+    double now = now_unix();
+    pthread_mutex_lock(&stapler->lock);
+    for (int i = 0; i < stapler->entry_count; i++) {
+        st_ocsp_entry_t *entry = &stapler->entries[i];
+        if (entry->cert == cert) {
+            if (entry->response && (entry->next_update == 0 || entry->next_update > now) &&
+                (copy = OPENSSL_malloc(entry->response_length))) {
+                memcpy(copy, entry->response, entry->response_length);
+                length = entry->response_length;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stapler->lock);
+    // 成功后由SSL释放copy
+    if (!copy || !SSL_set_tlsext_status_ocsp_resp(ssl, copy, length)) {
+        OPENSSL_free(copy);
+        __atomic_add_fetch(&stapler->missing, 1, __ATOMIC_RELAXED);
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    __atomic_add_fetch(&stapler->stapled, 1, __ATOMIC_RELAXED);
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// ---- 创建和释放 ----
+
+static X509 *find_issuer(X509 *cert, STACK_OF(X509) *chain, X509 *issuer) {
+    for (int i = 0; i < sk_X509_num(chain); i++) {
+        if (X509_check_issued(sk_X509_value(chain, i), cert) == X509_V_OK) {
+            return sk_X509_value(chain, i);
+        }
+    }
+    if (issuer && X509_check_issued(issuer, cert) == X509_V_OK) {
+        return issuer;
+    }
+    return X509_check_issued(cert, cert) == X509_V_OK ? cert : NULL;
+}
+
+static bool add_entry(st_ocsp_stapler_t *stapler, X509 *cert, STACK_OF(X509) *chain, X509 *issuer, const char *url) {
+    st_ocsp_entry_t entry = {.cert = cert};
+    entry.issuer = find_issuer(cert, chain, issuer);
+    if (entry.issuer && !(entry.id = OCSP_cert_to_id(NULL, cert, entry.issuer))) {
+        return false;
+    }
+    if (url && url[0]) {
+        entry.url = strdup(url);
+    } else {
+        STACK_OF(OPENSSL_STRING) *urls = X509_get1_ocsp(cert);
+        if (sk_OPENSSL_STRING_num(urls) > 0) {
+            entry.url = strdup(sk_OPENSSL_STRING_value(urls, 0));
+        }
+        X509_email_free(urls);
+    }
+    char name[256];
+    X509_NAME_oneline(X509_get_subject_name(cert), name, sizeof(name));
+    if (!stapler->file && (!entry.url || !entry.id)) {
+        log_warn("ocsp: %s has no %s, not stapling", name, entry.url ? "issuer" : "responder url");
+        OCSP_CERTID_free(entry.id);
+        free(entry.url);
+        return true;
+    }
+    if (!entry.issuer) {
+        log_warn("ocsp: issuer of %s unknown, matching %s by serial without verifying", name, stapler->file);
+    }
+    st_ocsp_entry_t *entries = realloc(stapler->entries, (stapler->entry_count + 1) * sizeof(st_ocsp_entry_t));
+    if (!entries) {
+        OCSP_CERTID_free(entry.id);
+        free(entry.url);
+        return false;
+    }
+    X509_up_ref(entry.cert);
+    if (entry.issuer) {
+        X509_up_ref(entry.issuer);
+    }
+    stapler->entries = entries;
+    stapler->entries[stapler->entry_count++] = entry;
+    return true;
+}
+
+static void free_entries(st_ocsp_stapler_t *stapler) {
+    for (int i = 0; i < stapler->entry_count; i++) {
+        st_ocsp_entry_t *entry = &stapler->entries[i];
+        X509_free(entry->cert);
+        X509_free(entry->issuer);
+        OCSP_CERTID_free(entry->id);
+        free(entry->url);
+        OPENSSL_free(entry->response);
+    }
+    free(stapler->entries);
+}
+
+static X509 *load_issuer(const char *file) {
+    FILE *fp = fopen(file, "r");
+    X509 *issuer = fp ? PEM_read_X509(fp, NULL, NULL, NULL) : NULL;
+    if (fp) {
+        fclose(fp);
+    }
+    if (!issuer) {
+        log_error("ocsp: cannot read issuer certificate %s", file);
+    }
+    return issuer;
+}
+
+st_ocsp_stapler_t *ocsp_stapler_new(SSL_CTX *ctx, const char *file, const char *url, const char *issuer, double refresh,
+                                    double timeout) {
+    st_ocsp_stapler_t *stapler = calloc(1, sizeof(st_ocsp_stapler_t));
+    if (!stapler) {
+        return NULL;
+    }
+    stapler->file = file && file[0] ? strdup(file) : NULL;
+    stapler->refresh = refresh > 0 ? refresh : OCSP_DEFAULT_REFRESH;
+    stapler->timeout = timeout > 0 ? timeout : OCSP_DEFAULT_TIMEOUT;
+    X509 *issuer_cert = issuer && issuer[0] ? load_issuer(issuer) : NULL;
+    // 遍历ctx中各类型私钥的证书, 完成后恢复当前证书
+    bool ok = true;
+    for (int rc = SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_FIRST); rc && ok; rc = SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_NEXT)) {
+        STACK_OF(X509) *chain = NULL;
+        SSL_CTX_get0_chain_certs(ctx, &chain);
+        ok = add_entry(stapler, SSL_CTX_get0_certificate(ctx), chain, issuer_cert, url);
+    }
+    SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_FIRST);
+    X509_free(issuer_cert);
+    if (!ok || stapler->entry_count == 0) {
+        log_error("ocsp: no certificate can be stapled");
+        free_entries(stapler);
+        free(stapler->file);
+        free(stapler);
+        return NULL;
+    }
+    pthread_mutex_init(&stapler->lock, NULL);
+    pthread_cond_init(&stapler->cond, NULL);
+    // 启动前同步加载一次, 失败时由后台线程重试
+    for (int i = 0; i < stapler->entry_count; i++) {
+        refresh_entry(stapler, &stapler->entries[i]);
+    }
+    if (pthread_create(&stapler->thread, NULL, refresh_thread, stapler) != 0) {
+        log_error("ocsp: cannot start refresh thread");
+        pthread_mutex_destroy(&stapler->lock);
+        pthread_cond_destroy(&stapler->cond);
+        free_entries(stapler);
+        free(stapler->file);
+        free(stapler);
+        return NULL;
+    }
+    SSL_CTX_set_tlsext_status_cb(ctx, on_status_request);
+    SSL_CTX_set_tlsext_status_arg(ctx, stapler);
+    log_info("ocsp: stapling %d certificates, %llu responses loaded", stapler->entry_count, (unsigned long long)stapler->refreshes);
+    return stapler;
+}
+
+void ocsp_stapler_free(st_ocsp_stapler_t *stapler) {
+    if (!stapler) {
+        return;
+    }
+    pthread_mutex_lock(&stapler->lock);
+    stapler->stopping = true;
+    pthread_cond_signal(&stapler->cond);
+    pthread_mutex_unlock(&stapler->lock);
+    pthread_join(stapler->thread, NULL);
+    pthread_mutex_destroy(&stapler->lock);
+    pthread_cond_destroy(&stapler->cond);
+    free_entries(stapler);
+    free(stapler->file);
+    free(stapler);
+}
+
+void ocsp_stapler_stats(st_ocsp_stapler_t *stapler, st_ocsp_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    double now = now_unix();
+    pthread_mutex_lock(&stapler->lock);
+    stats->certificates = stapler->entry_count;
+    for (int i = 0; i < stapler->entry_count; i++) {
+        const st_ocsp_entry_t *entry = &stapler->entries[i];
+        if (!entry->response || (entry->next_update > 0 && entry->next_update <= now)) {
+            continue;
+        }
+        stats->valid++;
+        if (entry->next_update > 0 && (stats->expires_in == 0 || entry->next_update - now < stats->expires_in)) {
+            stats->expires_in = entry->next_update - now;
+        }
+    }
+    pthread_mutex_unlock(&stapler->lock);
+    stats->stapled = __atomic_load_n(&stapler->stapled, __ATOMIC_RELAXED);
+    stats->missing = __atomic_load_n(&stapler->missing, __ATOMIC_RELAXED);
+    stats->refreshes = __atomic_load_n(&stapler->refreshes, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&stapler->failures, __ATOMIC_RELAXED);
+}
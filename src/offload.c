@@ -0,0 +1,696 @@
+#include "offload.h"
+#include "https_server.h"
+#include "request.h"
+#include "log.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OFFLOAD_MAX_HEADERS 64
+#define OFFLOAD_NULL_FIELD UINT32_MAX
+
+// 每个线程的任务队列, 分在不同缓存行
+typedef struct st_offload_queue {
+    pthread_mutex_t lock;
+    st_offload_task_t *head;
+    st_offload_task_t *tail;
+} __attribute__((aligned(64))) st_offload_queue_t;
+
+typedef struct st_offload_thread {
+    st_offload_t *offload;
+    int index;
+    pthread_t thread;
+} st_offload_thread_t;
+
+struct st_offload {
+    event_callbacks *app;
+    event_callbacks callbacks;
+    size_t max_body;
+    char paths[MAX_OFFLOAD_PATHS_LENGTH];
+    int thread_count;
+    int queue_count;
+    st_offload_thread_t *threads;
+    st_offload_queue_t *queues;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int idle;                      // 等待任务的线程数, 原子访问
+    bool stopping;                 // 受idle_lock保护
+    uint32_t next_queue;           // 轮流提交的下一个队列
+    // 统计, 原子访问
+    size_t queued;
+    size_t max_queued;
+    size_t running;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stolen;
+    uint64_t orphaned;
+    uint64_t wakeups;
+    uint64_t wait_total_us;
+    uint64_t wait_max_us;
+};
+
+// 记录的响应操作, 之后依次跟着field_count个字段: 长度(uint32_t) + 内容 + '\0'
+typedef struct st_offload_op {
+    int type;
+    int status;
+    long long content_length;
+    int field_count;
+} st_offload_op_t;
+
+enum {
+    OFFLOAD_OP_HEADER,
+    OFFLOAD_OP_RESPONSE,
+    OFFLOAD_OP_START,
+    OFFLOAD_OP_START_HEADERS,
+    OFFLOAD_OP_CHUNK,
+    OFFLOAD_OP_FINISH,
+    OFFLOAD_OP_ABORT,
+    OFFLOAD_OP_DATA
+};
+
+// 正在执行处理器的请求, 只在线程池的线程中非空
+static __thread st_offload_job_t *current_job;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void atomic_max(size_t *target, size_t value) {
+    size_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > current && !__atomic_compare_exchange_n(target, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// ---- 线程池 ----
+
+static st_offload_task_t *queue_pop(st_offload_t *offload, st_offload_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    st_offload_task_t *task = queue->head;
+    if (task) {
+        queue->head = task->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        __atomic_sub_fetch(&offload->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// 先取自己的队列, 空了再依次从其他线程的队列窃取. 处理器之间没有依赖, 都从队首取, 先到先执行
+static st_offload_task_t *take_task(st_offload_t *offload, int index) {
+    st_offload_task_t *task = queue_pop(offload, &offload->queues[index]);
+    if (task) {
+        return task;
+    }
+    for (int i = 1; i < offload->queue_count; i++) {
+        task = queue_pop(offload, &offload->queues[(index + i) % offload->queue_count]);
+        if (task) {
+            __atomic_add_fetch(&offload->stolen, 1, __ATOMIC_RELAXED);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void *run_offload_thread(void *arg) {
+    st_offload_thread_t *self = (st_offload_thread_t *)arg;
+    st_offload_t *offload = self->offload;
+    // 信号由工作线程处理
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        st_offload_task_t *task = take_task(offload, self->index);
+        if (!task) {
+            // 先登记为空闲再检查任务数, 与提交者的"先入队再检查空闲数"配合, 不会漏掉唤醒
+            pthread_mutex_lock(&offload->idle_lock);
+            __atomic_add_fetch(&offload->idle, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&offload->queued, __ATOMIC_SEQ_CST) == 0 && !offload->stopping) {
+                pthread_cond_wait(&offload->idle_cond, &offload->idle_lock);
+            }
+            __atomic_sub_fetch(&offload->idle, 1, __ATOMIC_SEQ_CST);
+            bool stop = offload->stopping && __atomic_load_n(&offload->queued, __ATOMIC_SEQ_CST) == 0;
+            pthread_mutex_unlock(&offload->idle_lock);
+            if (stop) {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t wait = (uint64_t)((now_seconds() - task->enqueued) * 1e6);
+        __atomic_add_fetch(&offload->wait_total_us, wait, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&offload->wait_max_us, __ATOMIC_RELAXED);
+        while (wait > max && !__atomic_compare_exchange_n(&offload->wait_max_us, &max, wait, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        __atomic_add_fetch(&offload->running, 1, __ATOMIC_RELAXED);
+        task->run(task);
+        __atomic_sub_fetch(&offload->running, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&offload->completed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static bool pool_submit(st_offload_t *offload, st_offload_task_t *task) {
+    if (offload->thread_count == 0) {
+        return false;
+    }
+    task->next = NULL;
+    task->enqueued = now_seconds();
+    uint32_t index = __atomic_fetch_add(&offload->next_queue, 1, __ATOMIC_RELAXED) % offload->queue_count;
+    st_offload_queue_t *queue = &offload->queues[index];
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) {
+        queue->tail->next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    size_t queued = __atomic_add_fetch(&offload->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->lock);
+    atomic_max(&offload->max_queued, queued);
+    __atomic_add_fetch(&offload->submitted, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&offload->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&offload->idle_lock);
+        pthread_cond_signal(&offload->idle_cond);
+        pthread_mutex_unlock(&offload->idle_lock);
+    }
+    return true;
+}
+
+st_offload_t *offload_new(int threads, size_t max_body, const char *paths) {
+    st_offload_t *offload = calloc(1, sizeof(st_offload_t));
+    if (!offload) {
+        return NULL;
+    }
+    if (threads <= 0) {
+        threads = OFFLOAD_DEFAULT_THREADS;
+    }
+    offload->max_body = max_body;
+    snprintf(offload->paths, sizeof(offload->paths), "%s", paths ? paths : "");
+    offload->threads = calloc(threads, sizeof(st_offload_thread_t));
+    offload->queues = aligned_alloc(64, threads * sizeof(st_offload_queue_t));
+    if (!offload->threads || !offload->queues) {
+        free(offload->threads);
+        free(offload->queues);
+        free(offload);
+        return NULL;
+    }
+    pthread_mutex_init(&offload->idle_lock, NULL);
+    pthread_cond_init(&offload->idle_cond, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&offload->queues[i].lock, NULL);
+        offload->queues[i].head = offload->queues[i].tail = NULL;
+    }
+    offload->queue_count = threads;
+    for (int i = 0; i < threads; i++) {
+        offload->threads[i].offload = offload;
+        offload->threads[i].index = i;
+        if (pthread_create(&offload->threads[i].thread, NULL, run_offload_thread, &offload->threads[i]) != 0) {
+            log_error("pthread_create");
+            offload_free(offload);
+            return NULL;
+        }
+        offload->thread_count++;
+    }
+    return offload;
+}
+
+void offload_free(st_offload_t *offload) {
+    if (!offload) {
+        return;
+    }
+    pthread_mutex_lock(&offload->idle_lock);
+    offload->stopping = true;
+    pthread_cond_broadcast(&offload->idle_cond);
+    pthread_mutex_unlock(&offload->idle_lock);
+    for (int i = 0; i < offload->thread_count; i++) {
+        pthread_join(offload->threads[i].thread, NULL);
+    }
+    for (int i = 0; i < offload->queue_count; i++) {
+        pthread_mutex_destroy(&offload->queues[i].lock);
+    }
+    pthread_cond_destroy(&offload->idle_cond);
+    pthread_mutex_destroy(&offload->idle_lock);
+    free(offload->queues);
+    free(offload->threads);
+    free(offload);
+}
+
+void offload_stats(st_offload_t *offload, st_offload_stats_t *stats) {
+    stats->threads = offload->thread_count;
+    stats->queued = __atomic_load_n(&offload->queued, __ATOMIC_RELAXED);
+    stats->max_queued = __atomic_load_n(&offload->max_queued, __ATOMIC_RELAXED);
+    stats->running = __atomic_load_n(&offload->running, __ATOMIC_RELAXED);
+    stats->submitted = __atomic_load_n(&offload->submitted, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&offload->completed, __ATOMIC_RELAXED);
+    stats->stolen = __atomic_load_n(&offload->stolen, __ATOMIC_RELAXED);
+    stats->orphaned = __atomic_load_n(&offload->orphaned, __ATOMIC_RELAXED);
+    stats->wakeups = __atomic_load_n(&offload->wakeups, __ATOMIC_RELAXED);
+    uint64_t started = stats->completed + stats->running;
+    stats->wait_avg = started ? __atomic_load_n(&offload->wait_total_us, __ATOMIC_RELAXED) / 1e6 / started : 0;
+    stats->wait_max = __atomic_load_n(&offload->wait_max_us, __ATOMIC_RELAXED) / 1e6;
+}
+
+// ---- 邮箱 ----
+
+static void free_job(st_offload_job_t *job) {
+    buffer_free(&job->body);
+    buffer_free(&job->ops);
+    free(job);
+}
+
+// 连接在处理器返回前关闭, 现在释放保留的连接结构
+static void free_orphan(st_offload_job_t *job) {
+    struct st_client *client = job->client;
+    event_callbacks *app = job->offload->app;
+    __atomic_add_fetch(&job->offload->orphaned, 1, __ATOMIC_RELAXED);
+    if (job->disconnected && app && app->on_disconnected) {
+        app->on_disconnected(client);
+    }
+    request_free(&client->request);
+    free(client);
+    free_job(job);
+}
+
+static const char *read_field(const char **p, size_t *length) {
+    uint32_t field_length;
+    memcpy(&field_length, *p, sizeof(field_length));
+    *p += sizeof(field_length);
+    if (field_length == OFFLOAD_NULL_FIELD) {
+        *length = 0;
+        return NULL;
+    }
+    const char *field = *p;
+    *p += field_length + 1;
+    *length = field_length;
+    return field;
+}
+
+// 在所属线程中按顺序执行记录的响应操作
+static void replay(st_offload_job_t *job, struct st_client *client) {
+    const char *p = buffer_data(&job->ops);
+    const char *end = p + buffer_length(&job->ops);
+    while (p < end) {
+        st_offload_op_t op;
+        memcpy(&op, p, sizeof(op));
+        p += sizeof(op);
+        const char *fields[2 + 2 * OFFLOAD_MAX_HEADERS];
+        size_t lengths[2 + 2 * OFFLOAD_MAX_HEADERS];
+        for (int i = 0; i < op.field_count; i++) {
+            fields[i] = read_field(&p, &lengths[i]);
+        }
+        switch (op.type) {
+            case OFFLOAD_OP_HEADER:
+                add_response_header(client, fields[0], fields[1]);
+                break;
+            case OFFLOAD_OP_RESPONSE:
+                send_response_body_to_client(client, op.status, fields[0], fields[1], fields[2], lengths[2]);
+                break;
+            case OFFLOAD_OP_START:
+                start_response_to_client(client, op.status, fields[0], fields[1]);
+                break;
+            case OFFLOAD_OP_START_HEADERS: {
+                st_header_pair_t headers[OFFLOAD_MAX_HEADERS];
+                int header_count = (op.field_count - 1) / 2;
+                for (int i = 0; i < header_count; i++) {
+                    headers[i] = (st_header_pair_t){fields[1 + i * 2], fields[2 + i * 2]};
+                }
+                start_response_with_headers(client, op.status, fields[0], headers, header_count, op.content_length);
+                break;
+            }
+            case OFFLOAD_OP_CHUNK:
+                send_response_chunk(client, fields[0], lengths[0]);
+                break;
+            case OFFLOAD_OP_FINISH:
+                finish_response_to_client(client);
+                break;
+            case OFFLOAD_OP_ABORT:
+                abort_response_to_client(client);
+                break;
+            case OFFLOAD_OP_DATA:
+                send_data_to_client(client, fields[0], lengths[0]);
+                break;
+        }
+    }
+}
+
+static void complete_job(st_offload_job_t *job) {
+    if (job->orphaned) {
+        free_orphan(job);
+        return;
+    }
+    struct st_client *client = job->client;
+    event_callbacks *app = job->offload->app;
+    // 重放时响应结束会继续解析流水线上的下一个请求, 它可能再次提交
+    client->offload = NULL;
+    replay(job, client);
+    if (job->disconnected && app && app->on_disconnected) {
+        app->on_disconnected(client);
+    }
+    free_job(job);
+}
+
+static void on_offload_mailbox(st_event_loop_t *loop, st_event_async_t *a) {
+    st_offload_mailbox_t *mailbox = (st_offload_mailbox_t *)a->data;
+    pthread_mutex_lock(&mailbox->lock);
+    st_offload_job_t *job = mailbox->head;
+    mailbox->head = mailbox->tail = NULL;
+    pthread_mutex_unlock(&mailbox->lock);
+    while (job) {
+        st_offload_job_t *next = job->next;
+        mailbox->worker->offload_pending--;
+        complete_job(job);
+        job = next;
+    }
+    if (mailbox->delivered) {
+        mailbox->delivered(mailbox->worker);
+    }
+}
+
+// 邮箱从空变为非空时才唤醒, 同一轮循环中返回的结果一次处理
+static void mailbox_push(st_offload_mailbox_t *mailbox, st_offload_job_t *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&mailbox->lock);
+    bool wake = !mailbox->head;
+    if (mailbox->tail) {
+        mailbox->tail->next = job;
+    } else {
+        mailbox->head = job;
+    }
+    mailbox->tail = job;
+    pthread_mutex_unlock(&mailbox->lock);
+    if (wake) {
+        __atomic_add_fetch(&job->offload->wakeups, 1, __ATOMIC_RELAXED);
+        event_async_send(&mailbox->async);
+    }
+}
+
+int offload_mailbox_init(st_offload_mailbox_t *mailbox, struct st_server_worker *worker, void (*delivered)(struct st_server_worker *worker)) {
+    pthread_mutex_init(&mailbox->lock, NULL);
+    mailbox->head = mailbox->tail = NULL;
+    mailbox->worker = worker;
+    mailbox->delivered = delivered;
+    event_async_init(&mailbox->async, on_offload_mailbox);
+    mailbox->async.data = mailbox;
+    if (event_async_start(worker->loop, &mailbox->async) < 0) {
+        pthread_mutex_destroy(&mailbox->lock);
+        return -1;
+    }
+    return 0;
+}
+
+// 服务器退出时连接不再释放, 只释放已关闭的连接
+void offload_mailbox_destroy(st_offload_mailbox_t *mailbox) {
+    event_async_stop(mailbox->worker->loop, &mailbox->async);
+    st_offload_job_t *job = mailbox->head;
+    while (job) {
+        st_offload_job_t *next = job->next;
+        if (job->orphaned) {
+            free_orphan(job);
+        } else {
+            job->client->offload = NULL;
+            free_job(job);
+        }
+        job = next;
+    }
+    mailbox->head = mailbox->tail = NULL;
+    pthread_mutex_destroy(&mailbox->lock);
+}
+
+// ---- 包装的回调 ----
+
+// 在线程池中执行, 处理器返回时响应还没结束的补上500或中止
+static void run_job(st_offload_task_t *task) {
+    st_offload_job_t *job = (st_offload_job_t *)task;
+    struct st_client *client = job->client;
+    event_callbacks *app = job->offload->app;
+    current_job = job;
+    if (app && app->on_body_start) {
+        app->on_body_start(client);
+    }
+    if (app && app->on_data_received && buffer_length(&job->body) > 0) {
+        app->on_data_received(client, buffer_data(&job->body), buffer_length(&job->body));
+    }
+    if (app && app->on_body_end) {
+        app->on_body_end(client);
+    }
+    if (job->response_state == RESPONSE_STATE_NONE) {
+        log_error("client:%p offloaded handler returned without a response", client);
+        const char *body = "handler did not respond\n";
+        offload_send_response(job, 500, "Internal Server Error", "text/plain", body, strlen(body));
+    } else if (job->response_state == RESPONSE_STATE_STREAMING) {
+        log_error("client:%p offloaded handler returned before finishing the response", client);
+        offload_abort_response(job);
+    }
+    current_job = NULL;
+    buffer_free(&job->body);
+    mailbox_push(client->worker->offload_mailbox, job);
+}
+
+// URL是否以paths中的某个前缀开头
+static bool match_paths(const char *paths, const char *url) {
+    if (!*paths) {
+        return true;
+    }
+    while (*paths) {
+        while (*paths == ' ' || *paths == ',') {
+            paths++;
+        }
+        size_t length = strcspn(paths, ", ");
+        if (length > 0 && strncmp(url, paths, length) == 0) {
+            return true;
+        }
+        paths += length;
+    }
+    return false;
+}
+
+// WebSocket升级要在循环中接受, 和不匹配paths的请求一样直接调用处理器
+static void offload_on_body_start(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    st_offload_t *offload = client->worker->params->offload;
+    if (!client->parser.upgrade && match_paths(offload->paths, get_request_url(client))) {
+        st_offload_job_t *job = calloc(1, sizeof(st_offload_job_t));
+        if (job) {
+            job->task.run = run_job;
+            job->offload = offload;
+            job->client = client;
+            job->response_state = RESPONSE_STATE_NONE;
+            client->offload = job;
+            return;
+        }
+        log_error("malloc offload job failed, running handler inline");
+    }
+    if (offload->app && offload->app->on_body_start) {
+        offload->app->on_body_start(client);
+    }
+}
+
+static void offload_on_data_received(void *ptr, const char *data, size_t length) {
+    struct st_client *client = (struct st_client *)ptr;
+    st_offload_job_t *job = client->offload;
+    if (!job) {
+        st_offload_t *offload = client->worker->params->offload;
+        if (offload->app && offload->app->on_data_received) {
+            offload->app->on_data_received(client, data, length);
+        }
+        return;
+    }
+    if (job->too_large) {
+        return;
+    }
+    if (buffer_length(&job->body) + length > job->offload->max_body || buffer_append(&job->body, data, length) < 0) {
+        job->too_large = true;
+        buffer_free(&job->body);
+    }
+}
+
+static void offload_on_body_end(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    st_offload_job_t *job = client->offload;
+    if (!job) {
+        st_offload_t *offload = client->worker->params->offload;
+        if (offload->app && offload->app->on_body_end) {
+            offload->app->on_body_end(client);
+        }
+        return;
+    }
+    if (job->too_large) {
+        client->offload = NULL;
+        free_job(job);
+        send_response_to_client(client, 413, "Payload Too Large", "request body too large\n");
+        return;
+    }
+    job->running = true;
+    client->worker->offload_pending++;
+    if (!pool_submit(job->offload, &job->task)) {
+        // 没有可用的线程, 在循环中执行, 结果同样经邮箱写出
+        run_job(&job->task);
+    }
+}
+
+// 处理器还在运行时推迟到它返回之后, 保证处理器看到的连接始终有效
+static void offload_on_disconnected(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    st_offload_job_t *job = client->offload;
+    if (job && job->running) {
+        job->disconnected = true;
+        return;
+    }
+    st_offload_t *offload = client->worker->params->offload;
+    if (offload->app && offload->app->on_disconnected) {
+        offload->app->on_disconnected(client);
+    }
+}
+
+event_callbacks *offload_wrap_callbacks(st_offload_t *offload, event_callbacks *app) {
+    offload->app = app;
+    if (app) {
+        offload->callbacks = *app;
+    }
+    offload->callbacks.on_body_start = offload_on_body_start;
+    offload->callbacks.on_data_received = offload_on_data_received;
+    offload->callbacks.on_body_end = offload_on_body_end;
+    offload->callbacks.on_disconnected = offload_on_disconnected;
+    return &offload->callbacks;
+}
+
+bool offload_release(struct st_client *client) {
+    st_offload_job_t *job = client->offload;
+    if (!job) {
+        return false;
+    }
+    if (!job->running) {
+        // 还在收请求体, 处理器没有开始
+        client->offload = NULL;
+        free_job(job);
+        return false;
+    }
+    job->orphaned = true;
+    return true;
+}
+
+// ---- 记录响应操作 ----
+
+st_offload_job_t *offload_capture(struct st_client *client) {
+    st_offload_job_t *job = current_job;
+    return job && job->client == client ? job : NULL;
+}
+
+static bool append_op(st_offload_job_t *job, int type, int status, long long content_length, int field_count, const char **fields, const size_t *lengths) {
+    st_offload_op_t op = {type, status, content_length, field_count};
+    size_t mark = buffer_length(&job->ops);
+    if (buffer_append(&job->ops, &op, sizeof(op)) < 0) {
+        return false;
+    }
+    for (int i = 0; i < field_count; i++) {
+        uint32_t length = fields[i] ? (uint32_t)lengths[i] : OFFLOAD_NULL_FIELD;
+        if (buffer_append(&job->ops, &length, sizeof(length)) < 0 ||
+            (fields[i] && (buffer_append(&job->ops, fields[i], lengths[i]) < 0 || buffer_append(&job->ops, "", 1) < 0))) {
+            job->ops.size = job->ops.offset + mark;
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t field_length(const char *field) {
+    return field ? strlen(field) : 0;
+}
+
+bool offload_add_header(st_offload_job_t *job, const char *name, const char *value) {
+    if (job->response_state != RESPONSE_STATE_NONE || job->header_count >= MAX_EXTRA_RESPONSE_HEADERS) {
+        return false;
+    }
+    const char *fields[] = {name, value};
+    size_t lengths[] = {strlen(name), strlen(value)};
+    if (!append_op(job, OFFLOAD_OP_HEADER, 0, 0, 2, fields, lengths)) {
+        return false;
+    }
+    job->header_count++;
+    return true;
+}
+
+bool offload_send_response(st_offload_job_t *job, int status_code, const char *status_message, const char *content_type, const char *body, size_t body_length) {
+    if (job->response_state != RESPONSE_STATE_NONE) {
+        return false;
+    }
+    const char *fields[] = {status_message, content_type, body ? body : ""};
+    size_t lengths[] = {field_length(status_message), field_length(content_type), body ? body_length : 0};
+    if (!append_op(job, OFFLOAD_OP_RESPONSE, status_code, 0, 3, fields, lengths)) {
+        return false;
+    }
+    job->response_state = RESPONSE_STATE_DONE;
+    return true;
+}
+
+bool offload_start_response(st_offload_job_t *job, int status_code, const char *status_message, const char *content_type) {
+    if (job->response_state != RESPONSE_STATE_NONE) {
+        return false;
+    }
+    const char *fields[] = {status_message, content_type};
+    size_t lengths[] = {field_length(status_message), field_length(content_type)};
+    if (!append_op(job, OFFLOAD_OP_START, status_code, 0, 2, fields, lengths)) {
+        return false;
+    }
+    job->response_state = RESPONSE_STATE_STREAMING;
+    return true;
+}
+
+bool offload_start_with_headers(st_offload_job_t *job, int status_code, const char *status_message, const st_header_pair_t *headers, int header_count, long long content_length) {
+    if (job->response_state != RESPONSE_STATE_NONE || header_count < 0 || header_count > OFFLOAD_MAX_HEADERS) {
+        return false;
+    }
+    const char *fields[1 + 2 * OFFLOAD_MAX_HEADERS];
+    size_t lengths[1 + 2 * OFFLOAD_MAX_HEADERS];
+    fields[0] = status_message;
+    lengths[0] = field_length(status_message);
+    for (int i = 0; i < header_count; i++) {
+        fields[1 + i * 2] = headers[i].name;
+        lengths[1 + i * 2] = strlen(headers[i].name);
+        fields[2 + i * 2] = headers[i].value;
+        lengths[2 + i * 2] = strlen(headers[i].value);
+    }
+    if (!append_op(job, OFFLOAD_OP_START_HEADERS, status_code, content_length, 1 + header_count * 2, fields, lengths)) {
+        return false;
+    }
+    job->response_state = RESPONSE_STATE_STREAMING;
+    return true;
+}
+
+bool offload_send_chunk(st_offload_job_t *job, const char *data, size_t length) {
+    if (job->response_state != RESPONSE_STATE_STREAMING) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    return append_op(job, OFFLOAD_OP_CHUNK, 0, 0, 1, &data, &length);
+}
+
+bool offload_finish_response(st_offload_job_t *job) {
+    if (job->response_state != RESPONSE_STATE_STREAMING || !append_op(job, OFFLOAD_OP_FINISH, 0, 0, 0, NULL, NULL)) {
+        return false;
+    }
+    job->response_state = RESPONSE_STATE_DONE;
+    return true;
+}
+
+void offload_abort_response(st_offload_job_t *job) {
+    if (job->response_state == RESPONSE_STATE_DONE) {
+        return;
+    }
+    job->response_state = RESPONSE_STATE_DONE;
+    append_op(job, OFFLOAD_OP_ABORT, 0, 0, 0, NULL, NULL);
+}
+
+bool offload_send_data(st_offload_job_t *job, const char *data, size_t length) {
+    return append_op(job, OFFLOAD_OP_DATA, 0, 0, 1, &data, &length);
+}
@@ -0,0 +1,154 @@
+#include "overload.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define OVERLOAD_SMOOTHING 0.25        // 延迟下降时的平滑系数, 上升时立即跟随
+#define OVERLOAD_SHED_STEP 0.05        // 每次超过目标时拒绝比例的增量, 按超出倍数放大
+#define OVERLOAD_RECOVER_STEP 0.02     // 低于目标一半时每次的减量
+
+static st_overload_stats_t counters;
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void count(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+// 定时器比预期晚触发的时间就是事件循环被占用的时间
+static void on_sample(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_overload_t *overload = (st_overload_t *)t->data;
+    double now = monotonic_now();
+    double sample = now - overload->expected;
+    if (sample < 0) {
+        sample = 0;
+    }
+    if (sample > overload->lag) {
+        overload->lag = sample;
+    } else {
+        overload->lag += (sample - overload->lag) * OVERLOAD_SMOOTHING;
+    }
+
+    double rate = overload->shed_rate;
+    if (overload->lag > overload->target_lag) {
+        rate += OVERLOAD_SHED_STEP * overload->lag / overload->target_lag;
+    } else if (overload->lag < overload->target_lag / 2) {
+        rate -= OVERLOAD_RECOVER_STEP;
+    }
+    overload->shed_rate = rate < 0 ? 0 : rate > OVERLOAD_MAX_SHED_RATE ? OVERLOAD_MAX_SHED_RATE : rate;
+
+    if (!overload->accept_paused && overload->lag > overload->pause_lag) {
+        overload->accept_paused = true;
+        count(&counters.accept_pauses);
+        log_warn("loop lag %.0fms, accept paused", overload->lag * 1000);
+        overload->on_accept(overload, true);
+    } else if (overload->accept_paused && overload->lag < overload->target_lag) {
+        overload->accept_paused = false;
+        log_info("loop lag %.0fms, accept resumed", overload->lag * 1000);
+        overload->on_accept(overload, false);
+    }
+
+    overload->expected = now + overload->interval;
+    event_timer_start(loop, t, overload->interval);
+}
+
+int overload_init(st_overload_t *overload, st_event_loop_t *loop, double target_lag, double pause_lag, int retry_after, overload_accept_cb_t on_accept, void *data) {
+    memset(overload, 0, sizeof(*overload));
+    overload->loop = loop;
+    overload->interval = OVERLOAD_DEFAULT_INTERVAL;
+    overload->target_lag = target_lag > 0 ? target_lag : OVERLOAD_DEFAULT_TARGET_LAG;
+    overload->pause_lag = pause_lag > overload->target_lag ? pause_lag : overload->target_lag * 4;
+    overload->on_accept = on_accept;
+    overload->data = data;
+    overload->random = (uint32_t)(uintptr_t)overload | 1;
+
+    snprintf(overload->retry_after, sizeof(overload->retry_after), "%d", retry_after);
+    int length = snprintf(overload->response, sizeof(overload->response),
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+        "Retry-After: %d\r\nConnection: close\r\n\r\n%s", strlen(OVERLOAD_BODY), retry_after, OVERLOAD_BODY);
+    if (length < 0 || (size_t)length >= sizeof(overload->response)) {
+        return -1;
+    }
+    overload->response_length = length;
+
+    event_timer_init(&overload->timer, on_sample, 0);
+    overload->timer.data = overload;
+    overload->expected = monotonic_now() + overload->interval;
+    event_timer_start(loop, &overload->timer, overload->interval);
+    return 0;
+}
+
+void overload_destroy(st_overload_t *overload) {
+    event_timer_stop(overload->loop, &overload->timer);
+}
+
+// 采样定时器已经过期却还没有触发, 说明本轮循环正被占用, 不必等到下一次采样
+static double current_rate(const st_overload_t *overload) {
+    double overdue = monotonic_now() - overload->expected;
+    if (overdue <= overload->target_lag) {
+        return overload->shed_rate;
+    }
+    double rate = OVERLOAD_SHED_STEP * overdue / overload->target_lag;
+    if (rate < overload->shed_rate) {
+        rate = overload->shed_rate;
+    }
+    return rate > OVERLOAD_MAX_SHED_RATE ? OVERLOAD_MAX_SHED_RATE : rate;
+}
+
+static bool shed(st_overload_t *overload) {
+    double rate = current_rate(overload);
+    if (rate <= 0) {
+        return false;
+    }
+    uint32_t x = overload->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    overload->random = x;
+    return (x >> 8) * (1.0 / (1 << 24)) < rate;
+}
+
+bool overload_admit_request(st_overload_t *overload) {
+    if (!shed(overload)) {
+        return true;
+    }
+    count(&counters.shed_requests);
+    return false;
+}
+
+// TLS 1.3的pre_shared_key, 或非空的会话票据. 只支持TLS 1.2的客户端才看会话ID,
+// TLS 1.3客户端为兼容中间设备总会带一个随机的会话ID
+static bool resumption_offered(SSL *ssl) {
+    const unsigned char *data;
+    size_t length;
+    if (SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_psk, &data, &length)) {
+        return true;
+    }
+    if (SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_session_ticket, &data, &length) && length > 0) {
+        return true;
+    }
+    return !SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_supported_versions, &data, &length) &&
+           SSL_client_hello_get0_session_id(ssl, &data) > 0;
+}
+
+bool overload_admit_handshake(st_overload_t *overload, SSL *ssl) {
+    if (resumption_offered(ssl) || !shed(overload)) {
+        return true;
+    }
+    count(&counters.shed_handshakes);
+    return false;
+}
+
+void overload_stats(const st_overload_t *overload, st_overload_stats_t *stats) {
+    stats->shed_requests = __atomic_load_n(&counters.shed_requests, __ATOMIC_RELAXED);
+    stats->shed_handshakes = __atomic_load_n(&counters.shed_handshakes, __ATOMIC_RELAXED);
+    stats->accept_pauses = __atomic_load_n(&counters.accept_pauses, __ATOMIC_RELAXED);
+    stats->lag = overload->lag;
+    stats->shed_rate = overload->shed_rate;
+    stats->accept_paused = overload->accept_paused;
+}
@@ -0,0 +1,1304 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "https_server.h"
+#include "http2.h"
+#include "ssl_utils.h"
+#include "buffer.h"
+#include "log.h"
+#include <llhttp.h>
+#include <openssl/err.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define UPSTREAM_READ_SIZE (16 * 1024)
+#define UPSTREAM_MAX_HEADERS 64
+#define UPSTREAM_MAX_REASON 64
+#define PROXY_MAX_ATTEMPTS 2
+#define EWMA_PENALTY 10.0              // 还没有观测值却已有未完成请求的主机
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_ACTIVE,
+    CONN_IDLE
+} conn_state_t;
+
+struct st_upstream_conn {
+    st_event_io_t io;              // 位于首位
+    int fd;
+    SSL *ssl;
+    st_proxy_worker_t *worker;
+    st_upstream_peer_t *peer;
+    st_upstream_conn_t *next;      // 空闲栈
+    conn_state_t state;
+    st_event_timer_t timer;        // 连接/读取/空闲超时
+    double last_activity;
+    llhttp_t parser;
+    st_buffer_t out;               // 尚未写出的请求
+    st_buffer_t head;              // 响应头, 依次存放"name\0value\0"
+    int header_count;
+    bool value_pending;            // 已收到名称, 还没有结束值
+    char reason[UPSTREAM_MAX_REASON];
+    size_t reason_length;
+    size_t written;                // 本次请求已写出的字节数, 为0时失败可以换连接重试
+    struct st_proxy_request *request;
+    bool reused;
+    bool read_paused;              // 下游积压, 暂停读取响应
+    bool informational;            // 正在接收1xx响应
+    bool message_done;             // 响应已收完, 在llhttp_execute返回后处理
+    bool reusable;                 // 响应之后没有多余数据, 也没有以关闭连接结束
+    bool dispatching;              // 失败和完成推迟到最外层调用返回前处理
+    bool failed;
+    bool timed_out;
+};
+
+typedef struct st_proxy_request {
+    struct st_client *client;
+    st_upstream_conn_t *conn;
+    int group;
+    st_buffer_t head;              // 序列化的请求头, 换连接重试时重发
+    double start;                  // 发出请求的时间, 用于计算首字节时间
+    int attempts;
+    bool chunked;                  // 请求体按chunked转发
+    bool has_body;
+    bool idempotent;
+    bool head_method;
+    bool request_done;             // 请求体已收完
+    bool client_paused;            // 因上游积压暂停了下游的读取
+    bool response_started;
+} st_proxy_request_t;
+
+static llhttp_settings_t upstream_settings;
+static st_proxy_stats_t counters;
+
+static void conn_after(st_upstream_conn_t *conn);
+static void conn_flush(st_upstream_conn_t *conn);
+static void conn_read(st_upstream_conn_t *conn);
+static bool proxy_dispatch(st_proxy_request_t *req, st_buffer_t *pending, st_upstream_peer_t *exclude);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void count(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+// 逗号分隔的列表中是否有token, 不区分大小写
+static bool token_listed(const char *list, const char *token, size_t token_length) {
+    while (*list) {
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+        size_t length = strcspn(list, ",");
+        while (length > 0 && (list[length - 1] == ' ' || list[length - 1] == '\t')) {
+            length--;
+        }
+        if (length == token_length && strncasecmp(list, token, length) == 0) {
+            return true;
+        }
+        list += strcspn(list, ",");
+    }
+    return false;
+}
+
+// 逐跳头部, 不转发
+static bool hop_by_hop(const char *name) {
+    static const char *names[] = {"connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// ---- 均衡和摘除 ----
+
+// 峰值EWMA: 比当前值大的样本立即生效, 小的样本按时间衰减地并入
+static void peer_observe(st_upstream_peer_t *peer, double rtt, double now) {
+    double elapsed = now - peer->ewma_stamp;
+    peer->ewma_stamp = now;
+    if (rtt > peer->ewma) {
+        peer->ewma = rtt;
+        return;
+    }
+    double w = exp(-(elapsed > 0 ? elapsed : 0) / PROXY_EWMA_DECAY);
+    peer->ewma = peer->ewma * w + rtt * (1 - w);
+}
+
+static double peer_cost(const st_upstream_peer_t *peer) {
+    if (peer->group->balance == BALANCE_LEAST_OUTSTANDING) {
+        return peer->outstanding;
+    }
+    if (peer->ewma == 0 && peer->outstanding > 0) {
+        return EWMA_PENALTY + peer->outstanding;
+    }
+    return peer->ewma * (peer->outstanding + 1);
+}
+
+static void peer_failure(st_upstream_peer_t *peer, st_event_loop_t *loop) {
+    const st_upstream_group_t *group = peer->group;
+    if (++peer->fails < group->max_fails) {
+        return;
+    }
+    peer->fails = 0;
+    peer->ejected_until = event_loop_now(loop) + group->fail_timeout;
+    count(&counters.ejections);
+    log_warn("upstream %s:%d ejected for %.1fs", peer->server->host, peer->server->port, group->fail_timeout);
+}
+
+// 代价最小的可用主机, 代价相同时从游标开始轮流. 全部被摘除时选最早恢复的
+static st_upstream_peer_t *pick_peer(st_proxy_worker_t *worker, int group_index, st_upstream_peer_t *exclude) {
+    const st_upstream_group_t *group = &worker->proxy->groups[group_index];
+    st_upstream_peer_t *peers = worker->peers[group_index];
+    double now = event_loop_now(worker->loop);
+    st_upstream_peer_t *best = NULL, *fallback = NULL;
+    double best_cost = 0;
+    int start = worker->cursors[group_index]++;
+    for (int i = 0; i < group->server_count; i++) {
+        st_upstream_peer_t *peer = &peers[(start + i) % group->server_count];
+        if (peer->ejected_until > now) {
+            if (!fallback || peer->ejected_until < fallback->ejected_until) {
+                fallback = peer;
+            }
+            continue;
+        }
+        if (peer == exclude && group->server_count > 1) {
+            continue;
+        }
+        double cost = peer_cost(peer);
+        if (!best || cost < best_cost) {
+            best = peer;
+            best_cost = cost;
+        }
+    }
+    if (best) {
+        return best;
+    }
+    return fallback ? fallback : exclude;
+}
+
+// ---- 上游连接 ----
+
+static void idle_remove(st_upstream_conn_t *conn) {
+    st_upstream_conn_t **slot = &conn->peer->idle;
+    while (*slot && *slot != conn) {
+        slot = &(*slot)->next;
+    }
+    if (*slot) {
+        *slot = conn->next;
+        conn->peer->idle_count--;
+    }
+    conn->next = NULL;
+}
+
+static void conn_close(st_upstream_conn_t *conn) {
+    st_event_loop_t *loop = conn->worker->loop;
+    if (conn->state == CONN_IDLE) {
+        idle_remove(conn);
+    }
+    event_io_stop(loop, &conn->io);
+    event_timer_stop(loop, &conn->timer);
+    if (conn->ssl) {
+        SSL_free(conn->ssl);
+        ERR_clear_error();
+    }
+    close(conn->fd);
+    buffer_free(&conn->out);
+    buffer_free(&conn->head);
+    free(conn);
+}
+
+static void conn_update_io(st_upstream_conn_t *conn) {
+    int events = 0;
+    if (conn->state == CONN_CONNECTING) {
+        events = EVENT_WRITE;
+    } else if (!conn->read_paused) {
+        events = EVENT_READ;
+    }
+    if (conn->state == CONN_ACTIVE && buffer_length(&conn->out) > 0) {
+        events |= EVENT_WRITE;
+    }
+    event_io_set(conn->worker->loop, &conn->io, events);
+}
+
+static void conn_fail(st_upstream_conn_t *conn, const char *reason) {
+    if (!conn->failed) {
+        log_debug("upstream %s:%d %s", conn->peer->server->host, conn->peer->server->port, reason);
+    }
+    conn->failed = true;
+}
+
+// 返回读到的字节数, 0表示对端关闭, -1表示出错, -2表示暂时没有数据
+static ssize_t conn_recv(st_upstream_conn_t *conn, char *buffer, size_t size) {
+    if (!conn->ssl) {
+        ssize_t n = recv(conn->fd, buffer, size, 0);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+        }
+        return n;
+    }
+    int n = SSL_read(conn->ssl, buffer, (int)size);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(conn->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        return -2;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && errno == 0)) {
+        return 0;
+    }
+    return -1;
+}
+
+static ssize_t conn_send(st_upstream_conn_t *conn, const char *data, size_t length) {
+    if (!conn->ssl) {
+        ssize_t n = send(conn->fd, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+        }
+        return n;
+    }
+    int n = SSL_write(conn->ssl, data, length > INT_MAX ? INT_MAX : (int)length);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(conn->ssl, n);
+    return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? -2 : -1;
+}
+
+static void conn_flush(st_upstream_conn_t *conn) {
+    if (conn->state != CONN_ACTIVE || conn->failed) {
+        return;
+    }
+    while (buffer_length(&conn->out) > 0) {
+        ssize_t n = conn_send(conn, buffer_data(&conn->out), buffer_length(&conn->out));
+        if (n == -2) {
+            break;
+        }
+        if (n < 0) {
+            conn_fail(conn, "write failed");
+            return;
+        }
+        buffer_consume(&conn->out, n);
+        conn->written += n;
+        conn->last_activity = event_loop_now(conn->worker->loop);
+    }
+    if (buffer_length(&conn->out) == 0) {
+        buffer_reset(&conn->out);
+    }
+    conn_update_io(conn);
+
+    st_proxy_request_t *req = conn->request;
+    if (req && req->client_paused && buffer_length(&conn->out) < PROXY_OUTPUT_HIGH_WATERMARK / 2) {
+        req->client_paused = false;
+        resume_client_reading(req->client);
+    }
+}
+
+static void conn_handshake(st_upstream_conn_t *conn) {
+    int ret = SSL_do_handshake(conn->ssl);
+    if (ret == 1) {
+        conn->state = CONN_ACTIVE;
+        conn->last_activity = event_loop_now(conn->worker->loop);
+        event_timer_start(conn->worker->loop, &conn->timer, conn->peer->group->read_timeout);
+        conn_flush(conn);
+        return;
+    }
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ) {
+        event_io_set(conn->worker->loop, &conn->io, EVENT_READ);
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+        event_io_set(conn->worker->loop, &conn->io, EVENT_READ | EVENT_WRITE);
+    } else {
+        conn_fail(conn, "tls handshake failed");
+    }
+}
+
+static void conn_connected(st_upstream_conn_t *conn) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        conn_fail(conn, "connect failed");
+        return;
+    }
+    const st_upstream_group_t *group = conn->peer->group;
+    if (!group->tls) {
+        conn->state = CONN_ACTIVE;
+        conn->last_activity = event_loop_now(conn->worker->loop);
+        event_timer_start(conn->worker->loop, &conn->timer, group->read_timeout);
+        conn_flush(conn);
+        return;
+    }
+    conn->ssl = SSL_new(group->ssl_ctx);
+    if (!conn->ssl) {
+        conn_fail(conn, "SSL_new failed");
+        return;
+    }
+    SSL_set_fd(conn->ssl, conn->fd);
+    SSL_set_connect_state(conn->ssl);
+    const char *host = conn->peer->server->host;
+    struct in6_addr ip;
+    if (inet_pton(AF_INET, host, &ip) != 1 && inet_pton(AF_INET6, host, &ip) != 1) {
+        SSL_set_tlsext_host_name(conn->ssl, host);
+    }
+    if (SSL_CTX_get_verify_mode(group->ssl_ctx) != SSL_VERIFY_NONE) {
+        SSL_set1_host(conn->ssl, host);
+    }
+    conn->state = CONN_HANDSHAKE;
+    conn_handshake(conn);
+}
+
+// 进入可能失败或完成响应的操作, 嵌套调用时由最外层统一处理
+static bool conn_enter(st_upstream_conn_t *conn) {
+    bool nested = conn->dispatching;
+    conn->dispatching = true;
+    return nested;
+}
+
+static void conn_leave(st_upstream_conn_t *conn, bool nested) {
+    if (!nested) {
+        conn->dispatching = false;
+        conn_after(conn);
+    }
+}
+
+static void on_conn_io(st_event_loop_t *loop, st_event_io_t *w, int revents) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)w->data;
+    bool nested = conn_enter(conn);
+    if (conn->state == CONN_CONNECTING) {
+        conn_connected(conn);
+    } else if (conn->state == CONN_HANDSHAKE) {
+        conn_handshake(conn);
+    } else if (conn->state == CONN_IDLE) {
+        // 空闲时可读说明对端关闭了连接
+        conn_fail(conn, "idle connection closed");
+    } else {
+        if (revents & EVENT_WRITE) {
+            conn_flush(conn);
+        }
+        if (revents & EVENT_READ) {
+            conn_read(conn);
+        }
+    }
+    conn_leave(conn, nested);
+}
+
+static void on_conn_timeout(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)t->data;
+    const st_upstream_group_t *group = conn->peer->group;
+    if (conn->state == CONN_IDLE) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->state == CONN_ACTIVE) {
+        // 下游积压而暂停读取, 或在等待下游的请求体时不算超时
+        st_proxy_request_t *req = conn->request;
+        bool waiting = conn->read_paused || (req && !req->request_done && buffer_length(&conn->out) == 0);
+        double remaining = conn->last_activity + group->read_timeout - event_loop_now(loop);
+        if (waiting || remaining > 0) {
+            event_timer_start(loop, t, waiting ? group->read_timeout : remaining);
+            return;
+        }
+    }
+    bool nested = conn_enter(conn);
+    conn->timed_out = true;
+    conn_fail(conn, "timed out");
+    conn_leave(conn, nested);
+}
+
+static st_upstream_conn_t *conn_connect(st_proxy_worker_t *worker, st_upstream_peer_t *peer) {
+    const st_upstream_server_t *server = peer->server;
+    int fd = socket(server->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("socket: %s", strerror(errno));
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr *)&server->addr, server->addr_length) < 0 && errno != EINPROGRESS) {
+        log_debug("connect %s:%d: %s", server->host, server->port, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    st_upstream_conn_t *conn = calloc(1, sizeof(st_upstream_conn_t));
+    if (!conn) {
+        log_error("malloc");
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->worker = worker;
+    conn->peer = peer;
+    conn->state = CONN_CONNECTING;
+    event_io_init(&conn->io, on_conn_io, fd, EVENT_WRITE, 0);
+    conn->io.data = conn;
+    if (event_io_start(worker->loop, &conn->io) < 0) {
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    event_timer_init(&conn->timer, on_conn_timeout, 0);
+    conn->timer.data = conn;
+    event_timer_start(worker->loop, &conn->timer, peer->group->connect_timeout);
+    count(&counters.connects);
+    return conn;
+}
+
+static st_upstream_conn_t *conn_acquire(st_proxy_worker_t *worker, st_upstream_peer_t *peer) {
+    st_upstream_conn_t *conn = peer->idle;
+    if (!conn) {
+        return conn_connect(worker, peer);
+    }
+    peer->idle = conn->next;
+    peer->idle_count--;
+    conn->next = NULL;
+    conn->state = CONN_ACTIVE;
+    conn->reused = true;
+    conn->last_activity = event_loop_now(worker->loop);
+    event_timer_start(worker->loop, &conn->timer, peer->group->read_timeout);
+    count(&counters.reuses);
+    return conn;
+}
+
+// 响应结束且可以复用时放回空闲栈
+static void conn_release(st_upstream_conn_t *conn) {
+    st_upstream_peer_t *peer = conn->peer;
+    if (peer->idle_count >= peer->group->max_idle) {
+        conn_close(conn);
+        return;
+    }
+    conn->state = CONN_IDLE;
+    conn->read_paused = false;
+    conn->next = peer->idle;
+    peer->idle = conn;
+    peer->idle_count++;
+    conn_update_io(conn);
+    event_timer_start(conn->worker->loop, &conn->timer, peer->group->idle_timeout);
+}
+
+// ---- 请求 ----
+
+static void request_free(st_proxy_request_t *req) {
+    buffer_free(&req->head);
+    free(req);
+}
+
+// 请求结束: 与连接和下游解除关联, 之后下游剩余的请求体被丢弃
+static struct st_client *request_detach(st_proxy_request_t *req) {
+    struct st_client *client = req->client;
+    client->proxy = NULL;
+    if (req->conn) {
+        req->conn->request = NULL;
+        req->conn->peer->outstanding--;
+        req->conn = NULL;
+    }
+    bool paused = req->client_paused;
+    request_free(req);
+    if (paused) {
+        resume_client_reading(client);
+    }
+    return client;
+}
+
+static void request_fail(st_proxy_request_t *req, bool timed_out) {
+    bool started = req->response_started;
+    struct st_client *client = request_detach(req);
+    count(&counters.failures);
+    if (started) {
+        abort_response_to_client(client);
+    } else if (timed_out) {
+        send_response_to_client(client, 504, "Gateway Timeout", "upstream timed out\n");
+    } else {
+        send_response_to_client(client, 502, "Bad Gateway", "upstream unavailable\n");
+    }
+}
+
+// 连接失败: 请求还没有被上游看到时换一台主机重试
+static void conn_error(st_upstream_conn_t *conn) {
+    st_proxy_request_t *req = conn->request;
+    st_upstream_peer_t *peer = conn->peer;
+    if (!req) {
+        conn_close(conn);
+        return;
+    }
+    // 复用的连接可能已被对端关闭, 不算主机故障
+    if (!conn->reused || conn->timed_out) {
+        peer_failure(peer, conn->worker->loop);
+    }
+    bool unsent = conn->written == 0;
+    bool retry = !req->response_started && req->attempts < PROXY_MAX_ATTEMPTS &&
+                 (unsent || (conn->reused && req->idempotent && !req->has_body));
+    bool timed_out = conn->timed_out;
+    st_buffer_t pending = {0};
+    if (retry && unsent) {
+        // 还没写出过数据, 缓冲的请求头和请求体整体移到新连接
+        pending = conn->out;
+        memset(&conn->out, 0, sizeof(conn->out));
+    }
+    conn->request = NULL;
+    req->conn = NULL;
+    peer->outstanding--;
+    conn_close(conn);
+
+    if (retry) {
+        req->attempts++;
+        count(&counters.retries);
+        if (proxy_dispatch(req, buffer_length(&pending) > 0 ? &pending : NULL, peer)) {
+            buffer_free(&pending);
+            return;
+        }
+    }
+    buffer_free(&pending);
+    request_fail(req, timed_out);
+}
+
+static void response_complete(st_upstream_conn_t *conn) {
+    st_proxy_request_t *req = conn->request;
+    st_upstream_peer_t *peer = conn->peer;
+    bool reusable = conn->reusable && req->request_done && buffer_length(&conn->out) == 0 &&
+                    llhttp_should_keep_alive(&conn->parser);
+    int status = conn->parser.status_code;
+    if (status == 502 || status == 503 || status == 504) {
+        peer_failure(peer, conn->worker->loop);
+    } else {
+        peer->fails = 0;
+    }
+    struct st_client *client = request_detach(req);
+    if (reusable) {
+        conn_release(conn);
+    } else {
+        conn_close(conn);
+    }
+    // 最后结束下游响应, 它可能接着解析流水线上的下一个请求
+    finish_response_to_client(client);
+}
+
+static void conn_after(st_upstream_conn_t *conn) {
+    if (conn->failed) {
+        conn_error(conn);
+    } else if (conn->message_done) {
+        response_complete(conn);
+    }
+}
+
+static void conn_read(st_upstream_conn_t *conn) {
+    char buffer[UPSTREAM_READ_SIZE];
+    while (!conn->read_paused && !conn->failed && !conn->message_done) {
+        ssize_t n = conn_recv(conn, buffer, sizeof(buffer));
+        if (n == -2) {
+            return;
+        }
+        if (n == 0 && conn->request) {
+            // 以关闭连接结束的响应体
+            llhttp_finish(&conn->parser);
+            if (conn->message_done) {
+                conn->reusable = false;
+                return;
+            }
+        }
+        if (n <= 0) {
+            conn_fail(conn, n == 0 ? "closed by upstream" : "read failed");
+            return;
+        }
+        conn->last_activity = event_loop_now(conn->worker->loop);
+        llhttp_errno_t err = llhttp_execute(&conn->parser, buffer, n);
+        if (conn->message_done) {
+            // 响应之后还有数据, 连接状态不可信
+            conn->reusable = err == HPE_PAUSED && llhttp_get_error_pos(&conn->parser) == buffer + n;
+            return;
+        }
+        if (err != HPE_OK) {
+            conn_fail(conn, llhttp_errno_name(err));
+            return;
+        }
+    }
+}
+
+// ---- 上游响应的解析回调 ----
+
+static int on_upstream_message_begin(llhttp_t *parser) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    buffer_reset(&conn->head);
+    conn->header_count = 0;
+    conn->value_pending = false;
+    conn->reason_length = 0;
+    conn->reason[0] = '\0';
+    return 0;
+}
+
+static int on_upstream_status(llhttp_t *parser, const char *at, size_t length) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    size_t room = sizeof(conn->reason) - 1 - conn->reason_length;
+    if (length > room) {
+        length = room;
+    }
+    memcpy(conn->reason + conn->reason_length, at, length);
+    conn->reason_length += length;
+    conn->reason[conn->reason_length] = '\0';
+    return 0;
+}
+
+// 上一个头部的值为空时不会有值的回调, 在这里补上结尾
+static int end_header_value(st_upstream_conn_t *conn) {
+    if (!conn->value_pending) {
+        return 0;
+    }
+    conn->value_pending = false;
+    conn->header_count++;
+    return buffer_append(&conn->head, "", 1);
+}
+
+static int on_upstream_header_field(llhttp_t *parser, const char *at, size_t length) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    if (end_header_value(conn) < 0 || buffer_length(&conn->head) + length > MAX_REQUEST_HEAD_SIZE) {
+        return -1;
+    }
+    return buffer_append(&conn->head, at, length);
+}
+
+static int on_upstream_header_field_complete(llhttp_t *parser) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    if (conn->header_count >= UPSTREAM_MAX_HEADERS) {
+        return -1;
+    }
+    conn->value_pending = true;
+    return buffer_append(&conn->head, "", 1);
+}
+
+static int on_upstream_header_value(llhttp_t *parser, const char *at, size_t length) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    if (buffer_length(&conn->head) + length > MAX_REQUEST_HEAD_SIZE) {
+        return -1;
+    }
+    return buffer_append(&conn->head, at, length);
+}
+
+static int on_upstream_header_value_complete(llhttp_t *parser) {
+    return end_header_value((st_upstream_conn_t *)parser->data);
+}
+
+static int on_upstream_headers_complete(llhttp_t *parser) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    st_proxy_request_t *req = conn->request;
+    if (!req || end_header_value(conn) < 0) {
+        return -1;
+    }
+    int status = parser->status_code;
+    if (status < 200) {
+        if (status == 101) {
+            return -1;
+        }
+        // 1xx之后还有最终响应
+        conn->informational = true;
+        return 0;
+    }
+    double now = now_seconds();
+    peer_observe(conn->peer, now - req->start, now);
+
+    st_header_pair_t headers[UPSTREAM_MAX_HEADERS];
+    int header_count = 0;
+    const char *connection = NULL;
+    const char *p = buffer_data(&conn->head);
+    for (int i = 0; i < conn->header_count; i++) {
+        const char *value = p + strlen(p) + 1;
+        if (strcasecmp(p, "connection") == 0) {
+            connection = value;
+        }
+        p = value + strlen(value) + 1;
+    }
+    p = buffer_data(&conn->head);
+    for (int i = 0; i < conn->header_count; i++) {
+        const char *name = p;
+        const char *value = name + strlen(name) + 1;
+        p = value + strlen(value) + 1;
+        if (hop_by_hop(name) || strcasecmp(name, "content-length") == 0 ||
+            (connection && token_listed(connection, name, strlen(name)))) {
+            continue;
+        }
+        headers[header_count++] = (st_header_pair_t){name, value};
+    }
+
+    bool no_body = req->head_method || status == 204 || status == 304;
+    long long content_length = -1;
+    if (parser->flags & F_CONTENT_LENGTH) {
+        content_length = (long long)parser->content_length;
+    } else if (no_body) {
+        content_length = 0;
+    }
+    req->response_started = true;
+    start_response_with_headers(req->client, status, conn->reason_length ? conn->reason : "OK", headers, header_count, content_length);
+    // HEAD的响应没有正文
+    return req->head_method ? 1 : 0;
+}
+
+static int on_upstream_body(llhttp_t *parser, const char *at, size_t length) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    st_proxy_request_t *req = conn->request;
+    if (!req) {
+        return -1;
+    }
+    struct st_client *client = req->client;
+    send_response_chunk(client, at, length);
+    if (conn->request && client_output_full(client)) {
+        // 下游写空后在on_drain中恢复
+        conn->read_paused = true;
+        conn_update_io(conn);
+    }
+    return 0;
+}
+
+static int on_upstream_message_complete(llhttp_t *parser) {
+    st_upstream_conn_t *conn = (st_upstream_conn_t *)parser->data;
+    if (conn->informational) {
+        conn->informational = false;
+        return 0;
+    }
+    conn->message_done = true;
+    conn->reusable = true;
+    return HPE_PAUSED;
+}
+
+// ---- 转发 ----
+
+// 依次追加a, sep, b和结尾的CRLF
+static bool append_line(st_buffer_t *buffer, const char *a, const char *sep, const char *b) {
+    return buffer_append(buffer, a, strlen(a)) == 0 && buffer_append(buffer, sep, strlen(sep)) == 0 &&
+           buffer_append(buffer, b, strlen(b)) == 0 && buffer_append(buffer, "\r\n", 2) == 0;
+}
+
+static void client_address(struct st_client *client, char *address, size_t size) {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    address[0] = '\0';
+    if (getpeername(client->client_fd, (struct sockaddr *)&addr, &length) < 0) {
+        return;
+    }
+    if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, address, size);
+    } else if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, address, size);
+    }
+}
+
+// 请求行和头部: 去掉逐跳头部, 追加X-Forwarded-For/Proto
+static bool build_request_head(st_proxy_request_t *req) {
+    struct st_client *client = req->client;
+    const st_request_t *request = &client->request;
+    st_buffer_t *head = &req->head;
+    const char *method = get_request_method(client);
+    const char *url = get_request_url(client);
+    if (buffer_append(head, method, strlen(method)) < 0 || buffer_append(head, " ", 1) < 0 ||
+        !append_line(head, url, "", " HTTP/1.1")) {
+        return false;
+    }
+    const char *connection = get_request_known_header(client, HEADER_CONNECTION);
+    for (int i = 0; i < request->header_count; i++) {
+        const st_http_header_t *header = &request->headers[i];
+        const char *name = request->head.data + header->name;
+        if (header->id == HEADER_X_FORWARDED_FOR || header->id == HEADER_X_FORWARDED_PROTO || hop_by_hop(name) ||
+            (req->chunked && header->id == HEADER_CONTENT_LENGTH) ||
+            (connection && token_listed(connection, name, header->name_length))) {
+            continue;
+        }
+        if (!append_line(head, name, ": ", request->head.data + header->value)) {
+            return false;
+        }
+    }
+    char address[INET6_ADDRSTRLEN];
+    client_address(client, address, sizeof(address));
+    const char *forwarded = get_request_known_header(client, HEADER_X_FORWARDED_FOR);
+    if (forwarded && address[0]) {
+        // 接在已有的列表后面
+        if (buffer_append(head, "X-Forwarded-For: ", 17) < 0 || !append_line(head, forwarded, ", ", address)) {
+            return false;
+        }
+    } else if (forwarded || address[0]) {
+        // UNIX套接字的客户端没有地址, 原样转发已有的列表, 不追加空项
+        if (!append_line(head, "X-Forwarded-For", ": ", forwarded ? forwarded : address)) {
+            return false;
+        }
+    }
+    // HTTP/2只经TLS的ALPN协商, 流的伪客户端没有自己的ssl
+    if (!append_line(head, "X-Forwarded-Proto", ": ", client->ssl || client->h2_stream ? "https" : "http")) {
+        return false;
+    }
+    if (req->chunked && buffer_append(head, "Transfer-Encoding: chunked\r\n", 28) < 0) {
+        return false;
+    }
+    return buffer_append(head, "\r\n", 2) == 0;
+}
+
+// 选主机取连接并发出请求. pending为空时发送请求头, 否则发送pending中缓冲的数据
+static bool proxy_dispatch(st_proxy_request_t *req, st_buffer_t *pending, st_upstream_peer_t *exclude) {
+    st_proxy_worker_t *worker = req->client->worker->proxy;
+    st_upstream_peer_t *peer = pick_peer(worker, req->group, exclude);
+    st_upstream_conn_t *conn = conn_acquire(worker, peer);
+    if (!conn) {
+        peer_failure(peer, worker->loop);
+        return false;
+    }
+    conn->request = req;
+    req->conn = conn;
+    peer->outstanding++;
+    llhttp_init(&conn->parser, HTTP_RESPONSE, &upstream_settings);
+    conn->parser.data = conn;
+    conn->written = 0;
+    conn->message_done = false;
+    conn->reusable = false;
+    conn->informational = false;
+    if (pending) {
+        st_buffer_t empty = conn->out;
+        conn->out = *pending;
+        *pending = empty;
+    } else if (buffer_append(&conn->out, buffer_data(&req->head), buffer_length(&req->head)) < 0) {
+        conn_fail(conn, "malloc");
+    }
+    req->start = now_seconds();
+    bool nested = conn_enter(conn);
+    conn_flush(conn);
+    conn_leave(conn, nested);
+    return true;
+}
+
+static void proxy_start(struct st_client *client, int group) {
+    st_proxy_request_t *req = calloc(1, sizeof(st_proxy_request_t));
+    if (!req) {
+        log_error("malloc");
+        send_response_to_client(client, 502, "Bad Gateway", "proxy out of memory\n");
+        return;
+    }
+    req->client = client;
+    req->group = group;
+    req->attempts = 1;
+    int method = client->parser.method;
+    req->head_method = method == HTTP_HEAD;
+    req->idempotent = method == HTTP_GET || method == HTTP_HEAD || method == HTTP_PUT ||
+                      method == HTTP_DELETE || method == HTTP_OPTIONS || method == HTTP_TRACE;
+    if (client->h2_stream) {
+        req->has_body = !client->h2_stream->remote_closed;
+        req->chunked = req->has_body && !get_request_known_header(client, HEADER_CONTENT_LENGTH);
+    } else {
+        req->chunked = (client->parser.flags & F_CHUNKED) != 0;
+        req->has_body = req->chunked || client->parser.content_length > 0;
+    }
+    if (!build_request_head(req)) {
+        request_free(req);
+        send_response_to_client(client, 502, "Bad Gateway", "request head too large\n");
+        return;
+    }
+    count(&counters.requests);
+    client->proxy = req;
+    if (!proxy_dispatch(req, NULL, NULL)) {
+        request_fail(req, false);
+    }
+}
+
+static void proxy_request_body(st_proxy_request_t *req, const char *data, size_t length) {
+    st_upstream_conn_t *conn = req->conn;
+    if (!conn || length == 0) {
+        return;
+    }
+    if (req->chunked) {
+        char prefix[32];
+        int n = snprintf(prefix, sizeof(prefix), "%zx\r\n", length);
+        if (buffer_append(&conn->out, prefix, n) < 0 || buffer_append(&conn->out, data, length) < 0 ||
+            buffer_append(&conn->out, "\r\n", 2) < 0) {
+            conn_fail(conn, "malloc");
+        }
+    } else if (buffer_append(&conn->out, data, length) < 0) {
+        conn_fail(conn, "malloc");
+    }
+    bool nested = conn_enter(conn);
+    conn_flush(conn);
+    if (!conn->failed && buffer_length(&conn->out) >= PROXY_OUTPUT_HIGH_WATERMARK && !req->client_paused) {
+        req->client_paused = true;
+        pause_client_reading(req->client);
+    }
+    conn_leave(conn, nested);
+}
+
+static void proxy_request_end(st_proxy_request_t *req) {
+    req->request_done = true;
+    st_upstream_conn_t *conn = req->conn;
+    if (!conn || !req->chunked) {
+        return;
+    }
+    if (buffer_append(&conn->out, "0\r\n\r\n", 5) < 0) {
+        conn_fail(conn, "malloc");
+    }
+    bool nested = conn_enter(conn);
+    conn_flush(conn);
+    conn_leave(conn, nested);
+}
+
+// 下游积压的响应写空了, 继续读取上游
+static void proxy_resume(st_proxy_request_t *req) {
+    st_upstream_conn_t *conn = req->conn;
+    if (!conn || !conn->read_paused || client_output_full(req->client)) {
+        return;
+    }
+    conn->read_paused = false;
+    conn->last_activity = event_loop_now(conn->worker->loop);
+    conn_update_io(conn);
+    bool nested = conn_enter(conn);
+    conn_read(conn);
+    conn_leave(conn, nested);
+}
+
+// 下游连接或流关闭, 上游连接上的响应无法再交付
+static void proxy_abort(st_proxy_request_t *req) {
+    st_upstream_conn_t *conn = req->conn;
+    req->client->proxy = NULL;
+    if (conn) {
+        conn->request = NULL;
+        conn->peer->outstanding--;
+        if (conn->dispatching) {
+            // 在连接自己的回调中, 交给最外层关闭
+            conn->failed = true;
+        } else {
+            conn_close(conn);
+        }
+    }
+    request_free(req);
+}
+
+// ---- 包装的回调 ----
+
+static int match_route(const st_proxy_t *proxy, const char *url) {
+    for (int i = 0; i < proxy->route_count; i++) {
+        if (strncmp(url, proxy->routes[i].prefix, proxy->routes[i].prefix_length) == 0) {
+            return proxy->routes[i].group;
+        }
+    }
+    return -1;
+}
+
+static void proxy_on_body_start(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    st_proxy_worker_t *worker = client->worker->proxy;
+    int group = worker ? match_route(worker->proxy, get_request_url(client)) : -1;
+    if (group >= 0) {
+        client->proxied = true;
+        proxy_start(client, group);
+        return;
+    }
+    event_callbacks *app = client->worker->params->options.proxy->app;
+    if (app && app->on_body_start) {
+        app->on_body_start(client);
+    }
+}
+
+static void proxy_on_data_received(void *ptr, const char *data, size_t length) {
+    struct st_client *client = (struct st_client *)ptr;
+    if (client->proxied) {
+        if (client->proxy) {
+            proxy_request_body(client->proxy, data, length);
+        }
+        return;
+    }
+    event_callbacks *app = client->worker->params->options.proxy->app;
+    if (app && app->on_data_received) {
+        app->on_data_received(client, data, length);
+    }
+}
+
+static void proxy_on_body_end(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    if (client->proxied) {
+        if (client->proxy) {
+            proxy_request_end(client->proxy);
+        }
+        return;
+    }
+    event_callbacks *app = client->worker->params->options.proxy->app;
+    if (app && app->on_body_end) {
+        app->on_body_end(client);
+    }
+}
+
+static void proxy_on_drain(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    if (client->proxied) {
+        if (client->proxy) {
+            proxy_resume(client->proxy);
+        }
+        return;
+    }
+    event_callbacks *app = client->worker->params->options.proxy->app;
+    if (app && app->on_drain) {
+        app->on_drain(client);
+    }
+}
+
+static void proxy_on_disconnected(void *ptr) {
+    struct st_client *client = (struct st_client *)ptr;
+    if (client->proxy) {
+        proxy_abort(client->proxy);
+    }
+    // HTTP/2流的断开只和这个请求有关, HTTP/1.1的断开是连接级的
+    if (client->proxied && client->h2_stream) {
+        return;
+    }
+    event_callbacks *app = client->worker->params->options.proxy->app;
+    if (app && app->on_disconnected) {
+        app->on_disconnected(client);
+    }
+}
+
+event_callbacks *proxy_wrap_callbacks(st_proxy_t *proxy, event_callbacks *app) {
+    proxy->app = app;
+    if (app) {
+        proxy->callbacks = *app;
+    }
+    proxy->callbacks.on_body_start = proxy_on_body_start;
+    proxy->callbacks.on_data_received = proxy_on_data_received;
+    proxy->callbacks.on_body_end = proxy_on_body_end;
+    proxy->callbacks.on_drain = proxy_on_drain;
+    proxy->callbacks.on_disconnected = proxy_on_disconnected;
+    return &proxy->callbacks;
+}
+
+// ---- 配置 ----
+
+static bool resolve_server(st_upstream_server_t *server, const char *value) {
+    const char *colon = strrchr(value, ':');
+    if (!colon || colon == value || (size_t)(colon - value) >= sizeof(server->host)) {
+        return false;
+    }
+    snprintf(server->host, sizeof(server->host), "%.*s", (int)(colon - value), value);
+    // [::1]:8080
+    if (server->host[0] == '[') {
+        size_t length = strlen(server->host);
+        if (length < 2 || server->host[length - 1] != ']') {
+            return false;
+        }
+        memmove(server->host, server->host + 1, length - 2);
+        server->host[length - 2] = '\0';
+    }
+    server->port = atoi(colon + 1);
+    struct addrinfo hints = {0}, *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (server->port <= 0 || getaddrinfo(server->host, colon + 1, &hints, &result) != 0) {
+        return false;
+    }
+    memcpy(&server->addr, result->ai_addr, result->ai_addrlen);
+    server->addr_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static bool load_group(st_upstream_group_t *group, const st_config_section_t *section) {
+    snprintf(group->name, sizeof(group->name), "%s", section->section + strlen("upstream:"));
+    group->balance = BALANCE_PEAK_EWMA;
+    group->max_idle = PROXY_DEFAULT_MAX_IDLE;
+    group->connect_timeout = PROXY_DEFAULT_CONNECT_TIMEOUT;
+    group->read_timeout = PROXY_DEFAULT_READ_TIMEOUT;
+    group->idle_timeout = PROXY_DEFAULT_IDLE_TIMEOUT;
+    group->max_fails = PROXY_DEFAULT_MAX_FAILS;
+    group->fail_timeout = PROXY_DEFAULT_FAIL_TIMEOUT;
+    bool verify = true;
+    const char *ca = NULL;
+    for (size_t i = 0; i < section->entry_count; i++) {
+        const char *key = section->entries[i].key;
+        const char *value = section->entries[i].value;
+        if (strcmp(key, "server") == 0) {
+            if (group->server_count >= PROXY_MAX_SERVERS) {
+                log_warn("upstream %s: too many servers", group->name);
+            } else if (resolve_server(&group->servers[group->server_count], value)) {
+                group->server_count++;
+            } else {
+                log_error("upstream %s: invalid server %s", group->name, value);
+            }
+        } else if (strcmp(key, "tls") == 0) {
+            group->tls = atoi(value) != 0;
+        } else if (strcmp(key, "verify") == 0) {
+            verify = atoi(value) != 0;
+        } else if (strcmp(key, "ca") == 0) {
+            ca = value;
+        } else if (strcmp(key, "balance") == 0) {
+            if (strcmp(value, "least_outstanding") == 0) {
+                group->balance = BALANCE_LEAST_OUTSTANDING;
+            } else if (strcmp(value, "peak_ewma") != 0) {
+                log_warn("upstream %s: unknown balance %s, using peak_ewma", group->name, value);
+            }
+        } else if (strcmp(key, "max_idle") == 0) {
+            group->max_idle = atoi(value);
+        } else if (strcmp(key, "connect_timeout") == 0) {
+            group->connect_timeout = atof(value);
+        } else if (strcmp(key, "read_timeout") == 0) {
+            group->read_timeout = atof(value);
+        } else if (strcmp(key, "idle_timeout") == 0) {
+            group->idle_timeout = atof(value);
+        } else if (strcmp(key, "max_fails") == 0) {
+            group->max_fails = atoi(value);
+        } else if (strcmp(key, "fail_timeout") == 0) {
+            group->fail_timeout = atof(value);
+        }
+    }
+    if (group->server_count == 0) {
+        log_error("upstream %s: no servers", group->name);
+        return false;
+    }
+    if (group->tls) {
+        group->ssl_ctx = init_client_ssl();
+        SSL_CTX_set_mode(group->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        if (verify) {
+            SSL_CTX_set_verify(group->ssl_ctx, SSL_VERIFY_PEER, NULL);
+            if (ca ? SSL_CTX_load_verify_locations(group->ssl_ctx, ca, NULL) != 1 : SSL_CTX_set_default_verify_paths(group->ssl_ctx) != 1) {
+                log_error("upstream %s: failed to load CA", group->name);
+            }
+        }
+    }
+    return true;
+}
+
+static void init_upstream_settings(void) {
+    llhttp_settings_init(&upstream_settings);
+    upstream_settings.on_message_begin = on_upstream_message_begin;
+    upstream_settings.on_status = on_upstream_status;
+    upstream_settings.on_header_field = on_upstream_header_field;
+    upstream_settings.on_header_field_complete = on_upstream_header_field_complete;
+    upstream_settings.on_header_value = on_upstream_header_value;
+    upstream_settings.on_header_value_complete = on_upstream_header_value_complete;
+    upstream_settings.on_headers_complete = on_upstream_headers_complete;
+    upstream_settings.on_body = on_upstream_body;
+    upstream_settings.on_message_complete = on_upstream_message_complete;
+}
+
+st_proxy_t *proxy_load(const st_config_file_t *config) {
+    st_proxy_t *proxy = calloc(1, sizeof(st_proxy_t));
+    if (!proxy) {
+        log_error("malloc");
+        return NULL;
+    }
+    for (size_t i = 0; i < config->section_count; i++) {
+        const st_config_section_t *section = &config->sections[i];
+        if (strncmp(section->section, "upstream:", strlen("upstream:")) != 0) {
+            continue;
+        }
+        if (proxy->group_count >= PROXY_MAX_GROUPS) {
+            log_warn("too many upstream groups");
+            break;
+        }
+        if (load_group(&proxy->groups[proxy->group_count], section)) {
+            proxy->group_count++;
+        }
+    }
+    for (size_t i = 0; i < config->section_count; i++) {
+        const st_config_section_t *section = &config->sections[i];
+        if (strcmp(section->section, "proxy") != 0) {
+            continue;
+        }
+        for (size_t j = 0; j < section->entry_count && proxy->route_count < PROXY_MAX_ROUTES; j++) {
+            if (strcmp(section->entries[j].key, "route") != 0) {
+                continue;
+            }
+            // "前缀 上游组"
+            st_proxy_route_t *route = &proxy->routes[proxy->route_count];
+            char name[MAX_VALUE_LENGTH];
+            if (sscanf(section->entries[j].value, "%99s %99s", route->prefix, name) != 2) {
+                log_error("invalid route %s", section->entries[j].value);
+                continue;
+            }
+            route->group = -1;
+            for (int k = 0; k < proxy->group_count; k++) {
+                if (strcmp(proxy->groups[k].name, name) == 0) {
+                    route->group = k;
+                }
+            }
+            if (route->group < 0) {
+                log_error("route %s: unknown upstream %s", route->prefix, name);
+                continue;
+            }
+            route->prefix_length = strlen(route->prefix);
+            proxy->route_count++;
+        }
+    }
+    if (proxy->route_count == 0) {
+        proxy_free(proxy);
+        return NULL;
+    }
+    init_upstream_settings();
+    return proxy;
+}
+
+void proxy_free(st_proxy_t *proxy) {
+    if (!proxy) {
+        return;
+    }
+    for (int i = 0; i < proxy->group_count; i++) {
+        if (proxy->groups[i].ssl_ctx) {
+            cleanup_ssl(proxy->groups[i].ssl_ctx);
+        }
+    }
+    free(proxy);
+}
+
+st_proxy_worker_t *proxy_worker_new(st_proxy_t *proxy, st_event_loop_t *loop) {
+    st_proxy_worker_t *worker = calloc(1, sizeof(st_proxy_worker_t));
+    if (!worker) {
+        log_error("malloc");
+        return NULL;
+    }
+    worker->proxy = proxy;
+    worker->loop = loop;
+    for (int i = 0; i < proxy->group_count; i++) {
+        const st_upstream_group_t *group = &proxy->groups[i];
+        worker->peers[i] = calloc(group->server_count, sizeof(st_upstream_peer_t));
+        if (!worker->peers[i]) {
+            log_error("malloc");
+            proxy_worker_free(worker);
+            return NULL;
+        }
+        for (int j = 0; j < group->server_count; j++) {
+            worker->peers[i][j].server = &group->servers[j];
+            worker->peers[i][j].group = group;
+        }
+    }
+    return worker;
+}
+
+// 只关闭空闲连接, 进行中的请求随各自的下游连接结束
+void proxy_worker_free(st_proxy_worker_t *worker) {
+    if (!worker) {
+        return;
+    }
+    for (int i = 0; i < worker->proxy->group_count; i++) {
+        if (!worker->peers[i]) {
+            continue;
+        }
+        for (int j = 0; j < worker->proxy->groups[i].server_count; j++) {
+            while (worker->peers[i][j].idle) {
+                conn_close(worker->peers[i][j].idle);
+            }
+        }
+        free(worker->peers[i]);
+    }
+    free(worker);
+}
+
+void proxy_stats(st_proxy_stats_t *stats) {
+    stats->requests = __atomic_load_n(&counters.requests, __ATOMIC_RELAXED);
+    stats->retries = __atomic_load_n(&counters.retries, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&counters.failures, __ATOMIC_RELAXED);
+    stats->ejections = __atomic_load_n(&counters.ejections, __ATOMIC_RELAXED);
+    stats->connects = __atomic_load_n(&counters.connects, __ATOMIC_RELAXED);
+    stats->reuses = __atomic_load_n(&counters.reuses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,121 @@
+#include "request.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void request_reset(st_request_t *request) {
+    buffer_reset(&request->head);
+    request->url = 0;
+    request->url_length = 0;
+    request->mark = 0;
+    request->header_count = 0;
+    memset(request->known, 0, sizeof(request->known));
+}
+
+void request_free(st_request_t *request) {
+    buffer_free(&request->head);
+    free(request->headers);
+    request->headers = NULL;
+    request->header_capacity = 0;
+    request_reset(request);
+}
+
+st_http_header_t *request_next_header(st_request_t *request) {
+    if (request->header_count >= MAX_REQUEST_HEADERS) {
+        log_error("too many request headers");
+        return NULL;
+    }
+    if (request->header_count == request->header_capacity) {
+        int capacity = request->header_capacity ? request->header_capacity * 2 : REQUEST_INITIAL_HEADERS;
+        if (capacity > MAX_REQUEST_HEADERS) {
+            capacity = MAX_REQUEST_HEADERS;
+        }
+        st_http_header_t *headers = realloc(request->headers, capacity * sizeof(st_http_header_t));
+        if (!headers) {
+            log_error("malloc");
+            return NULL;
+        }
+        request->headers = headers;
+        request->header_capacity = capacity;
+    }
+    return &request->headers[request->header_count];
+}
+
+int request_append(st_request_t *request, const char *at, size_t length) {
+    if (buffer_length(&request->head) + length > MAX_REQUEST_HEAD_SIZE) {
+        log_error("request head too large");
+        return -1;
+    }
+    return buffer_append(&request->head, at, length);
+}
+
+int request_terminate(st_request_t *request, uint32_t *start, uint32_t *length) {
+    *start = request->mark;
+    *length = (uint32_t)(buffer_length(&request->head) - request->mark);
+    if (request_append(request, "", 1) < 0) {
+        return -1;
+    }
+    request->mark = (uint32_t)buffer_length(&request->head);
+    return 0;
+}
+
+int request_commit_header(st_request_t *request) {
+    st_http_header_t *header = &request->headers[request->header_count];
+    if (request_terminate(request, &header->value, &header->value_length) < 0) {
+        return -1;
+    }
+    header->id = known_header_lookup(request->head.data + header->name, header->name_length);
+    if (header->id != HEADER_UNKNOWN && request->known[header->id] == 0) {
+        request->known[header->id] = (uint8_t)(request->header_count + 1);
+    }
+    request->header_count++;
+    return 0;
+}
+
+int request_set_url(st_request_t *request, const char *url, size_t length) {
+    if (request_append(request, url, length) < 0) {
+        return -1;
+    }
+    return request_terminate(request, &request->url, &request->url_length);
+}
+
+int request_add_header(st_request_t *request, const char *name, size_t name_length, const char *value, size_t value_length) {
+    st_http_header_t *header = request_next_header(request);
+    if (!header || request_append(request, name, name_length) < 0 ||
+        request_terminate(request, &header->name, &header->name_length) < 0 ||
+        request_append(request, value, value_length) < 0) {
+        return -1;
+    }
+    return request_commit_header(request);
+}
+
+const char *request_find_header(const st_request_t *request, const char *name) {
+    int id = known_header_lookup(name, strlen(name));
+    if (id != HEADER_UNKNOWN) {
+        return request_get_header(request, id);
+    }
+    for (int i = 0; i < request->header_count; i++) {
+        if (strcasecmp(request->head.data + request->headers[i].name, name) == 0) {
+            return request->head.data + request->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+const char *request_get_header(const st_request_t *request, int id) {
+    if (id < 0 || id >= KNOWN_HEADER_COUNT || request->known[id] == 0) {
+        return NULL;
+    }
+    return request->head.data + request->headers[request->known[id] - 1].value;
+}
+
+int request_method_from_string(const char *method, size_t length) {
+    for (int i = 0; i <= HTTP_QUERY; i++) {
+        const char *name = llhttp_method_name((llhttp_method_t)i);
+        if (strlen(name) == length && memcmp(name, method, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include "response_cache.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#define SHARD_INITIAL_BUCKETS 64
+#define CONNECTION_KEEP_ALIVE "\r\nConnection: keep-alive\r\n"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// FNV-1a
+static uint64_t hash_key(const char *key, size_t length) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static size_t entry_cost(const st_cache_entry_t *entry) {
+    return sizeof(st_cache_entry_t) + entry->length + entry->key_length;
+}
+
+static const char *entry_key(const st_cache_entry_t *entry) {
+    return entry->data + entry->length;
+}
+
+st_response_cache_t *response_cache_new(int shard_count, size_t capacity, size_t max_entry_size) {
+    if (shard_count <= 0) {
+        shard_count = RESPONSE_CACHE_DEFAULT_SHARDS;
+    }
+    st_response_cache_t *cache = calloc(1, sizeof(st_response_cache_t));
+    if (!cache) {
+        log_error("malloc");
+        return NULL;
+    }
+    cache->shards = calloc(shard_count, sizeof(st_cache_shard_t));
+    if (!cache->shards) {
+        log_error("malloc");
+        free(cache);
+        return NULL;
+    }
+    cache->shard_count = shard_count;
+    cache->shard_capacity = capacity / shard_count;
+    cache->max_entry_size = max_entry_size;
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    }
+    return cache;
+}
+
+static void entry_unref(st_cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(entry);
+    }
+}
+
+void response_cache_free(st_response_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->shard_count; i++) {
+        st_cache_shard_t *shard = &cache->shards[i];
+        st_cache_entry_t *entry = shard->lru_head;
+        while (entry) {
+            st_cache_entry_t *next = entry->lru_next;
+            entry_unref(entry);
+            entry = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+static st_cache_shard_t *shard_for(st_response_cache_t *cache, uint64_t hash) {
+    // 高位选分片, 低位选桶
+    return &cache->shards[(hash >> 32) % cache->shard_count];
+}
+
+static void lru_unlink(st_cache_shard_t *shard, st_cache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(st_cache_shard_t *shard, st_cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+// 返回指向匹配条目(或链表末尾)的指针, 没有桶时返回NULL
+static st_cache_entry_t **find_slot(st_cache_shard_t *shard, uint64_t hash, const char *key, size_t key_length) {
+    if (!shard->buckets) {
+        return NULL;
+    }
+    st_cache_entry_t **slot = &shard->buckets[hash & (shard->bucket_count - 1)];
+    while (*slot) {
+        st_cache_entry_t *entry = *slot;
+        if (entry->hash == hash && entry->key_length == key_length && memcmp(entry_key(entry), key, key_length) == 0) {
+            return slot;
+        }
+        slot = &entry->hash_next;
+    }
+    return slot;
+}
+
+// 从哈希表和LRU链表中移除, 并释放缓存持有的引用
+static void remove_entry(st_cache_shard_t *shard, st_cache_entry_t **slot) {
+    st_cache_entry_t *entry = *slot;
+    *slot = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->entry_count--;
+    shard->bytes -= entry_cost(entry);
+    entry_unref(entry);
+}
+
+static void remove_by_pointer(st_cache_shard_t *shard, st_cache_entry_t *entry) {
+    st_cache_entry_t **slot = &shard->buckets[entry->hash & (shard->bucket_count - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    remove_entry(shard, slot);
+}
+
+static int grow_buckets(st_cache_shard_t *shard) {
+    size_t count = shard->bucket_count ? shard->bucket_count * 2 : SHARD_INITIAL_BUCKETS;
+    st_cache_entry_t **buckets = calloc(count, sizeof(st_cache_entry_t *));
+    if (!buckets) {
+        return -1;
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        st_cache_entry_t *entry = shard->buckets[i];
+        while (entry) {
+            st_cache_entry_t *next = entry->hash_next;
+            st_cache_entry_t **slot = &buckets[entry->hash & (count - 1)];
+            entry->hash_next = *slot;
+            *slot = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+    return 0;
+}
+
+st_cache_entry_t *response_cache_lookup(st_response_cache_t *cache, const char *key, size_t key_length) {
+    uint64_t hash = hash_key(key, key_length);
+    st_cache_shard_t *shard = shard_for(cache, hash);
+    st_cache_entry_t *result = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    st_cache_entry_t **slot = find_slot(shard, hash, key, key_length);
+    if (slot && *slot) {
+        st_cache_entry_t *entry = *slot;
+        if (entry->expires <= now_seconds()) {
+            remove_entry(shard, slot);
+            shard->expirations++;
+        } else {
+            if (shard->lru_head != entry) {
+                lru_unlink(shard, entry);
+                lru_push_front(shard, entry);
+            }
+            __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+            result = entry;
+        }
+    }
+    if (result) {
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+void response_cache_release(st_cache_entry_t *entry) {
+    if (entry) {
+        entry_unref(entry);
+    }
+}
+
+bool response_cache_store(st_response_cache_t *cache, const char *key, size_t key_length,
+                          const char *head, size_t head_length, const char *body, size_t body_length, double ttl) {
+    size_t length = head_length + body_length;
+    if (ttl <= 0 || length > cache->max_entry_size) {
+        return false;
+    }
+    // 只缓存keep-alive形式的响应, 记下Connection头的位置以便改写
+    const char *connection = memmem(head, head_length, CONNECTION_KEEP_ALIVE, strlen(CONNECTION_KEEP_ALIVE));
+    if (!connection) {
+        return false;
+    }
+    st_cache_entry_t *entry = malloc(sizeof(st_cache_entry_t) + length + key_length);
+    if (!entry) {
+        log_error("malloc");
+        return false;
+    }
+    entry->data = (char *)(entry + 1);
+    memcpy(entry->data, head, head_length);
+    if (body_length > 0) {
+        memcpy(entry->data + head_length, body, body_length);
+    }
+    memcpy(entry->data + length, key, key_length);
+    entry->length = length;
+    entry->key_length = key_length;
+    entry->connection_offset = (connection - head) + 2;
+    entry->hash = hash_key(key, key_length);
+    entry->expires = now_seconds() + ttl;
+    entry->refs = 1;
+    entry->hash_next = NULL;
+    entry->lru_prev = entry->lru_next = NULL;
+
+    size_t cost = entry_cost(entry);
+    if (cost > cache->shard_capacity) {
+        free(entry);
+        return false;
+    }
+    st_cache_shard_t *shard = shard_for(cache, entry->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->entry_count >= shard->bucket_count && grow_buckets(shard) < 0) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return false;
+    }
+    st_cache_entry_t **slot = find_slot(shard, entry->hash, key, key_length);
+    if (*slot) {
+        remove_entry(shard, slot);
+    }
+    // 从最久未使用的一端淘汰, 直到放得下
+    while (shard->bytes + cost > cache->shard_capacity && shard->lru_tail) {
+        remove_by_pointer(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+    slot = find_slot(shard, entry->hash, key, key_length);
+    *slot = entry;
+    lru_push_front(shard, entry);
+    shard->entry_count++;
+    shard->bytes += cost;
+    shard->inserts++;
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+void response_cache_stats(st_response_cache_t *cache, st_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < cache->shard_count; i++) {
+        st_cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->evictions += shard->evictions;
+        stats->expirations += shard->expirations;
+        stats->entries += shard->entry_count;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+double cache_control_ttl(const char *value) {
+    if (!value) {
+        return 0;
+    }
+    double max_age = -1, s_maxage = -1;
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        size_t length = strcspn(value, ",=");
+        if ((length == 8 && strncasecmp(value, "no-store", 8) == 0) ||
+            (length == 8 && strncasecmp(value, "no-cache", 8) == 0) ||
+            (length == 7 && strncasecmp(value, "private", 7) == 0)) {
+            return 0;
+        }
+        bool is_max_age = length == 7 && strncasecmp(value, "max-age", 7) == 0;
+        bool is_s_maxage = length == 8 && strncasecmp(value, "s-maxage", 8) == 0;
+        value += length;
+        if (*value == '=') {
+            value++;
+            if (*value == '"') {
+                value++;
+            }
+            if ((is_max_age || is_s_maxage) && isdigit((unsigned char)*value)) {
+                double seconds = strtod(value, NULL);
+                if (is_max_age) {
+                    max_age = seconds;
+                } else {
+                    s_maxage = seconds;
+                }
+            }
+            value += strcspn(value, ",");
+        }
+    }
+    if (s_maxage >= 0) {
+        return s_maxage;
+    }
+    return max_age > 0 ? max_age : 0;
+}
+
+bool cache_control_has(const char *value, const char *name) {
+    size_t name_length = strlen(name);
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        size_t length = strcspn(value, ",= \t");
+        if (length == name_length && strncasecmp(value, name, length) == 0) {
+            return true;
+        }
+        value += strcspn(value, ",");
+    }
+    return false;
+}
+
+double cache_response_ttl(const char *cache_control, bool authorized) {
+    if (authorized && !cache_control_has(cache_control, "public") && !cache_control_has(cache_control, "s-maxage") &&
+        !cache_control_has(cache_control, "must-revalidate")) {
+        return 0;
+    }
+    // private和no-store由cache_control_ttl返回0挡住
+    return cache_control_ttl(cache_control);
+}
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "single_flight.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARD_INITIAL_BUCKETS 64
+#define CONNECTION_PREFIX "\r\nConnection: "
+
+// FNV-1a
+static uint64_t hash_key(const char *key, size_t length) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+st_flight_group_t *flight_group_new(int shard_count, double max_wait) {
+    if (shard_count <= 0) {
+        shard_count = FLIGHT_DEFAULT_SHARDS;
+    }
+    st_flight_group_t *group = calloc(1, sizeof(st_flight_group_t));
+    if (!group) {
+        log_error("malloc");
+        return NULL;
+    }
+    group->shards = calloc(shard_count, sizeof(st_flight_shard_t));
+    if (!group->shards) {
+        log_error("malloc");
+        free(group);
+        return NULL;
+    }
+    group->shard_count = shard_count;
+    group->max_wait = max_wait;
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&group->shards[i].lock, NULL);
+    }
+    return group;
+}
+
+// 工作线程都已退出, 不会再有进行中的请求
+void flight_group_free(st_flight_group_t *group) {
+    if (!group) {
+        return;
+    }
+    for (int i = 0; i < group->shard_count; i++) {
+        free(group->shards[i].buckets);
+        pthread_mutex_destroy(&group->shards[i].lock);
+    }
+    free(group->shards);
+    free(group);
+}
+
+static int grow_buckets(st_flight_shard_t *shard) {
+    size_t count = shard->bucket_count ? shard->bucket_count * 2 : SHARD_INITIAL_BUCKETS;
+    st_flight_t **buckets = calloc(count, sizeof(st_flight_t *));
+    if (!buckets) {
+        return -1;
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        st_flight_t *flight = shard->buckets[i];
+        while (flight) {
+            st_flight_t *next = flight->hash_next;
+            st_flight_t **slot = &buckets[flight->hash & (count - 1)];
+            flight->hash_next = *slot;
+            *slot = flight;
+            flight = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+    return 0;
+}
+
+static st_flight_shard_t *shard_for(st_flight_group_t *group, uint64_t hash) {
+    return &group->shards[(hash >> 32) % group->shard_count];
+}
+
+int flight_join(st_flight_group_t *group, const char *key, size_t key_length, st_flight_mailbox_t *mailbox, void *data,
+                st_flight_t **flight, st_flight_waiter_t **waiter) {
+    uint64_t hash = hash_key(key, key_length);
+    st_flight_shard_t *shard = shard_for(group, hash);
+    *flight = NULL;
+    *waiter = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->flight_count >= shard->bucket_count && grow_buckets(shard) < 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    st_flight_t **slot = &shard->buckets[hash & (shard->bucket_count - 1)];
+    while (*slot && !((*slot)->hash == hash && (*slot)->key_length == key_length && memcmp((*slot)->key, key, key_length) == 0)) {
+        slot = &(*slot)->hash_next;
+    }
+    if (*slot) {
+        st_flight_waiter_t *w = calloc(1, sizeof(st_flight_waiter_t));
+        if (!w) {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        w->flight = *slot;
+        w->shard = shard;
+        w->mailbox = mailbox;
+        w->data = data;
+        w->next = (*slot)->waiters;
+        (*slot)->waiters = w;
+        pthread_mutex_unlock(&shard->lock);
+        *waiter = w;
+        return FLIGHT_WAITER;
+    }
+    st_flight_t *f = malloc(sizeof(st_flight_t) + key_length);
+    if (!f) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    f->hash_next = NULL;
+    f->hash = hash;
+    f->key_length = key_length;
+    f->waiters = NULL;
+    memcpy(f->key, key, key_length);
+    *slot = f;
+    shard->flight_count++;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&group->stats.leaders, 1, __ATOMIC_RELAXED);
+    *flight = f;
+    return FLIGHT_LEADER;
+}
+
+// 复制响应, 记下Connection行的位置
+static st_flight_result_t *make_result(const char *head, size_t head_length, const char *body, size_t body_length) {
+    const char *line = memmem(head, head_length, CONNECTION_PREFIX, strlen(CONNECTION_PREFIX));
+    if (!line) {
+        return NULL;
+    }
+    line += 2;
+    const char *end = memmem(line, head_length - (line - head), "\r\n", 2);
+    if (!end) {
+        return NULL;
+    }
+    st_flight_result_t *result = malloc(sizeof(st_flight_result_t) + head_length + body_length);
+    if (!result) {
+        log_error("malloc");
+        return NULL;
+    }
+    result->refs = 1;
+    result->length = head_length + body_length;
+    result->connection_offset = line - head;
+    result->connection_length = end + 2 - line;
+    memcpy(result->data, head, head_length);
+    if (body_length > 0) {
+        memcpy(result->data + head_length, body, body_length);
+    }
+    return result;
+}
+
+static void mailbox_push(st_flight_mailbox_t *mailbox, st_flight_waiter_t *waiter) {
+    waiter->next = NULL;
+    pthread_mutex_lock(&mailbox->lock);
+    if (mailbox->tail) {
+        mailbox->tail->next = waiter;
+    } else {
+        mailbox->head = waiter;
+    }
+    mailbox->tail = waiter;
+    pthread_mutex_unlock(&mailbox->lock);
+    event_async_send(&mailbox->async);
+}
+
+void flight_complete(st_flight_group_t *group, st_flight_t *flight, const char *head, size_t head_length, const char *body, size_t body_length) {
+    st_flight_result_t *result = head ? make_result(head, head_length, body, body_length) : NULL;
+    st_flight_shard_t *shard = shard_for(group, flight->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    st_flight_t **slot = &shard->buckets[flight->hash & (shard->bucket_count - 1)];
+    while (*slot != flight) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = flight->hash_next;
+    shard->flight_count--;
+    st_flight_waiter_t *waiters = flight->waiters;
+    int count = 0;
+    for (st_flight_waiter_t *w = waiters; w; w = w->next) {
+        w->flight = NULL;
+        count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    free(flight);
+
+    if (result) {
+        __atomic_add_fetch(&result->refs, count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&group->stats.coalesced, count, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&group->stats.fallbacks, count, __ATOMIC_RELAXED);
+    }
+    while (waiters) {
+        st_flight_waiter_t *next = waiters->next;
+        waiters->result = result;
+        mailbox_push(waiters->mailbox, waiters);
+        waiters = next;
+    }
+    flight_result_release(result);
+}
+
+bool flight_cancel(st_flight_group_t *group, st_flight_waiter_t *waiter, bool timed_out) {
+    st_flight_shard_t *shard = waiter->shard;
+    bool removed = false;
+    pthread_mutex_lock(&shard->lock);
+    if (waiter->flight) {
+        st_flight_waiter_t **slot = &waiter->flight->waiters;
+        while (*slot != waiter) {
+            slot = &(*slot)->next;
+        }
+        *slot = waiter->next;
+        waiter->flight = NULL;
+        removed = true;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (removed && timed_out) {
+        __atomic_add_fetch(&group->stats.timeouts, 1, __ATOMIC_RELAXED);
+    }
+    return removed;
+}
+
+void flight_result_release(st_flight_result_t *result) {
+    if (result && __atomic_sub_fetch(&result->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(result);
+    }
+}
+
+void flight_waiter_free(st_flight_waiter_t *waiter) {
+    flight_result_release(waiter->result);
+    free(waiter);
+}
+
+static void on_mailbox(st_event_loop_t *loop, st_event_async_t *a) {
+    st_flight_mailbox_t *mailbox = (st_flight_mailbox_t *)a->data;
+    pthread_mutex_lock(&mailbox->lock);
+    st_flight_waiter_t *waiter = mailbox->head;
+    mailbox->head = mailbox->tail = NULL;
+    pthread_mutex_unlock(&mailbox->lock);
+    while (waiter) {
+        st_flight_waiter_t *next = waiter->next;
+        mailbox->deliver(waiter);
+        waiter = next;
+    }
+}
+
+int flight_mailbox_init(st_flight_mailbox_t *mailbox, st_event_loop_t *loop, flight_deliver_cb_t deliver) {
+    pthread_mutex_init(&mailbox->lock, NULL);
+    mailbox->head = mailbox->tail = NULL;
+    mailbox->deliver = deliver;
+    event_async_init(&mailbox->async, on_mailbox);
+    mailbox->async.data = mailbox;
+    if (event_async_start(loop, &mailbox->async) < 0) {
+        pthread_mutex_destroy(&mailbox->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void flight_mailbox_destroy(st_flight_mailbox_t *mailbox, st_event_loop_t *loop) {
+    event_async_stop(loop, &mailbox->async);
+    st_flight_waiter_t *waiter = mailbox->head;
+    while (waiter) {
+        st_flight_waiter_t *next = waiter->next;
+        flight_waiter_free(waiter);
+        waiter = next;
+    }
+    pthread_mutex_destroy(&mailbox->lock);
+}
+
+void flight_stats(st_flight_group_t *group, st_flight_stats_t *stats) {
+    stats->leaders = __atomic_load_n(&group->stats.leaders, __ATOMIC_RELAXED);
+    stats->coalesced = __atomic_load_n(&group->stats.coalesced, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&group->stats.timeouts, __ATOMIC_RELAXED);
+    stats->fallbacks = __atomic_load_n(&group->stats.fallbacks, __ATOMIC_RELAXED);
+}
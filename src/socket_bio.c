@@ -0,0 +1,113 @@
+#include "socket_bio.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+typedef struct st_socket_bio {
+    int fd;
+    st_buffer_t *out;
+    socket_bio_output_cb_t on_output;
+    void *arg;
+} st_socket_bio_t;
+
+static BIO_METHOD *socket_bio_method;
+static pthread_once_t socket_bio_once = PTHREAD_ONCE_INIT;
+
+static int socket_bio_write(BIO *bio, const char *data, int length) {
+    st_socket_bio_t *ctx = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    if (length <= 0) {
+        return 0;
+    }
+    bool was_empty = buffer_length(ctx->out) == 0;
+    if (buffer_append(ctx->out, data, length) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (was_empty && ctx->on_output) {
+        ctx->on_output(ctx->arg);
+    }
+    return length;
+}
+
+static int socket_bio_read(BIO *bio, char *data, int length) {
+    st_socket_bio_t *ctx = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    if (length <= 0) {
+        return 0;
+    }
+    ssize_t n = recv(ctx->fd, data, length, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        BIO_set_retry_read(bio);
+    }
+    return (int)n;
+}
+
+static int socket_bio_puts(BIO *bio, const char *str) {
+    return socket_bio_write(bio, str, (int)strlen(str));
+}
+
+static long socket_bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    st_socket_bio_t *ctx = BIO_get_data(bio);
+    switch (cmd) {
+        case BIO_C_GET_FD:
+            if (ptr) {
+                *(int *)ptr = ctx->fd;
+            }
+            return ctx->fd;
+        case BIO_CTRL_FLUSH:
+            // 记录已在输出缓冲区中, 由连接在循环结束时写出
+            return 1;
+        case BIO_CTRL_WPENDING:
+            return (long)buffer_length(ctx->out);
+        default:
+            return 0;
+    }
+}
+
+static int socket_bio_destroy(BIO *bio) {
+    free(BIO_get_data(bio));
+    BIO_set_data(bio, NULL);
+    BIO_set_init(bio, 0);
+    return 1;
+}
+
+static void init_socket_bio_method(void) {
+    int type = BIO_get_new_index() | BIO_TYPE_SOURCE_SINK | BIO_TYPE_DESCRIPTOR;
+    BIO_METHOD *method = BIO_meth_new(type, "xhttp socket");
+    if (!method) {
+        return;
+    }
+    BIO_meth_set_write(method, socket_bio_write);
+    BIO_meth_set_read(method, socket_bio_read);
+    BIO_meth_set_puts(method, socket_bio_puts);
+    BIO_meth_set_ctrl(method, socket_bio_ctrl);
+    BIO_meth_set_destroy(method, socket_bio_destroy);
+    socket_bio_method = method;
+}
+
+BIO *socket_bio_new(int fd, st_buffer_t *out, socket_bio_output_cb_t on_output, void *arg) {
+    pthread_once(&socket_bio_once, init_socket_bio_method);
+    if (!socket_bio_method) {
+        log_error("BIO_meth_new");
+        return NULL;
+    }
+    st_socket_bio_t *ctx = malloc(sizeof(st_socket_bio_t));
+    if (!ctx) {
+        log_error("malloc");
+        return NULL;
+    }
+    *ctx = (st_socket_bio_t){fd, out, on_output, arg};
+    BIO *bio = BIO_new(socket_bio_method);
+    if (!bio) {
+        free(ctx);
+        return NULL;
+    }
+    BIO_set_data(bio, ctx);
+    BIO_set_init(bio, 1);
+    return bio;
+}
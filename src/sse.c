@@ -0,0 +1,777 @@
+#include "sse.h"
+#include "https_server.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define SSE_INITIAL_BUCKETS 64
+#define SSE_INITIAL_QUEUE 8
+#define SSE_INITIAL_INBOX 16
+#define SSE_MAX_BATCH 64               // 一次写出的最多事件数
+#define SSE_BATCH_BYTES (16 * 1024)    // 一次写出的字节上限, 约一个TLS记录
+#define SSE_CHUNK_RESERVE 20           // 事件之前为chunk头预留的空间
+
+static const char heartbeat_chunk[] = "3\r\n:\n\n\r\n";
+static const char heartbeat_raw[] = ":\n\n";
+
+// 格式化好的事件, 所有订阅者共享, 创建后只读.
+// data中依次是预留空间, chunk头, 事件, "\r\n", 主题
+typedef struct st_sse_message {
+    int refs;                      // 原子访问
+    uint64_t hash;                 // 主题的哈希
+    size_t frame;                  // chunk头的位置
+    size_t length;                 // 事件的长度, 事件从SSE_CHUNK_RESERVE开始
+    const char *topic;
+    char data[];
+} st_sse_message_t;
+
+typedef struct st_sse_link st_sse_link_t;
+
+typedef struct st_sse_topic {
+    struct st_sse_topic *next;
+    uint64_t hash;
+    st_sse_link_t *links;
+    size_t count;
+    char name[];
+} st_sse_topic_t;
+
+// 一个订阅者对一个主题的订阅, 同时在主题的链表和订阅者的链表中
+struct st_sse_link {
+    st_sse_topic_t *topic;
+    st_sse_subscriber_t *subscriber;
+    st_sse_link_t *prev;
+    st_sse_link_t *next;
+    st_sse_link_t *sibling;        // 同一订阅者的下一个主题
+};
+
+struct st_sse_subscriber {
+    struct st_client *client;
+    event_callbacks *app;          // 连接原来的回调
+    st_sse_worker_t *worker;
+    st_sse_link_t *links;
+    st_sse_message_t **queue;      // 环形队列, 还没交给连接的事件, 第一次有事件时分配
+    size_t queue_head;
+    size_t queue_count;
+    size_t queue_capacity;
+    double last_write;
+    bool dirty;                    // 本批收到了事件, 批末统一写出
+    st_sse_subscriber_t *dirty_prev;
+    st_sse_subscriber_t *dirty_next;
+    st_sse_subscriber_t *prev;     // 工作线程的订阅者链表
+    st_sse_subscriber_t *next;
+};
+
+struct st_sse_worker {
+    st_sse_hub_t *hub;
+    st_event_loop_t *loop;
+    st_event_async_t async;
+    pthread_mutex_t lock;
+    st_sse_message_t **inbox;      // 受lock保护
+    size_t inbox_count;
+    size_t inbox_capacity;
+    st_sse_message_t **batch;      // 取出邮箱时与inbox交换
+    size_t batch_capacity;
+    st_sse_topic_t **buckets;
+    size_t bucket_count;
+    size_t topic_count;
+    st_sse_subscriber_t *subscribers;
+    size_t subscriber_count;       // 发布者原子读取, 为0时不投递
+    st_sse_subscriber_t *dirty;
+    st_event_timer_t heartbeat;
+    // 本线程的计数, 每批结束时加到hub上
+    uint64_t delivered;
+    uint64_t writes;
+    uint64_t dropped;
+};
+
+struct st_sse_hub {
+    pthread_mutex_t lock;          // 保护workers
+    st_sse_worker_t **workers;
+    int worker_count;
+    int worker_capacity;
+    size_t max_queue;
+    double heartbeat;
+    uint64_t published;            // 原子更新, 下同
+    uint64_t delivered;
+    uint64_t writes;
+    uint64_t dropped;
+};
+
+// FNV-1a
+static uint64_t hash_topic(const char *name, size_t length) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void message_release(st_sse_message_t *message) {
+    if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(message);
+    }
+}
+
+// 事件格式: [id: ...\n][event: ...\n]data: ...\n(每行一个)\n
+static st_sse_message_t *format_message(const char *topic, const char *event, const char *id, const char *data, size_t length) {
+    size_t topic_length = strlen(topic);
+    size_t lines = 1;
+    for (size_t i = 0; i < length; i++) {
+        lines += data[i] == '\n';
+    }
+    size_t bound = length + lines * 7 + 1;
+    if (id) {
+        bound += strlen(id) + 5;
+    }
+    if (event) {
+        bound += strlen(event) + 8;
+    }
+    st_sse_message_t *message = malloc(sizeof(st_sse_message_t) + SSE_CHUNK_RESERVE + bound + 2 + topic_length + 1);
+    if (!message) {
+        log_error("malloc");
+        return NULL;
+    }
+    char *p = message->data + SSE_CHUNK_RESERVE;
+    if (id) {
+        p += sprintf(p, "id: %s\n", id);
+    }
+    if (event) {
+        p += sprintf(p, "event: %s\n", event);
+    }
+    const char *line = data;
+    const char *end = data + length;
+    for (;;) {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t n = (eol ? eol : end) - line;
+        if (n > 0 && line[n - 1] == '\r') {
+            n--;
+        }
+        memcpy(p, "data: ", 6);
+        memcpy(p + 6, line, n);
+        p[6 + n] = '\n';
+        p += 7 + n;
+        if (!eol) {
+            break;
+        }
+        line = eol + 1;
+    }
+    *p++ = '\n';
+    message->length = p - (message->data + SSE_CHUNK_RESERVE);
+    memcpy(p, "\r\n", 2);
+    memcpy(p + 2, topic, topic_length + 1);
+    message->topic = p + 2;
+    message->hash = hash_topic(topic, topic_length);
+
+    char head[SSE_CHUNK_RESERVE];
+    int head_length = snprintf(head, sizeof(head), "%zx\r\n", message->length);
+    message->frame = SSE_CHUNK_RESERVE - head_length;
+    memcpy(message->data + message->frame, head, head_length);
+    message->refs = 1;
+    return message;
+}
+
+// ---- 订阅表 ----
+
+static st_sse_topic_t *find_topic(st_sse_worker_t *worker, const char *name, size_t length, uint64_t hash) {
+    for (st_sse_topic_t *topic = worker->buckets[hash & (worker->bucket_count - 1)]; topic; topic = topic->next) {
+        if (topic->hash == hash && strncmp(topic->name, name, length) == 0 && topic->name[length] == '\0') {
+            return topic;
+        }
+    }
+    return NULL;
+}
+
+static void grow_buckets(st_sse_worker_t *worker) {
+    size_t count = worker->bucket_count * 2;
+    st_sse_topic_t **buckets = calloc(count, sizeof(st_sse_topic_t *));
+    if (!buckets) {
+        // 链表变长, 仍然可用
+        return;
+    }
+    for (size_t i = 0; i < worker->bucket_count; i++) {
+        st_sse_topic_t *topic = worker->buckets[i];
+        while (topic) {
+            st_sse_topic_t *next = topic->next;
+            st_sse_topic_t **slot = &buckets[topic->hash & (count - 1)];
+            topic->next = *slot;
+            *slot = topic;
+            topic = next;
+        }
+    }
+    free(worker->buckets);
+    worker->buckets = buckets;
+    worker->bucket_count = count;
+}
+
+static st_sse_topic_t *add_topic(st_sse_worker_t *worker, const char *name, size_t length, uint64_t hash) {
+    st_sse_topic_t *topic = calloc(1, sizeof(st_sse_topic_t) + length + 1);
+    if (!topic) {
+        log_error("malloc");
+        return NULL;
+    }
+    topic->hash = hash;
+    memcpy(topic->name, name, length);
+    if (++worker->topic_count > worker->bucket_count) {
+        grow_buckets(worker);
+    }
+    st_sse_topic_t **slot = &worker->buckets[hash & (worker->bucket_count - 1)];
+    topic->next = *slot;
+    *slot = topic;
+    return topic;
+}
+
+static void remove_topic(st_sse_worker_t *worker, st_sse_topic_t *topic) {
+    st_sse_topic_t **slot = &worker->buckets[topic->hash & (worker->bucket_count - 1)];
+    while (*slot != topic) {
+        slot = &(*slot)->next;
+    }
+    *slot = topic->next;
+    worker->topic_count--;
+    free(topic);
+}
+
+static bool subscribe_topic(st_sse_subscriber_t *subscriber, const char *name, size_t length) {
+    st_sse_worker_t *worker = subscriber->worker;
+    for (st_sse_link_t *link = subscriber->links; link; link = link->sibling) {
+        if (strncmp(link->topic->name, name, length) == 0 && link->topic->name[length] == '\0') {
+            return true;
+        }
+    }
+    uint64_t hash = hash_topic(name, length);
+    st_sse_topic_t *topic = find_topic(worker, name, length, hash);
+    if (!topic && !(topic = add_topic(worker, name, length, hash))) {
+        return false;
+    }
+    st_sse_link_t *link = calloc(1, sizeof(st_sse_link_t));
+    if (!link) {
+        log_error("malloc");
+        if (topic->count == 0) {
+            remove_topic(worker, topic);
+        }
+        return false;
+    }
+    link->topic = topic;
+    link->subscriber = subscriber;
+    link->next = topic->links;
+    if (topic->links) {
+        topic->links->prev = link;
+    }
+    topic->links = link;
+    topic->count++;
+    link->sibling = subscriber->links;
+    subscriber->links = link;
+    return true;
+}
+
+// ---- 订阅者 ----
+
+static void mark_dirty(st_sse_subscriber_t *subscriber) {
+    if (subscriber->dirty) {
+        return;
+    }
+    st_sse_worker_t *worker = subscriber->worker;
+    subscriber->dirty = true;
+    subscriber->dirty_prev = NULL;
+    subscriber->dirty_next = worker->dirty;
+    if (worker->dirty) {
+        worker->dirty->dirty_prev = subscriber;
+    }
+    worker->dirty = subscriber;
+}
+
+static void unmark_dirty(st_sse_subscriber_t *subscriber) {
+    if (!subscriber->dirty) {
+        return;
+    }
+    if (subscriber->dirty_prev) {
+        subscriber->dirty_prev->dirty_next = subscriber->dirty_next;
+    } else {
+        subscriber->worker->dirty = subscriber->dirty_next;
+    }
+    if (subscriber->dirty_next) {
+        subscriber->dirty_next->dirty_prev = subscriber->dirty_prev;
+    }
+    subscriber->dirty = false;
+}
+
+static bool grow_queue(st_sse_subscriber_t *subscriber, size_t max) {
+    size_t capacity = subscriber->queue_capacity ? subscriber->queue_capacity * 2 : SSE_INITIAL_QUEUE;
+    if (capacity > max) {
+        capacity = max;
+    }
+    st_sse_message_t **queue = malloc(capacity * sizeof(st_sse_message_t *));
+    if (!queue) {
+        return false;
+    }
+    for (size_t i = 0; i < subscriber->queue_count; i++) {
+        queue[i] = subscriber->queue[(subscriber->queue_head + i) % subscriber->queue_capacity];
+    }
+    free(subscriber->queue);
+    subscriber->queue = queue;
+    subscriber->queue_head = 0;
+    subscriber->queue_capacity = capacity;
+    return true;
+}
+
+static void queue_pop(st_sse_subscriber_t *subscriber) {
+    message_release(subscriber->queue[subscriber->queue_head]);
+    subscriber->queue_head = (subscriber->queue_head + 1) % subscriber->queue_capacity;
+    subscriber->queue_count--;
+}
+
+// 队列满时丢弃最旧的事件. 调用者已为订阅者增加了引用
+static void enqueue(st_sse_subscriber_t *subscriber, st_sse_message_t *message) {
+    st_sse_worker_t *worker = subscriber->worker;
+    if (subscriber->queue_count == subscriber->queue_capacity &&
+        (subscriber->queue_capacity >= worker->hub->max_queue || !grow_queue(subscriber, worker->hub->max_queue))) {
+        if (subscriber->queue_count == 0) {
+            message_release(message);
+            worker->dropped++;
+            return;
+        }
+        queue_pop(subscriber);
+        worker->dropped++;
+    }
+    subscriber->queue[(subscriber->queue_head + subscriber->queue_count) % subscriber->queue_capacity] = message;
+    subscriber->queue_count++;
+}
+
+// 把队列中的事件交给连接, 连接的输出积压到高水位时停止, 等on_drain再继续
+static void pump(st_sse_subscriber_t *subscriber) {
+    struct st_client *client = subscriber->client;
+    st_sse_worker_t *worker = subscriber->worker;
+    bool framed = client->chunked && !client->h2_stream;
+    while (subscriber->queue_count > 0 && !client_output_full(client)) {
+        struct iovec iov[SSE_MAX_BATCH];
+        int count = 0;
+        size_t total = 0;
+        while (count < SSE_MAX_BATCH && (size_t)count < subscriber->queue_count) {
+            st_sse_message_t *message = subscriber->queue[(subscriber->queue_head + count) % subscriber->queue_capacity];
+            size_t length = framed ? SSE_CHUNK_RESERVE - message->frame + message->length + 2 : message->length;
+            if (count > 0 && total + length > SSE_BATCH_BYTES) {
+                break;
+            }
+            iov[count].iov_base = message->data + (framed ? message->frame : SSE_CHUNK_RESERVE);
+            iov[count].iov_len = length;
+            total += length;
+            count++;
+        }
+        // 返回后连接不再引用事件的内容: 明文连接已写入套接字或复制到输出缓冲区, TLS已加密
+        bool sent = send_vector_to_client(client, iov, count);
+        for (int i = 0; i < count; i++) {
+            queue_pop(subscriber);
+        }
+        if (!sent) {
+            // 连接正在关闭, 在on_disconnected中取消订阅
+            return;
+        }
+        worker->delivered += count;
+        worker->writes++;
+        subscriber->last_write = event_loop_now(worker->loop);
+    }
+}
+
+static void unsubscribe(st_sse_subscriber_t *subscriber) {
+    st_sse_worker_t *worker = subscriber->worker;
+    st_sse_link_t *link = subscriber->links;
+    while (link) {
+        st_sse_link_t *sibling = link->sibling;
+        st_sse_topic_t *topic = link->topic;
+        if (link->prev) {
+            link->prev->next = link->next;
+        } else {
+            topic->links = link->next;
+        }
+        if (link->next) {
+            link->next->prev = link->prev;
+        }
+        if (--topic->count == 0) {
+            remove_topic(worker, topic);
+        }
+        free(link);
+        link = sibling;
+    }
+    while (subscriber->queue_count > 0) {
+        queue_pop(subscriber);
+    }
+    unmark_dirty(subscriber);
+    if (subscriber->prev) {
+        subscriber->prev->next = subscriber->next;
+    } else {
+        worker->subscribers = subscriber->next;
+    }
+    if (subscriber->next) {
+        subscriber->next->prev = subscriber->prev;
+    }
+    __atomic_store_n(&worker->subscriber_count, worker->subscriber_count - 1, __ATOMIC_RELAXED);
+    subscriber->client->sse = NULL;
+    subscriber->client->callbacks = subscriber->app;
+    free(subscriber->queue);
+    free(subscriber);
+}
+
+static void flush_counters(st_sse_worker_t *worker) {
+    st_sse_hub_t *hub = worker->hub;
+    if (worker->delivered) {
+        __atomic_add_fetch(&hub->delivered, worker->delivered, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&hub->writes, worker->writes, __ATOMIC_RELAXED);
+    }
+    if (worker->dropped) {
+        __atomic_add_fetch(&hub->dropped, worker->dropped, __ATOMIC_RELAXED);
+    }
+    worker->delivered = worker->writes = worker->dropped = 0;
+}
+
+// ---- 订阅连接的回调: 输出写空时继续写队列, 断开时取消订阅, 其余转给应用 ----
+
+static event_callbacks *app_of(void *client) {
+    return ((struct st_client *)client)->sse->app;
+}
+
+static void sse_on_data_received(void *client, const char *data, size_t length) {
+    event_callbacks *app = app_of(client);
+    if (app && app->on_data_received) {
+        app->on_data_received(client, data, length);
+    }
+}
+
+static void sse_on_connected(void *client) {
+    event_callbacks *app = app_of(client);
+    if (app && app->on_connected) {
+        app->on_connected(client);
+    }
+}
+
+static void sse_on_disconnected(void *client) {
+    event_callbacks *app = app_of(client);
+    unsubscribe(((struct st_client *)client)->sse);
+    if (app && app->on_disconnected) {
+        app->on_disconnected(client);
+    }
+}
+
+static void sse_on_error(void *client, const char *error_message) {
+    event_callbacks *app = app_of(client);
+    if (app && app->on_error) {
+        app->on_error(client, error_message);
+    }
+}
+
+static void sse_on_body_start(void *client) {
+    event_callbacks *app = app_of(client);
+    if (app && app->on_body_start) {
+        app->on_body_start(client);
+    }
+}
+
+static void sse_on_body_end(void *client) {
+    event_callbacks *app = app_of(client);
+    if (app && app->on_body_end) {
+        app->on_body_end(client);
+    }
+}
+
+static void sse_on_drain(void *client) {
+    st_sse_subscriber_t *subscriber = ((struct st_client *)client)->sse;
+    pump(subscriber);
+    flush_counters(subscriber->worker);
+}
+
+static event_callbacks sse_callbacks = {
+    .on_data_received = sse_on_data_received,
+    .on_connected = sse_on_connected,
+    .on_disconnected = sse_on_disconnected,
+    .on_error = sse_on_error,
+    .on_body_start = sse_on_body_start,
+    .on_body_end = sse_on_body_end,
+    .on_drain = sse_on_drain
+};
+
+bool sse_subscribe(st_sse_worker_t *worker, struct st_client *client, const char *topics) {
+    if (!worker || client->sse) {
+        return false;
+    }
+    st_sse_subscriber_t *subscriber = calloc(1, sizeof(st_sse_subscriber_t));
+    if (!subscriber) {
+        log_error("malloc");
+        return false;
+    }
+    subscriber->client = client;
+    subscriber->app = client->callbacks;
+    subscriber->worker = worker;
+    subscriber->last_write = event_loop_now(worker->loop);
+    subscriber->next = worker->subscribers;
+    if (worker->subscribers) {
+        worker->subscribers->prev = subscriber;
+    }
+    worker->subscribers = subscriber;
+    __atomic_store_n(&worker->subscriber_count, worker->subscriber_count + 1, __ATOMIC_RELAXED);
+    client->sse = subscriber;
+    client->callbacks = &sse_callbacks;
+
+    const char *p = topics;
+    while (*p) {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        size_t length = strcspn(p, ",");
+        size_t trimmed = length;
+        while (trimmed > 0 && p[trimmed - 1] == ' ') {
+            trimmed--;
+        }
+        if (trimmed > 0 && !subscribe_topic(subscriber, p, trimmed)) {
+            unsubscribe(subscriber);
+            return false;
+        }
+        p += length;
+    }
+    if (!subscriber->links) {
+        unsubscribe(subscriber);
+        return false;
+    }
+    return true;
+}
+
+void sse_worker_close_all(st_sse_worker_t *worker) {
+    if (!worker) {
+        return;
+    }
+    while (worker->subscribers) {
+        struct st_client *client = worker->subscribers->client;
+        unsubscribe(worker->subscribers);
+        finish_response_to_client(client);
+    }
+}
+
+// ---- 工作线程 ----
+
+static void on_sse_heartbeat(st_event_loop_t *loop, st_event_timer_t *t) {
+    st_sse_worker_t *worker = (st_sse_worker_t *)t->data;
+    double now = event_loop_now(loop);
+    for (st_sse_subscriber_t *subscriber = worker->subscribers; subscriber; subscriber = subscriber->next) {
+        struct st_client *client = subscriber->client;
+        if (subscriber->queue_count > 0 || now - subscriber->last_write < worker->hub->heartbeat || client_output_full(client)) {
+            continue;
+        }
+        bool sent = client->chunked && !client->h2_stream ?
+            send_data_to_client(client, heartbeat_chunk, sizeof(heartbeat_chunk) - 1) :
+            send_data_to_client(client, heartbeat_raw, sizeof(heartbeat_raw) - 1);
+        if (sent) {
+            subscriber->last_write = now;
+        }
+    }
+}
+
+// 先把本批所有事件放入各订阅者的队列, 再逐个订阅者写出, 同一批的事件合并成一次写
+static void on_sse_mailbox(st_event_loop_t *loop, st_event_async_t *a) {
+    st_sse_worker_t *worker = (st_sse_worker_t *)a->data;
+    pthread_mutex_lock(&worker->lock);
+    st_sse_message_t **messages = worker->inbox;
+    size_t count = worker->inbox_count;
+    size_t capacity = worker->inbox_capacity;
+    worker->inbox = worker->batch;
+    worker->inbox_capacity = worker->batch_capacity;
+    worker->inbox_count = 0;
+    pthread_mutex_unlock(&worker->lock);
+    worker->batch = messages;
+    worker->batch_capacity = capacity;
+
+    for (size_t i = 0; i < count; i++) {
+        st_sse_message_t *message = messages[i];
+        st_sse_topic_t *topic = find_topic(worker, message->topic, strlen(message->topic), message->hash);
+        if (!topic) {
+            continue;
+        }
+        __atomic_add_fetch(&message->refs, (int)topic->count, __ATOMIC_RELAXED);
+        for (st_sse_link_t *link = topic->links; link; link = link->next) {
+            enqueue(link->subscriber, message);
+            mark_dirty(link->subscriber);
+        }
+    }
+    st_sse_subscriber_t *subscriber;
+    while ((subscriber = worker->dirty)) {
+        unmark_dirty(subscriber);
+        pump(subscriber);
+    }
+    for (size_t i = 0; i < count; i++) {
+        message_release(messages[i]);
+    }
+    flush_counters(worker);
+}
+
+// 邮箱从空变为非空时才唤醒
+static bool mailbox_push(st_sse_worker_t *worker, st_sse_message_t *message) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->inbox_count == worker->inbox_capacity) {
+        size_t capacity = worker->inbox_capacity ? worker->inbox_capacity * 2 : SSE_INITIAL_INBOX;
+        st_sse_message_t **inbox = realloc(worker->inbox, capacity * sizeof(st_sse_message_t *));
+        if (!inbox) {
+            pthread_mutex_unlock(&worker->lock);
+            log_error("malloc");
+            return false;
+        }
+        worker->inbox = inbox;
+        worker->inbox_capacity = capacity;
+    }
+    worker->inbox[worker->inbox_count++] = message;
+    bool wake = worker->inbox_count == 1;
+    pthread_mutex_unlock(&worker->lock);
+    if (wake) {
+        event_async_send(&worker->async);
+    }
+    return true;
+}
+
+st_sse_worker_t *sse_worker_new(st_sse_hub_t *hub, st_event_loop_t *loop) {
+    st_sse_worker_t *worker = calloc(1, sizeof(st_sse_worker_t));
+    if (!worker) {
+        log_error("malloc");
+        return NULL;
+    }
+    worker->buckets = calloc(SSE_INITIAL_BUCKETS, sizeof(st_sse_topic_t *));
+    if (!worker->buckets) {
+        log_error("malloc");
+        free(worker);
+        return NULL;
+    }
+    worker->bucket_count = SSE_INITIAL_BUCKETS;
+    worker->hub = hub;
+    worker->loop = loop;
+    pthread_mutex_init(&worker->lock, NULL);
+    event_async_init(&worker->async, on_sse_mailbox);
+    worker->async.data = worker;
+    if (event_async_start(loop, &worker->async) < 0) {
+        pthread_mutex_destroy(&worker->lock);
+        free(worker->buckets);
+        free(worker);
+        return NULL;
+    }
+    if (hub->heartbeat > 0) {
+        event_timer_init(&worker->heartbeat, on_sse_heartbeat, hub->heartbeat);
+        worker->heartbeat.data = worker;
+        event_timer_start(loop, &worker->heartbeat, hub->heartbeat);
+    }
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->worker_count == hub->worker_capacity) {
+        int capacity = hub->worker_capacity ? hub->worker_capacity * 2 : 8;
+        st_sse_worker_t **workers = realloc(hub->workers, capacity * sizeof(st_sse_worker_t *));
+        if (!workers) {
+            pthread_mutex_unlock(&hub->lock);
+            log_error("malloc");
+            event_timer_stop(loop, &worker->heartbeat);
+            event_async_stop(loop, &worker->async);
+            pthread_mutex_destroy(&worker->lock);
+            free(worker->buckets);
+            free(worker);
+            return NULL;
+        }
+        hub->workers = workers;
+        hub->worker_capacity = capacity;
+    }
+    hub->workers[hub->worker_count++] = worker;
+    pthread_mutex_unlock(&hub->lock);
+    return worker;
+}
+
+// 服务器退出时还在订阅的连接不再释放, 只取消订阅
+void sse_worker_free(st_sse_worker_t *worker) {
+    if (!worker) {
+        return;
+    }
+    st_sse_hub_t *hub = worker->hub;
+    pthread_mutex_lock(&hub->lock);
+    for (int i = 0; i < hub->worker_count; i++) {
+        if (hub->workers[i] == worker) {
+            hub->workers[i] = hub->workers[--hub->worker_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    event_timer_stop(worker->loop, &worker->heartbeat);
+    event_async_stop(worker->loop, &worker->async);
+    while (worker->subscribers) {
+        unsubscribe(worker->subscribers);
+    }
+    for (size_t i = 0; i < worker->inbox_count; i++) {
+        message_release(worker->inbox[i]);
+    }
+    flush_counters(worker);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker->inbox);
+    free(worker->batch);
+    free(worker->buckets);
+    free(worker);
+}
+
+// ---- 发布 ----
+
+st_sse_hub_t *sse_hub_new(int max_queue, double heartbeat) {
+    st_sse_hub_t *hub = calloc(1, sizeof(st_sse_hub_t));
+    if (!hub) {
+        log_error("malloc");
+        return NULL;
+    }
+    pthread_mutex_init(&hub->lock, NULL);
+    hub->max_queue = max_queue > 0 ? (size_t)max_queue : SSE_DEFAULT_MAX_QUEUE;
+    hub->heartbeat = heartbeat;
+    return hub;
+}
+
+void sse_hub_free(st_sse_hub_t *hub) {
+    if (!hub) {
+        return;
+    }
+    pthread_mutex_destroy(&hub->lock);
+    free(hub->workers);
+    free(hub);
+}
+
+static bool valid_field(const char *value) {
+    return !value || !strpbrk(value, "\r\n");
+}
+
+bool sse_publish(st_sse_hub_t *hub, const char *topic, const char *event, const char *id, const char *data, size_t length) {
+    if (!hub || !topic || !topic[0] || !valid_field(event) || !valid_field(id) || (!data && length > 0)) {
+        return false;
+    }
+    st_sse_message_t *message = format_message(topic, event, id, data ? data : "", length);
+    if (!message) {
+        return false;
+    }
+    // 发布者持有一个引用, 每个投递到的工作线程一个
+    bool ok = true;
+    pthread_mutex_lock(&hub->lock);
+    for (int i = 0; i < hub->worker_count; i++) {
+        st_sse_worker_t *worker = hub->workers[i];
+        if (__atomic_load_n(&worker->subscriber_count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+        if (!mailbox_push(worker, message)) {
+            message_release(message);
+            ok = false;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+    __atomic_add_fetch(&hub->published, 1, __ATOMIC_RELAXED);
+    message_release(message);
+    return ok;
+}
+
+void sse_stats(st_sse_hub_t *hub, st_sse_stats_t *stats) {
+    stats->subscribers = 0;
+    pthread_mutex_lock(&hub->lock);
+    for (int i = 0; i < hub->worker_count; i++) {
+        stats->subscribers += __atomic_load_n(&hub->workers[i]->subscriber_count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&hub->lock);
+    stats->published = __atomic_load_n(&hub->published, __ATOMIC_RELAXED);
+    stats->delivered = __atomic_load_n(&hub->delivered, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&hub->writes, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&hub->dropped, __ATOMIC_RELAXED);
+}
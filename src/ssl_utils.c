@@ -12,12 +12,34 @@ SSL_CTX* init_server_ssl(const char *cert_file, const char *key_file) {
         exit(EXIT_FAILURE);
     }
 
-    SSL_CTX_use_certificate_file(ctx, cert_file, SSL_FILETYPE_PEM);
+    // 文件中证书之后的中间证书作为链一起发送, OCSP装订也从中找颁发者
+    SSL_CTX_use_certificate_chain_file(ctx, cert_file);
     SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM);
 
+    // 非阻塞写: 允许部分写入, 重试时缓冲区地址可以变化
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     return ctx;
 }
 
+// ALPN协议列表, 按服务端偏好排列
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+static const unsigned char alpn_http1[] = "\x08http/1.1";
+
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    const unsigned char *protos = arg ? alpn_h2 : alpn_http1;
+    unsigned int length = arg ? sizeof(alpn_h2) - 1 : sizeof(alpn_http1) - 1;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, length, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        // 没有共同的协议时不使用ALPN, 按HTTP/1.1处理
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void set_server_alpn(SSL_CTX *ctx, bool http2) {
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, http2 ? (void *)1 : NULL);
+}
+
 SSL_CTX* init_client_ssl(void) {
     SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
     if (!ctx) {
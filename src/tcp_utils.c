@@ -2,10 +2,14 @@
 #include "log.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,11 +18,15 @@ int create_server_socket(int port) {
     int server_fd;
     struct sockaddr_in addr;
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // 升级时监听套接字经SCM_RIGHTS显式交接, 不随exec继承
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd == -1) {
         log_error("socket failed");
         exit(EXIT_FAILURE);
     }
+    // 旧进程的连接还处于TIME_WAIT时也能重新启动
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -39,6 +47,75 @@ int create_server_socket(int port) {
     return server_fd;
 }
 
+// 路径已存在时, 只有是套接字且连不上(没有进程在监听)才删除; 普通文件或还在服务的套接字不动, 返回false
+static bool remove_stale_unix_socket(const char *path, const struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        log_error("lstat %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        log_error("%s exists and is not a socket", path);
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error("socket failed");
+        return false;
+    }
+    int ret = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+    int err = errno;
+    close(fd);
+    if (ret == 0) {
+        log_error("%s is in use by another process", path);
+        return false;
+    }
+    if (err != ECONNREFUSED) {
+        log_error("connect %s: %s", path, strerror(err));
+        return false;
+    }
+    if (unlink(path) == -1) {
+        log_error("unlink %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int create_unix_server_socket(const char *path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("unix socket path too long: %s", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd == -1) {
+        log_error("socket failed");
+        return -1;
+    }
+    // 上次退出时留下的套接字文件. 退出时不删除, 升级后新进程还在用同一个文件
+    if (!remove_stale_unix_socket(path, &addr)) {
+        close(server_fd);
+        return -1;
+    }
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_error("bind %s failed", path);
+        close(server_fd);
+        return -1;
+    }
+    if (listen(server_fd, 10) == -1) {
+        log_error("listen failed");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
 int create_client_socket(const char *hostname, int port) {
     int client_fd;
     struct sockaddr_in addr;
@@ -0,0 +1,215 @@
+#include "trace.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 环形缓冲区的一格. 写入第n条记录时seq先置为2n+1, 写完置为2n+2;
+// 读取前后seq相同且为偶数才算读到完整的记录
+typedef struct st_trace_slot {
+    uint64_t seq;
+    st_trace_record_t record;
+} st_trace_slot_t;
+
+struct st_tracer {
+    double sample_rate;
+    st_trace_slot_t *slots;
+    size_t capacity;               // 2的幂
+    uint64_t head;                 // 已分配的记录数, 原子访问
+    uint64_t connections;          // 连接序号, 原子访问
+    uint64_t sampled;
+};
+
+static __thread uint64_t random_state;
+
+// xorshift64*, 每个线程一个状态
+static double next_random(void) {
+    if (random_state == 0) {
+        random_state = trace_now() ^ (uint64_t)(uintptr_t)&random_state;
+        random_state |= 1;
+    }
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return ((random_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+st_tracer_t *tracer_new(double sample_rate, size_t capacity) {
+    st_tracer_t *tracer = calloc(1, sizeof(st_tracer_t));
+    if (!tracer) {
+        return NULL;
+    }
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    tracer->slots = calloc(size, sizeof(st_trace_slot_t));
+    if (!tracer->slots) {
+        free(tracer);
+        return NULL;
+    }
+    tracer->capacity = size;
+    tracer->sample_rate = sample_rate;
+    return tracer;
+}
+
+void tracer_free(st_tracer_t *tracer) {
+    if (!tracer) {
+        return;
+    }
+    free(tracer->slots);
+    free(tracer);
+}
+
+st_trace_record_t *trace_begin(st_tracer_t *tracer, int worker) {
+    if (!tracer || tracer->sample_rate <= 0 || (tracer->sample_rate < 1 && next_random() >= tracer->sample_rate)) {
+        return NULL;
+    }
+    st_trace_record_t *record = calloc(1, sizeof(st_trace_record_t));
+    if (!record) {
+        return NULL;
+    }
+    record->tracer = tracer;
+    record->worker = worker;
+    record->connection = __atomic_add_fetch(&tracer->connections, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tracer->sampled, 1, __ATOMIC_RELAXED);
+    return record;
+}
+
+void trace_set_request(st_trace_record_t *record, const char *method, const char *url) {
+    snprintf(record->method, sizeof(record->method), "%s", method);
+    snprintf(record->url, sizeof(record->url), "%s", url);
+}
+
+static bool has_stamps(const st_trace_record_t *record) {
+    for (int i = 0; i < TRACE_STAGE_COUNT; i++) {
+        if (record->stamps[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void trace_commit(st_trace_record_t *record) {
+    if (!has_stamps(record)) {
+        return;
+    }
+    st_tracer_t *tracer = record->tracer;
+    uint64_t n = __atomic_fetch_add(&tracer->head, 1, __ATOMIC_RELAXED);
+    st_trace_slot_t *slot = &tracer->slots[n & (tracer->capacity - 1)];
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->record = *record;
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+
+    // 连接阶段只随第一条记录导出
+    memset(record->stamps, 0, sizeof(record->stamps));
+    record->method[0] = '\0';
+    record->url[0] = '\0';
+}
+
+void trace_end(st_trace_record_t *record) {
+    if (!record) {
+        return;
+    }
+    trace_commit(record);
+    free(record);
+}
+
+// ---- 导出 ----
+
+typedef struct {
+    const char *name;
+    trace_stage_t from;
+    trace_stage_t to;
+} st_trace_phase_t;
+
+static const st_trace_phase_t phases[] = {
+    {"accept", TRACE_ACCEPT, TRACE_HANDSHAKE_START},
+    {"handshake", TRACE_HANDSHAKE_START, TRACE_HANDSHAKE_END},
+    {"read headers", TRACE_FIRST_BYTE, TRACE_HEADERS_COMPLETE},
+    {"read body", TRACE_HEADERS_COMPLETE, TRACE_MESSAGE_COMPLETE},
+    {"handler", TRACE_HANDLER_START, TRACE_HANDLER_END},
+    {"write", TRACE_HANDLER_END, TRACE_LAST_BYTE},
+};
+
+static void write_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void write_event(FILE *fp, bool *first, const char *name, const st_trace_record_t *record, uint64_t from, uint64_t to, int pid) {
+    fprintf(fp, "%s\n{\"name\":", *first ? "" : ",");
+    *first = false;
+    write_json_string(fp, name);
+    fprintf(fp, ",\"cat\":\"xhttp\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu,\"args\":{\"worker\":%d",
+            from / 1000.0, (to - from) / 1000.0, pid, (unsigned long long)record->connection, record->worker);
+    if (record->url[0]) {
+        fprintf(fp, ",\"url\":");
+        write_json_string(fp, record->url);
+    }
+    fprintf(fp, "}}");
+}
+
+static void write_record(FILE *fp, bool *first, const st_trace_record_t *record, int pid) {
+    const uint64_t *stamps = record->stamps;
+    if (stamps[TRACE_FIRST_BYTE]) {
+        // 整个请求, 到最后到达的阶段为止
+        uint64_t end = stamps[TRACE_FIRST_BYTE];
+        for (int i = TRACE_FIRST_BYTE; i < TRACE_STAGE_COUNT; i++) {
+            end = stamps[i] > end ? stamps[i] : end;
+        }
+        char name[TRACE_URL_LENGTH + 16];
+        snprintf(name, sizeof(name), "%s %s", record->method, record->url);
+        write_event(fp, first, name, record, stamps[TRACE_FIRST_BYTE], end, pid);
+    }
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        uint64_t from = stamps[phases[i].from];
+        uint64_t to = stamps[phases[i].to];
+        if (from && to >= from) {
+            write_event(fp, first, phases[i].name, record, from, to, pid);
+        }
+    }
+}
+
+size_t trace_dump(st_tracer_t *tracer, FILE *fp) {
+    int pid = (int)getpid();
+    uint64_t head = __atomic_load_n(&tracer->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > tracer->capacity ? head - tracer->capacity : 0;
+    size_t count = 0;
+    bool first = true;
+    fprintf(fp, "{\"traceEvents\":[");
+    for (uint64_t n = start; n < head; n++) {
+        st_trace_slot_t *slot = &tracer->slots[n & (tracer->capacity - 1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != 2 * n + 2) {
+            // 还在写入, 或者已被更新的记录覆盖
+            continue;
+        }
+        st_trace_record_t record = slot->record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        write_record(fp, &first, &record, pid);
+        count++;
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return count;
+}
+
+void trace_stats(st_tracer_t *tracer, st_trace_stats_t *stats) {
+    stats->sampled = __atomic_load_n(&tracer->sampled, __ATOMIC_RELAXED);
+    stats->recorded = __atomic_load_n(&tracer->head, __ATOMIC_RELAXED);
+    stats->capacity = tracer->capacity;
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define UPGRADE_MAGIC 0x58485550        // "XHUP"
+#define UPGRADE_MAX_ARGS 64
+#define UPGRADE_MAX_CMDLINE 4096
+
+extern char **environ;
+
+typedef struct st_handoff_message {
+    uint32_t magic;
+    uint32_t fd_count;
+    uint32_t has_ticket_keys;
+    unsigned char ticket_keys[UPGRADE_TICKET_KEYS_LENGTH];
+} st_handoff_message_t;
+
+int upgrade_receive(st_handoff_t *handoff) {
+    memset(handoff, 0, sizeof(*handoff));
+    const char *value = getenv(UPGRADE_ENV);
+    if (!value) {
+        return -1;
+    }
+    int channel = atoi(value);
+    // 不再传给以后启动的进程
+    unsetenv(UPGRADE_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    struct timeval timeout = {UPGRADE_READY_TIMEOUT, 0};
+    setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    st_handoff_message_t message;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct iovec iov = {&message, sizeof(message)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if (n != sizeof(message) || message.magic != UPGRADE_MAGIC) {
+        log_error("invalid upgrade handoff: %s", n < 0 ? strerror(errno) : "short message");
+        close(channel);
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count && handoff->fd_count < UPGRADE_MAX_FDS; i++) {
+            memcpy(&handoff->fds[handoff->fd_count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        }
+    }
+    if (message.has_ticket_keys) {
+        memcpy(handoff->ticket_keys, message.ticket_keys, sizeof(handoff->ticket_keys));
+        handoff->has_ticket_keys = true;
+    }
+    log_info("upgrade: received %d listeners%s", handoff->fd_count, handoff->has_ticket_keys ? " and ticket keys" : "");
+    return channel;
+}
+
+int upgrade_take_listener(st_handoff_t *handoff, int port) {
+    for (int i = 0; i < handoff->fd_count; i++) {
+        struct sockaddr_storage addr;
+        socklen_t length = sizeof(addr);
+        int fd = handoff->fds[i];
+        if (fd < 0 || getsockname(fd, (struct sockaddr *)&addr, &length) < 0) {
+            continue;
+        }
+        int local = 0;
+        if (addr.ss_family == AF_INET) {
+            local = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        } else if (addr.ss_family == AF_INET6) {
+            local = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+        }
+        if (local == port) {
+            handoff->fds[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+int upgrade_take_unix_listener(st_handoff_t *handoff, const char *path) {
+    for (int i = 0; i < handoff->fd_count; i++) {
+        struct sockaddr_un addr;
+        socklen_t length = sizeof(addr);
+        int fd = handoff->fds[i];
+        if (fd < 0 || getsockname(fd, (struct sockaddr *)&addr, &length) < 0 || addr.sun_family != AF_UNIX) {
+            continue;
+        }
+        if (length > offsetof(struct sockaddr_un, sun_path) && strncmp(addr.sun_path, path, sizeof(addr.sun_path)) == 0) {
+            handoff->fds[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+void upgrade_release(st_handoff_t *handoff) {
+    for (int i = 0; i < handoff->fd_count; i++) {
+        if (handoff->fds[i] >= 0) {
+            close(handoff->fds[i]);
+            handoff->fds[i] = -1;
+        }
+    }
+    handoff->fd_count = 0;
+}
+
+void upgrade_ready(int channel) {
+    if (write(channel, "R", 1) != 1) {
+        log_error("upgrade: notify old process: %s", strerror(errno));
+    }
+    close(channel);
+}
+
+// 可执行文件被替换后/proc/self/exe指向已删除的旧文件, 去掉后缀得到新文件的路径
+static bool executable_path(char *path, size_t size) {
+    ssize_t n = readlink("/proc/self/exe", path, size - 1);
+    if (n <= 0) {
+        return false;
+    }
+    path[n] = '\0';
+    const char *suffix = " (deleted)";
+    size_t suffix_length = strlen(suffix);
+    if ((size_t)n > suffix_length && strcmp(path + n - suffix_length, suffix) == 0) {
+        path[n - suffix_length] = '\0';
+    }
+    return true;
+}
+
+// 沿用启动时的参数
+static int command_line(char *buffer, size_t size, char **argv) {
+    FILE *file = fopen("/proc/self/cmdline", "r");
+    if (!file) {
+        return -1;
+    }
+    size_t length = fread(buffer, 1, size - 1, file);
+    fclose(file);
+    buffer[length] = '\0';
+    int argc = 0;
+    for (size_t i = 0; i < length && argc < UPGRADE_MAX_ARGS; i += strlen(buffer + i) + 1) {
+        argv[argc++] = buffer + i;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+static int send_handoff(int channel, const st_handoff_t *handoff) {
+    st_handoff_message_t message = {0};
+    message.magic = UPGRADE_MAGIC;
+    message.fd_count = handoff->fd_count;
+    message.has_ticket_keys = handoff->has_ticket_keys;
+    memcpy(message.ticket_keys, handoff->ticket_keys, sizeof(message.ticket_keys));
+
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)] = {0};
+    struct iovec iov = {&message, sizeof(message)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (handoff->fd_count > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * handoff->fd_count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handoff->fd_count);
+        memcpy(CMSG_DATA(cmsg), handoff->fds, sizeof(int) * handoff->fd_count);
+    }
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == sizeof(message) ? 0 : -1;
+}
+
+int upgrade_spawn(const st_handoff_t *handoff, pid_t *pid) {
+    char path[PATH_MAX];
+    char cmdline[UPGRADE_MAX_CMDLINE];
+    char *argv[UPGRADE_MAX_ARGS + 1];
+    if (!executable_path(path, sizeof(path)) || command_line(cmdline, sizeof(cmdline), argv) <= 0) {
+        log_error("upgrade: cannot determine executable");
+        return -1;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_error("upgrade: socketpair: %s", strerror(errno));
+        return -1;
+    }
+
+    // fork之后子进程只能调用异步信号安全的函数, 环境变量提前准备好
+    size_t env_count = 0;
+    while (environ[env_count]) {
+        env_count++;
+    }
+    char **envp = calloc(env_count + 2, sizeof(char *));
+    char variable[32];
+    if (!envp) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    snprintf(variable, sizeof(variable), "%s=%d", UPGRADE_ENV, sv[1]);
+    size_t count = 0;
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0) {
+            envp[count++] = environ[i];
+        }
+    }
+    envp[count++] = variable;
+    envp[count] = NULL;
+
+    *pid = fork();
+    if (*pid == 0) {
+        // 交接套接字要留给新进程
+        fcntl(sv[1], F_SETFD, 0);
+        execve(path, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (*pid < 0) {
+        log_error("upgrade: fork: %s", strerror(errno));
+        close(sv[0]);
+        return -1;
+    }
+    if (send_handoff(sv[0], handoff) < 0) {
+        log_error("upgrade: send handoff: %s", strerror(errno));
+        close(sv[0]);
+        return -1;
+    }
+    log_info("upgrade: started %s as pid %d", path, (int)*pid);
+    return sv[0];
+}
@@ -0,0 +1,434 @@
+#include "websocket.h"
+#include "https_server.h"
+#include "log.h"
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_CONTROL_PAYLOAD 125
+#define WS_SMALL_FRAME 4096        // 小帧的头部和数据合并成一次写入
+
+typedef void (*unmask_fn_t)(uint8_t *data, size_t length, const uint8_t key[4]);
+
+static void unmask_scalar(uint8_t *data, size_t length, const uint8_t key[4]) {
+    uint32_t k32;
+    memcpy(&k32, key, 4);
+    uint64_t k64 = ((uint64_t)k32 << 32) | k32;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= k64;
+        memcpy(data + i, &v, 8);
+    }
+    for (; i < length; i++) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void unmask_sse2(uint8_t *data, size_t length, const uint8_t key[4]) {
+    uint32_t k32;
+    memcpy(&k32, key, 4);
+    __m128i k = _mm_set1_epi32((int)k32);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+    }
+    // i是16的倍数, 掩码相位不变
+    unmask_scalar(data + i, length - i, key);
+}
+
+__attribute__((target("avx2")))
+static void unmask_avx2(uint8_t *data, size_t length, const uint8_t key[4]) {
+    uint32_t k32;
+    memcpy(&k32, key, 4);
+    __m256i k = _mm256_set1_epi32((int)k32);
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i *)(data + i + 32), _mm256_xor_si256(b, k));
+    }
+    for (; i + 32 <= length; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(a, k));
+    }
+    unmask_scalar(data + i, length - i, key);
+}
+#endif
+
+static unmask_fn_t unmask_impl = unmask_scalar;
+static const char *unmask_name = "scalar";
+static pthread_once_t unmask_once = PTHREAD_ONCE_INIT;
+
+static void select_unmask(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        unmask_impl = unmask_avx2;
+        unmask_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        unmask_impl = unmask_sse2;
+        unmask_name = "sse2";
+    }
+#endif
+}
+
+void ws_unmask(uint8_t *data, size_t length, const uint8_t key[4]) {
+    pthread_once(&unmask_once, select_unmask);
+    unmask_impl(data, length, key);
+}
+
+const char *ws_unmask_kernel(void) {
+    pthread_once(&unmask_once, select_unmask);
+    return unmask_name;
+}
+
+bool ws_set_unmask_kernel(const char *name) {
+    pthread_once(&unmask_once, select_unmask);
+    if (strcmp(name, "scalar") == 0) {
+        unmask_impl = unmask_scalar;
+        unmask_name = "scalar";
+        return true;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        unmask_impl = unmask_sse2;
+        unmask_name = "sse2";
+        return true;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        unmask_impl = unmask_avx2;
+        unmask_name = "avx2";
+        return true;
+    }
+#endif
+    return false;
+}
+
+st_websocket_t *ws_create(size_t max_message_size) {
+    st_websocket_t *ws = calloc(1, sizeof(st_websocket_t));
+    if (!ws) {
+        log_error("malloc");
+        return NULL;
+    }
+    ws->max_message_size = max_message_size ? max_message_size : WS_DEFAULT_MAX_MESSAGE_SIZE;
+    return ws;
+}
+
+void ws_destroy(st_websocket_t *ws) {
+    if (!ws) {
+        return;
+    }
+    buffer_free(&ws->message);
+    free(ws);
+}
+
+void ws_accept_key(const char *key, char *out) {
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA_CTX sha;
+    SHA1_Init(&sha);
+    SHA1_Update(&sha, key, strlen(key));
+    SHA1_Update(&sha, WS_GUID, sizeof(WS_GUID) - 1);
+    SHA1_Final(digest, &sha);
+    EVP_EncodeBlock((unsigned char *)out, digest, sizeof(digest));
+}
+
+// 文本消息必须是合法的UTF-8, 拒绝超长编码、代理区和超过U+10FFFF的码点
+static bool utf8_valid(const uint8_t *s, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        // ASCII快速路径
+        if (i + 8 <= length) {
+            uint64_t v;
+            memcpy(&v, s + i, 8);
+            if (!(v & 0x8080808080808080ULL)) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t n;
+        uint32_t cp;
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+            cp = c & 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            cp = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if (i + n >= length) {
+            return false;
+        }
+        for (size_t k = 1; k <= n; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (s[i + k] & 0x3f);
+        }
+        if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+static bool send_frame(struct st_client *client, int opcode, bool fin, const char *data, size_t length) {
+    char frame[WS_SMALL_FRAME];
+    size_t header = 2;
+    frame[0] = (char)((fin ? 0x80 : 0) | opcode);
+    if (length < 126) {
+        frame[1] = (char)length;
+    } else if (length <= 0xffff) {
+        frame[1] = 126;
+        frame[2] = (char)(length >> 8);
+        frame[3] = (char)length;
+        header = 4;
+    } else {
+        frame[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            frame[2 + i] = (char)((uint64_t)length >> (56 - 8 * i));
+        }
+        header = 10;
+    }
+    if (header + length <= sizeof(frame)) {
+        if (length > 0) {
+            memcpy(frame + header, data, length);
+        }
+        return send_data_to_client(client, frame, header + length);
+    }
+    return send_data_to_client(client, frame, header) && send_data_to_client(client, data, length);
+}
+
+static bool send_close(struct st_client *client, uint16_t code, const char *reason, size_t reason_length) {
+    st_websocket_t *ws = client->ws;
+    char payload[WS_MAX_CONTROL_PAYLOAD];
+    if (ws->close_sent) {
+        return false;
+    }
+    ws->close_sent = true;
+    if (code == 0) {
+        return send_frame(client, WS_OPCODE_CLOSE, true, NULL, 0);
+    }
+    if (reason_length > sizeof(payload) - 2) {
+        reason_length = sizeof(payload) - 2;
+    }
+    payload[0] = (char)(code >> 8);
+    payload[1] = (char)code;
+    memcpy(payload + 2, reason, reason_length);
+    return send_frame(client, WS_OPCODE_CLOSE, true, payload, reason_length + 2);
+}
+
+static int fail(struct st_client *client, uint16_t code, const char *reason) {
+    log_error("websocket client:%p %s", client, reason);
+    client->ws->close_received = true;
+    send_close(client, code, reason, strlen(reason));
+    return 1;
+}
+
+static void deliver(struct st_client *client, int opcode, const char *data, size_t length) {
+    if (client->callbacks && client->callbacks->on_ws_message) {
+        client->callbacks->on_ws_message(client, opcode, data, length);
+    }
+}
+
+static bool close_code_valid(uint16_t code) {
+    if (code >= 3000 && code <= 4999) {
+        return true;
+    }
+    return code >= 1000 && code <= 1011 && code != 1004 && code != 1005 && code != 1006;
+}
+
+static int handle_frame(struct st_client *client, bool fin, int opcode, char *payload, size_t length) {
+    st_websocket_t *ws = client->ws;
+    switch (opcode) {
+        case WS_OPCODE_CONTINUATION:
+            if (!ws->message_opcode) {
+                return fail(client, WS_CLOSE_PROTOCOL_ERROR, "unexpected continuation frame");
+            }
+            if (buffer_length(&ws->message) + length > ws->max_message_size) {
+                return fail(client, WS_CLOSE_TOO_BIG, "message too big");
+            }
+            if (buffer_append(&ws->message, payload, length) < 0) {
+                return fail(client, WS_CLOSE_TOO_BIG, "out of memory");
+            }
+            if (fin) {
+                int message_opcode = ws->message_opcode;
+                ws->message_opcode = 0;
+                if (message_opcode == WS_OPCODE_TEXT && !utf8_valid((const uint8_t *)buffer_data(&ws->message), buffer_length(&ws->message))) {
+                    return fail(client, WS_CLOSE_INVALID_DATA, "invalid utf-8");
+                }
+                deliver(client, message_opcode, buffer_data(&ws->message), buffer_length(&ws->message));
+                buffer_reset(&ws->message);
+            }
+            return 0;
+
+        case WS_OPCODE_TEXT:
+        case WS_OPCODE_BINARY:
+            if (ws->message_opcode) {
+                return fail(client, WS_CLOSE_PROTOCOL_ERROR, "expected continuation frame");
+            }
+            if (!fin) {
+                ws->message_opcode = opcode;
+                if (buffer_append(&ws->message, payload, length) < 0) {
+                    return fail(client, WS_CLOSE_TOO_BIG, "out of memory");
+                }
+                return 0;
+            }
+            if (opcode == WS_OPCODE_TEXT && !utf8_valid((const uint8_t *)payload, length)) {
+                return fail(client, WS_CLOSE_INVALID_DATA, "invalid utf-8");
+            }
+            // 未分片的消息直接从读缓冲区交付
+            deliver(client, opcode, payload, length);
+            return 0;
+
+        case WS_OPCODE_CLOSE: {
+            uint16_t code = 0;
+            if (length == 1) {
+                return fail(client, WS_CLOSE_PROTOCOL_ERROR, "invalid close frame");
+            }
+            if (length >= 2) {
+                code = ((uint8_t)payload[0] << 8) | (uint8_t)payload[1];
+                if (!close_code_valid(code)) {
+                    return fail(client, WS_CLOSE_PROTOCOL_ERROR, "invalid close code");
+                }
+                if (!utf8_valid((const uint8_t *)payload + 2, length - 2)) {
+                    return fail(client, WS_CLOSE_INVALID_DATA, "invalid close reason");
+                }
+            }
+            ws->close_received = true;
+            deliver(client, WS_OPCODE_CLOSE, payload, length);
+            // 回送同样的状态码完成关闭握手
+            send_close(client, code, NULL, 0);
+            return 1;
+        }
+
+        case WS_OPCODE_PING:
+            if (!ws->close_sent) {
+                send_frame(client, WS_OPCODE_PONG, true, payload, length);
+            }
+            deliver(client, WS_OPCODE_PING, payload, length);
+            return 0;
+
+        case WS_OPCODE_PONG:
+            deliver(client, WS_OPCODE_PONG, payload, length);
+            return 0;
+
+        default:
+            return fail(client, WS_CLOSE_PROTOCOL_ERROR, "unknown opcode");
+    }
+}
+
+int ws_process(struct st_client *client) {
+    st_websocket_t *ws = client->ws;
+    st_buffer_t *in = &client->in;
+
+    while (!client->read_paused && client->state == CLIENT_STATE_ACTIVE && !ws->close_received) {
+        uint8_t *p = (uint8_t *)in->data + in->offset;
+        size_t available = buffer_length(in);
+        if (available < 2) {
+            break;
+        }
+        bool fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0f;
+        uint64_t length = p[1] & 0x7f;
+        size_t header = 2;
+        if (length == 126) {
+            if (available < 4) {
+                break;
+            }
+            length = (p[2] << 8) | p[3];
+            header = 4;
+        } else if (length == 127) {
+            if (available < 10) {
+                break;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = (length << 8) | p[2 + i];
+            }
+            header = 10;
+        }
+
+        if (p[0] & 0x70) {
+            return fail(client, WS_CLOSE_PROTOCOL_ERROR, "reserved bits set");
+        }
+        if (!(p[1] & 0x80)) {
+            return fail(client, WS_CLOSE_PROTOCOL_ERROR, "unmasked client frame");
+        }
+        if (opcode >= WS_OPCODE_CLOSE && (!fin || length > WS_MAX_CONTROL_PAYLOAD)) {
+            return fail(client, WS_CLOSE_PROTOCOL_ERROR, "invalid control frame");
+        }
+        if (length > ws->max_message_size) {
+            return fail(client, WS_CLOSE_TOO_BIG, "frame too big");
+        }
+        // 等待整帧到达, 然后在读缓冲区上原地去掩码
+        if (available < header + 4 + length) {
+            break;
+        }
+        uint8_t *key = p + header;
+        uint8_t *payload = key + 4;
+        ws_unmask(payload, length, key);
+        int ret = handle_frame(client, fin, opcode, (char *)payload, length);
+        buffer_consume(in, header + 4 + length);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return ws->close_received && ws->close_sent ? 1 : 0;
+}
+
+bool ws_send_message(struct st_client *client, int opcode, const char *data, size_t length) {
+    st_websocket_t *ws = client->ws;
+    if (!ws || ws->close_sent || ws->sending_fragments) {
+        return false;
+    }
+    return send_frame(client, opcode, true, data, length);
+}
+
+bool ws_send_fragment(struct st_client *client, int opcode, const char *data, size_t length, bool fin) {
+    st_websocket_t *ws = client->ws;
+    if (!ws || ws->close_sent) {
+        return false;
+    }
+    if (ws->sending_fragments) {
+        opcode = WS_OPCODE_CONTINUATION;
+    }
+    ws->sending_fragments = !fin;
+    return send_frame(client, opcode, fin, data, length);
+}
+
+bool ws_send_ping(struct st_client *client, const char *data, size_t length) {
+    st_websocket_t *ws = client->ws;
+    if (!ws || ws->close_sent || length > WS_MAX_CONTROL_PAYLOAD) {
+        return false;
+    }
+    return send_frame(client, WS_OPCODE_PING, true, data, length);
+}
+
+bool ws_close(struct st_client *client, uint16_t code, const char *reason) {
+    if (!client->ws) {
+        return false;
+    }
+    return send_close(client, code, reason, reason ? strlen(reason) : 0);
+}
@@ -0,0 +1,410 @@
+//  make bench
+//  bin/bench_cache [requests] [objects] [cache_kb]
+//  在127.0.0.1:18491启动明文服务器: /obj/N缓存一小时, /short/N缓存1秒, /lang/N按Accept-Language区分变体,
+//  都带ETag, If-None-Match匹配时返回304. client_loop按Zipf分布请求objects个对象, 分别测只用内存,
+//  内存加文件, 以及重新打开同一文件的命中率和源站请求数, 再验证过期后的重新验证, 内容变化和Vary.
+//  每个响应都核对内容
+
+#define _GNU_SOURCE
+
+#include "client_loop.h"
+#include <llhttp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define PORT 18491
+#define MAX_BODY (16 * 1024)
+
+typedef struct {
+    int fd;
+    llhttp_t parser;
+    char path[256];
+    size_t path_length;
+    char field[64];
+    size_t field_length;
+    char value[256];
+    size_t value_length;
+    char if_none_match[256];
+    char language[64];
+    bool done;
+} st_session_t;
+
+static llhttp_settings_t request_settings;
+static long origin_requests;
+static long origin_not_modified;
+static long origin_bytes;
+static int version = 1;            // 改变后所有响应的内容和ETag都变化
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t hash_string(const char *s, uint64_t hash) {
+    while (*s) {
+        hash = (hash ^ (uint8_t)*s++) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 内容由路径, 语言和版本决定, 长度为1KB到8KB
+static size_t make_body(char *body, const char *path, const char *language, int v, uint64_t *tag) {
+    uint64_t hash = hash_string(language, hash_string(path, 14695981039346656037ULL)) + v;
+    const char *slash = strrchr(path, '/');
+    size_t length = 1024 * (1 + (slash ? atol(slash + 1) : 0) % 8);
+    for (size_t i = 0; i < length; i++) {
+        body[i] = (char)((hash + i * 31) % 251);
+    }
+    *tag = hash;
+    return length;
+}
+
+// ---- 服务器 ----
+
+static int append(char *buffer, size_t *length, size_t size, const char *at, size_t n) {
+    if (*length + n < size) {
+        memcpy(buffer + *length, at, n);
+        *length += n;
+        buffer[*length] = '\0';
+    }
+    return 0;
+}
+
+static int on_url(llhttp_t *parser, const char *at, size_t length) {
+    st_session_t *s = (st_session_t *)parser->data;
+    return append(s->path, &s->path_length, sizeof(s->path), at, length);
+}
+
+static int on_header_field(llhttp_t *parser, const char *at, size_t length) {
+    st_session_t *s = (st_session_t *)parser->data;
+    return append(s->field, &s->field_length, sizeof(s->field), at, length);
+}
+
+static int on_header_value(llhttp_t *parser, const char *at, size_t length) {
+    st_session_t *s = (st_session_t *)parser->data;
+    return append(s->value, &s->value_length, sizeof(s->value), at, length);
+}
+
+static int on_header_value_complete(llhttp_t *parser) {
+    st_session_t *s = (st_session_t *)parser->data;
+    if (strcasecmp(s->field, "if-none-match") == 0) {
+        strcpy(s->if_none_match, s->value);
+    } else if (strcasecmp(s->field, "accept-language") == 0 && s->value_length < sizeof(s->language)) {
+        strcpy(s->language, s->value);
+    }
+    s->field_length = s->value_length = 0;
+    s->field[0] = s->value[0] = '\0';
+    return 0;
+}
+
+static int on_message_complete(llhttp_t *parser) {
+    ((st_session_t *)parser->data)->done = true;
+    return HPE_PAUSED;
+}
+
+static bool send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// 响应头和响应体一起发送, 避免Nagle和延迟确认
+static bool respond(st_session_t *s) {
+    char response[512 + MAX_BODY], etag[32];
+    char *body = response + 512;
+    bool vary = strncmp(s->path, "/lang/", 6) == 0;
+    const char *language = vary ? s->language : "";
+    uint64_t tag;
+    size_t length = make_body(body, s->path, language, __atomic_load_n(&version, __ATOMIC_RELAXED), &tag);
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)tag);
+    int max_age = strncmp(s->path, "/short/", 7) == 0 ? 1 : 3600;
+    __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+    int n;
+    if (strcmp(s->if_none_match, etag) == 0) {
+        __atomic_add_fetch(&origin_not_modified, 1, __ATOMIC_RELAXED);
+        n = snprintf(response, 512, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: max-age=%d\r\n%s\r\n", etag,
+                     max_age, vary ? "Vary: Accept-Language\r\n" : "");
+        return send_all(s->fd, response, n);
+    }
+    __atomic_add_fetch(&origin_bytes, (long)length, __ATOMIC_RELAXED);
+    n = snprintf(response, 512, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nETag: %s\r\nCache-Control: max-age=%d\r\n%s\r\n",
+                 length, etag, max_age, vary ? "Vary: Accept-Language\r\n" : "");
+    memmove(response + n, body, length);
+    return send_all(s->fd, response, n + length);
+}
+
+static void session_reset(st_session_t *s) {
+    int fd = s->fd;
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    llhttp_init(&s->parser, HTTP_REQUEST, &request_settings);
+    s->parser.data = s;
+}
+
+static void *serve_connection(void *arg) {
+    st_session_t *s = (st_session_t *)arg;
+    session_reset(s);
+    char buffer[16384];
+    ssize_t n;
+    while ((n = recv(s->fd, buffer, sizeof(buffer), 0)) > 0) {
+        const char *p = buffer;
+        while (n > 0) {
+            llhttp_errno_t err = llhttp_execute(&s->parser, p, n);
+            if (!s->done) {
+                if (err != HPE_OK) {
+                    goto done;
+                }
+                break;
+            }
+            const char *end = llhttp_get_error_pos(&s->parser);
+            n -= end - p;
+            p = end;
+            if (!respond(s)) {
+                goto done;
+            }
+            session_reset(s);
+        }
+    }
+done:
+    close(s->fd);
+    free(s);
+    return NULL;
+}
+
+static void *run_server(void *arg) {
+    int listener = (int)(long)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        st_session_t *s = calloc(1, sizeof(st_session_t));
+        s->fd = fd;
+        pthread_t id;
+        pthread_create(&id, NULL, serve_connection, s);
+        pthread_detach(id);
+    }
+    return NULL;
+}
+
+static bool start_server(void) {
+    llhttp_settings_init(&request_settings);
+    request_settings.on_url = on_url;
+    request_settings.on_header_field = on_header_field;
+    request_settings.on_header_value = on_header_value;
+    request_settings.on_header_value_complete = on_header_value_complete;
+    request_settings.on_message_complete = on_message_complete;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("bind");
+        return false;
+    }
+    pthread_t id;
+    pthread_create(&id, NULL, run_server, (void *)(long)fd);
+    pthread_detach(id);
+    return true;
+}
+
+// ---- 客户端 ----
+
+static long mismatches;
+
+static st_client_loop_t *open_client(size_t cache_size, const char *file) {
+    st_client_loop_options_t options;
+    client_loop_init_options(&options);
+    options.tls = false;
+    options.connections = 4;
+    options.cache_size = cache_size;
+    options.cache_file = file;
+    options.cache_file_size = 64 * 1024 * 1024;
+    st_client_loop_t *client = client_loop_new("127.0.0.1", PORT, &options);
+    if (!client || !client_loop_start(client)) {
+        fprintf(stderr, "failed to start client\n");
+        exit(1);
+    }
+    return client;
+}
+
+// 发出请求并核对内容, 返回状态码
+static int fetch(st_client_loop_t *client, const char *path, const char *language) {
+    char headers[128] = "";
+    if (language[0]) {
+        snprintf(headers, sizeof(headers), "Accept-Language: %s\r\n", language);
+    }
+    st_client_request_t request = {.method = HTTP_METHOD_GET, .path = path, .headers = headers};
+    st_client_future_t *future;
+    while (!(future = client_loop_submit_future(client, &request))) {
+        usleep(1000);
+    }
+    const st_client_response_t *response = client_future_wait(future, -1);
+    static char want[MAX_BODY];
+    uint64_t tag;
+    size_t length = make_body(want, path, strncmp(path, "/lang/", 6) == 0 ? language : "",
+                              __atomic_load_n(&version, __ATOMIC_RELAXED), &tag);
+    int status = response->error == CLIENT_OK ? response->status : -1;
+    if (status != 200 || response->body_length != length || memcmp(response->body, want, length) != 0) {
+        mismatches++;
+    }
+    client_future_free(future);
+    return status;
+}
+
+typedef struct {
+    long requests;
+    long origin;
+    long bytes;
+    double elapsed;
+} st_phase_t;
+
+static st_phase_t phase_begin(void) {
+    return (st_phase_t){0, __atomic_load_n(&origin_requests, __ATOMIC_RELAXED), __atomic_load_n(&origin_bytes, __ATOMIC_RELAXED),
+                        now_seconds()};
+}
+
+static void phase_report(const char *name, st_client_loop_t *client, st_phase_t *phase) {
+    phase->elapsed = now_seconds() - phase->elapsed;
+    long origin = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED) - phase->origin;
+    long bytes = __atomic_load_n(&origin_bytes, __ATOMIC_RELAXED) - phase->bytes;
+    st_client_cache_stats_t stats = {0};
+    bool cached = client_loop_cache_stats(client, &stats);
+    printf("%-16s %7ld req  %7.0f req/s  origin %6ld req %8.1f KB (%5.1f%%)", name, phase->requests,
+           phase->requests / phase->elapsed, origin, bytes / 1024.0, phase->requests ? 100.0 * origin / phase->requests : 0);
+    if (cached) {
+        printf("  hit %5.1f%%  evict %llu  disk hit %llu  mem %llu/%llu KB  disk %llu/%llu KB", 100 * client_cache_hit_ratio(&stats),
+               (unsigned long long)stats.evictions, (unsigned long long)stats.disk_hits, (unsigned long long)stats.entries,
+               (unsigned long long)(stats.bytes >> 10), (unsigned long long)stats.disk_entries,
+               (unsigned long long)(stats.disk_bytes >> 10));
+    }
+    printf("\n");
+}
+
+// Zipf(s=1)分布的累积概率
+static double *zipf_table(int objects) {
+    double *cdf = malloc(objects * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < objects; i++) {
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+    for (int i = 0; i < objects; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+static int zipf_pick(const double *cdf, int objects, unsigned *seed) {
+    double u = (double)rand_r(seed) / RAND_MAX;
+    int lo = 0, hi = objects - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void run_workload(const char *name, st_client_loop_t *client, const double *cdf, int objects, long requests) {
+    unsigned seed = 1;
+    char path[64];
+    st_phase_t phase = phase_begin();
+    for (long i = 0; i < requests; i++) {
+        snprintf(path, sizeof(path), "/obj/%d", zipf_pick(cdf, objects, &seed));
+        fetch(client, path, "");
+    }
+    phase.requests = requests;
+    phase_report(name, client, &phase);
+}
+
+static void check(const char *name, bool ok) {
+    printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) {
+        mismatches++;
+    }
+}
+
+int main(int argc, char **argv) {
+    long requests = argc > 1 ? atol(argv[1]) : 50000;
+    int objects = argc > 2 ? atoi(argv[2]) : 5000;
+    size_t cache_size = (argc > 3 ? atol(argv[3]) : 4096) * 1024;
+    if (!start_server()) {
+        return 1;
+    }
+    char file[] = "/tmp/bench_cache_XXXXXX";
+    int fd = mkstemp(file);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    double *cdf = zipf_table(objects);
+    printf("%ld requests over %d objects (zipf), ~%d KB total, cache %zu KB\n", requests, objects, objects * 9 / 2, cache_size >> 10);
+
+    st_client_loop_t *client = open_client(0, NULL);
+    run_workload("no cache", client, cdf, objects, requests);
+    client_loop_free(client);
+
+    client = open_client(cache_size, NULL);
+    run_workload("memory", client, cdf, objects, requests);
+    client_loop_free(client);
+
+    client = open_client(cache_size, file);
+    run_workload("memory+file", client, cdf, objects, requests);
+    client_loop_free(client);
+
+    // 重新打开同一文件, 之前缓存的对象不用再取
+    client = open_client(cache_size, file);
+    run_workload("reopened file", client, cdf, objects, requests);
+
+    // 过期后用If-None-Match重新验证, 304时返回缓存的内容
+    long before = __atomic_load_n(&origin_not_modified, __ATOMIC_RELAXED);
+    fetch(client, "/short/3", "");
+    fetch(client, "/short/3", "");
+    usleep(1100 * 1000);
+    fetch(client, "/short/3", "");
+    check("revalidated with 304", __atomic_load_n(&origin_not_modified, __ATOMIC_RELAXED) == before + 1);
+    long origin = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+    fetch(client, "/short/3", "");
+    check("fresh again after 304", __atomic_load_n(&origin_requests, __ATOMIC_RELAXED) == origin);
+
+    // 内容变化时重新验证得到新的200
+    usleep(1100 * 1000);
+    __atomic_add_fetch(&version, 1, __ATOMIC_RELAXED);
+    before = __atomic_load_n(&origin_not_modified, __ATOMIC_RELAXED);
+    fetch(client, "/short/3", "");
+    check("changed content replaces entry", __atomic_load_n(&origin_not_modified, __ATOMIC_RELAXED) == before);
+
+    // 同一路径按Accept-Language保存两个变体
+    origin = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+    fetch(client, "/lang/5", "en");
+    fetch(client, "/lang/5", "fr");
+    fetch(client, "/lang/5", "en");
+    fetch(client, "/lang/5", "fr");
+    check("vary keeps both variants", __atomic_load_n(&origin_requests, __ATOMIC_RELAXED) == origin + 2);
+    client_loop_free(client);
+
+    unlink(file);
+    free(cdf);
+    printf("content mismatches: %ld\n", mismatches);
+    return mismatches > 0;
+}
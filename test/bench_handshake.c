@@ -0,0 +1,225 @@
+//  make bench
+//  bin/bench_handshake host port [threads] [seconds] [tls1.2|tls1.3]
+//  每个线程不断建立新连接完成完整握手(不复用会话), 统计每秒握手数和握手延迟;
+//  同时用一个keep-alive连接每10ms请求/hello, 观察握手压力下事件循环的响应.
+//  对比[async_crypto] enable=0与enable=1
+
+#define _GNU_SOURCE
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SAMPLES 1000000
+
+typedef struct {
+    double *samples;
+    long count;
+    long failed;
+} st_samples_t;
+
+static SSL_CTX *ctx;
+static struct sockaddr_in address;
+static volatile int running = 1;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void add_sample(st_samples_t *s, double value) {
+    if (s->count < MAX_SAMPLES) {
+        s->samples[s->count] = value;
+    }
+    s->count++;
+}
+
+static SSL *connect_tls(int *out_fd) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+    *out_fd = fd;
+    return ssl;
+}
+
+static void *run_handshakes(void *arg) {
+    st_samples_t *s = (st_samples_t *)arg;
+    while (running) {
+        double start = now_seconds();
+        int fd;
+        SSL *ssl = connect_tls(&fd);
+        if (!ssl) {
+            s->failed++;
+            continue;
+        }
+        add_sample(s, now_seconds() - start);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+// 读完一个Content-Length响应
+static bool request_hello(SSL *ssl) {
+    static const char request[] = "GET /hello HTTP/1.1\r\nHost: bench\r\n\r\n";
+    if (SSL_write(ssl, request, sizeof(request) - 1) <= 0) {
+        return false;
+    }
+    char buf[4096];
+    int length = 0;
+    for (;;) {
+        int n = SSL_read(ssl, buf + length, sizeof(buf) - 1 - length);
+        if (n <= 0) {
+            return false;
+        }
+        length += n;
+        buf[length] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        char *cl = strcasestr(buf, "Content-Length:");
+        if (end && cl && length >= (end - buf) + 4 + atoi(cl + 15)) {
+            return true;
+        }
+        if (length == sizeof(buf) - 1) {
+            return false;
+        }
+    }
+}
+
+static void *run_probe(void *arg) {
+    st_samples_t *s = (st_samples_t *)arg;
+    int fd;
+    SSL *ssl = connect_tls(&fd);
+    if (!ssl) {
+        s->failed++;
+        return NULL;
+    }
+    while (running) {
+        double start = now_seconds();
+        if (!request_hello(ssl)) {
+            s->failed++;
+            break;
+        }
+        add_sample(s, now_seconds() - start);
+        struct timespec ts = {0, 10000000};
+        nanosleep(&ts, NULL);
+    }
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *samples, long count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    long index = (long)(p * (count - 1));
+    return samples[index];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s host port [threads] [seconds] [tls1.2|tls1.3]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int threads = argc > 3 ? atoi(argv[3]) : 8;
+    double seconds = argc > 4 ? atof(argv[4]) : 5;
+
+    struct hostent *host = gethostbyname(argv[1]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[1]);
+        return 1;
+    }
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(argv[2]));
+    memcpy(&address.sin_addr, host->h_addr_list[0], sizeof(address.sin_addr));
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    // 每次都是完整握手, 服务器每个连接做一次私钥运算
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    if (argc > 5 && strcmp(argv[5], "tls1.2") == 0) {
+        SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    }
+
+    pthread_t ids[threads + 1];
+    st_samples_t samples[threads + 1];
+    for (int i = 0; i <= threads; i++) {
+        samples[i] = (st_samples_t){.samples = malloc(MAX_SAMPLES * sizeof(double))};
+        pthread_create(&ids[i], NULL, i == threads ? run_probe : run_handshakes, &samples[i]);
+    }
+    double start = now_seconds();
+    struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    running = 0;
+    for (int i = 0; i <= threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    // 合并所有握手线程的样本
+    long total = 0, failed = 0;
+    for (int i = 0; i < threads; i++) {
+        total += samples[i].count < MAX_SAMPLES ? samples[i].count : MAX_SAMPLES;
+        failed += samples[i].failed;
+    }
+    double *all = malloc((total ? total : 1) * sizeof(double));
+    long n = 0;
+    for (int i = 0; i < threads; i++) {
+        long count = samples[i].count < MAX_SAMPLES ? samples[i].count : MAX_SAMPLES;
+        memcpy(all + n, samples[i].samples, count * sizeof(double));
+        n += count;
+    }
+    qsort(all, total, sizeof(double), compare_double);
+    st_samples_t *probe = &samples[threads];
+    long probes = probe->count < MAX_SAMPLES ? probe->count : MAX_SAMPLES;
+    qsort(probe->samples, probes, sizeof(double), compare_double);
+
+    printf("threads:%d  %.2fs  handshakes:%ld failed:%ld  %.0f handshakes/s\n", threads, elapsed, total, failed, total / elapsed);
+    printf("  handshake p50:%.2fms p99:%.2fms max:%.2fms\n", percentile(all, total, 0.5) * 1000,
+           percentile(all, total, 0.99) * 1000, percentile(all, total, 1.0) * 1000);
+    printf("  /hello probes:%ld failed:%ld p50:%.2fms p99:%.2fms max:%.2fms\n", probes, probe->failed,
+           percentile(probe->samples, probes, 0.5) * 1000, percentile(probe->samples, probes, 0.99) * 1000,
+           percentile(probe->samples, probes, 1.0) * 1000);
+    for (int i = 0; i <= threads; i++) {
+        free(samples[i].samples);
+    }
+    free(all);
+    SSL_CTX_free(ctx);
+    return failed > 0 || probe->failed > 0;
+}
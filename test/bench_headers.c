@@ -0,0 +1,79 @@
+//  make bench
+//  bin/bench_headers [rounds]    比较完美哈希识别请求头与strcasecmp逐个比较的耗时
+
+#include "known_headers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// 典型浏览器请求中的头部名称, 混有未知头部和不同的大小写
+static const char *sample[] = {
+    "Host", "User-Agent", "Accept", "Accept-Language", "Accept-Encoding", "Referer",
+    "Connection", "Cookie", "Upgrade-Insecure-Requests", "Sec-Fetch-Dest", "Sec-Fetch-Mode",
+    "Sec-Fetch-Site", "If-None-Match", "If-Modified-Since", "Cache-Control", "content-length",
+    "content-type", "X-Forwarded-For", "x-custom-trace", "Range"
+};
+#define SAMPLE_COUNT (int)(sizeof(sample) / sizeof(sample[0]))
+
+#define KNOWN_HEADER_NAME(id, name) name,
+static const char *names[] = {KNOWN_HEADER_LIST(KNOWN_HEADER_NAME)};
+#undef KNOWN_HEADER_NAME
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 原来的做法: 按顺序与每个已知名称做strcasecmp
+static int lookup_strcasecmp(const char *name) {
+    for (int i = 0; i < KNOWN_HEADER_COUNT; i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return HEADER_UNKNOWN;
+}
+
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t lengths[SAMPLE_COUNT];
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        lengths[i] = strlen(sample[i]);
+        if (known_header_lookup(sample[i], lengths[i]) != lookup_strcasecmp(sample[i])) {
+            fprintf(stderr, "mismatch: %s\n", sample[i]);
+            return 1;
+        }
+    }
+    // 所有已知名称都能识别为自身
+    for (int i = 0; i < KNOWN_HEADER_COUNT; i++) {
+        if (known_header_lookup(names[i], strlen(names[i])) != i) {
+            fprintf(stderr, "lookup failed: %s\n", names[i]);
+            return 1;
+        }
+    }
+
+    volatile long sink = 0;
+    double start = now_seconds();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < SAMPLE_COUNT; i++) {
+            sink += lookup_strcasecmp(sample[i]);
+        }
+    }
+    double chain = now_seconds() - start;
+
+    start = now_seconds();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < SAMPLE_COUNT; i++) {
+            sink += known_header_lookup(sample[i], lengths[i]);
+        }
+    }
+    double hash = now_seconds() - start;
+
+    long lookups = rounds * SAMPLE_COUNT;
+    printf("strcasecmp chain: %.1f ns/header\n", chain / lookups * 1e9);
+    printf("perfect hash:     %.1f ns/header (%.1fx)\n", hash / lookups * 1e9, chain / hash);
+    return 0;
+}
@@ -0,0 +1,232 @@
+//  make bench
+//  bin/bench_hedge [requests] [threads] [replicas] [slow_ratio] [slow_ms]
+//  在127.0.0.1~127.0.0.N上启动N个明文副本, 每个请求正常耗时0.5~1.5ms, 随机有slow_ratio比例的请求
+//  慢slow_ms毫秒. client_loop以addresses轮流连接各副本, threads个线程各自串行请求,
+//  依次比较不对冲, 固定延迟对冲, 按p95对冲, 以及只设截止时间时的延迟分布和副本收到的请求数(额外负载)
+
+#define _GNU_SOURCE
+
+#include "client_loop.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define PORT 18480
+#define MAX_REPLICAS 8
+
+typedef struct {
+    int index;
+    int fd;
+    double slow_ratio;
+    int slow_ms;
+} st_replica_t;
+
+typedef struct {
+    st_client_loop_t *client;
+    long requests;
+    double deadline;
+    double *latencies;
+    long failed;
+    long deadlines;
+} st_worker_t;
+
+static long served;
+static pthread_barrier_t barrier;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_ms(double ms) {
+    struct timespec ts = {(time_t)(ms / 1000), (long)((ms - (long)(ms / 1000) * 1000) * 1e6)};
+    nanosleep(&ts, NULL);
+}
+
+// 每个连接一个线程, 逐个处理请求; 对冲被取消时客户端关闭连接, 线程随之退出
+static void *serve_connection(void *arg) {
+    st_replica_t *replica = (st_replica_t *)((void **)arg)[0];
+    int fd = (int)(long)((void **)arg)[1];
+    free(arg);
+    unsigned seed = (unsigned)fd * 2654435761u ^ (unsigned)replica->index;
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+    char buf[4096];
+    int length = 0;
+    for (;;) {
+        ssize_t n = recv(fd, buf + length, sizeof(buf) - 1 - length, 0);
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+        buf[length] = '\0';
+        char *end;
+        while ((end = strstr(buf, "\r\n\r\n"))) {
+            double ms = 0.5 + rand_r(&seed) % 1000 / 1000.0;
+            if (rand_r(&seed) % 10000 < replica->slow_ratio * 10000) {
+                ms = replica->slow_ms;
+            }
+            sleep_ms(ms);
+            __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+            if (send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL) < 0) {
+                goto done;
+            }
+            end += 4;
+            length -= end - buf;
+            memmove(buf, end, length + 1);
+        }
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static void *run_replica(void *arg) {
+    st_replica_t *replica = (st_replica_t *)arg;
+    for (;;) {
+        int fd = accept(replica->fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        void **args = malloc(2 * sizeof(void *));
+        args[0] = replica;
+        args[1] = (void *)(long)fd;
+        pthread_t id;
+        pthread_create(&id, NULL, serve_connection, args);
+        pthread_detach(id);
+    }
+    return NULL;
+}
+
+static bool start_replica(st_replica_t *replica) {
+    char ip[32];
+    snprintf(ip, sizeof(ip), "127.0.0.%d", replica->index + 1);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    replica->fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(replica->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(replica->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(replica->fd, 128) < 0) {
+        perror(ip);
+        return false;
+    }
+    pthread_t id;
+    pthread_create(&id, NULL, run_replica, replica);
+    pthread_detach(id);
+    return true;
+}
+
+static void *run_worker(void *arg) {
+    st_worker_t *w = (st_worker_t *)arg;
+    st_client_request_t request = {.method = HTTP_METHOD_GET, .path = "/", .deadline = w->deadline};
+    pthread_barrier_wait(&barrier);
+    for (long i = 0; i < w->requests; i++) {
+        double start = now_seconds();
+        st_client_future_t *future;
+        while (!(future = client_loop_submit_future(w->client, &request))) {
+            sleep_ms(1);
+        }
+        const st_client_response_t *response = client_future_wait(future, -1);
+        w->latencies[i] = now_seconds() - start;
+        if (response->error == CLIENT_ERROR_DEADLINE) {
+            w->deadlines++;
+        } else if (response->error != CLIENT_OK || response->status != 200) {
+            w->failed++;
+        }
+        client_future_free(future);
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, const char *addresses, int threads, long requests, double hedge_delay, double hedge_percentile,
+                double deadline) {
+    st_client_loop_options_t options;
+    client_loop_init_options(&options);
+    options.tls = false;
+    options.addresses = addresses;
+    options.connections = threads * 2;
+    options.hedge_delay = hedge_delay;
+    options.hedge_percentile = hedge_percentile;
+    st_client_loop_t *client = client_loop_new("127.0.0.1", PORT, &options);
+    if (!client || !client_loop_start(client)) {
+        fprintf(stderr, "failed to start client\n");
+        exit(1);
+    }
+    st_worker_t workers[threads];
+    pthread_t ids[threads];
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (st_worker_t){.client = client, .requests = requests, .deadline = deadline};
+        workers[i].latencies = malloc(requests * sizeof(double));
+        pthread_create(&ids[i], NULL, run_worker, &workers[i]);
+    }
+    long served_before = __atomic_load_n(&served, __ATOMIC_RELAXED);
+    pthread_barrier_wait(&barrier);
+    double start = now_seconds();
+    long total = threads * requests, failed = 0, deadlines = 0;
+    double *all = malloc(total * sizeof(double));
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        memcpy(all + i * requests, workers[i].latencies, requests * sizeof(double));
+        failed += workers[i].failed;
+        deadlines += workers[i].deadlines;
+        free(workers[i].latencies);
+    }
+    double elapsed = now_seconds() - start;
+    st_client_loop_stats_t stats;
+    client_loop_stats(client, &stats);
+    client_loop_free(client);
+    // 被取消的副本请求可能还在服务端处理
+    sleep_ms(100);
+    long load = __atomic_load_n(&served, __ATOMIC_RELAXED) - served_before;
+    qsort(all, total, sizeof(double), compare_double);
+    printf("%-14s p50:%6.2fms p90:%6.2fms p99:%6.2fms p99.9:%6.2fms max:%6.2fms  %.0f req/s\n", name, all[total / 2] * 1000,
+           all[total * 90 / 100] * 1000, all[total * 99 / 100] * 1000, all[total * 999 / 1000] * 1000, all[total - 1] * 1000,
+           total / elapsed);
+    printf("%-14s hedged:%llu (%.1f%%) wins:%llu denied:%llu deadlines:%ld failed:%ld  server requests:%ld (+%.1f%%) connects:%llu\n", "",
+           (unsigned long long)stats.hedged, stats.hedged * 100.0 / total, (unsigned long long)stats.hedge_wins,
+           (unsigned long long)stats.hedge_denied, deadlines, failed, load, (load - total) * 100.0 / total,
+           (unsigned long long)stats.connects);
+    free(all);
+}
+
+int main(int argc, char **argv) {
+    long requests = argc > 1 ? atol(argv[1]) : 2000;
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    int replicas = argc > 3 ? atoi(argv[3]) : 3;
+    double slow_ratio = argc > 4 ? atof(argv[4]) : 0.03;
+    int slow_ms = argc > 5 ? atoi(argv[5]) : 50;
+    if (replicas < 1 || replicas > MAX_REPLICAS) {
+        fprintf(stderr, "replicas: 1-%d\n", MAX_REPLICAS);
+        return 1;
+    }
+
+    static st_replica_t servers[MAX_REPLICAS];
+    char addresses[256] = "";
+    for (int i = 0; i < replicas; i++) {
+        servers[i] = (st_replica_t){.index = i, .slow_ratio = slow_ratio, .slow_ms = slow_ms};
+        if (!start_replica(&servers[i])) {
+            return 1;
+        }
+        snprintf(addresses + strlen(addresses), sizeof(addresses) - strlen(addresses), "%s127.0.0.%d", i ? "," : "", i + 1);
+    }
+    printf("replicas:%d (slow %.1f%% x %dms) threads:%d requests:%ld\n", replicas, slow_ratio * 100, slow_ms, threads,
+           threads * requests);
+
+    run("no hedge", addresses, threads, requests, 0, 0, 0);
+    run("hedge 5ms", addresses, threads, requests, 0.005, 0, 0);
+    run("hedge p95", addresses, threads, requests, 0.005, 95, 0);
+    run("deadline 20ms", addresses, threads, requests, 0, 0, 0.02);
+    return 0;
+}
@@ -0,0 +1,181 @@
+//  make bench
+//  bin/bench_idle host port server_pid [connections] [hold_seconds] [target_bytes]
+//  建立大量keep-alive连接, 每个连接请求一次/hello后保持空闲, 按服务器进程的VmRSS增量
+//  计算每个空闲连接占用的内存; 保持期间每秒采样一次, 观察是否增长.
+//  给出target_bytes时超过目标返回非0. 对比[server] low_memory=0与low_memory=1,
+//  连接数受ulimit -n限制
+
+#define _GNU_SOURCE
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+    SSL *ssl;
+} st_idle_conn_t;
+
+static SSL_CTX *ctx;
+static struct sockaddr_in address;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 服务器进程的常驻内存(字节)
+static long read_rss(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            rss = atol(line + 6) * 1024;
+            break;
+        }
+    }
+    fclose(fp);
+    return rss;
+}
+
+// 读完一个Content-Length响应
+static bool request_hello(SSL *ssl) {
+    static const char request[] = "GET /hello HTTP/1.1\r\nHost: bench\r\n\r\n";
+    if (SSL_write(ssl, request, sizeof(request) - 1) <= 0) {
+        return false;
+    }
+    char buf[4096];
+    int length = 0;
+    for (;;) {
+        int n = SSL_read(ssl, buf + length, sizeof(buf) - 1 - length);
+        if (n <= 0) {
+            return false;
+        }
+        length += n;
+        buf[length] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        char *cl = strcasestr(buf, "Content-Length:");
+        if (end && cl && length >= (end - buf) + 4 + atoi(cl + 15)) {
+            return true;
+        }
+        if (length == sizeof(buf) - 1) {
+            return false;
+        }
+    }
+}
+
+static bool open_idle(st_idle_conn_t *conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(conn->fd);
+        return false;
+    }
+    conn->ssl = SSL_new(ctx);
+    SSL_set_fd(conn->ssl, conn->fd);
+    if (SSL_connect(conn->ssl) != 1 || !request_hello(conn->ssl)) {
+        ERR_clear_error();
+        SSL_free(conn->ssl);
+        close(conn->fd);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s host port server_pid [connections] [hold_seconds] [target_bytes]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int pid = atoi(argv[3]);
+    int connections = argc > 4 ? atoi(argv[4]) : 5000;
+    int hold = argc > 5 ? atoi(argv[5]) : 5;
+    long target = argc > 6 ? atol(argv[6]) : 0;
+
+    struct hostent *host = gethostbyname(argv[1]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[1]);
+        return 1;
+    }
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(argv[2]));
+    memcpy(&address.sin_addr, host->h_addr_list[0], sizeof(address.sin_addr));
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    // 本进程也持有同样多的连接
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    // 先建立少量连接, 让服务器的线程栈, 会话缓存和分配器进入稳定状态
+    st_idle_conn_t warmup[16];
+    int warmed = 0;
+    while (warmed < 16 && open_idle(&warmup[warmed])) {
+        warmed++;
+    }
+    sleep(1);
+    long before = read_rss(pid);
+    if (before < 0) {
+        fprintf(stderr, "cannot read RSS of pid %d\n", pid);
+        return 1;
+    }
+
+    st_idle_conn_t *conns = calloc(connections, sizeof(st_idle_conn_t));
+    double start = now_seconds();
+    int opened = 0;
+    for (; opened < connections; opened++) {
+        if (!open_idle(&conns[opened])) {
+            fprintf(stderr, "connection %d failed\n", opened);
+            break;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    sleep(1);
+    long after = read_rss(pid);
+    printf("connections:%d  opened in %.2fs  server RSS %.1fMB -> %.1fMB\n", opened, elapsed, before / 1048576.0, after / 1048576.0);
+
+    long peak = after;
+    for (int i = 1; i <= hold; i++) {
+        sleep(1);
+        long rss = read_rss(pid);
+        peak = rss > peak ? rss : peak;
+        printf("  hold %ds RSS %.1fMB\n", i, rss / 1048576.0);
+    }
+    long per_connection = opened > 0 ? (peak - before) / opened : 0;
+    printf("  %ld bytes per idle connection%s\n", per_connection,
+           target > 0 ? (per_connection <= target ? " (within target)" : " (ABOVE target)") : "");
+
+    for (int i = 0; i < opened; i++) {
+        SSL_free(conns[i].ssl);
+        close(conns[i].fd);
+    }
+    for (int i = 0; i < warmed; i++) {
+        SSL_free(warmup[i].ssl);
+        close(warmup[i].fd);
+    }
+    free(conns);
+    SSL_CTX_free(ctx);
+    return opened < connections || (target > 0 && per_connection > target);
+}
@@ -0,0 +1,391 @@
+//  make bench
+//  bin/bench_load host port threads connections_per_thread requests_per_connection [path] [delay_ms] [kbps]
+//  给出delay_ms/kbps时经本地中继模拟链路: 服务器到客户端方向按带宽逐个报文段发出, 每段再延迟delay_ms到达,
+//  反方向只有延迟. 除完整响应的延迟外还统计收到第一个响应体字节的时间, 对比[server] dynamic_records=0与1
+
+#define _GNU_SOURCE
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define MAX_LEN 65536
+#define SEGMENT_SIZE 1448
+
+typedef struct {
+    const char *host;
+    int port;
+    int connections;
+    int requests;
+    const char *path;
+    SSL_CTX *ctx;
+    double *latencies;
+    double *first_bytes;
+    int completed;
+    int failed;
+} bench_thread_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int connect_to(const char *host, int port) {
+    struct hostent *server = gethostbyname(host);
+    if (!server) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+// ---- 模拟链路的中继 ----
+
+typedef struct st_segment {
+    struct st_segment *next;
+    double at;                     // 到达对端的时间
+    int length;
+    char data[SEGMENT_SIZE];
+} st_segment_t;
+
+typedef struct {
+    st_segment_t *head;
+    st_segment_t *tail;
+} st_segment_queue_t;
+
+static struct sockaddr_in relay_target;
+static double link_delay;
+static double link_rate;           // 字节/秒, 0表示不限
+static int relay_port;
+
+static void queue_push(st_segment_queue_t *queue, st_segment_t *segment) {
+    segment->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = segment;
+    } else {
+        queue->head = segment;
+    }
+    queue->tail = segment;
+}
+
+// 写出已到达的报文段, 对端关闭时返回-1
+static int deliver(st_segment_queue_t *queue, int fd, double now) {
+    while (queue->head && queue->head->at <= now) {
+        st_segment_t *segment = queue->head;
+        for (int sent = 0; sent < segment->length;) {
+            ssize_t n = send(fd, segment->data + sent, segment->length - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return -1;
+            }
+            sent += n;
+        }
+        queue->head = segment->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        free(segment);
+    }
+    return 0;
+}
+
+static void *relay_connection(void *arg) {
+    int client = (int)(intptr_t)arg;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(server, (struct sockaddr *)&relay_target, sizeof(relay_target)) < 0) {
+        close(server);
+        close(client);
+        return NULL;
+    }
+    int nodelay = 1;
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    st_segment_queue_t up = {0}, down = {0};
+    double link_free = 0;
+    bool open = true;
+    while (open || up.head || down.head) {
+        double now = now_seconds();
+        if (deliver(&up, server, now) < 0 || deliver(&down, client, now) < 0) {
+            break;
+        }
+        double next = 0;
+        if (up.head) {
+            next = up.head->at;
+        }
+        if (down.head && (!next || down.head->at < next)) {
+            next = down.head->at;
+        }
+        struct pollfd fds[2] = {{client, open ? POLLIN : 0, 0}, {server, open ? POLLIN : 0, 0}};
+        struct timespec timeout, *wait = NULL;
+        if (next) {
+            double delta = next > now ? next - now : 0;
+            timeout.tv_sec = (time_t)delta;
+            timeout.tv_nsec = (long)((delta - timeout.tv_sec) * 1e9);
+            wait = &timeout;
+        } else if (!open) {
+            break;
+        }
+        if (ppoll(fds, 2, wait, NULL) <= 0) {
+            continue;
+        }
+        now = now_seconds();
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            st_segment_t *segment = malloc(sizeof(st_segment_t));
+            segment->length = (int)recv(fds[i].fd, segment->data, SEGMENT_SIZE, 0);
+            if (segment->length <= 0) {
+                free(segment);
+                open = false;
+                continue;
+            }
+            if (i == 0) {
+                segment->at = now + link_delay;
+                queue_push(&up, segment);
+            } else {
+                // 按带宽排队发出, 发出后再经过传播延迟
+                double depart = link_free > now ? link_free : now;
+                if (link_rate > 0) {
+                    depart += segment->length / link_rate;
+                }
+                link_free = depart;
+                segment->at = depart + link_delay;
+                queue_push(&down, segment);
+            }
+        }
+    }
+    while (up.head) {
+        st_segment_t *next = up.head->next;
+        free(up.head);
+        up.head = next;
+    }
+    while (down.head) {
+        st_segment_t *next = down.head->next;
+        free(down.head);
+        down.head = next;
+    }
+    close(server);
+    close(client);
+    return NULL;
+}
+
+static void *relay_accept(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, relay_connection, (void *)(intptr_t)fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// 在本地端口启动中继, 之后的连接都经过它
+static int start_relay(const char *host, int port) {
+    struct hostent *server = gethostbyname(host);
+    if (!server) {
+        return -1;
+    }
+    relay_target.sin_family = AF_INET;
+    relay_target.sin_port = htons(port);
+    memcpy(&relay_target.sin_addr.s_addr, server->h_addr, server->h_length);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t length = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &length) < 0) {
+        close(fd);
+        return -1;
+    }
+    relay_port = ntohs(addr.sin_port);
+    pthread_t tid;
+    pthread_create(&tid, NULL, relay_accept, (void *)(intptr_t)fd);
+    pthread_detach(tid);
+    return 0;
+}
+
+// 读取一个完整响应(只支持Content-Length), 头部之后的数据只计数不保存.
+// first_body为收到第一个响应体字节的时间
+static int read_response(SSL *ssl, char *buffer, double *first_body) {
+    int length = 0;
+    long header = -1, body = 0, received = 0;
+    *first_body = 0;
+    for (;;) {
+        int n = SSL_read(ssl, buffer + length, MAX_LEN - length - 1);
+        if (n <= 0) {
+            return -1;
+        }
+        if (header < 0) {
+            length += n;
+            buffer[length] = '\0';
+            char *end = strstr(buffer, "\r\n\r\n");
+            if (!end) {
+                if (length == MAX_LEN - 1) {
+                    return -1;
+                }
+                continue;
+            }
+            header = end - buffer + 4;
+            char *cl = strcasestr(buffer, "content-length:");
+            body = cl ? atol(cl + 15) : 0;
+            received = length - header;
+            length = 0;
+        } else {
+            received += n;
+        }
+        if (received > 0 && *first_body == 0) {
+            *first_body = now_seconds();
+        }
+        if (received >= body) {
+            return 0;
+        }
+    }
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = (bench_thread_t *)arg;
+    char request[512];
+    char *response = malloc(MAX_LEN);
+    int request_length = snprintf(request, sizeof(request),
+        "POST %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\nContent-Length: 5\r\n\r\nhello",
+        t->path, t->host);
+
+    for (int c = 0; c < t->connections; c++) {
+        int fd = connect_to(t->host, t->port);
+        if (fd < 0) {
+            t->failed += t->requests;
+            continue;
+        }
+        SSL *ssl = SSL_new(t->ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_connect(ssl) <= 0) {
+            t->failed += t->requests;
+            SSL_free(ssl);
+            close(fd);
+            continue;
+        }
+        for (int r = 0; r < t->requests; r++) {
+            double start = now_seconds();
+            double first_body;
+            if (SSL_write(ssl, request, request_length) <= 0 || read_response(ssl, response, &first_body) < 0) {
+                t->failed += t->requests - r;
+                break;
+            }
+            t->first_bytes[t->completed] = (first_body ? first_body : now_seconds()) - start;
+            t->latencies[t->completed++] = now_seconds() - start;
+        }
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(fd);
+    }
+    free(response);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 6) {
+        fprintf(stderr, "usage: %s host port threads connections_per_thread requests_per_connection [path] [delay_ms] [kbps]\n", argv[0]);
+        return 1;
+    }
+    int threads = atoi(argv[3]);
+    const char *host = argv[1];
+    int port = atoi(argv[2]);
+    link_delay = argc > 7 ? atof(argv[7]) / 1000 : 0;
+    link_rate = argc > 8 ? atof(argv[8]) * 1000 / 8 : 0;
+    if (link_delay > 0 || link_rate > 0) {
+        if (start_relay(host, port) < 0) {
+            fprintf(stderr, "cannot start relay\n");
+            return 1;
+        }
+        printf("simulated link: delay %.1fms, %s\n", link_delay * 1000, argc > 8 ? argv[8] : "unlimited");
+        host = "127.0.0.1";
+        port = relay_port;
+    }
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    bench_thread_t *args = calloc(threads, sizeof(bench_thread_t));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i].host = host;
+        args[i].port = port;
+        args[i].connections = atoi(argv[4]);
+        args[i].requests = atoi(argv[5]);
+        args[i].path = argc > 6 ? argv[6] : "/";
+        args[i].ctx = ctx;
+        args[i].latencies = calloc((size_t)args[i].connections * args[i].requests, sizeof(double));
+        args[i].first_bytes = calloc((size_t)args[i].connections * args[i].requests, sizeof(double));
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    }
+
+    int completed = 0, failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        completed += args[i].completed;
+        failed += args[i].failed;
+    }
+    double elapsed = now_seconds() - start;
+
+    double *all = calloc(completed ? completed : 1, sizeof(double));
+    double *first = calloc(completed ? completed : 1, sizeof(double));
+    int n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, args[i].latencies, args[i].completed * sizeof(double));
+        memcpy(first + n, args[i].first_bytes, args[i].completed * sizeof(double));
+        n += args[i].completed;
+        free(args[i].latencies);
+        free(args[i].first_bytes);
+    }
+    qsort(all, n, sizeof(double), compare_double);
+    qsort(first, n, sizeof(double), compare_double);
+
+    printf("requests: %d, failed: %d, elapsed: %.3fs, rps: %.0f\n", completed, failed, elapsed, completed / elapsed);
+    if (n > 0) {
+        printf("latency p50: %.3fms, p90: %.3fms, p99: %.3fms, max: %.3fms\n",
+            all[n / 2] * 1e3, all[n * 90 / 100] * 1e3, all[n * 99 / 100] * 1e3, all[n - 1] * 1e3);
+        printf("first body byte p50: %.3fms, p90: %.3fms, p99: %.3fms, max: %.3fms\n",
+            first[n / 2] * 1e3, first[n * 90 / 100] * 1e3, first[n * 99 / 100] * 1e3, first[n - 1] * 1e3);
+    }
+
+    free(all);
+    free(first);
+    free(args);
+    free(tids);
+    SSL_CTX_free(ctx);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+//  make bench
+//  bin/bench_sse host port subscribers [messages] [size] [threads]
+//  建立subscribers个/events?topics=bench事件流, 再用一个keep-alive连接请求/publish每次发布100个事件,
+//  直到发布messages个. 统计所有订阅者收齐的时间, 每秒投递的事件数, 以及从发布到收到的延迟
+//  (事件内容带有服务器发布时的单调时钟, 须在同一主机上运行). 最后打印/sse-stats.
+//  需要[sse] enable=1, 订阅者数受ulimit -n限制
+
+#define _GNU_SOURCE
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PUBLISH_BATCH 100
+#define MAX_SAMPLES 1000000
+#define LINE_SIZE 256
+
+typedef struct {
+    int fd;
+    SSL *ssl;
+    bool subscribed;               // 收到了响应头
+    int line_length;
+    char line[LINE_SIZE];
+} st_subscriber_t;
+
+typedef struct {
+    int index;
+    int count;                     // 本线程的订阅者
+    st_subscriber_t *subscribers;
+    long connected;                // 原子访问, 下同
+    long received;
+    double last_received;
+    double *samples;
+    long sample_count;
+    long sample_every;
+} st_reader_t;
+
+static SSL_CTX *ctx;
+static struct sockaddr_in address;
+static volatile int running = 1;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static SSL *connect_tls(int *out_fd) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+    *out_fd = fd;
+    return ssl;
+}
+
+// 按行处理事件流: 状态行表示订阅成功, data:行是"序号 发布时间(纳秒) 填充"
+static void process_line(st_reader_t *reader, st_subscriber_t *s, double now) {
+    s->line[s->line_length] = '\0';
+    if (!s->subscribed && strncmp(s->line, "HTTP/1.1 200", 12) == 0) {
+        s->subscribed = true;
+        __atomic_add_fetch(&reader->connected, 1, __ATOMIC_RELAXED);
+    } else if (strncmp(s->line, "data: ", 6) == 0) {
+        long long published = 0;
+        char *end;
+        strtol(s->line + 6, &end, 10);
+        published = strtoll(end, NULL, 10);
+        long received = __atomic_add_fetch(&reader->received, 1, __ATOMIC_RELAXED);
+        reader->last_received = now;
+        if (received % reader->sample_every == 0 && reader->sample_count < MAX_SAMPLES) {
+            reader->samples[reader->sample_count++] = now - published * 1e-9;
+        }
+    }
+    s->line_length = 0;
+}
+
+static void read_subscriber(st_reader_t *reader, st_subscriber_t *s) {
+    char buf[16384];
+    for (;;) {
+        int n = SSL_read(s->ssl, buf, sizeof(buf));
+        if (n <= 0) {
+            int err = SSL_get_error(s->ssl, n);
+            if (err != SSL_ERROR_WANT_READ) {
+                ERR_clear_error();
+            }
+            return;
+        }
+        double now = now_seconds();
+        for (int i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                process_line(reader, s, now);
+            } else if (s->line_length < LINE_SIZE - 1) {
+                s->line[s->line_length++] = buf[i];
+            }
+        }
+    }
+}
+
+static void *run_reader(void *arg) {
+    st_reader_t *reader = (st_reader_t *)arg;
+    int ep = epoll_create1(0);
+    static const char request[] = "GET /events?topics=bench HTTP/1.1\r\nHost: bench\r\n\r\n";
+    for (int i = 0; i < reader->count; i++) {
+        st_subscriber_t *s = &reader->subscribers[i];
+        s->ssl = connect_tls(&s->fd);
+        if (!s->ssl) {
+            fprintf(stderr, "thread %d: connection %d failed\n", reader->index, i);
+            break;
+        }
+        SSL_write(s->ssl, request, sizeof(request) - 1);
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+        epoll_ctl(ep, EPOLL_CTL_ADD, s->fd, &ev);
+    }
+    struct epoll_event events[256];
+    while (running) {
+        int n = epoll_wait(ep, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            read_subscriber(reader, (st_subscriber_t *)events[i].data.ptr);
+        }
+    }
+    for (int i = 0; i < reader->count; i++) {
+        if (reader->subscribers[i].ssl) {
+            SSL_free(reader->subscribers[i].ssl);
+            close(reader->subscribers[i].fd);
+        }
+    }
+    close(ep);
+    return NULL;
+}
+
+// 在keep-alive连接上请求一次, 读完Content-Length响应, body可以为NULL
+static bool request(SSL *ssl, const char *path, char *body, size_t size) {
+    char req[256];
+    int length = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", path);
+    if (SSL_write(ssl, req, length) <= 0) {
+        return false;
+    }
+    char buf[4096];
+    int received = 0;
+    for (;;) {
+        int n = SSL_read(ssl, buf + received, sizeof(buf) - 1 - received);
+        if (n <= 0) {
+            return false;
+        }
+        received += n;
+        buf[received] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        char *cl = strcasestr(buf, "Content-Length:");
+        if (end && cl && received >= (end - buf) + 4 + atoi(cl + 15)) {
+            if (body) {
+                snprintf(body, size, "%s", end + 4);
+            }
+            return true;
+        }
+        if (received == sizeof(buf) - 1) {
+            return false;
+        }
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s host port subscribers [messages] [size] [threads]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int subscribers = atoi(argv[3]);
+    long messages = argc > 4 ? atol(argv[4]) : 1000;
+    int size = argc > 5 ? atoi(argv[5]) : 64;
+    int threads = argc > 6 ? atoi(argv[6]) : 4;
+    if (threads > subscribers) {
+        threads = subscribers;
+    }
+
+    struct hostent *host = gethostbyname(argv[1]);
+    if (!host) {
+        fprintf(stderr, "unknown host %s\n", argv[1]);
+        return 1;
+    }
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(argv[2]));
+    memcpy(&address.sin_addr, host->h_addr_list[0], sizeof(address.sin_addr));
+    ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    long expected = (long)subscribers * messages;
+    long every = expected / MAX_SAMPLES + 1;
+    pthread_t ids[threads];
+    st_reader_t readers[threads];
+    for (int i = 0; i < threads; i++) {
+        int count = subscribers / threads + (i < subscribers % threads);
+        readers[i] = (st_reader_t){.index = i, .count = count, .sample_every = every};
+        readers[i].subscribers = calloc(count, sizeof(st_subscriber_t));
+        readers[i].samples = malloc(MAX_SAMPLES * sizeof(double));
+        pthread_create(&ids[i], NULL, run_reader, &readers[i]);
+    }
+
+    // 等所有订阅者收到响应头
+    double start = now_seconds();
+    long connected = 0;
+    while (connected < subscribers && now_seconds() - start < 120) {
+        usleep(100000);
+        connected = 0;
+        for (int i = 0; i < threads; i++) {
+            connected += __atomic_load_n(&readers[i].connected, __ATOMIC_RELAXED);
+        }
+    }
+    printf("subscribers:%ld/%d connected in %.2fs\n", connected, subscribers, now_seconds() - start);
+
+    int fd;
+    SSL *publisher = connect_tls(&fd);
+    if (!publisher) {
+        fprintf(stderr, "publisher connection failed\n");
+        return 1;
+    }
+    expected = connected * messages;
+    start = now_seconds();
+    for (long published = 0; published < messages; published += PUBLISH_BATCH) {
+        char path[128];
+        long count = messages - published < PUBLISH_BATCH ? messages - published : PUBLISH_BATCH;
+        snprintf(path, sizeof(path), "/publish?topic=bench&count=%ld&size=%d", count, size);
+        if (!request(publisher, path, NULL, 0)) {
+            fprintf(stderr, "publish failed\n");
+            break;
+        }
+    }
+    double published_at = now_seconds();
+
+    // 收齐, 或者2秒没有新的事件(被丢弃的不会再到达)
+    long received = 0, last = -1;
+    double progress = now_seconds();
+    while (received < expected && now_seconds() - progress < 2) {
+        usleep(10000);
+        received = 0;
+        for (int i = 0; i < threads; i++) {
+            received += __atomic_load_n(&readers[i].received, __ATOMIC_RELAXED);
+        }
+        if (received != last) {
+            last = received;
+            progress = now_seconds();
+        }
+    }
+    double finished = start;
+    for (int i = 0; i < threads; i++) {
+        finished = readers[i].last_received > finished ? readers[i].last_received : finished;
+    }
+    double elapsed = finished - start;
+
+    char stats[256] = "";
+    request(publisher, "/sse-stats", stats, sizeof(stats));
+    SSL_free(publisher);
+    close(fd);
+    running = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+
+    long n = 0;
+    for (int i = 0; i < threads; i++) {
+        n += readers[i].sample_count;
+    }
+    double *all = malloc((n ? n : 1) * sizeof(double));
+    n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, readers[i].samples, readers[i].sample_count * sizeof(double));
+        n += readers[i].sample_count;
+        free(readers[i].samples);
+        free(readers[i].subscribers);
+    }
+    qsort(all, n, sizeof(double), compare_double);
+
+    printf("messages:%ld size:%d published in %.3fs, received %ld/%ld in %.3fs  %.0f deliveries/s\n",
+           messages, size, published_at - start, received, expected, elapsed, elapsed > 0 ? received / elapsed : 0);
+    if (n > 0) {
+        printf("  latency p50:%.2fms p99:%.2fms max:%.2fms\n", all[n / 2] * 1000, all[n * 99 / 100] * 1000, all[n - 1] * 1000);
+    }
+    printf("  server %s", stats);
+    free(all);
+    SSL_CTX_free(ctx);
+    return received < expected;
+}
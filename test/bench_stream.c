@@ -0,0 +1,445 @@
+//  make bench
+//  bin/bench_stream [megabytes] [slow_mbps]
+//  在127.0.0.1:18490启动明文服务器: PUT/POST统计收到的请求体字节和校验和, GET /N返回N字节的固定序列.
+//  client_loop依次从文件(Content-Length), 非阻塞管道(chunked), 回调上传, 再下载到文件, 限速读取的
+//  非阻塞管道(slow_mbps MB/s, 验证背压)和回调, 核对长度和校验和, 打印吞吐和每项的峰值RSS增长
+
+#define _GNU_SOURCE
+
+#include "client_loop.h"
+#include <llhttp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define PORT 18490
+#define BLOCK (64 * 1024)
+
+typedef struct {
+    uint64_t length;
+    uint64_t hash;
+} st_digest_t;
+
+typedef struct {
+    int fd;
+    llhttp_t parser;
+    st_digest_t body;
+    char path[256];
+    size_t path_length;
+    bool done;
+} st_session_t;
+
+typedef struct {
+    int fd;
+    uint64_t length;
+    double mbps;                   // 管道读取端的限速, 0表示不限
+    st_digest_t digest;
+} st_pipe_t;
+
+static llhttp_settings_t request_settings;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 第i个字节为i*31%251, 上传和下载用同一序列
+static void fill(char *buffer, uint64_t offset, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = (char)((offset + i) * 31 % 251);
+    }
+}
+
+static void digest_update(st_digest_t *digest, const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        digest->hash = (digest->hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+    }
+    digest->length += length;
+}
+
+static st_digest_t expected_digest(uint64_t length) {
+    st_digest_t digest = {0, 14695981039346656037ULL};
+    char buffer[BLOCK];
+    for (uint64_t offset = 0; offset < length; offset += BLOCK) {
+        size_t n = length - offset < BLOCK ? length - offset : BLOCK;
+        fill(buffer, offset, n);
+        digest_update(&digest, buffer, n);
+    }
+    return digest;
+}
+
+// 峰值RSS(KB), reset时先清零
+static long peak_rss(bool reset) {
+    if (reset) {
+        FILE *f = fopen("/proc/self/clear_refs", "w");
+        if (f) {
+            fputs("5", f);
+            fclose(f);
+        }
+    }
+    char line[256];
+    long kb = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return kb;
+}
+
+// ---- 服务器 ----
+
+static int on_url(llhttp_t *parser, const char *at, size_t length) {
+    st_session_t *s = (st_session_t *)parser->data;
+    if (s->path_length + length < sizeof(s->path)) {
+        memcpy(s->path + s->path_length, at, length);
+        s->path_length += length;
+        s->path[s->path_length] = '\0';
+    }
+    return 0;
+}
+
+static int on_body(llhttp_t *parser, const char *at, size_t length) {
+    digest_update(&((st_session_t *)parser->data)->body, at, length);
+    return 0;
+}
+
+static int on_message_complete(llhttp_t *parser) {
+    ((st_session_t *)parser->data)->done = true;
+    return HPE_PAUSED;
+}
+
+static bool send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool respond(st_session_t *s) {
+    char head[256];
+    if (s->parser.method == HTTP_GET) {
+        uint64_t length = strtoull(s->path + 1, NULL, 10);
+        int n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n\r\n", (unsigned long long)length);
+        if (!send_all(s->fd, head, n)) {
+            return false;
+        }
+        char buffer[BLOCK];
+        for (uint64_t offset = 0; offset < length; offset += BLOCK) {
+            size_t size = length - offset < BLOCK ? length - offset : BLOCK;
+            fill(buffer, offset, size);
+            if (!send_all(s->fd, buffer, size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    char body[64];
+    int length = snprintf(body, sizeof(body), "%llu %016llx", (unsigned long long)s->body.length,
+                          (unsigned long long)s->body.hash);
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s", length, body);
+    return send_all(s->fd, head, n);
+}
+
+static void session_reset(st_session_t *s) {
+    llhttp_init(&s->parser, HTTP_REQUEST, &request_settings);
+    s->parser.data = s;
+    s->body = (st_digest_t){0, 14695981039346656037ULL};
+    s->path_length = 0;
+    s->path[0] = '\0';
+    s->done = false;
+}
+
+static void *serve_connection(void *arg) {
+    st_session_t *s = (st_session_t *)arg;
+    session_reset(s);
+    char buffer[BLOCK];
+    ssize_t n;
+    while ((n = recv(s->fd, buffer, sizeof(buffer), 0)) > 0) {
+        const char *p = buffer;
+        while (n > 0) {
+            llhttp_errno_t err = llhttp_execute(&s->parser, p, n);
+            if (!s->done) {
+                if (err != HPE_OK) {
+                    goto done;
+                }
+                break;
+            }
+            const char *end = llhttp_get_error_pos(&s->parser);
+            n -= end - p;
+            p = end;
+            if (!respond(s)) {
+                goto done;
+            }
+            session_reset(s);
+        }
+    }
+done:
+    close(s->fd);
+    free(s);
+    return NULL;
+}
+
+static void *run_server(void *arg) {
+    int listener = (int)(long)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        st_session_t *s = calloc(1, sizeof(st_session_t));
+        s->fd = fd;
+        pthread_t id;
+        pthread_create(&id, NULL, serve_connection, s);
+        pthread_detach(id);
+    }
+    return NULL;
+}
+
+static bool start_server(void) {
+    llhttp_settings_init(&request_settings);
+    request_settings.on_url = on_url;
+    request_settings.on_body = on_body;
+    request_settings.on_message_complete = on_message_complete;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("bind");
+        return false;
+    }
+    pthread_t id;
+    pthread_create(&id, NULL, run_server, (void *)(long)fd);
+    pthread_detach(id);
+    return true;
+}
+
+// ---- 客户端 ----
+
+// 管道写入端: 生成序列写进管道
+static void *feed_pipe(void *arg) {
+    st_pipe_t *p = (st_pipe_t *)arg;
+    char buffer[BLOCK];
+    for (uint64_t offset = 0; offset < p->length; offset += BLOCK) {
+        size_t size = p->length - offset < BLOCK ? p->length - offset : BLOCK;
+        fill(buffer, offset, size);
+        for (size_t done = 0; done < size;) {
+            ssize_t n = write(p->fd, buffer + done, size - done);
+            if (n <= 0) {
+                goto out;
+            }
+            done += n;
+        }
+    }
+out:
+    close(p->fd);
+    return NULL;
+}
+
+// 管道读取端: 按mbps限速读取并计算校验和
+static void *drain_pipe(void *arg) {
+    st_pipe_t *p = (st_pipe_t *)arg;
+    char buffer[BLOCK];
+    double start = now_seconds();
+    ssize_t n;
+    while ((n = read(p->fd, buffer, sizeof(buffer))) > 0) {
+        digest_update(&p->digest, buffer, n);
+        if (p->mbps > 0) {
+            double ahead = p->digest.length / (p->mbps * 1e6) - (now_seconds() - start);
+            if (ahead > 0) {
+                usleep((useconds_t)(ahead * 1e6));
+            }
+        }
+    }
+    close(p->fd);
+    return NULL;
+}
+
+static ssize_t produce(void *arg, char *buffer, size_t size) {
+    uint64_t *state = (uint64_t *)arg;   // [0]已产生, [1]总长度
+    size_t n = state[1] - state[0] < size ? state[1] - state[0] : size;
+    fill(buffer, state[0], n);
+    state[0] += n;
+    return n;
+}
+
+static bool consume(void *arg, const char *data, size_t length) {
+    digest_update((st_digest_t *)arg, data, length);
+    return true;
+}
+
+static const st_client_response_t *run_request(st_client_loop_t *client, st_client_request_t *request, st_client_future_t **future) {
+    while (!(*future = client_loop_submit_future(client, request))) {
+        usleep(1000);
+    }
+    return client_future_wait(*future, -1);
+}
+
+static void report(const char *name, const st_client_response_t *response, st_digest_t got, st_digest_t want, double elapsed,
+                   long rss_before) {
+    bool ok = response->error == CLIENT_OK && response->status == 200 && got.length == want.length && got.hash == want.hash;
+    printf("%-22s %s %8.1f MB/s  %6.2fs  peak rss +%ld KB%s%s\n", name, ok ? "ok  " : "FAIL", want.length / elapsed / 1e6, elapsed,
+           peak_rss(false) - rss_before, response->error != CLIENT_OK ? "  " : "",
+           response->error != CLIENT_OK ? client_error_string(response->error) : "");
+}
+
+// 上传的结果是服务器返回的"长度 校验和"
+static st_digest_t parse_upload(const st_client_response_t *response) {
+    st_digest_t digest = {0, 0};
+    if (response->body) {
+        char text[64];
+        size_t n = response->body_length < sizeof(text) - 1 ? response->body_length : sizeof(text) - 1;
+        memcpy(text, response->body, n);
+        text[n] = '\0';
+        unsigned long long length, hash;
+        if (sscanf(text, "%llu %llx", &length, &hash) == 2) {
+            digest = (st_digest_t){length, hash};
+        }
+    }
+    return digest;
+}
+
+int main(int argc, char **argv) {
+    uint64_t size = (argc > 1 ? atoll(argv[1]) : 256) * 1024 * 1024;
+    double slow_mbps = argc > 2 ? atof(argv[2]) : 200;
+    if (!start_server()) {
+        return 1;
+    }
+    st_client_loop_options_t options;
+    client_loop_init_options(&options);
+    options.tls = false;
+    options.connections = 2;
+    st_client_loop_t *client = client_loop_new("127.0.0.1", PORT, &options);
+    if (!client || !client_loop_start(client)) {
+        fprintf(stderr, "failed to start client\n");
+        return 1;
+    }
+    st_digest_t want = expected_digest(size);
+    printf("body: %llu MB\n", (unsigned long long)(size >> 20));
+
+    char path[] = "/tmp/bench_stream_XXXXXX";
+    int file = mkstemp(path);
+    unlink(path);
+    char buffer[BLOCK];
+    for (uint64_t offset = 0; offset < size; offset += BLOCK) {
+        size_t n = size - offset < BLOCK ? size - offset : BLOCK;
+        fill(buffer, offset, n);
+        if (write(file, buffer, n) != (ssize_t)n) {
+            perror("write");
+            return 1;
+        }
+    }
+
+    st_client_future_t *future;
+    const st_client_response_t *response;
+    long rss;
+    double start;
+
+    // 文件上传, 长度取文件大小
+    lseek(file, 0, SEEK_SET);
+    st_client_request_t upload = {.method = HTTP_METHOD_PUT, .path = "/upload", .body_mode = CLIENT_BODY_FD, .body_fd = file};
+    rss = peak_rss(true);
+    start = now_seconds();
+    response = run_request(client, &upload, &future);
+    report("upload file", response, parse_upload(response), want, now_seconds() - start, rss);
+    client_future_free(future);
+
+    // 管道上传, 长度未知用chunked
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return 1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    st_pipe_t feeder = {.fd = fds[1], .length = size};
+    pthread_t id;
+    rss = peak_rss(true);
+    start = now_seconds();
+    pthread_create(&id, NULL, feed_pipe, &feeder);
+    upload.body_fd = fds[0];
+    response = run_request(client, &upload, &future);
+    report("upload pipe (chunked)", response, parse_upload(response), want, now_seconds() - start, rss);
+    client_future_free(future);
+    pthread_join(id, NULL);
+    close(fds[0]);
+
+    // 回调上传, 给出长度
+    uint64_t state[2] = {0, size};
+    st_client_request_t produced = {.method = HTTP_METHOD_POST, .path = "/upload", .body_mode = CLIENT_BODY_CALLBACK,
+                                    .body_read = produce, .body_arg = state, .body_size = size};
+    rss = peak_rss(true);
+    start = now_seconds();
+    response = run_request(client, &produced, &future);
+    report("upload callback", response, parse_upload(response), want, now_seconds() - start, rss);
+    client_future_free(future);
+
+    // 下载到文件
+    char url[64];
+    snprintf(url, sizeof(url), "/%llu", (unsigned long long)size);
+    if (ftruncate(file, 0) < 0) {
+        return 1;
+    }
+    lseek(file, 0, SEEK_SET);
+    st_client_request_t download = {.method = HTTP_METHOD_GET, .path = url, .response_mode = CLIENT_BODY_FD, .response_fd = file};
+    rss = peak_rss(true);
+    start = now_seconds();
+    response = run_request(client, &download, &future);
+    double elapsed = now_seconds() - start;
+    st_digest_t got = {0, 14695981039346656037ULL};
+    lseek(file, 0, SEEK_SET);
+    ssize_t n;
+    while ((n = read(file, buffer, sizeof(buffer))) > 0) {
+        digest_update(&got, buffer, n);
+    }
+    report("download file", response, got, want, elapsed, rss);
+    client_future_free(future);
+    close(file);
+
+    // 下载到限速读取的管道, 缓冲应保持在一次读取的大小
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return 1;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    st_pipe_t drainer = {.fd = fds[0], .mbps = slow_mbps, .digest = {0, 14695981039346656037ULL}};
+    rss = peak_rss(true);
+    start = now_seconds();
+    pthread_create(&id, NULL, drain_pipe, &drainer);
+    download.response_fd = fds[1];
+    response = run_request(client, &download, &future);
+    close(fds[1]);
+    pthread_join(id, NULL);
+    char name[64];
+    snprintf(name, sizeof(name), "download pipe %gMB/s", slow_mbps);
+    report(name, response, drainer.digest, want, now_seconds() - start, rss);
+    client_future_free(future);
+
+    // 下载到回调
+    got = (st_digest_t){0, 14695981039346656037ULL};
+    st_client_request_t consumed = {.method = HTTP_METHOD_GET, .path = url, .response_mode = CLIENT_BODY_CALLBACK,
+                                    .response_write = consume, .response_arg = &got};
+    rss = peak_rss(true);
+    start = now_seconds();
+    response = run_request(client, &consumed, &future);
+    report("download callback", response, got, want, now_seconds() - start, rss);
+    client_future_free(future);
+
+    client_loop_free(client);
+    return 0;
+}
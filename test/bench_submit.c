@@ -0,0 +1,258 @@
+//  make bench
+//  bin/bench_submit queue [threads] [items_per_thread]                          无锁MPSC队列与互斥锁的入队吞吐
+//  bin/bench_submit host port [threads] [requests_per_thread] [callback|queue|future] [connections] [tls|plain|unix:path]
+//                                                                            多线程经client_loop提交请求的吞吐;
+//                                                                            对比TLS, 明文端口([server] plain_port)和unix_path
+
+#define _GNU_SOURCE
+
+#include "client_loop.h"
+#include "mpsc_queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+typedef enum {
+    MODE_CALLBACK,
+    MODE_QUEUE,
+    MODE_FUTURE
+} submit_mode_t;
+
+typedef struct {
+    st_client_loop_t *client;
+    st_mpsc_queue_t *queue;
+    pthread_mutex_t *lock;
+    int index;
+    long items;
+    submit_mode_t mode;
+    long retries;                  // 队列满时的退避次数
+    double submit_time;
+} st_producer_t;
+
+static long completed;
+static long failed;
+static pthread_barrier_t barrier;
+
+// 对照: 互斥锁保护的计数, 相当于入队临界区最短的加锁队列
+static long locked_count;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *push_lock_free(void *arg) {
+    st_producer_t *p = (st_producer_t *)arg;
+    pthread_barrier_wait(&barrier);
+    for (long i = 0; i < p->items; i++) {
+        while (!mpsc_queue_push(p->queue, (void *)(i + 1))) {
+            p->retries++;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *push_locked(void *arg) {
+    st_producer_t *p = (st_producer_t *)arg;
+    pthread_barrier_wait(&barrier);
+    for (long i = 0; i < p->items; i++) {
+        pthread_mutex_lock(p->lock);
+        locked_count++;
+        pthread_mutex_unlock(p->lock);
+    }
+    return NULL;
+}
+
+static int bench_queue(int threads, long items) {
+    st_mpsc_queue_t queue;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t ids[threads];
+    st_producer_t producers[threads];
+    long total = (long)threads * items;
+
+    for (int round = 0; round < 2; round++) {
+        mpsc_queue_init(&queue, 4096);
+        pthread_barrier_init(&barrier, NULL, threads + 1);
+        for (int i = 0; i < threads; i++) {
+            producers[i] = (st_producer_t){.queue = &queue, .lock = &lock, .items = items};
+            pthread_create(&ids[i], NULL, round == 0 ? push_lock_free : push_locked, &producers[i]);
+        }
+        pthread_barrier_wait(&barrier);
+        double start = now_seconds();
+        long consumed = 0;
+        if (round == 0) {
+            // 单消费者与生产者同时运行, 取空时让出CPU
+            while (consumed < total) {
+                if (mpsc_queue_pop(&queue)) {
+                    consumed++;
+                } else {
+                    sched_yield();
+                }
+            }
+        } else {
+            while (consumed < total) {
+                pthread_mutex_lock(&lock);
+                long n = locked_count;
+                locked_count = 0;
+                pthread_mutex_unlock(&lock);
+                consumed += n;
+                if (n == 0) {
+                    sched_yield();
+                }
+            }
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(ids[i], NULL);
+        }
+        double elapsed = now_seconds() - start;
+        long retries = 0;
+        for (int i = 0; i < threads; i++) {
+            retries += producers[i].retries;
+        }
+        printf("%-10s threads:%d items:%ld  %.2fs  %.0f items/s  full:%ld\n", round == 0 ? "lock-free" : "mutex",
+               threads, total, elapsed, total / elapsed, retries);
+        pthread_barrier_destroy(&barrier);
+        mpsc_queue_destroy(&queue);
+    }
+    return 0;
+}
+
+static void on_complete(const st_client_response_t *response, void *arg) {
+    if (response->error == CLIENT_OK && response->status == 200) {
+        __atomic_add_fetch(&completed, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *produce_requests(void *arg) {
+    st_producer_t *p = (st_producer_t *)arg;
+    st_client_request_t request = {.method = HTTP_METHOD_GET, .path = "/hello"};
+    st_completion_queue_t *queue = p->mode == MODE_QUEUE ? completion_queue_new() : NULL;
+    st_client_future_t **futures = p->mode == MODE_FUTURE ? calloc(p->items, sizeof(*futures)) : NULL;
+    long done = 0;
+
+    pthread_barrier_wait(&barrier);
+    double start = now_seconds();
+    for (long i = 0; i < p->items; i++) {
+        for (;;) {
+            bool ok;
+            if (p->mode == MODE_FUTURE) {
+                futures[i] = client_loop_submit_future(p->client, &request);
+                ok = futures[i] != NULL;
+            } else {
+                ok = client_loop_submit(p->client, &request, on_complete, p, queue);
+            }
+            if (ok) {
+                break;
+            }
+            // 队列满, 让出CPU后重试; 完成队列模式等待并处理已到达的响应
+            p->retries++;
+            if (queue) {
+                done += completion_queue_wait(queue, 0.001, 0);
+            } else {
+                sched_yield();
+            }
+        }
+    }
+    p->submit_time = now_seconds() - start;
+
+    if (p->mode == MODE_QUEUE) {
+        while (done < p->items) {
+            done += completion_queue_wait(queue, 1.0, 0);
+        }
+        completion_queue_free(queue);
+    } else if (p->mode == MODE_FUTURE) {
+        for (long i = 0; i < p->items; i++) {
+            const st_client_response_t *response = client_future_wait(futures[i], -1);
+            on_complete(response, p);
+            client_future_free(futures[i]);
+        }
+        free(futures);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "queue") == 0) {
+        return bench_queue(argc > 2 ? atoi(argv[2]) : 32, argc > 3 ? atol(argv[3]) : 1000000);
+    }
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s queue [threads] [items] | host port [threads] [requests] [callback|queue|future] [connections] [tls|plain|unix:path]\n", argv[0]);
+        return 1;
+    }
+    const char *host = argv[1];
+    int port = atoi(argv[2]);
+    int threads = argc > 3 ? atoi(argv[3]) : 32;
+    long requests = argc > 4 ? atol(argv[4]) : 1000;
+    submit_mode_t mode = MODE_CALLBACK;
+    if (argc > 5) {
+        mode = strcmp(argv[5], "queue") == 0 ? MODE_QUEUE : strcmp(argv[5], "future") == 0 ? MODE_FUTURE : MODE_CALLBACK;
+    }
+
+    st_client_loop_options_t options;
+    client_loop_init_options(&options);
+    options.verify = false;
+    options.connections = argc > 6 ? atoi(argv[6]) : 16;
+    const char *transport = argc > 7 ? argv[7] : "tls";
+    if (strcmp(transport, "tls") != 0) {
+        options.tls = false;
+        if (strncmp(transport, "unix:", 5) == 0) {
+            options.unix_path = transport + 5;
+        }
+    }
+    st_client_loop_t *client = client_loop_new(host, port, &options);
+    if (!client || !client_loop_start(client)) {
+        fprintf(stderr, "failed to start client\n");
+        return 1;
+    }
+
+    pthread_t ids[threads];
+    st_producer_t producers[threads];
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        producers[i] = (st_producer_t){.client = client, .index = i, .items = requests, .mode = mode};
+        pthread_create(&ids[i], NULL, produce_requests, &producers[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    double start = now_seconds();
+    long total = (long)threads * requests;
+    if (mode == MODE_CALLBACK) {
+        while (__atomic_load_n(&completed, __ATOMIC_RELAXED) + __atomic_load_n(&failed, __ATOMIC_RELAXED) < total) {
+            struct timespec ts = {0, 1000000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+
+    double submit_time = 0;
+    long retries = 0;
+    for (int i = 0; i < threads; i++) {
+        submit_time = producers[i].submit_time > submit_time ? producers[i].submit_time : submit_time;
+        retries += producers[i].retries;
+    }
+    st_client_loop_stats_t stats;
+    client_loop_stats(client, &stats);
+    client_loop_free(client);
+
+    static const char *mode_names[] = {"callback", "queue", "future"};
+    printf("mode:%s transport:%s threads:%d requests:%ld connections:%d\n", mode_names[mode], transport, threads, total, options.connections);
+    printf("  completed:%ld failed:%ld  %.2fs  %.0f req/s  client cpu:%.2fs (%.1fus/req)\n", completed, failed, elapsed, completed / elapsed,
+           cpu, completed > 0 ? cpu / completed * 1e6 : 0);
+    printf("  submit: %.0f req/s (slowest producer)  backpressure retries:%ld\n", total / submit_time, retries);
+    printf("  wakeups:%llu  avg batch:%.1f  connects:%llu\n", (unsigned long long)stats.wakeups,
+           stats.wakeups ? (double)stats.submitted / stats.wakeups : 0, (unsigned long long)stats.connects);
+    return failed > 0;
+}
@@ -0,0 +1,236 @@
+//  make bench
+//  bin/bench_websocket unmask                                  比较各去掩码实现的吞吐
+//  bin/bench_websocket host port frame_size messages [path]    对/ws回显接口测试往返吞吐
+
+#define _GNU_SOURCE
+
+#include "websocket.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define BATCH_BYTES (1024 * 1024)   // 每轮最多未确认的数据量
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_unmask(void) {
+    static const char *kernels[] = {"scalar", "sse2", "avx2"};
+    static const size_t sizes[] = {16, 125, 1024, 16384, 1024 * 1024};
+    const uint8_t key[4] = {0x12, 0x34, 0x56, 0x78};
+    uint8_t *data = malloc(1024 * 1024 + 1);
+    memset(data, 0xab, 1024 * 1024 + 1);
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (!ws_set_unmask_kernel(kernels[k])) {
+            printf("%-6s not supported\n", kernels[k]);
+            continue;
+        }
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t total = 0;
+            double start = now_seconds();
+            // 从奇数地址开始, 覆盖未对齐的情况
+            while (total < (size_t)2 * 1024 * 1024 * 1024) {
+                ws_unmask(data + 1, sizes[s], key);
+                total += sizes[s];
+            }
+            double elapsed = now_seconds() - start;
+            printf("%-6s %8zu bytes: %8.2f GB/s\n", kernels[k], sizes[s], total / elapsed / 1e9);
+        }
+    }
+    free(data);
+}
+
+static int connect_to(const char *host, int port) {
+    struct hostent *server = gethostbyname(host);
+    if (!server) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+static int read_full(SSL *ssl, char *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        int n = SSL_read(ssl, buffer + done, (int)(length - done));
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int upgrade(SSL *ssl, const char *host, const char *path) {
+    char request[512];
+    int length = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", path, host);
+    if (SSL_write(ssl, request, length) <= 0) {
+        return -1;
+    }
+    // 逐字节读取响应头, 避免读走后面的帧
+    char head[1024];
+    size_t n = 0;
+    while (n < sizeof(head) - 1) {
+        if (SSL_read(ssl, head + n, 1) != 1) {
+            return -1;
+        }
+        n++;
+        if (n >= 4 && memcmp(head + n - 4, "\r\n\r\n", 4) == 0) {
+            head[n] = '\0';
+            return strncmp(head, "HTTP/1.1 101", 12) == 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// 构造带掩码的二进制帧, 返回帧长度
+static size_t build_frame(char *out, const char *payload, size_t length) {
+    size_t n = 0;
+    out[n++] = (char)(0x80 | WS_OPCODE_BINARY);
+    if (length < 126) {
+        out[n++] = (char)(0x80 | length);
+    } else if (length <= 0xffff) {
+        out[n++] = (char)(0x80 | 126);
+        out[n++] = (char)(length >> 8);
+        out[n++] = (char)length;
+    } else {
+        out[n++] = (char)(0x80 | 127);
+        for (int i = 7; i >= 0; i--) {
+            out[n++] = (char)((uint64_t)length >> (i * 8));
+        }
+    }
+    uint8_t key[4];
+    RAND_bytes(key, sizeof(key));
+    memcpy(out + n, key, 4);
+    n += 4;
+    memcpy(out + n, payload, length);
+    ws_unmask((uint8_t *)out + n, length, key);
+    return n + length;
+}
+
+// 读取一个服务端帧(不带掩码), 返回payload长度
+static long read_frame(SSL *ssl, char *payload, size_t capacity) {
+    unsigned char head[10];
+    if (read_full(ssl, (char *)head, 2) < 0) {
+        return -1;
+    }
+    uint64_t length = head[1] & 0x7f;
+    if (length == 126) {
+        if (read_full(ssl, (char *)head + 2, 2) < 0) {
+            return -1;
+        }
+        length = ((uint64_t)head[2] << 8) | head[3];
+    } else if (length == 127) {
+        if (read_full(ssl, (char *)head + 2, 8) < 0) {
+            return -1;
+        }
+        length = 0;
+        for (int i = 0; i < 8; i++) {
+            length = (length << 8) | head[2 + i];
+        }
+    }
+    if (length > capacity || read_full(ssl, payload, length) < 0) {
+        return -1;
+    }
+    return (long)length;
+}
+
+static int bench_echo(const char *host, int port, size_t frame_size, int messages, const char *path) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    int fd = connect_to(host, port);
+    if (fd < 0) {
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) <= 0 || upgrade(ssl, host, path) < 0) {
+        fprintf(stderr, "websocket handshake failed\n");
+        return 1;
+    }
+
+    int per_batch = frame_size >= BATCH_BYTES ? 1 : (int)(BATCH_BYTES / (frame_size + 14));
+    char *payload = malloc(frame_size ? frame_size : 1);
+    char *echo = malloc(frame_size ? frame_size : 1);
+    char *frames = malloc((size_t)per_batch * (frame_size + 14));
+    memset(payload, 'x', frame_size);
+
+    int sent = 0, received = 0, failed = 0;
+    double start = now_seconds();
+    while (received < messages) {
+        // 连续发送一批帧再读取回显, 模拟流水线
+        int batch = messages - sent < per_batch ? messages - sent : per_batch;
+        size_t length = 0;
+        for (int i = 0; i < batch; i++) {
+            length += build_frame(frames + length, payload, frame_size);
+        }
+        if (SSL_write(ssl, frames, (int)length) <= 0) {
+            failed = 1;
+            break;
+        }
+        sent += batch;
+        for (int i = 0; i < batch; i++) {
+            long n = read_frame(ssl, echo, frame_size);
+            if (n != (long)frame_size || memcmp(echo, payload, frame_size) != 0) {
+                failed = 1;
+                break;
+            }
+            received++;
+        }
+        if (failed) {
+            break;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("frame: %zu bytes, messages: %d, elapsed: %.3fs, msg/s: %.0f, throughput: %.1f MB/s%s\n",
+        frame_size, received, elapsed, received / elapsed, (double)received * frame_size / elapsed / 1e6,
+        failed ? " (failed)" : "");
+
+    free(payload);
+    free(echo);
+    free(frames);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    SSL_CTX_free(ctx);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "unmask") == 0) {
+        bench_unmask();
+        return 0;
+    }
+    if (argc < 5) {
+        fprintf(stderr, "usage: %s unmask\n       %s host port frame_size messages [path]\n", argv[0], argv[0]);
+        return 1;
+    }
+    return bench_echo(argv[1], atoi(argv[2]), (size_t)atol(argv[3]), atoi(argv[4]), argc > 5 ? argv[5] : "/ws");
+}
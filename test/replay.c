@@ -0,0 +1,265 @@
+//  make replay
+//  bin/replay capture.bin host port [speed] [connections] [tls|plain|unix:path] [limit]
+//  用client_loop按[capture]抓取的文件重放请求: 保持记录的方法, URL, 头部和请求体, 请求按原来的时间间隔
+//  除以speed提交(2表示快一倍, 0表示不等待尽快提交). 只能重放GET/POST/PUT/DELETE, 其他方法跳过;
+//  被替换的头部和逐跳头部不发送, 截断的请求体补零到原始长度. 最后打印延迟分位数, 状态码分布,
+//  以及提交比计划晚了多少(客户端跟不上时偏大, 结果不可信)
+
+#define _GNU_SOURCE
+
+#include "client_loop.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_BODY (64 * 1024 * 1024)
+
+typedef struct {
+    double due;                    // 相对开始的计划时间(秒), 已按speed缩放
+    st_client_request_t request;
+    char *path;
+    char *headers;
+    char *body;
+    double submitted;
+    double latency;
+    int status;
+    client_error_t error;
+} st_replay_t;
+
+static long done;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_until(double at) {
+    struct timespec ts = {(time_t)at, (long)((at - (time_t)at) * 1e9)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int method_from_name(const char *name) {
+    static const char *names[] = {"GET", "POST", "PUT", "DELETE"};
+    static const http_method methods[] = {HTTP_METHOD_GET, HTTP_METHOD_POST, HTTP_METHOD_PUT, HTTP_METHOD_DELETE};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return methods[i];
+        }
+    }
+    return -1;
+}
+
+// 由客户端生成或只对原连接有意义的头部
+static bool skip_header(const char *name, const char *value) {
+    static const char *names[] = {"host", "content-length", "transfer-encoding", "connection", "keep-alive", "te", "upgrade",
+                                  "expect", "http2-settings"};
+    if (strcmp(value, CAPTURE_REDACTED) == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool load_entry(st_replay_t *r, const st_capture_entry_t *entry, double speed) {
+    int method = method_from_name(entry->method);
+    if (method < 0) {
+        return false;
+    }
+    size_t length = 1;
+    const char *p = entry->headers;
+    for (int i = 0; i < entry->header_count; i++) {
+        size_t name = strlen(p) + 1;
+        size_t value = strlen(p + name) + 1;
+        length += name + value + 2;
+        p += name + value;
+    }
+    r->headers = malloc(length);
+    r->path = strdup(entry->url);
+    size_t body_length = entry->body_length < MAX_BODY ? entry->body_length : MAX_BODY;
+    r->body = calloc(1, body_length + 1);
+    if (!r->headers || !r->path || !r->body) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(r->body, entry->body, entry->body_saved < body_length ? entry->body_saved : body_length);
+    char *out = r->headers;
+    p = entry->headers;
+    for (int i = 0; i < entry->header_count; i++) {
+        const char *name = p;
+        const char *value = p + strlen(p) + 1;
+        p = value + strlen(value) + 1;
+        if (!skip_header(name, value)) {
+            out += sprintf(out, "%s: %s\r\n", name, value);
+        }
+    }
+    *out = '\0';
+    r->due = speed > 0 ? entry->offset_us / 1e6 / speed : 0;
+    r->request = (st_client_request_t){.method = (http_method)method, .path = r->path, .headers = r->headers, .body = r->body,
+                                       .body_length = body_length};
+    return true;
+}
+
+static void on_complete(const st_client_response_t *response, void *arg) {
+    st_replay_t *r = (st_replay_t *)arg;
+    r->latency = now_seconds() - r->submitted;
+    r->status = response->status;
+    r->error = response->error;
+    __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *name, double *values, long n) {
+    if (n == 0) {
+        return;
+    }
+    qsort(values, n, sizeof(double), compare_double);
+    printf("  %-8s n:%-7ld p50:%7.2fms p90:%7.2fms p99:%7.2fms p99.9:%7.2fms max:%7.2fms\n", name, n, values[n / 2] * 1000,
+           values[n * 90 / 100] * 1000, values[n * 99 / 100] * 1000, values[n * 999 / 1000] * 1000, values[n - 1] * 1000);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s capture.bin host port [speed] [connections] [tls|plain|unix:path] [limit]\n", argv[0]);
+        return 1;
+    }
+    double speed = argc > 4 ? atof(argv[4]) : 1;
+    const char *transport = argc > 6 ? argv[6] : "tls";
+    long limit = argc > 7 ? atol(argv[7]) : 0;
+
+    uint64_t start_ns;
+    st_capture_reader_t *reader = capture_reader_open(argv[1], &start_ns);
+    if (!reader) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+    long count = 0, capacity = 1024, skipped = 0;
+    st_replay_t *requests = malloc(capacity * sizeof(st_replay_t));
+    st_capture_entry_t entry;
+    int ret;
+    double first = -1;
+    uint64_t first_us = 0, last_us = 0;
+    while ((limit <= 0 || count < limit) && (ret = capture_reader_next(reader, &entry)) > 0) {
+        if (count == capacity) {
+            capacity *= 2;
+            requests = realloc(requests, capacity * sizeof(st_replay_t));
+        }
+        memset(&requests[count], 0, sizeof(st_replay_t));
+        if (!load_entry(&requests[count], &entry, speed)) {
+            skipped++;
+            continue;
+        }
+        // 从第一条开始计时
+        if (first < 0) {
+            first = requests[count].due;
+            first_us = entry.offset_us;
+        }
+        requests[count].due -= first;
+        last_us = entry.offset_us;
+        count++;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: corrupt record after %ld requests, replaying those\n", argv[1], count);
+    }
+    capture_reader_close(reader);
+    if (count == 0) {
+        fprintf(stderr, "nothing to replay\n");
+        return 1;
+    }
+    double span = (last_us - first_us) / 1e6;
+
+    st_client_loop_options_t options;
+    client_loop_init_options(&options);
+    options.verify = false;
+    options.connections = argc > 5 ? atoi(argv[5]) : 16;
+    if (strcmp(transport, "tls") != 0) {
+        options.tls = false;
+        if (strncmp(transport, "unix:", 5) == 0) {
+            options.unix_path = transport + 5;
+        }
+    }
+    st_client_loop_t *client = client_loop_new(argv[2], atoi(argv[3]), &options);
+    if (!client || !client_loop_start(client)) {
+        fprintf(stderr, "failed to start client\n");
+        return 1;
+    }
+
+    double *lag = malloc(count * sizeof(double));
+    double start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        st_replay_t *r = &requests[i];
+        if (speed > 0) {
+            sleep_until(start + r->due);
+        }
+        r->submitted = now_seconds();
+        while (!client_loop_submit(client, &r->request, on_complete, r, NULL)) {
+            usleep(100);
+            r->submitted = now_seconds();
+        }
+        lag[i] = speed > 0 ? r->submitted - (start + r->due) : 0;
+    }
+    double submitted = now_seconds();
+    while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < count && now_seconds() - submitted < 60) {
+        usleep(1000);
+    }
+    double elapsed = now_seconds() - start;
+    long finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+    client_loop_free(client);
+
+    static const char *methods[] = {"GET", "POST", "PUT", "DELETE"};
+    long statuses[6] = {0}, errors = 0;
+    double *all = malloc(count * sizeof(double));
+    double *by_method = malloc(count * sizeof(double));
+    long n = 0;
+    for (long i = 0; i < count; i++) {
+        if (requests[i].error != CLIENT_OK) {
+            errors++;
+            continue;
+        }
+        statuses[requests[i].status / 100 < 6 ? requests[i].status / 100 : 0]++;
+        all[n++] = requests[i].latency;
+    }
+
+    printf("replayed %ld requests from %s (skipped %ld with unsupported methods), recorded span %.2fs, speed %s\n", count, argv[1],
+           skipped, span, speed > 0 ? argv[4] : "max");
+    printf("  finished %ld in %.2fs  %.0f req/s  errors:%ld  2xx:%ld 3xx:%ld 4xx:%ld 5xx:%ld\n", finished, elapsed, count / elapsed,
+           errors, statuses[2], statuses[3], statuses[4], statuses[5]);
+    if (speed > 0) {
+        qsort(lag, count, sizeof(double), compare_double);
+        printf("  submit lag p50:%.2fms p99:%.2fms max:%.2fms\n", lag[count / 2] * 1000, lag[count * 99 / 100] * 1000,
+               lag[count - 1] * 1000);
+    }
+    print_latency("all", all, n);
+    for (int m = 0; m < 4; m++) {
+        long k = 0;
+        for (long i = 0; i < count; i++) {
+            if (requests[i].error == CLIENT_OK && requests[i].request.method == (http_method)m) {
+                by_method[k++] = requests[i].latency;
+            }
+        }
+        print_latency(methods[m], by_method, k);
+    }
+
+    for (long i = 0; i < count; i++) {
+        free(requests[i].path);
+        free(requests[i].headers);
+        free(requests[i].body);
+    }
+    free(requests);
+    free(lag);
+    free(all);
+    free(by_method);
+    return errors > 0;
+}
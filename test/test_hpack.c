@@ -0,0 +1,193 @@
+// HPACK编解码测试, 用RFC 7541附录C的示例: 逐个头部块解码, 比较头部和动态表大小;
+// C.4/C.6(Huffman)的头部再按同样顺序编码, 与示例字节比较.
+//   make test
+
+#include "hpack.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_HEADERS 8
+#define MAX_BLOCK 256
+
+typedef struct {
+    const char *name;
+    const char *value;
+} st_test_header_t;
+
+typedef struct {
+    const char *hex;           // 示例中的头部块
+    const char *encoded;       // 本编码器的输出与示例不同时的期望, NULL表示与hex相同
+    size_t table_size;         // 处理完这一块后动态表的大小
+    st_test_header_t headers[MAX_HEADERS];
+} st_test_block_t;
+
+typedef struct {
+    const st_test_header_t *headers;
+    int index;
+    int failed;
+} st_decode_ctx_t;
+
+static int failures;
+
+static size_t hex_decode(const char *hex, uint8_t *out) {
+    size_t n = 0;
+    for (const char *p = hex; *p; p++) {
+        if (*p == ' ') {
+            continue;
+        }
+        unsigned int byte;
+        sscanf(p, "%2x", &byte);
+        out[n++] = (uint8_t)byte;
+        p++;
+    }
+    return n;
+}
+
+static int on_header(void *arg, const char *name, size_t name_length, const char *value, size_t value_length) {
+    st_decode_ctx_t *ctx = (st_decode_ctx_t *)arg;
+    const st_test_header_t *expected = &ctx->headers[ctx->index++];
+    if (!expected->name || strlen(expected->name) != name_length || memcmp(expected->name, name, name_length) != 0 ||
+        strlen(expected->value) != value_length || memcmp(expected->value, value, value_length) != 0) {
+        printf("  header %d: got %.*s: %.*s\n", ctx->index, (int)name_length, name, (int)value_length, value);
+        ctx->failed = 1;
+    }
+    return 0;
+}
+
+// separate为true时每块用新的动态表
+static void check_decode(const char *title, const st_test_block_t *blocks, int count, size_t max_size, bool separate) {
+    st_hpack_table_t table;
+    hpack_table_init(&table, max_size);
+    for (int i = 0; i < count; i++) {
+        if (separate && i > 0) {
+            hpack_table_free(&table);
+            hpack_table_init(&table, max_size);
+        }
+        uint8_t data[MAX_BLOCK];
+        size_t length = hex_decode(blocks[i].hex, data);
+        st_decode_ctx_t ctx = {blocks[i].headers, 0, 0};
+        if (hpack_decode(&table, data, length, on_header, &ctx) < 0) {
+            printf("  decode error\n");
+            ctx.failed = 1;
+        }
+        if (blocks[i].headers[ctx.index].name) {
+            printf("  missing header %s\n", blocks[i].headers[ctx.index].name);
+            ctx.failed = 1;
+        }
+        if (table.size != blocks[i].table_size) {
+            printf("  table size %zu, expected %zu\n", table.size, blocks[i].table_size);
+            ctx.failed = 1;
+        }
+        printf("%s decode %s.%d\n", ctx.failed ? "FAIL" : "ok  ", title, i + 1);
+        failures += ctx.failed;
+    }
+    hpack_table_free(&table);
+}
+
+static void check_encode(const char *title, const st_test_block_t *blocks, int count, size_t max_size) {
+    st_hpack_table_t table;
+    hpack_table_init(&table, max_size);
+    for (int i = 0; i < count; i++) {
+        uint8_t expected[MAX_BLOCK];
+        size_t expected_length = hex_decode(blocks[i].encoded ? blocks[i].encoded : blocks[i].hex, expected);
+        st_buffer_t out = {0};
+        int failed = 0;
+        for (const st_test_header_t *h = blocks[i].headers; h->name; h++) {
+            if (hpack_encode(&table, &out, h->name, h->value, strlen(h->value), true) < 0) {
+                printf("  encode error at %s\n", h->name);
+                failed = 1;
+            }
+        }
+        if (buffer_length(&out) != expected_length || memcmp(buffer_data(&out), expected, expected_length) != 0) {
+            printf("  got");
+            for (size_t k = 0; k < buffer_length(&out); k++) {
+                printf(" %02x", (uint8_t)buffer_data(&out)[k]);
+            }
+            printf("\n");
+            failed = 1;
+        }
+        if (table.size != blocks[i].table_size) {
+            printf("  table size %zu, expected %zu\n", table.size, blocks[i].table_size);
+            failed = 1;
+        }
+        printf("%s encode %s.%d\n", failed ? "FAIL" : "ok  ", title, i + 1);
+        failures += failed;
+        buffer_free(&out);
+    }
+    hpack_table_free(&table);
+}
+
+#define DATE1 "Mon, 21 Oct 2013 20:13:21 GMT"
+#define DATE2 "Mon, 21 Oct 2013 20:13:22 GMT"
+#define COOKIE "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"
+
+// C.2: 各种字面值表示, 每块单独解码
+static const st_test_block_t c2[] = {
+    {"400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", NULL, 55,
+     {{"custom-key", "custom-header"}}},
+    {"040c 2f73 616d 706c 652f 7061 7468", NULL, 0, {{":path", "/sample/path"}}},
+    {"1008 7061 7373 776f 7264 0673 6563 7265 74", NULL, 0, {{"password", "secret"}}},
+    {"82", NULL, 0, {{":method", "GET"}}},
+};
+
+// C.3/C.4: 同一连接上的三个请求, 不用/使用Huffman
+#define REQUEST1 {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}}
+#define REQUEST2                                                                                                  \
+    {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},                  \
+     {"cache-control", "no-cache"}}
+#define REQUEST3                                                                                                  \
+    {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},       \
+     {"custom-key", "custom-value"}}
+
+static const st_test_block_t c3[] = {
+    {"8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", NULL, 57, REQUEST1},
+    {"8286 84be 5808 6e6f 2d63 6163 6865", NULL, 110, REQUEST2},
+    {"8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", NULL, 164, REQUEST3},
+};
+
+static const st_test_block_t c4[] = {
+    {"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", NULL, 57, REQUEST1},
+    {"8286 84be 5886 a8eb 1064 9cbf", NULL, 110, REQUEST2},
+    {"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", NULL, 164, REQUEST3},
+};
+
+// C.5/C.6: 动态表上限256的三个响应, 有条目被淘汰
+#define RESPONSE1 {{":status", "302"}, {"cache-control", "private"}, {"date", DATE1}, {"location", "https://www.example.com"}}
+#define RESPONSE2 {{":status", "307"}, {"cache-control", "private"}, {"date", DATE1}, {"location", "https://www.example.com"}}
+#define RESPONSE3                                                                                                 \
+    {{":status", "200"}, {"cache-control", "private"}, {"date", DATE2}, {"location", "https://www.example.com"},   \
+     {"content-encoding", "gzip"}, {"set-cookie", COOKIE}}
+
+static const st_test_block_t c5[] = {
+    {"4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d "
+     "546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+     NULL, 222, RESPONSE1},
+    {"4803 3330 37c1 c0bf", NULL, 222, RESPONSE2},
+    {"88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f "
+     "6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b "
+     "2076 6572 7369 6f6e 3d31",
+     NULL, 215, RESPONSE3},
+};
+
+// "307"的Huffman编码与原文等长, 编码器只在更短时用Huffman, 所以C.6.2编码出的是C.5.2的原文形式
+static const st_test_block_t c6[] = {
+    {"4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 "
+     "8f0b 97c8 e9ae 82ae 43d3",
+     NULL, 222, RESPONSE1},
+    {"4883 640e ffc1 c0bf", "4803 3330 37c1 c0bf", 222, RESPONSE2},
+    {"88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 "
+     "dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+     NULL, 215, RESPONSE3},
+};
+
+int main(void) {
+    check_decode("C.2", c2, 4, HPACK_DEFAULT_TABLE_SIZE, true);
+    check_decode("C.3", c3, 3, HPACK_DEFAULT_TABLE_SIZE, false);
+    check_decode("C.4", c4, 3, HPACK_DEFAULT_TABLE_SIZE, false);
+    check_decode("C.5", c5, 3, 256, false);
+    check_decode("C.6", c6, 3, 256, false);
+    check_encode("C.4", c4, 3, HPACK_DEFAULT_TABLE_SIZE);
+    check_encode("C.6", c6, 3, 256);
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
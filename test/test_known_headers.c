@@ -0,0 +1,76 @@
+// 已知请求头完美哈希的测试: 每个名称识别为自己的编号, 大小写混合也能识别,
+// 差一个字节, 长短不同和未收录的名称都返回HEADER_UNKNOWN.
+//   make test
+
+#include "known_headers.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+static int failures;
+
+static void expect(const char *what, const char *name, size_t length, int expected) {
+    int id = known_header_lookup(name, length);
+    if (id != expected) {
+        printf("FAIL %s: \"", what);
+        for (size_t i = 0; i < length; i++) {
+            printf(isprint((unsigned char)name[i]) ? "%c" : "\\x%02x", (unsigned char)name[i]);
+        }
+        printf("\" -> %d, expected %d\n", id, expected);
+        failures++;
+    }
+}
+
+int main(void) {
+    int checks = 0;
+    for (int id = 0; id < KNOWN_HEADER_COUNT; id++) {
+        const char *name = known_header_name(id);
+        size_t length = strlen(name);
+        char buf[KNOWN_HEADER_MAX_LENGTH + 2];
+
+        expect("exact", name, length, id);
+        // 名称后面紧跟其他数据, 只看length
+        snprintf(buf, sizeof(buf), "%sx", name);
+        expect("trailing data", buf, length, id);
+
+        for (size_t i = 0; i < length; i++) {
+            buf[i] = toupper((unsigned char)name[i]);
+        }
+        expect("upper case", buf, length, id);
+        for (size_t i = 0; i < length; i++) {
+            buf[i] = i % 2 ? toupper((unsigned char)name[i]) : name[i];
+        }
+        expect("mixed case", buf, length, id);
+
+        expect("truncated", name, length - 1, HEADER_UNKNOWN);
+        expect("extended", buf, length + 1, HEADER_UNKNOWN);
+
+        // 每个位置换一个字节: 换成别的字母, 或换成或上0x20后才等于原字节的非字母(如'\r'对'-'),
+        // 或者高位置1的字节
+        for (size_t i = 0; i < length; i++) {
+            unsigned char c = (unsigned char)name[i];
+            unsigned char replacements[] = {c == 'q' ? 'z' : 'q', (unsigned char)(c & ~0x20), (unsigned char)(c | 0x80)};
+            for (size_t k = 0; k < sizeof(replacements); k++) {
+                if (isalpha(c) && k == 1) {
+                    continue;  // 字母去掉0x20就是大写, 应当匹配
+                }
+                memcpy(buf, name, length);
+                buf[i] = (char)replacements[k];
+                expect("near miss", buf, length, HEADER_UNKNOWN);
+            }
+        }
+        checks++;
+    }
+
+    const char *unknown[] = {"", "x", "hosts", "x-custom-header", "content-lengt", "set-cookie", "location", "x-forwarded-host",
+                             "sec-websocket-accept", "authorisation"};
+    for (size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+        expect("unknown", unknown[i], strlen(unknown[i]), HEADER_UNKNOWN);
+    }
+    char longer[KNOWN_HEADER_MAX_LENGTH + 8];
+    memset(longer, 'a', sizeof(longer));
+    expect("too long", longer, sizeof(longer), HEADER_UNKNOWN);
+
+    printf("%d known headers checked, %s\n", checks, failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+// OCSP装订测试: 在内存中生成CA, 服务器证书和由CA签名的OCSP响应, 经BIO对完成握手.
+// 检查从file=加载的响应被装订, 过了nextUpdate的响应不再装订但握手照常完成,
+// 以及文件被替换后由后台更新读到新的响应.
+//   make test
+
+#include "ocsp_stapling.h"
+#include "log.h"
+#include <openssl/ec.h>
+#include <openssl/ocsp.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures;
+
+static void check(const char *what, bool ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    failures += !ok;
+}
+
+static EVP_PKEY *make_key(void) {
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (ctx && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0) {
+        EVP_PKEY_keygen(ctx, &key);
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+// issuer为空时自签名
+static X509 *make_cert(EVP_PKEY *key, const char *common_name, long serial, X509 *issuer, EVP_PKEY *issuer_key) {
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)common_name, -1, -1, 0);
+    X509_set_issuer_name(cert, issuer ? X509_get_subject_name(issuer) : name);
+    X509_sign(cert, issuer_key ? issuer_key : key, EVP_sha256());
+    return cert;
+}
+
+static X509 *ca, *leaf;
+static EVP_PKEY *ca_key, *leaf_key;
+static char file[64];
+
+// CA签名的good响应写入file(先写临时文件再改名), 返回DER, 用OPENSSL_free释放
+static int write_response(long this_offset, long next_offset, unsigned char **der) {
+    OCSP_CERTID *id = OCSP_cert_to_id(NULL, leaf, ca);
+    OCSP_BASICRESP *basic = OCSP_BASICRESP_new();
+    ASN1_TIME *this_update = X509_gmtime_adj(NULL, this_offset);
+    ASN1_TIME *next_update = X509_gmtime_adj(NULL, next_offset);
+    OCSP_basic_add1_status(basic, id, V_OCSP_CERTSTATUS_GOOD, 0, NULL, this_update, next_update);
+    OCSP_basic_sign(basic, ca, ca_key, EVP_sha256(), NULL, 0);
+    OCSP_RESPONSE *response = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, basic);
+    *der = NULL;
+    int length = i2d_OCSP_RESPONSE(response, der);
+    char tmp[80];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp) {
+        fwrite(*der, 1, length, fp);
+        fclose(fp);
+        rename(tmp, file);
+    }
+    OCSP_RESPONSE_free(response);
+    OCSP_BASICRESP_free(basic);
+    ASN1_TIME_free(this_update);
+    ASN1_TIME_free(next_update);
+    OCSP_CERTID_free(id);
+    return length;
+}
+
+static SSL_CTX *make_server_ctx(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(ctx, leaf);
+    SSL_CTX_use_PrivateKey(ctx, leaf_key);
+    // 链中的CA用来构造CertID和验证响应签名
+    SSL_CTX_add1_chain_cert(ctx, ca);
+    return ctx;
+}
+
+// 经内存中的BIO对握手, 客户端请求status_request. 返回握手是否完成, *stapled为收到的响应(没有时为NULL)
+static bool handshake(SSL_CTX *server_ctx, SSL_CTX *client_ctx, unsigned char **stapled, long *stapled_length) {
+    BIO *server_bio, *client_bio;
+    BIO_new_bio_pair(&server_bio, 0, &client_bio, 0);
+    SSL *server = SSL_new(server_ctx);
+    SSL *client = SSL_new(client_ctx);
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_bio(client, client_bio, client_bio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+    SSL_set_tlsext_status_type(client, TLSEXT_STATUSTYPE_ocsp);
+
+    bool done = false;
+    for (int i = 0; i < 20 && !done; i++) {
+        int client_rc = SSL_do_handshake(client);
+        int server_rc = SSL_do_handshake(server);
+        done = client_rc == 1 && server_rc == 1;
+    }
+    *stapled = NULL;
+    *stapled_length = 0;
+    const unsigned char *response;
+    long length = SSL_get_tlsext_status_ocsp_resp(client, &response);
+    if (done && response && length > 0) {
+        *stapled = OPENSSL_memdup(response, length);
+        *stapled_length = length;
+    }
+    SSL_free(client);
+    SSL_free(server);
+    return done;
+}
+
+static bool same_response(const unsigned char *stapled, long stapled_length, const unsigned char *der, int length) {
+    return stapled && stapled_length == length && memcmp(stapled, der, length) == 0;
+}
+
+// 从file=加载的响应被装订
+static void test_staple(SSL_CTX *client_ctx) {
+    unsigned char *der, *stapled;
+    long stapled_length;
+    int length = write_response(-60, 3600, &der);
+    SSL_CTX *ctx = make_server_ctx();
+    st_ocsp_stapler_t *stapler = ocsp_stapler_new(ctx, file, NULL, NULL, 3600, 5);
+    check("stapler loads the response file", stapler != NULL);
+    if (!stapler) {
+        SSL_CTX_free(ctx);
+        OPENSSL_free(der);
+        return;
+    }
+    bool done = handshake(ctx, client_ctx, &stapled, &stapled_length);
+    check("handshake staples the loaded response", done && same_response(stapled, stapled_length, der, length));
+    st_ocsp_stats_t stats;
+    ocsp_stapler_stats(stapler, &stats);
+    check("stats count the staple", stats.certificates == 1 && stats.valid == 1 && stats.stapled == 1 && stats.missing == 0 &&
+                                    stats.refreshes == 1 && stats.failures == 0);
+    OPENSSL_free(stapled);
+    SSL_CTX_free(ctx);
+    ocsp_stapler_free(stapler);
+    OPENSSL_free(der);
+}
+
+// 加载时仍有效, 之后过了nextUpdate: 不再装订, 握手照常完成
+static void test_expired(SSL_CTX *client_ctx) {
+    unsigned char *der, *stapled;
+    long stapled_length;
+    write_response(-60, 2, &der);
+    SSL_CTX *ctx = make_server_ctx();
+    st_ocsp_stapler_t *stapler = ocsp_stapler_new(ctx, file, NULL, NULL, 3600, 5);
+    if (!stapler) {
+        check("stapler loads a short-lived response", false);
+        SSL_CTX_free(ctx);
+        OPENSSL_free(der);
+        return;
+    }
+    sleep(3);
+    bool done = handshake(ctx, client_ctx, &stapled, &stapled_length);
+    check("response past nextUpdate is not stapled", stapled == NULL);
+    check("handshake still completes", done);
+    st_ocsp_stats_t stats;
+    ocsp_stapler_stats(stapler, &stats);
+    check("stats count the missing staple", stats.valid == 0 && stats.stapled == 0 && stats.missing == 1);
+    OPENSSL_free(stapled);
+    SSL_CTX_free(ctx);
+    ocsp_stapler_free(stapler);
+    OPENSSL_free(der);
+}
+
+// refresh=1: 文件替换后后台线程在一秒左右重新读取, 之后的握手装订新响应
+static void test_refresh(SSL_CTX *client_ctx) {
+    unsigned char *first, *second, *stapled;
+    long stapled_length;
+    write_response(-60, 3600, &first);
+    SSL_CTX *ctx = make_server_ctx();
+    st_ocsp_stapler_t *stapler = ocsp_stapler_new(ctx, file, NULL, NULL, 1, 5);
+    if (!stapler) {
+        check("stapler loads the response file", false);
+        SSL_CTX_free(ctx);
+        OPENSSL_free(first);
+        return;
+    }
+    st_ocsp_stats_t stats;
+    ocsp_stapler_stats(stapler, &stats);
+    uint64_t refreshes = stats.refreshes;
+    int length = write_response(-30, 7200, &second);
+    // 等到替换后的文件被读过一次以上
+    for (int i = 0; i < 50 && stats.refreshes < refreshes + 2; i++) {
+        usleep(100 * 1000);
+        ocsp_stapler_stats(stapler, &stats);
+    }
+    bool done = handshake(ctx, client_ctx, &stapled, &stapled_length);
+    check("replaced file is picked up by the refresh", done && same_response(stapled, stapled_length, second, length));
+    OPENSSL_free(stapled);
+    SSL_CTX_free(ctx);
+    ocsp_stapler_free(stapler);
+    OPENSSL_free(first);
+    OPENSSL_free(second);
+}
+
+int main(void) {
+    set_log_level(LOG_WARN);
+    snprintf(file, sizeof(file), "/tmp/test_ocsp_%d.der", (int)getpid());
+    ca_key = make_key();
+    leaf_key = make_key();
+    ca = make_cert(ca_key, "test ca", 1, NULL, NULL);
+    leaf = make_cert(leaf_key, "localhost", 2, ca, ca_key);
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+
+    test_staple(client_ctx);
+    test_expired(client_ctx);
+    test_refresh(client_ctx);
+
+    SSL_CTX_free(client_ctx);
+    X509_free(leaf);
+    X509_free(ca);
+    EVP_PKEY_free(leaf_key);
+    EVP_PKEY_free(ca_key);
+    unlink(file);
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
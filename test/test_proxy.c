@@ -0,0 +1,563 @@
+// 反向代理测试: 在127.0.0.1上启动明文上游和带[proxy]配置的服务器(单个工作线程, 主机状态按线程统计),
+// 客户端经明文端口发请求. 检查:
+//   - Content-Length和chunked请求体边收边转发;
+//   - 逐跳头部和Connection中列出的头部被去掉, 追加X-Forwarded-For/X-Forwarded-Proto;
+//   - 连续失败的主机被动摘除;
+//   - 连接失败时只重试还没发出的请求, 或复用连接上幂等且没有请求体的请求.
+//   make test
+
+#define _GNU_SOURCE
+#include "https_server.h"
+#include "proxy.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BODY_SIZE (256 * 1024)
+#define CHUNK_SIZE (16 * 1024)
+
+static int failures;
+
+static void check(const char *what, bool ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    failures += !ok;
+}
+
+// ---- 读取HTTP/1.1消息 ----
+
+typedef struct {
+    int fd;
+    char data[64 * 1024];
+    size_t start;
+    size_t end;
+} st_reader_t;
+
+static bool reader_fill(st_reader_t *r) {
+    if (r->start > 0) {
+        memmove(r->data, r->data + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == sizeof(r->data)) {
+        return false;
+    }
+    ssize_t n = recv(r->fd, r->data + r->end, sizeof(r->data) - r->end, 0);
+    if (n <= 0) {
+        return false;
+    }
+    r->end += n;
+    return true;
+}
+
+// 读到空行为止, head中保留全部行(含结尾的空行)
+static bool read_head(st_reader_t *r, char *head, size_t size) {
+    char *end;
+    while (!(end = memmem(r->data + r->start, r->end - r->start, "\r\n\r\n", 4))) {
+        if (!reader_fill(r)) {
+            return false;
+        }
+    }
+    size_t length = end + 4 - (r->data + r->start);
+    if (length >= size) {
+        return false;
+    }
+    memcpy(head, r->data + r->start, length);
+    head[length] = '\0';
+    r->start += length;
+    return true;
+}
+
+// 读length字节到body, 每次读到数据都累加到*progress
+static bool read_exact(st_reader_t *r, char *body, size_t length, size_t *progress) {
+    while (length > 0) {
+        if (r->start == r->end && !reader_fill(r)) {
+            return false;
+        }
+        size_t n = r->end - r->start < length ? r->end - r->start : length;
+        memcpy(body, r->data + r->start, n);
+        r->start += n;
+        body += n;
+        length -= n;
+        if (progress) {
+            __atomic_add_fetch(progress, n, __ATOMIC_RELAXED);
+        }
+    }
+    return true;
+}
+
+static bool read_line(st_reader_t *r, char *line, size_t size) {
+    char *end;
+    while (!(end = memmem(r->data + r->start, r->end - r->start, "\r\n", 2))) {
+        if (!reader_fill(r)) {
+            return false;
+        }
+    }
+    size_t length = end - (r->data + r->start);
+    if (length >= size) {
+        return false;
+    }
+    memcpy(line, r->data + r->start, length);
+    line[length] = '\0';
+    r->start += length + 2;
+    return true;
+}
+
+static const char *find_header(const char *head, const char *name) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\r\n%s:", name);
+    const char *p = strcasestr(head, pattern);
+    return p ? p + strlen(pattern) + strspn(p + strlen(pattern), " ") : NULL;
+}
+
+// 按Content-Length或chunked读正文, 都没有时读到连接关闭. 返回正文长度, 出错返回-1
+static long read_body(st_reader_t *r, const char *head, char *body, size_t size, size_t *progress) {
+    const char *value = find_header(head, "Content-Length");
+    if (value) {
+        size_t length = strtoul(value, NULL, 10);
+        return length <= size && read_exact(r, body, length, progress) ? (long)length : -1;
+    }
+    value = find_header(head, "Transfer-Encoding");
+    if (value && strncasecmp(value, "chunked", 7) == 0) {
+        size_t total = 0;
+        char line[64];
+        for (;;) {
+            if (!read_line(r, line, sizeof(line))) {
+                return -1;
+            }
+            size_t length = strtoul(line, NULL, 16);
+            if (length == 0) {
+                return read_line(r, line, sizeof(line)) ? (long)total : -1;
+            }
+            if (total + length > size || !read_exact(r, body + total, length, progress) || !read_line(r, line, sizeof(line))) {
+                return -1;
+            }
+            total += length;
+        }
+    }
+    if (strncmp(head, "HTTP/", 5) != 0) {
+        return 0;  // 没有长度的请求没有正文
+    }
+    size_t total = 0;
+    while (total < size) {
+        if (r->start == r->end && !reader_fill(r)) {
+            break;
+        }
+        size_t n = r->end - r->start < size - total ? r->end - r->start : size - total;
+        memcpy(body + total, r->data + r->start, n);
+        r->start += n;
+        total += n;
+    }
+    return (long)total;
+}
+
+// ---- 上游 ----
+
+typedef enum {
+    UPSTREAM_ECHO,          // 200, 正文为收到的请求体长度
+    UPSTREAM_UNAVAILABLE,   // 503
+    UPSTREAM_CLOSE,         // 读完请求后关闭连接, 不响应
+    UPSTREAM_CLOSE_SECOND   // 每个连接上的第一个请求正常响应, 第二个请求关闭连接
+} backend_mode_t;
+
+typedef struct {
+    backend_mode_t mode;
+    int listen_fd;
+    int port;
+    int requests;              // 收完的请求数
+    size_t body_received;      // 当前请求已收到的正文字节数
+    pthread_mutex_t lock;
+    char last_head[4096];
+    char *last_body;
+    long last_body_length;
+} st_backend_t;
+
+typedef struct {
+    st_backend_t *upstream;
+    int fd;
+} st_backend_conn_t;
+
+static void *upstream_conn_thread(void *arg) {
+    st_backend_conn_t *conn = (st_backend_conn_t *)arg;
+    st_backend_t *upstream = conn->upstream;
+    st_reader_t *r = calloc(1, sizeof(st_reader_t));
+    char *body = malloc(BODY_SIZE);
+    char head[4096];
+    r->fd = conn->fd;
+    for (int served = 0;; served++) {
+        if (!read_head(r, head, sizeof(head))) {
+            break;
+        }
+        __atomic_store_n(&upstream->body_received, 0, __ATOMIC_RELAXED);
+        long length = read_body(r, head, body, BODY_SIZE, &upstream->body_received);
+        if (length < 0) {
+            break;
+        }
+        pthread_mutex_lock(&upstream->lock);
+        snprintf(upstream->last_head, sizeof(upstream->last_head), "%s", head);
+        memcpy(upstream->last_body, body, length);
+        upstream->last_body_length = length;
+        upstream->requests++;
+        pthread_mutex_unlock(&upstream->lock);
+
+        char response[512];
+        int n;
+        if (upstream->mode == UPSTREAM_CLOSE || (upstream->mode == UPSTREAM_CLOSE_SECOND && served == 1)) {
+            break;
+        } else if (upstream->mode == UPSTREAM_UNAVAILABLE) {
+            n = snprintf(response, sizeof(response), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 4\r\n\r\nbusy");
+        } else {
+            char text[32];
+            int text_length = snprintf(text, sizeof(text), "%ld", length);
+            n = snprintf(response, sizeof(response),
+                         "HTTP/1.1 200 OK\r\nConnection: keep-alive, X-Internal\r\nKeep-Alive: timeout=30\r\n"
+                         "X-Internal: secret\r\nX-Upstream: %d\r\nContent-Length: %d\r\n\r\n%s",
+                         upstream->port, text_length, text);
+        }
+        if (send(conn->fd, response, n, MSG_NOSIGNAL) != n) {
+            break;
+        }
+    }
+    close(conn->fd);
+    free(body);
+    free(r);
+    free(conn);
+    return NULL;
+}
+
+static void *upstream_accept_thread(void *arg) {
+    st_backend_t *upstream = (st_backend_t *)arg;
+    for (;;) {
+        int fd = accept(upstream->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        st_backend_conn_t *conn = malloc(sizeof(st_backend_conn_t));
+        conn->upstream = upstream;
+        conn->fd = fd;
+        pthread_t thread;
+        pthread_create(&thread, NULL, upstream_conn_thread, conn);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static int listen_local(int backlog, int *port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t length = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, backlog) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &length) < 0) {
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void start_upstream(st_backend_t *upstream, backend_mode_t mode) {
+    upstream->mode = mode;
+    upstream->listen_fd = listen_local(16, &upstream->port);
+    upstream->last_body = malloc(BODY_SIZE);
+    pthread_mutex_init(&upstream->lock, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, upstream_accept_thread, upstream);
+    pthread_detach(thread);
+}
+
+static int upstream_requests(st_backend_t *upstream) {
+    pthread_mutex_lock(&upstream->lock);
+    int requests = upstream->requests;
+    pthread_mutex_unlock(&upstream->lock);
+    return requests;
+}
+
+// 不接受连接且队列已满的监听套接字: 新连接的SYN被丢弃, 代理只能等到连接超时
+static int start_stalled(int *port) {
+    int fd = listen_local(0, port);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(*port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    for (int i = 0; i < 3; i++) {
+        int filler = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        connect(filler, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    usleep(100 * 1000);
+    return fd;
+}
+
+// ---- 客户端 ----
+
+static int proxy_port;
+
+static int connect_proxy(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(proxy_port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    struct timeval timeout = {5, 0};
+    for (int i = 0; i < 50; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return fd;
+        }
+        close(fd);
+        usleep(100 * 1000);
+    }
+    return -1;
+}
+
+static bool send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+typedef struct {
+    int status;
+    char head[4096];
+    char body[256];
+} st_response_t;
+
+static bool read_response(int fd, st_response_t *response) {
+    st_reader_t *r = calloc(1, sizeof(st_reader_t));
+    r->fd = fd;
+    bool ok = read_head(r, response->head, sizeof(response->head));
+    long length = ok ? read_body(r, response->head, response->body, sizeof(response->body) - 1, NULL) : -1;
+    free(r);
+    response->status = length >= 0 ? atoi(response->head + 9) : -1;
+    response->body[length >= 0 ? length : 0] = '\0';
+    return length >= 0;
+}
+
+// 新连接上发一个请求, 返回状态码, 失败时返回-1
+static int request(const char *method, const char *url, const char *headers, const char *body, st_response_t *response) {
+    int fd = connect_proxy();
+    if (fd < 0) {
+        return -1;
+    }
+    char data[1024];
+    int length = snprintf(data, sizeof(data), "%s %s HTTP/1.1\r\nHost: localhost\r\n%s", method, url, headers ? headers : "");
+    if (body) {
+        length += snprintf(data + length, sizeof(data) - length, "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+    } else {
+        length += snprintf(data + length, sizeof(data) - length, "\r\n");
+    }
+    st_response_t local;
+    response = response ? response : &local;
+    bool ok = send_all(fd, data, length) && read_response(fd, response);
+    close(fd);
+    return ok ? response->status : -1;
+}
+
+static uint64_t retries(void) {
+    st_proxy_stats_t stats;
+    proxy_stats(&stats);
+    return stats.retries;
+}
+
+// ---- 测试 ----
+
+static st_backend_t echo, unavailable, closing, closing_second;
+static int stalled_port;
+
+// 等上游收到至少length字节的正文
+static bool wait_body(st_backend_t *upstream, size_t length) {
+    for (int i = 0; i < 300; i++) {
+        if (__atomic_load_n(&upstream->body_received, __ATOMIC_RELAXED) >= length) {
+            return true;
+        }
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+static bool echo_received(const char *body, size_t length) {
+    pthread_mutex_lock(&echo.lock);
+    bool same = echo.last_body_length == (long)length && memcmp(echo.last_body, body, length) == 0;
+    pthread_mutex_unlock(&echo.lock);
+    return same;
+}
+
+// 请求体的前一半到达上游后才发送后一半
+static void test_streaming(void) {
+    char *body = malloc(BODY_SIZE);
+    for (size_t i = 0; i < BODY_SIZE; i++) {
+        body[i] = 'a' + i % 26;
+    }
+    st_response_t response;
+    char head[256];
+
+    int fd = connect_proxy();
+    int length = snprintf(head, sizeof(head), "POST /echo/length HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n", BODY_SIZE);
+    __atomic_store_n(&echo.body_received, 0, __ATOMIC_RELAXED);
+    send_all(fd, head, length);
+    send_all(fd, body, BODY_SIZE / 2);
+    check("Content-Length body reaches upstream before it is complete", wait_body(&echo, BODY_SIZE / 2));
+    send_all(fd, body + BODY_SIZE / 2, BODY_SIZE / 2);
+    check("Content-Length body is forwarded intact",
+          read_response(fd, &response) && response.status == 200 && atoi(response.body) == BODY_SIZE && echo_received(body, BODY_SIZE) &&
+          find_header(echo.last_head, "Content-Length") && !find_header(echo.last_head, "Transfer-Encoding"));
+    close(fd);
+
+    fd = connect_proxy();
+    length = snprintf(head, sizeof(head), "POST /echo/chunked HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n");
+    __atomic_store_n(&echo.body_received, 0, __ATOMIC_RELAXED);
+    send_all(fd, head, length);
+    for (size_t offset = 0; offset < BODY_SIZE; offset += CHUNK_SIZE) {
+        if (offset == BODY_SIZE / 2) {
+            check("chunked body reaches upstream before it is complete", wait_body(&echo, BODY_SIZE / 2));
+        }
+        char prefix[16];
+        int n = snprintf(prefix, sizeof(prefix), "%x\r\n", CHUNK_SIZE);
+        send_all(fd, prefix, n);
+        send_all(fd, body + offset, CHUNK_SIZE);
+        send_all(fd, "\r\n", 2);
+    }
+    send_all(fd, "0\r\n\r\n", 5);
+    check("chunked body is forwarded intact",
+          read_response(fd, &response) && response.status == 200 && atoi(response.body) == BODY_SIZE && echo_received(body, BODY_SIZE) &&
+          find_header(echo.last_head, "Transfer-Encoding") && !find_header(echo.last_head, "Content-Length"));
+    close(fd);
+    free(body);
+}
+
+static void test_headers(void) {
+    st_response_t response;
+    int status = request("GET", "/echo/headers",
+                         "Connection: keep-alive, X-Secret\r\nKeep-Alive: timeout=5\r\nProxy-Connection: keep-alive\r\n"
+                         "TE: trailers\r\nTrailer: X-Checksum\r\nX-Secret: 1\r\nX-Keep: yes\r\n"
+                         "X-Forwarded-For: 10.0.0.1\r\nX-Forwarded-Proto: https\r\n",
+                         NULL, &response);
+    pthread_mutex_lock(&echo.lock);
+    const char *head = echo.last_head;
+    static const char *dropped[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "X-Secret"};
+    bool none = true;
+    for (size_t i = 0; i < sizeof(dropped) / sizeof(dropped[0]); i++) {
+        none = none && !find_header(head, dropped[i]);
+    }
+    check("request hop-by-hop and Connection-listed headers are dropped", status == 200 && none);
+    check("other request headers are forwarded", strstr(head, "\r\nX-Keep: yes\r\n") && strstr(head, "\r\nHost: localhost\r\n"));
+    check("X-Forwarded-For appends the client address", strstr(head, "\r\nX-Forwarded-For: 10.0.0.1, 127.0.0.1\r\n") != NULL);
+    check("X-Forwarded-Proto names the listener", strstr(head, "\r\nX-Forwarded-Proto: http\r\n") && !strstr(head, "https"));
+    pthread_mutex_unlock(&echo.lock);
+    check("response hop-by-hop and Connection-listed headers are dropped",
+          !find_header(response.head, "X-Internal") && !find_header(response.head, "Keep-Alive") &&
+          find_header(response.head, "X-Upstream"));
+}
+
+// least_outstanding下依次请求在两台主机间轮流, 第二次503后摘除, 之后都到正常的主机
+static void test_ejection(void) {
+    st_proxy_stats_t before, after;
+    proxy_stats(&before);
+    int ok = 0;
+    for (int i = 0; i < 10; i++) {
+        ok += request("GET", "/eject/", NULL, NULL, NULL) == 200;
+    }
+    proxy_stats(&after);
+    check("failing host is ejected after max_fails", upstream_requests(&unavailable) == 2 && after.ejections - before.ejections == 1);
+    check("requests go to the remaining host", ok == 8);
+}
+
+static void test_retry(void) {
+    st_response_t response;
+    uint64_t start = retries();
+    // 第一台主机连接超时, 缓冲的请求头和请求体整体换到第二台
+    int status = request("POST", "/unsent/", NULL, "hello", &response);
+    check("unsent request is retried on another host", status == 200 && retries() - start == 1 && echo_received("hello", 5));
+
+    start = retries();
+    int before = upstream_requests(&closing);
+    status = request("GET", "/fresh/", NULL, NULL, NULL);
+    check("sent request on a new connection is not retried",
+          status == 502 && retries() == start && upstream_requests(&closing) - before == 1);
+    status = request("POST", "/fresh/", NULL, "data", NULL);
+    check("sent request with a body on a new connection is not retried",
+          status == 502 && retries() == start && upstream_requests(&closing) - before == 2);
+
+    // 每个上游连接上的第二个请求失败
+    start = retries();
+    request("GET", "/reused/1", NULL, NULL, NULL);
+    status = request("GET", "/reused/2", NULL, NULL, NULL);
+    check("idempotent request without a body on a reused connection is retried", status == 200 && retries() - start == 1);
+    start = retries();
+    status = request("POST", "/reused/3", NULL, "data", NULL);
+    check("POST with a body on a reused connection is not retried", status == 502 && retries() == start);
+    request("GET", "/reused/4", NULL, NULL, NULL);
+    status = request("POST", "/reused/5", "Content-Length: 0\r\n", NULL, NULL);
+    check("non-idempotent request on a reused connection is not retried", status == 502 && retries() == start);
+    request("GET", "/reused/6", NULL, NULL, NULL);
+    status = request("PUT", "/reused/7", NULL, "data", NULL);
+    check("idempotent request with a body on a reused connection is not retried", status == 502 && retries() == start);
+    request("GET", "/reused/8", NULL, NULL, NULL);
+    status = request("PUT", "/reused/9", "Content-Length: 0\r\n", NULL, NULL);
+    check("idempotent PUT without a body on a reused connection is retried", status == 200 && retries() - start == 1);
+}
+
+static int free_port(void) {
+    int port;
+    int fd = listen_local(1, &port);
+    close(fd);
+    return port;
+}
+
+static st_server_options_t options;
+static int tls_port;
+
+static void *server_thread(void *arg) {
+    event_callbacks callbacks = {0};
+    start_https_server_with_options("bin/cert.pem", "bin/key.pem", tls_port, &options, &callbacks);
+    return NULL;
+}
+
+int main(void) {
+    set_log_level(LOG_ERROR);
+    start_upstream(&echo, UPSTREAM_ECHO);
+    start_upstream(&unavailable, UPSTREAM_UNAVAILABLE);
+    start_upstream(&closing, UPSTREAM_CLOSE);
+    start_upstream(&closing_second, UPSTREAM_CLOSE_SECOND);
+    start_stalled(&stalled_port);
+    tls_port = free_port();
+    proxy_port = free_port();
+
+    char file[64];
+    snprintf(file, sizeof(file), "/tmp/test_proxy_%d.conf", (int)getpid());
+    FILE *fp = fopen(file, "w");
+    fprintf(fp, "[server]\nworkers=1\nplain_port=%d\n", proxy_port);
+    fprintf(fp, "[proxy]\nroute=/echo/ echo\nroute=/eject/ eject\nroute=/unsent/ unsent\nroute=/fresh/ fresh\nroute=/reused/ reused\n");
+    fprintf(fp, "[upstream:echo]\nserver=127.0.0.1:%d\n", echo.port);
+    fprintf(fp, "[upstream:eject]\nserver=127.0.0.1:%d\nserver=127.0.0.1:%d\nbalance=least_outstanding\nmax_fails=2\nfail_timeout=60\n",
+            unavailable.port, echo.port);
+    fprintf(fp, "[upstream:unsent]\nserver=127.0.0.1:%d\nserver=127.0.0.1:%d\nconnect_timeout=0.5\n", stalled_port, echo.port);
+    fprintf(fp, "[upstream:fresh]\nserver=127.0.0.1:%d\nmax_fails=100\n", closing.port);
+    fprintf(fp, "[upstream:reused]\nserver=127.0.0.1:%d\nmax_fails=100\n", closing_second.port);
+    fclose(fp);
+    st_config_file_t config;
+    if (parse_config(file, &config) != 0) {
+        printf("FAIL parse %s\n", file);
+        return 1;
+    }
+    unlink(file);
+    init_server_options(&options);
+    load_server_options(&options, &config);
+    free_config(&config);
+    check("proxy routes are loaded", options.proxy && options.proxy->route_count == 5 && options.proxy->group_count == 5);
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_thread, NULL);
+
+    test_streaming();
+    test_headers();
+    test_ejection();
+    test_retry();
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    // 服务器和上游线程不会返回, 直接退出
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+}
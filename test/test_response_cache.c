@@ -0,0 +1,68 @@
+// 响应缓存测试: Cache-Control各指令得到的缓存秒数, 带Authorization的请求只在响应
+// 明确允许时保存(RFC 9111 3.5), 以及保存后能按键查到.
+//   make test
+
+#include "response_cache.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures;
+
+static void expect_ttl(const char *cache_control, bool authorized, double expected) {
+    double ttl = cache_response_ttl(cache_control, authorized);
+    bool ok = ttl == expected;
+    printf("%s %s\"%s\" -> %g", ok ? "ok  " : "FAIL", authorized ? "authorized " : "", cache_control ? cache_control : "(none)", ttl);
+    if (!ok) {
+        printf(", expected %g", expected);
+        failures++;
+    }
+    printf("\n");
+}
+
+static void check_store(void) {
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: keep-alive\r\n\r\n";
+    st_response_cache_t *cache = response_cache_new(2, 1024 * 1024, 64 * 1024);
+    bool ok = response_cache_store(cache, "GET /a", 6, head, strlen(head), "hello", 5, 60);
+    st_cache_entry_t *entry = response_cache_lookup(cache, "GET /a", 6);
+    ok = ok && entry && entry->length == strlen(head) + 5 && memcmp(entry->data, head, strlen(head)) == 0;
+    if (entry) {
+        response_cache_release(entry);
+    }
+    // 别的键查不到, ttl为0的不保存
+    ok = ok && !response_cache_lookup(cache, "GET /b", 6);
+    response_cache_store(cache, "GET /c", 6, head, strlen(head), "hello", 5, 0);
+    ok = ok && !response_cache_lookup(cache, "GET /c", 6);
+    printf("%s store and lookup\n", ok ? "ok  " : "FAIL");
+    failures += !ok;
+    response_cache_free(cache);
+}
+
+int main(void) {
+    expect_ttl(NULL, false, 0);
+    expect_ttl("max-age=60", false, 60);
+    expect_ttl("public, max-age=60", false, 60);
+    expect_ttl("max-age=\"60\"", false, 60);
+    expect_ttl("max-age=0", false, 0);
+    expect_ttl("max-age=60, s-maxage=10", false, 10);
+    expect_ttl("s-maxage=10, max-age=60", false, 10);
+    expect_ttl("S-MaxAge=10", false, 10);
+    expect_ttl("private, max-age=60", false, 0);
+    expect_ttl("max-age=60, no-store", false, 0);
+    expect_ttl("no-cache, max-age=60", false, 0);
+    expect_ttl("private=\"Set-Cookie\", max-age=60", false, 0);
+
+    // 带Authorization: 没有public, s-maxage或must-revalidate就不保存
+    expect_ttl("max-age=60", true, 0);
+    expect_ttl(NULL, true, 0);
+    expect_ttl("public, max-age=60", true, 60);
+    expect_ttl("s-maxage=10", true, 10);
+    expect_ttl("max-age=60, must-revalidate", true, 60);
+    expect_ttl("public, private, max-age=60", true, 0);
+    expect_ttl("public, no-store", true, 0);
+    // 只在参数里出现的不算指令
+    expect_ttl("max-age=60, x-note=public", true, 0);
+
+    check_store();
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+// 请求合并测试: 领头请求的响应经邮箱交给所有等待者, 没有可共享的响应时等待者回退;
+// 服务器上并发的相同GET只执行一次处理器, 带Authorization或Cookie的请求和private响应不共享.
+//   make test
+
+#define _GNU_SOURCE
+#include "https_server.h"
+#include "single_flight.h"
+#include "log.h"
+#include <openssl/ssl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int failures;
+
+static void check(const char *what, bool ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    failures += !ok;
+}
+
+// ---- single_flight接口 ----
+
+static st_event_loop_t *loop;
+static st_flight_result_t *delivered[4];
+static int delivered_count;
+static int expected_count;
+
+// 拿走结果的引用, 测试最后统一释放
+static void on_deliver(st_flight_waiter_t *waiter) {
+    delivered[delivered_count++] = waiter->result;
+    waiter->result = NULL;
+    flight_waiter_free(waiter);
+    if (delivered_count == expected_count) {
+        event_loop_break(loop);
+    }
+}
+
+static void test_group(void) {
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: keep-alive\r\n\r\n";
+    st_flight_group_t *group = flight_group_new(4, 5);
+    st_flight_mailbox_t mailbox;
+    loop = event_loop_new(EVENT_ENGINE_EPOLL, 64);
+    flight_mailbox_init(&mailbox, loop, on_deliver);
+
+    st_flight_t *flight, *other;
+    st_flight_waiter_t *waiter, *waiters[3];
+    check("first request leads", flight_join(group, "GET /a", 6, &mailbox, NULL, &flight, &waiter) == FLIGHT_LEADER && flight);
+    check("same key waits", flight_join(group, "GET /a", 6, &mailbox, NULL, &other, &waiters[0]) == FLIGHT_WAITER && waiters[0]);
+    flight_join(group, "GET /a", 6, &mailbox, NULL, &other, &waiters[1]);
+    flight_join(group, "GET /a", 6, &mailbox, NULL, &other, &waiters[2]);
+    check("cancelled waiter is removed", flight_cancel(group, waiters[2], true));
+    flight_waiter_free(waiters[2]);
+
+    // 两个等待者拿到同一份响应
+    expected_count = 2;
+    flight_complete(group, flight, head, strlen(head), "hello", 5);
+    event_loop_run(loop);
+    st_flight_result_t *result = delivered[0];
+    check("waiters share the result", delivered_count == 2 && result && delivered[1] == result && result->refs == 2);
+    check("result holds head and body",
+          result && result->length == strlen(head) + 5 && memcmp(result->data, head, strlen(head)) == 0 &&
+          memcmp(result->data + strlen(head), "hello", 5) == 0);
+    check("connection line is located",
+          result && result->connection_length == strlen("Connection: keep-alive\r\n") &&
+          memcmp(result->data + result->connection_offset, "Connection: keep-alive\r\n", result->connection_length) == 0);
+    flight_result_release(delivered[0]);
+    flight_result_release(delivered[1]);
+
+    // 完成后同一个键重新领头, head为空时等待者回退
+    check("completed key leads again", flight_join(group, "GET /a", 6, &mailbox, NULL, &flight, &waiter) == FLIGHT_LEADER);
+    flight_join(group, "GET /a", 6, &mailbox, NULL, &other, &waiters[0]);
+    delivered_count = 0;
+    expected_count = 1;
+    flight_complete(group, flight, NULL, 0, NULL, 0);
+    event_loop_run(loop);
+    check("waiter falls back without result", delivered_count == 1 && delivered[0] == NULL);
+
+    st_flight_stats_t stats;
+    flight_stats(group, &stats);
+    check("stats", stats.leaders == 2 && stats.coalesced == 2 && stats.timeouts == 1 && stats.fallbacks == 1);
+
+    flight_mailbox_destroy(&mailbox, loop);
+    event_loop_destroy(loop);
+    flight_group_free(group);
+}
+
+// ---- 服务器 ----
+
+static int handler_runs;
+
+static void on_body_end(void *client) {
+    char body[64];
+    usleep(200 * 1000);
+    snprintf(body, sizeof(body), "run %d", __atomic_add_fetch(&handler_runs, 1, __ATOMIC_RELAXED));
+    if (strcmp(get_request_url(client), "/private") == 0) {
+        add_response_header(client, "Cache-Control", "private");
+    }
+    send_response_to_client(client, 200, "OK", body);
+}
+
+static event_callbacks callbacks = {.on_body_end = on_body_end};
+static st_server_options_t options;
+static int port;
+
+static void *server_thread(void *arg) {
+    start_https_server_with_options("bin/cert.pem", "bin/key.pem", port, &options, &callbacks);
+    return NULL;
+}
+
+static int free_port(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t length = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *)&addr, &length);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static SSL *connect_to_server(SSL_CTX *ctx) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    for (int i = 0; i < 50; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            SSL *ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, fd);
+            if (SSL_connect(ssl) == 1) {
+                return ssl;
+            }
+            SSL_free(ssl);
+        }
+        close(fd);
+        usleep(100 * 1000);
+    }
+    return NULL;
+}
+
+static void send_request(SSL *ssl, const char *url, const char *header) {
+    char request[256];
+    int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n%sConnection: close\r\n\r\n", url, header);
+    SSL_write(ssl, request, length);
+}
+
+// 读到连接关闭, 返回响应正文
+static void read_body(SSL *ssl, char *body, size_t size) {
+    char response[4096];
+    size_t length = 0;
+    int n;
+    while (length < sizeof(response) - 1 && (n = SSL_read(ssl, response + length, sizeof(response) - 1 - length)) > 0) {
+        length += n;
+    }
+    response[length] = '\0';
+    const char *start = strstr(response, "\r\n\r\n");
+    snprintf(body, size, "%s", start ? start + 4 : "");
+    close(SSL_get_fd(ssl));
+    SSL_free(ssl);
+}
+
+// A先发出请求, 100ms后B发出相同的请求, 此时A的处理器仍在执行
+static void concurrent_pair(SSL_CTX *ctx, const char *what, const char *url, const char *header, bool shared) {
+    SSL *a = connect_to_server(ctx);
+    SSL *b = connect_to_server(ctx);
+    if (!a || !b) {
+        check(what, false);
+        return;
+    }
+    int runs = __atomic_load_n(&handler_runs, __ATOMIC_RELAXED);
+    char body_a[64], body_b[64];
+    send_request(a, url, header);
+    usleep(100 * 1000);
+    send_request(b, url, header);
+    read_body(a, body_a, sizeof(body_a));
+    read_body(b, body_b, sizeof(body_b));
+    runs = __atomic_load_n(&handler_runs, __ATOMIC_RELAXED) - runs;
+    bool ok = body_a[0] && body_b[0] && (shared ? runs == 1 && strcmp(body_a, body_b) == 0 : runs == 2 && strcmp(body_a, body_b) != 0);
+    check(what, ok);
+}
+
+static void test_server(void) {
+    set_log_level(LOG_ERROR);
+    init_server_options(&options);
+    // 处理器阻塞所在的工作线程, B由空闲的工作线程接受
+    options.engine = EVENT_ENGINE_EPOLL;
+    options.workers = 4;
+    options.coalesce = true;
+    port = free_port();
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_thread, NULL);
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    concurrent_pair(ctx, "server shares a concurrent GET", "/slow", "", true);
+    concurrent_pair(ctx, "server does not coalesce with Authorization", "/slow", "Authorization: Basic dXNlcjpwYXNz\r\n", false);
+    concurrent_pair(ctx, "server does not coalesce with Cookie", "/slow", "Cookie: session=1\r\n", false);
+    concurrent_pair(ctx, "server does not share a private response", "/private", "", false);
+    SSL_CTX_free(ctx);
+}
+
+int main(void) {
+    test_group();
+    test_server();
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    // 服务器线程不会返回, 直接退出
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+}
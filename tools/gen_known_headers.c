@@ -0,0 +1,115 @@
+//  由Makefile调用: gen_known_headers > build/known_headers_table.h
+//  为known_headers.h中的名称构造最小完美哈希(hash and displace):
+//  第一次哈希把名称分到桶里, 每个桶找一个种子, 使桶内名称的第二次哈希落到互不冲突的空槽.
+
+#include "known_headers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KNOWN_HEADER_NAME(id, name) name,
+static const char *names[] = {KNOWN_HEADER_LIST(KNOWN_HEADER_NAME)};
+#undef KNOWN_HEADER_NAME
+
+#define BUCKET_COUNT ((KNOWN_HEADER_COUNT + 1) / 2)
+#define MAX_SEED 10000000
+
+static uint64_t hashes[KNOWN_HEADER_COUNT];
+static int bucket_of[KNOWN_HEADER_COUNT];
+static uint32_t seeds[BUCKET_COUNT];
+static int slots[KNOWN_HEADER_COUNT];
+
+static int bucket_size(int bucket) {
+    int size = 0;
+    for (int i = 0; i < KNOWN_HEADER_COUNT; i++) {
+        size += bucket_of[i] == bucket;
+    }
+    return size;
+}
+
+// 为一个桶寻找种子, 成功后占用对应的槽
+static int place_bucket(int bucket) {
+    int members[KNOWN_HEADER_COUNT];
+    int count = 0;
+    for (int i = 0; i < KNOWN_HEADER_COUNT; i++) {
+        if (bucket_of[i] == bucket) {
+            members[count++] = i;
+        }
+    }
+    for (uint32_t seed = 0; seed < MAX_SEED; seed++) {
+        int taken[KNOWN_HEADER_COUNT];
+        int ok = 1;
+        for (int m = 0; m < count && ok; m++) {
+            taken[m] = known_header_slot_hash(hashes[members[m]], seed) % KNOWN_HEADER_COUNT;
+            if (slots[taken[m]] >= 0) {
+                ok = 0;
+            }
+            for (int k = 0; k < m && ok; k++) {
+                ok = taken[k] != taken[m];
+            }
+        }
+        if (ok) {
+            for (int m = 0; m < count; m++) {
+                slots[taken[m]] = members[m];
+            }
+            seeds[bucket] = seed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(void) {
+    for (int i = 0; i < KNOWN_HEADER_COUNT; i++) {
+        size_t length = strlen(names[i]);
+        if (length > KNOWN_HEADER_MAX_LENGTH) {
+            fprintf(stderr, "header name too long: %s\n", names[i]);
+            return 1;
+        }
+        uint64_t words[KNOWN_HEADER_WORDS] = {0};
+        hashes[i] = known_header_load(words, names[i], length);
+        for (int k = 0; k < i; k++) {
+            if (hashes[k] == hashes[i]) {
+                fprintf(stderr, "hash collision: %s %s\n", names[k], names[i]);
+                return 1;
+            }
+        }
+        bucket_of[i] = hashes[i] % BUCKET_COUNT;
+        slots[i] = -1;
+    }
+
+    // 先放大的桶, 空槽多时更容易找到种子
+    int order[BUCKET_COUNT];
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        order[b] = b;
+    }
+    for (int a = 0; a < BUCKET_COUNT; a++) {
+        for (int b = a + 1; b < BUCKET_COUNT; b++) {
+            if (bucket_size(order[b]) > bucket_size(order[a])) {
+                int t = order[a];
+                order[a] = order[b];
+                order[b] = t;
+            }
+        }
+    }
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        if (place_bucket(order[b]) < 0) {
+            fprintf(stderr, "no seed found for bucket %d\n", order[b]);
+            return 1;
+        }
+    }
+
+    printf("// 由tools/gen_known_headers.c生成, 不要手工修改\n\n");
+    printf("#define KNOWN_HEADER_BUCKETS %d\n\n", BUCKET_COUNT);
+    printf("static const uint32_t known_header_seeds[KNOWN_HEADER_BUCKETS] = {");
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        printf("%s%u", b ? ", " : "", seeds[b]);
+    }
+    printf("};\n\n");
+    printf("static const int8_t known_header_slots[KNOWN_HEADER_COUNT] = {\n");
+    for (int s = 0; s < KNOWN_HEADER_COUNT; s++) {
+        printf("    %d,  // %s\n", slots[s], names[slots[s]]);
+    }
+    printf("};\n");
+    return 0;
+}